@@ -19,4 +19,15 @@ namespace eosio { namespace chain {
     */
    digest_type merkle( vector<digest_type> ids );
 
+   /**
+    *  Calculates the branch proving that ids[index] is part of merkle(ids): the sibling at each level, from the leaf
+    *  up, made canonical left or right so that the proof implies the side of every concatenation.
+    */
+   vector<digest_type> merkle_proof( vector<digest_type> ids, size_t index );
+
+   /**
+    *  Calculates the merkle root implied by a leaf and its merkle_proof, to be compared with the expected root.
+    */
+   digest_type merkle_root_from_proof( const digest_type& leaf, const vector<digest_type>& proof );
+
 } } /// eosio::chain
@@ -49,4 +49,39 @@ digest_type merkle(vector<digest_type> ids) {
    return ids.front();
 }
 
+vector<digest_type> merkle_proof(vector<digest_type> ids, size_t index) {
+   FC_ASSERT( index < ids.size(), "merkle leaf index out of range" );
+
+   vector<digest_type> proof;
+   while( ids.size() > 1 ) {
+      if( ids.size() % 2 )
+         ids.push_back(ids.back());
+
+      if( index % 2 )
+         proof.push_back(make_canonical_left(ids[index - 1]));
+      else
+         proof.push_back(make_canonical_right(ids[index + 1]));
+
+      for (size_t i = 0; i < ids.size() / 2; i++) {
+         ids[i] = digest_type::hash(make_canonical_pair(ids[2 * i], ids[(2 * i) + 1]));
+      }
+
+      ids.resize(ids.size() / 2);
+      index /= 2;
+   }
+
+   return proof;
+}
+
+digest_type merkle_root_from_proof(const digest_type& leaf, const vector<digest_type>& proof) {
+   digest_type node = leaf;
+   for( const auto& sibling : proof ) {
+      if( is_canonical_left(sibling) )
+         node = digest_type::hash(make_canonical_pair(sibling, node));
+      else
+         node = digest_type::hash(make_canonical_pair(node, sibling));
+   }
+   return node;
+}
+
 } } // eosio::chain
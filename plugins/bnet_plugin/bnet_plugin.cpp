@@ -179,11 +179,6 @@ using bnet_message = fc::static_variant<hello,
                                         >;
 
 
-struct by_id;
-struct by_num;
-struct by_received;
-struct by_expired;
-
 namespace eosio {
   using namespace chain::plugin_interface;
 
@@ -198,65 +193,158 @@ namespace eosio {
   }
 
   /**
-   *  Each session is presumed to operate in its own strand so that
-   *  operations can execute in parallel.
+   *  Fixed-capacity record of what a peer knows about the blocks in a window of block numbers.
+   *  Block number n lives in slot n % capacity, which holds two ids so that a short fork does not
+   *  evict the block it competes with. Callers keep the window to capacity block numbers.
    */
-  class session : public std::enable_shared_from_this<session>
-  {
+  class block_status_tracker {
      public:
-        enum session_state {
-           hello_state,
-           sending_state,
-           idle_state
-        };
+        static constexpr uint32_t capacity = 1024;
+        static constexpr uint32_t ways = 2;
 
         struct block_status {
-           block_status( block_id_type i, bool kby_peer, bool rfrom_peer)
-           {
-              known_by_peer      = kby_peer;
-              received_from_peer = rfrom_peer;
-              id = i;
-           }
-
+           block_id_type id;                    ///< the block id, empty when unused
            bool known_by_peer  = false;         ///< we sent block to peer or peer sent us notice
            bool received_from_peer = false;     ///< peer sent us this block and considers full block valid
-           block_id_type id;                    ///< the block id;
-       //    block_id_type prev;                  ///< the prev block id
+        };
 
-       //    shared_ptr< vector<char> >  block_msg; ///< packed bnet_message for this block
+        const block_status* find( const block_id_type& id )const {
+           return const_cast<block_status_tracker*>(this)->find( id );
+        }
 
-           uint32_t block_num()const { return block_header::num_from_id(id); }
-        };
+        block_status* find( const block_id_type& id ) {
+           auto num = block_header::num_from_id( id );
+           if( num < _min_block_num ) return nullptr;
+           auto& slot = _slots[num % capacity];
+           for( auto& s : slot ) {
+              if( s.id == id ) return &s;
+           }
+           return nullptr;
+        }
+
+        /// replaces whichever entry of the slot is unused or oldest
+        block_status& insert( const block_id_type& id ) {
+           auto num = block_header::num_from_id( id );
+           auto& slot = _slots[num % capacity];
+           auto* dest = &slot[0];
+           for( auto& s : slot ) {
+              if( s.id == block_id_type() || block_header::num_from_id( s.id ) < block_header::num_from_id( dest->id ) ) {
+                 dest = &s;
+                 if( s.id == block_id_type() ) break;
+              }
+           }
+           *dest = block_status{ id };
+           return *dest;
+        }
 
-        typedef boost::multi_index_container<block_status,
-           indexed_by<
-              ordered_unique< tag<by_id>,  member<block_status,block_id_type,&block_status::id> >,
-              ordered_non_unique< tag<by_num>,  const_mem_fun<block_status,uint32_t,&block_status::block_num> >
-           >
-        > block_status_index;
+        /// forgets all blocks numbered below num
+        void purge_below( uint32_t num ) { _min_block_num = std::max( _min_block_num, num ); }
+
+     private:
+        std::vector<std::array<block_status, ways>> _slots = std::vector<std::array<block_status, ways>>( capacity );
+        uint32_t                                    _min_block_num = 0;
+  };
 
+  /**
+   *  Fixed-capacity, set associative record of the transactions exchanged with a peer. An entry
+   *  is dropped once expired; when its set is full the entry expiring first is replaced, which at
+   *  worst sends the peer a transaction it already has. Transactions waiting to be sent are queued
+   *  in accepted order with their own expiration, so replacing their entry does not lose them; they
+   *  are skipped once the peer is known to have them. The queue is bounded too: when it is full the
+   *  oldest waiting transaction is not sent to this peer.
+   */
+  class transaction_status_tracker {
+     public:
+        static constexpr uint32_t sets = 1024;
+        static constexpr uint32_t ways = 4;
+        static constexpr uint32_t max_pending = sets * ways;
 
         struct transaction_status {
-           time_point                 received;
-           time_point                 expired; /// 5 seconds from last accepted
            transaction_id_type        id;
-           transaction_metadata_ptr   trx;
+           time_point                 expired; /// 5 seconds from last accepted
+           bool                       known_by_peer = false;
+        };
+
+        transaction_status* find( const transaction_id_type& id, const time_point& now ) {
+           for( auto& s : set_for( id ) ) {
+              if( s.id == id ) return s.expired >= now ? &s : nullptr;
+           }
+           return nullptr;
+        }
+
+        transaction_status& insert( const transaction_id_type& id, const time_point& now ) {
+           auto& set = set_for( id );
+           auto* dest = &set[0];
+           for( auto& s : set ) {
+              if( s.id == id || s.expired < now ) { dest = &s; break; }
+              if( s.expired < dest->expired ) dest = &s;
+           }
+           *dest = transaction_status{ id };
+           return *dest;
+        }
+
+        /// queue a transaction to be sent until expired, dropping the oldest when full
+        void push_pending( const transaction_metadata_ptr& t, const time_point& expired ) {
+           if( _pending.size() >= max_pending ) _pending.pop_front();
+           _pending.push_back( pending_transaction{ t, expired } );
+        }
+
+        /// @return the oldest queued transaction the peer is not known to have, marked as known
+        transaction_metadata_ptr pop_pending( const time_point& now ) {
+           while( !_pending.empty() ) {
+              auto p = std::move( _pending.front() );
+              _pending.pop_front();
+              auto* stat = find( p.trx->id, now );
+              if( stat ) {
+                 if( stat->known_by_peer ) continue;
+              } else {
+                 if( p.expired < now ) continue;
+                 // the entry was replaced by another transaction of its set
+                 stat = &insert( p.trx->id, now );
+                 stat->expired = p.expired;
+              }
+              stat->known_by_peer = true;
+              return p.trx;
+           }
+           return transaction_metadata_ptr();
+        }
+
+     private:
+        std::array<transaction_status, ways>& set_for( const transaction_id_type& id ) {
+           return _sets[id._hash[0] % sets];
+        }
 
-           void mark_known_by_peer() { received = fc::time_point::maximum(); trx.reset();  }
-           bool known_by_peer()const { return received == fc::time_point::maximum(); }
+        std::vector<std::array<transaction_status, ways>> _sets = std::vector<std::array<transaction_status, ways>>( sets );
+        struct pending_transaction {
+           transaction_metadata_ptr   trx;
+           time_point                 expired;
         };
 
-        typedef boost::multi_index_container<transaction_status,
-           indexed_by<
-              ordered_unique< tag<by_id>,  member<transaction_status,transaction_id_type,&transaction_status::id> >,
-              ordered_non_unique< tag<by_received>,  member<transaction_status,time_point,&transaction_status::received> >,
-              ordered_non_unique< tag<by_expired>,  member<transaction_status,time_point,&transaction_status::expired> >
-           >
-        > transaction_status_index;
+        std::deque<pending_transaction>                    _pending;
+  };
+
+  constexpr uint32_t block_status_tracker::capacity;
+  constexpr uint32_t block_status_tracker::ways;
+  constexpr uint32_t transaction_status_tracker::sets;
+  constexpr uint32_t transaction_status_tracker::ways;
+  constexpr uint32_t transaction_status_tracker::max_pending;
+
+  /**
+   *  Each session is presumed to operate in its own strand so that
+   *  operations can execute in parallel.
+   */
+  class session : public std::enable_shared_from_this<session>
+  {
+     public:
+        enum session_state {
+           hello_state,
+           sending_state,
+           idle_state
+        };
 
-        block_status_index        _block_status;
-        transaction_status_index  _transaction_status;
-        const uint32_t            _max_block_status_range = 2048; // limit tracked block_status known_by_peer
+        block_status_tracker        _block_status;
+        transaction_status_tracker  _transaction_status;
+        const uint32_t              _max_block_status_range = block_status_tracker::capacity; // limit tracked block_status known_by_peer
 
         public_key_type    _local_peer_id;
         uint32_t           _local_lib             = 0;
@@ -298,7 +386,7 @@ namespace eosio {
         string                                                         _remote_host;
         string                                                         _remote_port;
 
-        vector<char>                                                  _out_buffer;
+        std::shared_ptr<const vector<char>>                           _out_buffer; ///< message being written, blocks are shared with other sessions
         //boost::beast::multi_buffer                                  _in_buffer;
         boost::beast::flat_buffer                                     _in_buffer;
         flat_set<block_id_type>                                       _block_header_notices;
@@ -435,39 +523,22 @@ namespace eosio {
          */
         void on_accepted_transaction( transaction_metadata_ptr t ) {
            //ilog( "accepted ${t}", ("t",t->id) );
-           auto itr = _transaction_status.find( t->id );
-           if( itr != _transaction_status.end() ) {
-              if( !itr->known_by_peer() ) {
-                 _transaction_status.modify( itr, [&]( auto& stat ) {
-                    stat.expired = std::min<fc::time_point>( fc::time_point::now() + fc::seconds(5), t->packed_trx->expiration() );
-                 });
+           auto now = fc::time_point::now();
+           auto* stat = _transaction_status.find( t->id, now );
+           if( stat ) {
+              if( !stat->known_by_peer ) {
+                 stat->expired = std::min<fc::time_point>( now + fc::seconds(5), t->packed_trx->expiration() );
               }
               return;
            }
 
-           transaction_status stat;
-           stat.received = fc::time_point::now();
-           stat.expired  = stat.received + fc::seconds(5);
-           stat.id       = t->id;
-           stat.trx      = t;
-           _transaction_status.insert( stat );
+           auto expired = now + fc::seconds(5);
+           _transaction_status.insert( t->id, now ).expired = expired;
+           _transaction_status.push_pending( t, expired );
 
            maybe_send_next_message();
         }
 
-        /**
-         * Remove all transactions that expired from cache prior to now
-         */
-        void purge_transaction_cache() {
-           auto& idx = _transaction_status.get<by_expired>();
-           auto itr = idx.begin();
-           auto now = fc::time_point::now();
-           while( itr != idx.end() && itr->expired < now ) {
-              idx.erase(itr);
-              itr = idx.begin();
-           }
-        }
-
         /**
          *  When our local LIB advances we can purge our known history up to
          *  the LIB or up to the last block known by the remote peer.
@@ -478,17 +549,11 @@ namespace eosio {
            _local_lib_id = s->id;
 
            auto purge_to = std::min( _local_lib, _last_sent_block_num );
-
-           auto& idx = _block_status.get<by_num>();
-           auto itr = idx.begin();
-           while( itr != idx.end() && itr->block_num() < purge_to ) {
-              idx.erase(itr);
-              itr = idx.begin();
-           }
+           _block_status.purge_below( purge_to );
 
            if( _remote_request_irreversible_only ) {
-              auto bitr = _block_status.find(s->id);
-              if ( bitr == _block_status.end() || !bitr->received_from_peer ) {
+              auto* bstat = _block_status.find(s->id);
+              if ( !bstat || !bstat->received_from_peer ) {
                  _block_header_notices.insert(s->id);
               }
            }
@@ -501,9 +566,9 @@ namespace eosio {
            verify_strand_in_this_thread(_strand, __func__, __LINE__);
            try {
               auto id = b->id();
-              auto itr = _block_status.find( id );
-              if( itr == _block_status.end() ) return;
-              if( itr->received_from_peer ) {
+              auto* bstat = _block_status.find( id );
+              if( !bstat ) return;
+              if( bstat->received_from_peer ) {
                  peer_elog(this, "bad signed_block_ptr : unknown" );
                  elog( "peer sent bad block #${b} ${i}, disconnect", ("b", b->block_num())("i",b->id())  );
                  _ws->next_layer().close();
@@ -520,12 +585,12 @@ namespace eosio {
 
            if( fc::time_point::now() - s->block->timestamp  < fc::seconds(6) ) {
            //   ilog( "queue notice to peer that we have this block so hopefully they don't send it to us" );
-              auto itr = _block_status.find( id );
-              if( !_remote_request_irreversible_only && ( itr == _block_status.end() || !itr->received_from_peer ) ) {
+              auto* bstat = _block_status.find( id );
+              if( !_remote_request_irreversible_only && ( !bstat || !bstat->received_from_peer ) ) {
                  _block_header_notices.insert( id );
               }
-              if( itr == _block_status.end() ) {
-                 _block_status.insert( block_status(id, false, false) );
+              if( !bstat ) {
+                 _block_status.insert( id );
               }
            }
         }
@@ -545,18 +610,14 @@ namespace eosio {
               _last_sent_block_id  = _local_lib_id;
            }
 
-           purge_transaction_cache();
-
-           /** purge all transactions from cache, I will send them as part of a block
-            * in the future unless peer tells me they already have block.
+           /** stop sending transactions included in the block, I will send them as part of a block
+            * in the future unless peer tells me they already have block. Their entries are kept as
+            * known so a queued copy is skipped rather than taken for a replaced entry and resent.
             */
            for( const auto& receipt : s->block->transactions ) {
               if( receipt.trx.which() == 1 ) {
                  const auto& pt = receipt.trx.get<packed_transaction>();
-                 const auto& tid = pt.id();
-                 auto itr = _transaction_status.find( tid );
-                 if( itr != _transaction_status.end() )
-                    _transaction_status.erase(itr);
+                 mark_transaction_known_by_peer( pt.id() );
               }
            }
 
@@ -616,29 +677,33 @@ namespace eosio {
 
         void send( const bnet_message& msg ) { try {
            auto ps = fc::raw::pack_size(msg);
-           _out_buffer.resize(ps);
-           fc::datastream<char*> ds(_out_buffer.data(), ps);
+           auto buff = std::make_shared<vector<char>>(ps);
+           fc::datastream<char*> ds(buff->data(), ps);
            fc::raw::pack(ds, msg);
-           send();
+           send( std::move(buff) );
         } FC_LOG_AND_RETHROW() }
 
         template<class T>
         void send( const bnet_message& msg, const T& ex ) { try {
            auto ex_size = fc::raw::pack_size(ex);
            auto ps = fc::raw::pack_size(msg) + fc::raw::pack_size(unsigned_int(ex_size)) + ex_size;
-           _out_buffer.resize(ps);
-           fc::datastream<char*> ds(_out_buffer.data(), ps);
+           auto buff = std::make_shared<vector<char>>(ps);
+           fc::datastream<char*> ds(buff->data(), ps);
            fc::raw::pack( ds, msg );
            fc::raw::pack( ds, unsigned_int(ex_size) );
            fc::raw::pack( ds, ex );
-           send();
+           send( std::move(buff) );
         } FC_LOG_AND_RETHROW() }
 
-        void send() { try {
+        /// sends the block packed once by bnet_plugin_impl for all sessions
+        void send_block( const signed_block_ptr& b );
+
+        void send( std::shared_ptr<const vector<char>> buff ) { try {
            verify_strand_in_this_thread(_strand, __func__, __LINE__);
 
+           _out_buffer = std::move(buff);
            _state = sending_state;
-           _ws->async_write( boost::asio::buffer(_out_buffer),
+           _ws->async_write( boost::asio::buffer(*_out_buffer),
                              boost::asio::bind_executor(
                                 _strand,
                                std::bind( &session::on_write,
@@ -648,20 +713,21 @@ namespace eosio {
         } FC_LOG_AND_RETHROW() }
 
         void mark_block_status( const block_id_type& id, bool known_by_peer, bool recv_from_peer ) {
-           auto itr = _block_status.find(id);
-           if( itr == _block_status.end() ) {
+           auto* bstat = _block_status.find(id);
+           if( !bstat ) {
               // optimization to avoid sending blocks to nodes that already know about them
               // to avoid unbounded memory growth limit number tracked
               const auto min_block_num = std::min( _local_lib, _last_sent_block_num );
               const auto max_block_num = min_block_num + _max_block_status_range;
               const auto block_num = block_header::num_from_id( id );
-              if( block_num > min_block_num && block_num < max_block_num && _block_status.size() < _max_block_status_range )
-                 _block_status.insert( block_status( id, known_by_peer, recv_from_peer ) );
-           } else {
-              _block_status.modify( itr, [&]( auto& item ) {
+              if( block_num > min_block_num && block_num < max_block_num ) {
+                 auto& item = _block_status.insert( id );
                  item.known_by_peer = known_by_peer;
-                 if (recv_from_peer) item.received_from_peer = true;
-              });
+                 item.received_from_peer = recv_from_peer;
+              }
+           } else {
+              bstat->known_by_peer = known_by_peer;
+              if (recv_from_peer) bstat->received_from_peer = true;
            }
         }
 
@@ -673,11 +739,9 @@ namespace eosio {
         void maybe_send_next_message() {
            verify_strand_in_this_thread(_strand, __func__, __LINE__);
            if( _state == sending_state ) return; /// in process of sending
-           if( _out_buffer.size() ) return; /// in process of sending
+           if( _out_buffer ) return; /// in process of sending
            if( !_recv_remote_hello || !_sent_remote_hello ) return;
 
-           clear_expired_trx();
-
            if( send_block_notice() ) return;
            if( send_pong() ) return;
            if( send_ping() ) return;
@@ -739,37 +803,20 @@ namespace eosio {
         }
 
         bool is_known_by_peer( block_id_type id ) {
-           auto itr = _block_status.find(id);
-           if( itr == _block_status.end() ) return false;
-           return itr->known_by_peer;
-        }
-
-        void clear_expired_trx() {
-           auto& idx = _transaction_status.get<by_expired>();
-           auto itr = idx.begin();
-           while( itr != idx.end() && itr->expired < fc::time_point::now() ) {
-              idx.erase(itr);
-              itr = idx.begin();
-           }
+           auto* bstat = _block_status.find(id);
+           if( !bstat ) return false;
+           return bstat->known_by_peer;
         }
 
         bool send_next_trx() { try {
            if( !_remote_request_trx  ) return false;
 
-           auto& idx = _transaction_status.get<by_received>();
-           auto start = idx.begin();
-           if( start == idx.end() || start->known_by_peer() )
+           auto trx = _transaction_status.pop_pending( fc::time_point::now() );
+           if( !trx )
               return false;
 
-
-           auto ptrx_ptr = start->trx->packed_trx;
-
-           idx.modify( start, [&]( auto& stat ) {
-              stat.mark_known_by_peer();
-           });
-
-           // wlog("sending trx ${id}", ("id",start->id) );
-           send(ptrx_ptr);
+           // wlog("sending trx ${id}", ("id",trx->id) );
+           send(trx->packed_trx);
 
            return true;
 
@@ -815,7 +862,7 @@ namespace eosio {
             _last_sent_block_id  = next_id;
             _last_sent_block_num = nextblock->block_num();
 
-            send( nextblock );
+            send_block( nextblock );
             status( "sending block " + std::to_string( block_header::num_from_id(next_id) ) );
 
             if( nextblock->timestamp > (fc::time_point::now() - fc::seconds(5)) ) {
@@ -1021,18 +1068,15 @@ namespace eosio {
          * @return true if trx is known by local host, false if new to this host
          */
         bool mark_transaction_known_by_peer( const transaction_id_type& id ) {
-           auto itr = _transaction_status.find( id );
-           if( itr != _transaction_status.end() ) {
-              _transaction_status.modify( itr, [&]( auto& stat ) {
-                 stat.mark_known_by_peer();
-              });
+           auto now = fc::time_point::now();
+           auto* stat = _transaction_status.find( id, now );
+           if( stat ) {
+              stat->known_by_peer = true;
               return true;
            } else {
-              transaction_status stat;
-              stat.id = id;
-              stat.mark_known_by_peer();
-              stat.expired = fc::time_point::now()+fc::seconds(5);
-              _transaction_status.insert(stat);
+              auto& item = _transaction_status.insert( id, now );
+              item.known_by_peer = true;
+              item.expired = now + fc::seconds(5);
            }
            return false;
         }
@@ -1047,7 +1091,7 @@ namespace eosio {
               return on_fail( ec, "write" );
            }
            _state = idle_state;
-           _out_buffer.resize(0);
+           _out_buffer.reset();
            maybe_send_next_message();
         }
 
@@ -1150,6 +1194,41 @@ namespace eosio {
          channels::rejected_block::channel_type::handle         _on_bad_block_handle;
          channels::accepted_transaction::channel_type::handle   _on_appled_trx_handle;
 
+         static constexpr size_t                                _max_packed_blocks = 64;
+         std::mutex                                             _packed_blocks_mtx;
+         std::map<block_id_type, std::shared_ptr<const vector<char>>> _packed_blocks; /// bnet_message of recent blocks, shared by all sessions
+         std::deque<block_id_type>                              _packed_block_order; /// oldest first
+
+         /**
+          * @return the block packed as a bnet_message, packing it only if no session or
+          * accepted block notification already did. Called from any thread.
+          */
+         std::shared_ptr<const vector<char>> packed_block( const signed_block_ptr& b ) {
+            auto id = b->id();
+            {
+               std::lock_guard<std::mutex> g( _packed_blocks_mtx );
+               auto itr = _packed_blocks.find( id );
+               if( itr != _packed_blocks.end() ) return itr->second;
+            }
+
+            bnet_message msg( b );
+            auto ps = fc::raw::pack_size( msg );
+            auto buff = std::make_shared<vector<char>>( ps );
+            fc::datastream<char*> ds( buff->data(), ps );
+            fc::raw::pack( ds, msg );
+
+            std::lock_guard<std::mutex> g( _packed_blocks_mtx );
+            auto r = _packed_blocks.emplace( id, std::move(buff) );
+            if( r.second ) {
+               _packed_block_order.push_back( id );
+               if( _packed_block_order.size() > _max_packed_blocks ) {
+                  _packed_blocks.erase( _packed_block_order.front() );
+                  _packed_block_order.pop_front();
+               }
+            }
+            return r.first->second;
+         }
+
          void async_add_session( std::weak_ptr<session> wp ) {
             app().post(priority::low, [wp,this]{
                if( auto l = wp.lock() ) {
@@ -1199,6 +1278,7 @@ namespace eosio {
           */
          void on_accepted_block( block_state_ptr s ) {
             _ioc->post( [s,this] { /// post this to the thread pool because packing can be intensive
+               packed_block( s->block );
                for_each_session( [s]( auto ses ){ ses->on_accepted_block( s ); } );
             });
          }
@@ -1445,6 +1525,12 @@ namespace eosio {
    }
 
 
+   constexpr size_t bnet_plugin_impl::_max_packed_blocks;
+
+   void session::send_block( const signed_block_ptr& b ) { try {
+      send( _net_plugin->packed_block( b ) );
+   } FC_LOG_AND_RETHROW() }
+
    session::~session() {
      wlog( "close session ${n}",("n",_session_num) );
      std::weak_ptr<bnet_plugin_impl> netp = _net_plugin;
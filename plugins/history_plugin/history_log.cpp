@@ -0,0 +1,603 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE
+ */
+#include <eosio/history_plugin/history_log.hpp>
+#include <eosio/chain/exceptions.hpp>
+
+#include <fc/io/raw.hpp>
+#include <fc/log/logger.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+namespace eosio {
+
+namespace {
+   constexpr uint32_t trx_index_version     = 1;
+   constexpr uint32_t min_trx_log2_capacity = 16;
+   constexpr uint32_t empty_trx_block       = 0;
+   constexpr uint32_t removed_trx_block     = ~uint32_t(0);
+   constexpr uint32_t account_index_version = 1;
+}
+
+history_log::history_log( const boost::filesystem::path& dir )
+: log_filename( (dir / "history.log").string() )
+, index_filename( (dir / "history.index").string() )
+, trx_filename( (dir / "history.trx").string() )
+, accounts_filename( (dir / "history.accounts").string() )
+{
+   open_log();
+   open_index();
+   const bool trx_index_valid = open_trx_index();
+   const uint32_t accounts_end = load_account_index();
+
+   const uint32_t first_block = trx_index_valid ? accounts_end : _begin_block;
+   for( uint32_t block_num = first_block; block_num < _end_block; ++block_num ) {
+      history_log_header header;
+      const auto summary = read_summary( get_pos( block_num ), header );
+      if( block_num >= accounts_end )
+         index_summary( block_num, summary );
+      if( !trx_index_valid )
+         index_transactions( block_num, summary );
+      if( !((block_num - first_block + 1) % 100000) ) {
+         ilog( "indexing history.log: ${n} blocks", ("n", block_num - first_block + 1) );
+      }
+   }
+   if( !trx_index_valid )
+      write_trx_header( true );
+   if( accounts_end != _end_block )
+      write_account_index();
+   ilog( "history.log indexed ${a} accounts and ${t} transactions", ("a", account_runs.size())("t", trx_header.count) );
+}
+
+uint64_t history_log::trx_key( const chain::transaction_id_type& id ) {
+   // big endian, so that ordering by key matches ordering by id prefix
+   const auto* p = reinterpret_cast<const uint8_t*>( id.data() );
+   uint64_t key = 0;
+   for( int i = 0; i < 8; ++i ) key = (key << 8) | p[i];
+   return key;
+}
+
+void history_log::append_block( uint32_t block_num, const chain::block_id_type& block_id, const chain::block_id_type& prev_id,
+                                chain::block_timestamp_type block_time, std::vector<history_action>&& actions ) {
+   EOS_ASSERT( _begin_block == _end_block || block_num <= _end_block, chain::plugin_exception,
+               "missed a block in history.log" );
+
+   if( _begin_block != _end_block && block_num > _begin_block ) {
+      const auto prev = block_num == _end_block ? last_block_id : read_header( block_num - 1 ).block_id;
+      EOS_ASSERT( prev_id == prev, chain::plugin_exception, "missed a fork change in history.log" );
+   }
+
+   // history.trx is regenerated on startup if anything below does not complete
+   write_trx_header( false );
+
+   if( block_num < _end_block )
+      truncate( block_num );
+
+   std::sort( actions.begin(), actions.end(), []( const history_action& a, const history_action& b ) {
+      return a.summary.global_sequence < b.summary.global_sequence;
+   });
+
+   history_block_summary summary{ block_time };
+   std::vector<chain::bytes> traces;
+   summary.actions.reserve( actions.size() );
+   traces.reserve( actions.size() );
+   for( auto& a : actions ) {
+      summary.actions.emplace_back( std::move( a.summary ) );
+      traces.emplace_back( std::move( a.packed_trace ) );
+   }
+
+   const auto summary_bin = fc::raw::pack( summary );
+   const auto traces_bin = fc::raw::pack( traces );
+   EOS_ASSERT( summary_bin.size() == (uint32_t)summary_bin.size(), chain::plugin_exception, "history summary is too big" );
+
+   history_log_header header{ block_num, block_id, sizeof(uint32_t) + summary_bin.size() + traces_bin.size() };
+   log.seekg( 0, std::ios_base::end );
+   uint64_t pos = log.tellg();
+   log.write( (char*)&header, sizeof(header) );
+   uint32_t s = (uint32_t)summary_bin.size();
+   log.write( (char*)&s, sizeof(s) );
+   log.write( summary_bin.data(), summary_bin.size() );
+   log.write( traces_bin.data(), traces_bin.size() );
+   log.write( (char*)&pos, sizeof(pos) );
+
+   index.seekg( 0, std::ios_base::end );
+   index.write( (char*)&pos, sizeof(pos) );
+
+   if( _begin_block == _end_block )
+      _begin_block = block_num;
+   _end_block    = block_num + 1;
+   last_block_id = block_id;
+
+   index_summary( block_num, summary );
+   index_transactions( block_num, summary );
+   write_trx_header( true );
+}
+
+int32_t history_log::account_action_count( chain::account_name account )const {
+   auto itr = account_runs.find( account );
+   if( itr == account_runs.end() ) return 0;
+   const auto& last = itr->second.back();
+   return last.first_account_sequence + last.count;
+}
+
+fc::optional<uint64_t> history_log::global_sequence( chain::account_name account, int32_t account_sequence )const {
+   auto itr = account_runs.find( account );
+   if( itr == account_runs.end() || account_sequence < 0 ) return {};
+
+   const auto& runs = itr->second;
+   auto run = std::upper_bound( runs.begin(), runs.end(), account_sequence, []( int32_t seq, const action_run& r ) {
+      return seq < r.first_account_sequence;
+   });
+   if( run == runs.begin() ) return {};
+   --run;
+   if( account_sequence - run->first_account_sequence >= (int64_t)run->count ) return {};
+   return run->first_global_sequence + (account_sequence - run->first_account_sequence);
+}
+
+fc::optional<history_log::action_entry> history_log::get_action( uint64_t global_sequence ) {
+   auto itr = std::upper_bound( block_first_sequence.begin(), block_first_sequence.end(), global_sequence,
+                                []( uint64_t seq, const std::pair<uint64_t, uint32_t>& b ) { return seq < b.first; } );
+   if( itr == block_first_sequence.begin() ) return {};
+   --itr;
+
+   const auto& block = read_block( itr->second );
+   const auto& actions = block.summary.actions;
+   auto a = std::lower_bound( actions.begin(), actions.end(), global_sequence,
+                              []( const history_action_summary& s, uint64_t seq ) { return s.global_sequence < seq; } );
+   if( a == actions.end() || a->global_sequence != global_sequence ) return {};
+
+   return action_entry{ global_sequence, itr->second, block.summary.block_time, a->trx_id,
+                        block.traces[a - actions.begin()] };
+}
+
+std::vector<history_log::action_entry>
+history_log::get_transaction( const chain::transaction_id_type& id, uint32_t prefix_bits,
+                              const std::function<bool(const chain::transaction_id_type&)>& match ) {
+   EOS_ASSERT( prefix_bits >= 32, chain::plugin_exception, "transaction id prefix is too short" );
+   std::vector<action_entry> result;
+   const uint64_t mask = prefix_bits >= 64 ? ~uint64_t(0) : ~uint64_t(0) << (64 - prefix_bits);
+   const uint64_t key = trx_key( id ) & mask;
+
+   // all keys sharing the leading 32 bits are in the probe cluster starting at their slot
+   std::vector<uint32_t> block_nums;
+   const uint64_t capacity_mask = (uint64_t(1) << trx_header.log2_capacity) - 1;
+   for( uint64_t pos = trx_slot_pos( key ); ; pos = (pos + 1) & capacity_mask ) {
+      const auto slot = read_trx_slot( pos );
+      if( slot.block_num == empty_trx_block ) break;
+      if( slot.block_num != removed_trx_block && (slot.key & mask) == key )
+         block_nums.push_back( slot.block_num );
+   }
+   std::sort( block_nums.begin(), block_nums.end() );
+   block_nums.erase( std::unique( block_nums.begin(), block_nums.end() ), block_nums.end() );
+
+   for( uint32_t block_num : block_nums ) {
+      const auto& block = read_block( block_num );
+      const auto& actions = block.summary.actions;
+      for( size_t i = 0; i < actions.size(); ++i ) {
+         if( result.empty() ? !match( actions[i].trx_id ) : actions[i].trx_id != result.front().trx_id )
+            continue;
+         result.emplace_back( action_entry{ actions[i].global_sequence, block_num, block.summary.block_time,
+                                            actions[i].trx_id, block.traces[i] } );
+      }
+      if( !result.empty() ) break;
+   }
+   return result;
+}
+
+void history_log::index_summary( uint32_t block_num, const history_block_summary& summary ) {
+   if( summary.actions.empty() ) return;
+   block_first_sequence.emplace_back( summary.actions.front().global_sequence, block_num );
+
+   for( const auto& a : summary.actions ) {
+      for( const auto& account : a.accounts ) {
+         auto& runs = account_runs[account];
+         if( !runs.empty() && runs.back().first_global_sequence + runs.back().count == a.global_sequence ) {
+            ++runs.back().count;
+         } else {
+            int32_t next = runs.empty() ? 0 : runs.back().first_account_sequence + runs.back().count;
+            runs.push_back( action_run{ a.global_sequence, next, 1 } );
+         }
+      }
+   }
+}
+
+void history_log::unindex_summary( uint32_t block_num, const history_block_summary& summary ) {
+   for( auto a = summary.actions.rbegin(); a != summary.actions.rend(); ++a ) {
+      for( const auto& account : a->accounts ) {
+         auto itr = account_runs.find( account );
+         EOS_ASSERT( itr != account_runs.end() && !itr->second.empty(), chain::plugin_exception,
+                     "history index is missing account ${a}", ("a", account) );
+         auto& runs = itr->second;
+         if( --runs.back().count == 0 ) runs.pop_back();
+         if( runs.empty() ) account_runs.erase( itr );
+      }
+   }
+   if( !summary.actions.empty() ) {
+      EOS_ASSERT( !block_first_sequence.empty() && block_first_sequence.back().second == block_num, chain::plugin_exception,
+                  "history index is missing block ${b}", ("b", block_num) );
+      block_first_sequence.pop_back();
+   }
+}
+
+void history_log::index_transactions( uint32_t block_num, const history_block_summary& summary ) {
+   const chain::transaction_id_type* prev_trx_id = nullptr;
+   for( const auto& a : summary.actions ) {
+      // actions of a transaction are contiguous in global sequence order
+      if( !prev_trx_id || *prev_trx_id != a.trx_id )
+         insert_trx( trx_slot{ trx_key( a.trx_id ), block_num } );
+      prev_trx_id = &a.trx_id;
+   }
+}
+
+void history_log::unindex_transactions( uint32_t block_num, const history_block_summary& summary ) {
+   const chain::transaction_id_type* prev_trx_id = nullptr;
+   for( const auto& a : summary.actions ) {
+      if( !prev_trx_id || *prev_trx_id != a.trx_id )
+         remove_trx( trx_slot{ trx_key( a.trx_id ), block_num } );
+      prev_trx_id = &a.trx_id;
+   }
+}
+
+uint64_t history_log::trx_slot_pos( uint64_t key )const {
+   // fibonacci hashing of the leading 32 bits, so that short prefixes of the key find their slot
+   return ((key >> 32) * 0x9E3779B97F4A7C15ull) >> (64 - trx_header.log2_capacity);
+}
+
+history_log::trx_slot history_log::read_trx_slot( uint64_t slot_pos ) {
+   trx_slot slot;
+   trx_index.seekg( sizeof(trx_header) + slot_pos * sizeof(slot) );
+   trx_index.read( (char*)&slot, sizeof(slot) );
+   return slot;
+}
+
+void history_log::write_trx_slot( uint64_t slot_pos, const trx_slot& slot ) {
+   trx_index.seekp( sizeof(trx_header) + slot_pos * sizeof(slot) );
+   trx_index.write( (const char*)&slot, sizeof(slot) );
+}
+
+void history_log::insert_trx( const trx_slot& slot ) {
+   const uint64_t capacity = uint64_t(1) << trx_header.log2_capacity;
+   if( (trx_header.used + 1) * 2 > capacity ) {
+      // rebuild at a load of at most 1/4, which also drops the removed slots
+      uint32_t log2_capacity = min_trx_log2_capacity;
+      while( (trx_header.count + 1) * 4 > (uint64_t(1) << log2_capacity) ) ++log2_capacity;
+      rehash_trx_index( log2_capacity );
+   }
+
+   const uint64_t capacity_mask = (uint64_t(1) << trx_header.log2_capacity) - 1;
+   for( uint64_t pos = trx_slot_pos( slot.key ); ; pos = (pos + 1) & capacity_mask ) {
+      const auto existing = read_trx_slot( pos );
+      if( existing.block_num == empty_trx_block || existing.block_num == removed_trx_block ) {
+         if( existing.block_num == empty_trx_block ) ++trx_header.used;
+         ++trx_header.count;
+         write_trx_slot( pos, slot );
+         return;
+      }
+   }
+}
+
+void history_log::remove_trx( const trx_slot& slot ) {
+   const uint64_t capacity_mask = (uint64_t(1) << trx_header.log2_capacity) - 1;
+   for( uint64_t pos = trx_slot_pos( slot.key ); ; pos = (pos + 1) & capacity_mask ) {
+      const auto existing = read_trx_slot( pos );
+      EOS_ASSERT( existing.block_num != empty_trx_block, chain::plugin_exception,
+                  "history.trx is missing a transaction of block ${b}", ("b", slot.block_num) );
+      if( existing.key == slot.key && existing.block_num == slot.block_num ) {
+         --trx_header.count;
+         write_trx_slot( pos, trx_slot{ 0, removed_trx_block } );
+         return;
+      }
+   }
+}
+
+history_log_header history_log::read_header( uint32_t block_num ) {
+   history_log_header header;
+   log.seekg( get_pos( block_num ) );
+   log.read( (char*)&header, sizeof(header) );
+   return header;
+}
+
+history_block_summary history_log::read_summary( uint64_t pos, history_log_header& header ) {
+   log.seekg( pos );
+   log.read( (char*)&header, sizeof(header) );
+   uint32_t s = 0;
+   log.read( (char*)&s, sizeof(s) );
+   EOS_ASSERT( sizeof(s) + s <= header.payload_size, chain::plugin_exception, "corrupt history.log (9)" );
+   std::vector<char> bin( s );
+   log.read( bin.data(), bin.size() );
+   return fc::raw::unpack<history_block_summary>( bin );
+}
+
+const history_log::block_entry& history_log::read_block( uint32_t block_num ) {
+   if( cached_block && cached_block_num == block_num ) return *cached_block;
+
+   EOS_ASSERT( block_num >= _begin_block && block_num < _end_block, chain::plugin_exception,
+               "read non-existing block in history.log" );
+   history_log_header header = read_header( block_num );
+   std::vector<char> payload( header.payload_size );
+   log.read( payload.data(), payload.size() );
+
+   uint32_t s = 0;
+   EOS_ASSERT( payload.size() >= sizeof(s), chain::plugin_exception, "corrupt history.log (10)" );
+   memcpy( &s, payload.data(), sizeof(s) );
+   EOS_ASSERT( sizeof(s) + s <= payload.size(), chain::plugin_exception, "corrupt history.log (11)" );
+
+   block_entry block;
+   fc::datastream<const char*> summary_ds( payload.data() + sizeof(s), s );
+   fc::raw::unpack( summary_ds, block.summary );
+   fc::datastream<const char*> traces_ds( payload.data() + sizeof(s) + s, payload.size() - sizeof(s) - s );
+   fc::raw::unpack( traces_ds, block.traces );
+   EOS_ASSERT( block.traces.size() == block.summary.actions.size(), chain::plugin_exception, "corrupt history.log (12)" );
+
+   cached_block = std::move( block );
+   cached_block_num = block_num;
+   return *cached_block;
+}
+
+bool history_log::get_last_block( uint64_t size ) {
+   history_log_header header;
+   uint64_t           suffix;
+   log.seekg( size - sizeof(suffix) );
+   log.read( (char*)&suffix, sizeof(suffix) );
+   if( suffix > size || suffix + sizeof(header) > size ) {
+      elog( "corrupt history.log (2)" );
+      return false;
+   }
+   log.seekg( suffix );
+   log.read( (char*)&header, sizeof(header) );
+   if( suffix + sizeof(header) + header.payload_size + sizeof(suffix) != size ) {
+      elog( "corrupt history.log (3)" );
+      return false;
+   }
+   _end_block    = header.block_num + 1;
+   last_block_id = header.block_id;
+   if( _begin_block >= _end_block ) {
+      elog( "corrupt history.log (4)" );
+      return false;
+   }
+   return true;
+}
+
+void history_log::recover_blocks( uint64_t size ) {
+   ilog( "recover history.log" );
+   uint64_t pos = 0;
+   while( true ) {
+      history_log_header header;
+      if( pos + sizeof(header) > size )
+         break;
+      log.seekg( pos );
+      log.read( (char*)&header, sizeof(header) );
+      uint64_t suffix;
+      if( header.payload_size > size || pos + sizeof(header) + header.payload_size + sizeof(suffix) > size )
+         break;
+      log.seekg( pos + sizeof(header) + header.payload_size );
+      log.read( (char*)&suffix, sizeof(suffix) );
+      if( suffix != pos )
+         break;
+      pos = pos + sizeof(header) + header.payload_size + sizeof(suffix);
+   }
+   log.flush();
+   boost::filesystem::resize_file( log_filename, pos );
+   log.sync();
+   EOS_ASSERT( pos > 0 && get_last_block( pos ), chain::plugin_exception, "recover history.log failed" );
+}
+
+void history_log::open_log() {
+   log.open( log_filename, std::ios_base::binary | std::ios_base::in | std::ios_base::out | std::ios_base::app );
+   log.seekg( 0, std::ios_base::end );
+   uint64_t size = log.tellg();
+   if( size >= sizeof(history_log_header) ) {
+      history_log_header header;
+      log.seekg( 0 );
+      log.read( (char*)&header, sizeof(header) );
+      EOS_ASSERT( header.version == 0 && sizeof(header) + header.payload_size + sizeof(uint64_t) <= size,
+                  chain::plugin_exception, "corrupt history.log (1)" );
+      _begin_block  = header.block_num;
+      last_block_id = header.block_id;
+      if( !get_last_block( size ) )
+         recover_blocks( size );
+      ilog( "history.log has blocks ${b}-${e}", ("b", _begin_block)("e", _end_block - 1) );
+   } else {
+      EOS_ASSERT( !size, chain::plugin_exception, "corrupt history.log (5)" );
+      ilog( "history.log is empty" );
+   }
+}
+
+void history_log::open_index() {
+   index.open( index_filename, std::ios_base::binary | std::ios_base::in | std::ios_base::out | std::ios_base::app );
+   index.seekg( 0, std::ios_base::end );
+   if( (uint64_t)index.tellg() == uint64_t(_end_block - _begin_block) * sizeof(uint64_t) )
+      return;
+   ilog( "Regenerate history.index" );
+   index.close();
+   index.open( index_filename, std::ios_base::binary | std::ios_base::in | std::ios_base::out | std::ios_base::trunc );
+
+   log.seekg( 0, std::ios_base::end );
+   uint64_t size = log.tellg();
+   uint64_t pos  = 0;
+   while( pos < size ) {
+      history_log_header header;
+      EOS_ASSERT( pos + sizeof(header) <= size, chain::plugin_exception, "corrupt history.log (6)" );
+      log.seekg( pos );
+      log.read( (char*)&header, sizeof(header) );
+      uint64_t suffix_pos = pos + sizeof(header) + header.payload_size;
+      uint64_t suffix;
+      EOS_ASSERT( suffix_pos + sizeof(suffix) <= size, chain::plugin_exception, "corrupt history.log (7)" );
+      log.seekg( suffix_pos );
+      log.read( (char*)&suffix, sizeof(suffix) );
+      EOS_ASSERT( suffix == pos, chain::plugin_exception, "corrupt history.log (8)" );
+
+      index.write( (char*)&pos, sizeof(pos) );
+      pos = suffix_pos + sizeof(suffix);
+   }
+}
+
+bool history_log::open_trx_index() {
+   if( boost::filesystem::exists( trx_filename ) ) {
+      trx_index.open( trx_filename, std::ios_base::binary | std::ios_base::in | std::ios_base::out );
+      trx_index.seekg( 0, std::ios_base::end );
+      const uint64_t size = trx_index.tellg();
+      if( size >= sizeof(trx_header) ) {
+         trx_index.seekg( 0 );
+         trx_index.read( (char*)&trx_header, sizeof(trx_header) );
+         if( trx_header.version == trx_index_version && trx_header.clean &&
+             trx_header.begin_block == _begin_block && trx_header.end_block == _end_block &&
+             trx_header.log2_capacity >= min_trx_log2_capacity && trx_header.log2_capacity < 48 &&
+             size == sizeof(trx_header) + (uint64_t(1) << trx_header.log2_capacity) * sizeof(trx_slot) )
+            return true;
+      }
+      trx_index.close();
+   }
+   ilog( "Regenerate history.trx" );
+   create_trx_index( min_trx_log2_capacity );
+   return false;
+}
+
+void history_log::create_trx_index( uint32_t log2_capacity ) {
+   trx_index.open( trx_filename, std::ios_base::binary | std::ios_base::in | std::ios_base::out | std::ios_base::trunc );
+   trx_header = trx_index_header{ trx_index_version, log2_capacity };
+   trx_index.write( (const char*)&trx_header, sizeof(trx_header) );
+   trx_index.flush();
+   // zero filled, i.e. all slots empty
+   boost::filesystem::resize_file( trx_filename, sizeof(trx_header) + (uint64_t(1) << log2_capacity) * sizeof(trx_slot) );
+}
+
+void history_log::rehash_trx_index( uint32_t log2_capacity ) {
+   const auto old_filename = trx_filename + ".old";
+   const uint64_t old_capacity = uint64_t(1) << trx_header.log2_capacity;
+   trx_index.close();
+   boost::filesystem::rename( trx_filename, old_filename );
+   create_trx_index( log2_capacity );
+
+   std::fstream old( old_filename, std::ios_base::binary | std::ios_base::in );
+   old.seekg( sizeof(trx_header) );
+   for( uint64_t i = 0; i < old_capacity; ++i ) {
+      trx_slot slot;
+      old.read( (char*)&slot, sizeof(slot) );
+      EOS_ASSERT( old, chain::plugin_exception, "corrupt history.trx" );
+      if( slot.block_num != empty_trx_block && slot.block_num != removed_trx_block )
+         insert_trx( slot );
+   }
+   old.close();
+   boost::filesystem::remove( old_filename );
+   ilog( "history.trx resized to ${n} slots", ("n", uint64_t(1) << log2_capacity) );
+}
+
+void history_log::write_trx_header( bool clean ) {
+   trx_header.begin_block = _begin_block;
+   trx_header.end_block   = _end_block;
+   trx_header.clean       = clean;
+   trx_index.seekp( 0 );
+   trx_index.write( (const char*)&trx_header, sizeof(trx_header) );
+   if( clean )
+      trx_index.flush();
+}
+
+void history_log::write_account_index() {
+   const auto tmp_filename = accounts_filename + ".tmp";
+   std::ofstream out( tmp_filename, std::ios_base::binary | std::ios_base::trunc );
+   account_index_header header{ account_index_version, _begin_block, _end_block };
+   header.last_block_id = last_block_id;
+   header.num_blocks    = block_first_sequence.size();
+   header.num_accounts  = account_runs.size();
+   out.write( (const char*)&header, sizeof(header) );
+   for( const auto& b : block_first_sequence ) {
+      const account_index_block block{ b.first, b.second };
+      out.write( (const char*)&block, sizeof(block) );
+   }
+   for( const auto& a : account_runs ) {
+      const account_index_entry entry{ a.first.value, a.second.size() };
+      out.write( (const char*)&entry, sizeof(entry) );
+      out.write( (const char*)a.second.data(), a.second.size() * sizeof(action_run) );
+   }
+   out.close();
+   EOS_ASSERT( out, chain::plugin_exception, "cannot write ${f}", ("f", tmp_filename) );
+   // replaced in one step, so a crash leaves the previous snapshot
+   boost::filesystem::rename( tmp_filename, accounts_filename );
+}
+
+/// @return the block after the last one loaded from history.accounts, _begin_block if nothing was loaded
+uint32_t history_log::load_account_index() {
+   if( _begin_block == _end_block || !boost::filesystem::exists( accounts_filename ) )
+      return _begin_block;
+
+   std::ifstream in( accounts_filename, std::ios_base::binary );
+   const uint64_t size = boost::filesystem::file_size( accounts_filename );
+   account_index_header header;
+   in.read( (char*)&header, sizeof(header) );
+   // a fork may have replaced the last indexed block since the snapshot was written
+   bool ok = in && header.version == account_index_version && header.begin_block == _begin_block &&
+             header.end_block > _begin_block && header.end_block <= _end_block &&
+             read_header( header.end_block - 1 ).block_id == header.last_block_id &&
+             header.num_blocks <= (size - sizeof(header)) / sizeof(account_index_block);
+
+   for( uint64_t i = 0; ok && i < header.num_blocks; ++i ) {
+      account_index_block block;
+      ok = (bool)in.read( (char*)&block, sizeof(block) );
+      block_first_sequence.emplace_back( block.first_global_sequence, block.block_num );
+   }
+   for( uint64_t i = 0; ok && i < header.num_accounts; ++i ) {
+      account_index_entry entry;
+      ok = in.read( (char*)&entry, sizeof(entry) ) && entry.num_runs &&
+           entry.num_runs <= (size - (uint64_t)in.tellg()) / sizeof(action_run);
+      if( !ok ) break;
+      auto& runs = account_runs[chain::account_name( entry.account )];
+      runs.resize( entry.num_runs );
+      ok = (bool)in.read( (char*)runs.data(), runs.size() * sizeof(action_run) );
+   }
+   ok = ok && (uint64_t)in.tellg() == size;
+
+   if( !ok ) {
+      ilog( "Regenerate history.accounts" );
+      account_runs.clear();
+      block_first_sequence.clear();
+      return _begin_block;
+   }
+   ilog( "history.accounts has blocks ${b}-${e}", ("b", header.begin_block)("e", header.end_block - 1) );
+   return header.end_block;
+}
+
+uint64_t history_log::get_pos( uint32_t block_num ) {
+   uint64_t pos = 0;
+   index.seekg( uint64_t(block_num - _begin_block) * sizeof(pos) );
+   index.read( (char*)&pos, sizeof(pos) );
+   return pos;
+}
+
+void history_log::truncate( uint32_t block_num ) {
+   cached_block.reset();
+   for( uint32_t b = _end_block; b > std::max( block_num, _begin_block ); --b ) {
+      history_log_header header;
+      const auto summary = read_summary( get_pos( b - 1 ), header );
+      unindex_summary( b - 1, summary );
+      unindex_transactions( b - 1, summary );
+   }
+
+   log.flush();
+   index.flush();
+   uint64_t num_removed = 0;
+   if( block_num <= _begin_block ) {
+      num_removed = _end_block - _begin_block;
+      log.seekg( 0 );
+      index.seekg( 0 );
+      boost::filesystem::resize_file( log_filename, 0 );
+      boost::filesystem::resize_file( index_filename, 0 );
+      _begin_block = _end_block = 0;
+   } else {
+      num_removed  = _end_block - block_num;
+      uint64_t pos = get_pos( block_num );
+      log.seekg( 0 );
+      index.seekg( 0 );
+      boost::filesystem::resize_file( log_filename, pos );
+      boost::filesystem::resize_file( index_filename, uint64_t(block_num - _begin_block) * sizeof(uint64_t) );
+      _end_block    = block_num;
+      last_block_id = read_header( block_num - 1 ).block_id;
+   }
+   log.sync();
+   index.sync();
+   ilog( "fork or replay: removed ${n} blocks from history.log", ("n", num_removed) );
+}
+
+} // namespace eosio
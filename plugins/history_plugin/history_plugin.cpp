@@ -1,6 +1,7 @@
 #include <eosio/history_plugin/history_plugin.hpp>
 #include <eosio/history_plugin/account_control_history_object.hpp>
 #include <eosio/history_plugin/public_key_history_object.hpp>
+#include <eosio/history_plugin/history_log.hpp>
 #include <eosio/chain/controller.hpp>
 #include <eosio/chain/trace.hpp>
 #include <eosio/chain_plugin/chain_plugin.hpp>
@@ -16,70 +17,6 @@ namespace eosio {
 
    static appbase::abstract_plugin& _history_plugin = app().register_plugin<history_plugin>();
 
-
-   struct account_history_object : public chainbase::object<account_history_object_type, account_history_object>  {
-      OBJECT_CTOR( account_history_object );
-
-      id_type      id;
-      account_name account; ///< the name of the account which has this action in its history
-      uint64_t     action_sequence_num = 0; ///< the sequence number of the relevant action (global)
-      int32_t      account_sequence_num = 0; ///< the sequence number for this account (per-account)
-   };
-
-   struct action_history_object : public chainbase::object<action_history_object_type, action_history_object> {
-
-      OBJECT_CTOR( action_history_object, (packed_action_trace) );
-
-      id_type      id;
-      uint64_t     action_sequence_num; ///< the sequence number of the relevant action
-
-      shared_string        packed_action_trace;
-      uint32_t             block_num;
-      block_timestamp_type block_time;
-      transaction_id_type  trx_id;
-   };
-   using account_history_id_type = account_history_object::id_type;
-   using action_history_id_type  = action_history_object::id_type;
-
-
-   struct by_action_sequence_num;
-   struct by_account_action_seq;
-   struct by_trx_id;
-
-   using action_history_index = chainbase::shared_multi_index_container<
-      action_history_object,
-      indexed_by<
-         ordered_unique<tag<by_id>, member<action_history_object, action_history_object::id_type, &action_history_object::id>>,
-         ordered_unique<tag<by_action_sequence_num>, member<action_history_object, uint64_t, &action_history_object::action_sequence_num>>,
-         ordered_unique<tag<by_trx_id>,
-            composite_key< action_history_object,
-               member<action_history_object, transaction_id_type, &action_history_object::trx_id>,
-               member<action_history_object, uint64_t, &action_history_object::action_sequence_num >
-            >
-         >
-      >
-   >;
-
-   using account_history_index = chainbase::shared_multi_index_container<
-      account_history_object,
-      indexed_by<
-         ordered_unique<tag<by_id>, member<account_history_object, account_history_object::id_type, &account_history_object::id>>,
-         ordered_unique<tag<by_account_action_seq>,
-            composite_key< account_history_object,
-               member<account_history_object, account_name, &account_history_object::account >,
-               member<account_history_object, int32_t, &account_history_object::account_sequence_num >
-            >
-         >
-      >
-   >;
-
-} /// namespace eosio
-
-CHAINBASE_SET_INDEX_TYPE(eosio::account_history_object, eosio::account_history_index)
-CHAINBASE_SET_INDEX_TYPE(eosio::action_history_object, eosio::action_history_index)
-
-namespace eosio {
-
    template<typename MultiIndex, typename LookupType>
    static void remove(chainbase::database& db, const account_name& account_name, const permission_name& permission)
    {
@@ -141,7 +78,14 @@ namespace eosio {
          std::set<filter_entry> filter_on;
          std::set<filter_entry> filter_out;
          chain_plugin*          chain_plug = nullptr;
+         mutable fc::optional<history_log> log; // read through the const api, which caches blocks
          fc::optional<scoped_connection> applied_transaction_connection;
+         fc::optional<scoped_connection> accepted_block_connection;
+
+         // actions of transactions applied since the last block, written when their block is accepted
+         std::map<transaction_id_type, std::vector<history_action>> cached_actions;
+         std::vector<history_action>                                onblock_actions;
+         bool                                                       log_failed = false;
 
           bool filter(const action_trace& act) {
             bool pass_on = false;
@@ -204,27 +148,6 @@ namespace eosio {
             return result;
          }
 
-         void record_account_action( account_name n, const base_action_trace& act ) {
-            auto& chain = chain_plug->chain();
-            chainbase::database& db = const_cast<chainbase::database&>( chain.db() ); // Override read-only access to state DB (highly unrecommended practice!)
-
-            const auto& idx = db.get_index<account_history_index, by_account_action_seq>();
-            auto itr = idx.lower_bound( boost::make_tuple( name(n.value+1), 0 ) );
-
-            uint64_t asn = 0;
-            if( itr != idx.begin() ) --itr;
-            if( itr->account == n )
-               asn = itr->account_sequence_num + 1;
-
-            //idump((n)(act.receipt.global_sequence)(asn));
-            const auto& a = db.create<account_history_object>( [&]( auto& aho ) {
-              aho.account = n;
-              aho.action_sequence_num = act.receipt.global_sequence;
-              aho.account_sequence_num = asn;
-            });
-            //idump((a.account)(a.action_sequence_num)(a.action_sequence_num));
-         }
-
          void on_system_action( const action_trace& at ) {
             auto& chain = chain_plug->chain();
             chainbase::database& db = const_cast<chainbase::database&>( chain.db() ); // Override read-only access to state DB (highly unrecommended practice!)
@@ -252,42 +175,71 @@ namespace eosio {
             }
          }
 
-         void on_action_trace( const action_trace& at ) {
+         void on_action_trace( const action_trace& at, std::vector<history_action>& actions ) {
             if( filter( at ) ) {
                //idump((fc::json::to_pretty_string(at)));
-               auto& chain = chain_plug->chain();
-               chainbase::database& db = const_cast<chainbase::database&>( chain.db() ); // Override read-only access to state DB (highly unrecommended practice!)
-
-               db.create<action_history_object>( [&]( auto& aho ) {
-                  auto ps = fc::raw::pack_size( at );
-                  aho.packed_action_trace.resize(ps);
-                  datastream<char*> ds( aho.packed_action_trace.data(), ps );
-                  fc::raw::pack( ds, at );
-                  aho.action_sequence_num = at.receipt.global_sequence;
-                  aho.block_num = chain.pending_block_state()->block_num;
-                  aho.block_time = chain.pending_block_time();
-                  aho.trx_id     = at.trx_id;
-               });
-
                auto aset = account_set( at );
-               for( auto a : aset ) {
-                  record_account_action( a, at );
-               }
+               actions.emplace_back( history_action{
+                  { at.receipt.global_sequence, at.trx_id, vector<account_name>( aset.begin(), aset.end() ) },
+                  fc::raw::pack( at ) } );
             }
             if( at.receipt.receiver == chain::config::system_account_name )
                on_system_action( at );
             for( const auto& iline : at.inline_traces ) {
-               on_action_trace( iline );
+               on_action_trace( iline, actions );
             }
          }
 
+         static bool is_onblock( const transaction_trace_ptr& p ) {
+            if( p->action_traces.size() != 1 )
+               return false;
+            const auto& act = p->action_traces[0].act;
+            return act.account == chain::config::system_account_name && act.name == N(onblock);
+         }
+
          void on_applied_transaction( const transaction_trace_ptr& trace ) {
             if( !trace->receipt || (trace->receipt->status != transaction_receipt_header::executed &&
                   trace->receipt->status != transaction_receipt_header::soft_fail) )
                return;
+            std::vector<history_action> actions;
             for( const auto& atrace : trace->action_traces ) {
-               on_action_trace( atrace );
+               on_action_trace( atrace, actions );
+            }
+            // a transaction applied again, e.g. after an aborted block, replaces its earlier actions
+            if( is_onblock( trace ) )
+               onblock_actions = std::move( actions );
+            else if( trace->failed_dtrx_trace )
+               cached_actions[trace->failed_dtrx_trace->id] = std::move( actions );
+            else
+               cached_actions[trace->id] = std::move( actions );
+         }
+
+         void on_accepted_block( const block_state_ptr& bs ) {
+            if( log_failed ) return;
+            std::vector<history_action> actions = std::move( onblock_actions );
+            for( const auto& r : bs->block->transactions ) {
+               const auto& id = r.trx.contains<transaction_id_type>() ? r.trx.get<transaction_id_type>()
+                                                                      : r.trx.get<packed_transaction>().id();
+               auto itr = cached_actions.find( id );
+               if( itr == cached_actions.end() ) continue; // failed or filtered out
+               std::move( itr->second.begin(), itr->second.end(), std::back_inserter( actions ) );
+            }
+            cached_actions.clear();
+            onblock_actions.clear();
+
+            // the controller signal swallows exceptions, so a block missing from history.log has to stop the node here;
+            // the partially written block is recovered or truncated when history.log is opened again
+            try {
+               log->append_block( bs->block_num, bs->id, bs->header.previous, bs->header.timestamp, std::move( actions ) );
+            } catch( const fc::exception& e ) {
+               elog( "failed to write block ${b} to history.log, shutting down: ${e}", ("b", bs->block_num)("e", e.to_detail_string()) );
+               log_failed = true;
+            } catch( const std::exception& e ) {
+               elog( "failed to write block ${b} to history.log, shutting down: ${e}", ("b", bs->block_num)("e", e.what()) );
+               log_failed = true;
             }
+            if( log_failed )
+               app().quit();
          }
    };
 
@@ -305,6 +257,13 @@ namespace eosio {
             ("filter-on,f", bpo::value<vector<string>>()->composing(),
              "Track actions which match receiver:action:actor. Actor may be blank to include all. Action and Actor both blank allows all from Recieiver. Receiver may not be blank.")
             ;
+      cfg.add_options()
+            ("history-dir", bpo::value<bfs::path>()->default_value("history"),
+             "the location of the action history directory (absolute path or relative to application data dir)")
+            ;
+      cli.add_options()
+            ("delete-history", bpo::bool_switch()->default_value(false), "clear action history files")
+            ;
       cfg.add_options()
             ("filter-out,F", bpo::value<vector<string>>()->composing(),
              "Do not track actions which match receiver:action:actor. Action and Actor both blank excludes all from Reciever. Actor blank excludes all from reciever:action. Receiver may not be blank.")
@@ -318,7 +277,7 @@ namespace eosio {
             for( auto& s : fo ) {
                if( s == "*" || s == "\"*\"" ) {
                   my->bypass_filter = true;
-                  wlog( "--filter-on * enabled. This can fill shared_mem, causing nodeos to stop." );
+                  wlog( "--filter-on * enabled. This can fill the history directory disk." );
                   break;
                }
                std::vector<std::string> v;
@@ -348,16 +307,27 @@ namespace eosio {
          auto& chain = my->chain_plug->chain();
 
          chainbase::database& db = const_cast<chainbase::database&>( chain.db() ); // Override read-only access to state DB (highly unrecommended practice!)
-         // TODO: Use separate chainbase database for managing the state of the history_plugin (or remove deprecated history_plugin entirely) 
-         db.add_index<account_history_index>();
-         db.add_index<action_history_index>();
+         // actions are kept in history.log, only the small key and account control indexes remain in chainbase
          db.add_index<account_control_history_multi_index>();
          db.add_index<public_key_history_multi_index>();
 
+         auto dir_option = options.at( "history-dir" ).as<bfs::path>();
+         bfs::path history_dir = dir_option.is_relative() ? app().data_dir() / dir_option : dir_option;
+         if( options.at( "delete-history" ).as<bool>() ) {
+            ilog( "Deleting action history" );
+            bfs::remove_all( history_dir );
+         }
+         bfs::create_directories( history_dir );
+         my->log.emplace( history_dir );
+
          my->applied_transaction_connection.emplace(
                chain.applied_transaction.connect( [&]( const transaction_trace_ptr& p ) {
                   my->on_applied_transaction( p );
                } ));
+         my->accepted_block_connection.emplace(
+               chain.accepted_block.connect( [&]( const block_state_ptr& p ) {
+                  my->on_accepted_block( p );
+               } ));
       } FC_LOG_AND_RETHROW()
    }
 
@@ -366,6 +336,13 @@ namespace eosio {
 
    void history_plugin::plugin_shutdown() {
       my->applied_transaction_connection.reset();
+      my->accepted_block_connection.reset();
+      // a failed append leaves history.log to be recovered on startup, the indexes are regenerated then
+      if( my->log && !my->log_failed ) {
+         try {
+            my->log->write_account_index();
+         } FC_LOG_AND_DROP();
+      }
    }
 
 
@@ -375,26 +352,18 @@ namespace eosio {
       read_only::get_actions_result read_only::get_actions( const read_only::get_actions_params& params )const {
          edump((params));
         auto& chain = history->chain_plug->chain();
-        const auto& db = chain.db();
+        auto& log = *history->log;
         const auto abi_serializer_max_time = history->chain_plug->get_abi_serializer_max_time();
 
-        const auto& idx = db.get_index<account_history_index, by_account_action_seq>();
-
         int32_t start = 0;
         int32_t pos = params.pos ? *params.pos : -1;
         int32_t end = 0;
         int32_t offset = params.offset ? *params.offset : -20;
         auto n = params.account_name;
         idump((pos));
-        if( pos == -1 ) {
-            auto itr = idx.lower_bound( boost::make_tuple( name(n.value+1), 0 ) );
-            if( itr == idx.begin() ) {
-               if( itr->account == n )
-                  pos = itr->account_sequence_num+1;
-            } else if( itr != idx.begin() ) --itr;
-
-            if( itr->account == n )
-               pos = itr->account_sequence_num + 1;
+        const int32_t count = log.account_action_count( n );
+        if( pos == -1 && count > 0 ) {
+            pos = count;
         }
 
         if( pos== -1 ) pos = 0xfffffff;
@@ -411,23 +380,20 @@ namespace eosio {
 
         idump((start)(end));
 
-        auto start_itr = idx.lower_bound( boost::make_tuple( n, start ) );
-        auto end_itr = idx.upper_bound( boost::make_tuple( n, end) );
-
         auto start_time = fc::time_point::now();
         auto end_time = start_time;
 
         get_actions_result result;
         result.last_irreversible_block = chain.last_irreversible_block_num();
-        while( start_itr != end_itr ) {
-           const auto& a = db.get<action_history_object, by_action_sequence_num>( start_itr->action_sequence_num );
-           fc::datastream<const char*> ds( a.packed_action_trace.data(), a.packed_action_trace.size() );
-           action_trace t;
-           fc::raw::unpack( ds, t );
+        for( int64_t seq = std::max( start, 0 ); seq <= end && seq < count; ++seq ) {
+           const auto global_seq = log.global_sequence( n, seq );
+           const auto a = global_seq ? log.get_action( *global_seq ) : fc::optional<history_log::action_entry>();
+           EOS_ASSERT( a, chain::plugin_exception, "history.log is missing action ${s} of ${n}", ("s", seq)("n", n) );
+           action_trace t = fc::raw::unpack<action_trace>( a->packed_trace );
            result.actions.emplace_back( ordered_action_result{
-                                 start_itr->action_sequence_num,
-                                 start_itr->account_sequence_num,
-                                 a.block_num, a.block_time,
+                                 a->global_sequence,
+                                 static_cast<int32_t>(seq),
+                                 a->block_num, a->block_time,
                                  chain.to_variant_with_abi(t, abi_serializer_max_time)
                                  });
 
@@ -436,7 +402,6 @@ namespace eosio {
               result.time_limit_exceeded_error = true;
               break;
            }
-           ++start_itr;
         }
         return result;
       }
@@ -465,11 +430,9 @@ namespace eosio {
             return (*(input_id.data() + input_id_size) & 0xF0) == (*(id.data() + input_id_size) & 0xF0);
          };
 
-         const auto& db = chain.db();
-         const auto& idx = db.get_index<action_history_index, by_trx_id>();
-         auto itr = idx.lower_bound( boost::make_tuple( input_id ) );
+         const auto actions = history->log->get_transaction( input_id, input_id_length * 4, txn_id_matched );
 
-         bool in_history = (itr != idx.end() && txn_id_matched(itr->trx_id) );
+         bool in_history = !actions.empty();
 
          if( !in_history && !p.block_num_hint ) {
             EOS_THROW(tx_not_found, "Transaction ${id} not found in history and no block hint was given", ("id",p.id));
@@ -478,19 +441,14 @@ namespace eosio {
          get_transaction_result result;
 
          if( in_history ) {
-            result.id         = itr->trx_id;
+            result.id         = actions.front().trx_id;
             result.last_irreversible_block = chain.last_irreversible_block_num();
-            result.block_num  = itr->block_num;
-            result.block_time = itr->block_time;
+            result.block_num  = actions.front().block_num;
+            result.block_time = actions.front().block_time;
 
-            while( itr != idx.end() && itr->trx_id == result.id ) {
-
-              fc::datastream<const char*> ds( itr->packed_action_trace.data(), itr->packed_action_trace.size() );
-              action_trace t;
-              fc::raw::unpack( ds, t );
+            for( const auto& a : actions ) {
+              action_trace t = fc::raw::unpack<action_trace>( a.packed_trace );
               result.traces.emplace_back( chain.to_variant_with_abi(t, abi_serializer_max_time) );
-
-              ++itr;
             }
 
             auto blk = chain.fetch_block_by_number( result.block_num );
@@ -0,0 +1,222 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE
+ */
+#pragma once
+
+#include <eosio/chain/block_timestamp.hpp>
+#include <eosio/chain/types.hpp>
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <functional>
+#include <map>
+
+namespace eosio {
+
+/*
+ *   history.log:
+ *   +---------+----------------+-----------+------------------+-----+---------+----------------+
+ *   | Entry i | Pos of Entry i | Entry i+1 | Pos of Entry i+1 | ... | Entry z | Pos of Entry z |
+ *   +---------+----------------+-----------+------------------+-----+---------+----------------+
+ *
+ *   history.index:
+ *   +-------------+---------------+-----+-------------+
+ *   | Pos Entry i | Pos Entry i+1 | ... | Pos Entry z |
+ *   +-------------+---------------+-----+-------------+
+ *
+ *   history.trx:
+ *   +------------------+--------+--------+-----+------------------+
+ *   | trx_index_header | Slot 0 | Slot 1 | ... | Slot 2^log2 - 1  |
+ *   +------------------+--------+--------+-----+------------------+
+ *
+ *   history.accounts:
+ *   +----------------------+-----------------------------+---------------------------------------------+
+ *   | account_index_header | account_index_block of each | account_index_entry and action_runs of each |
+ *   |                      | block with actions          | account                                     |
+ *   +----------------------+-----------------------------+---------------------------------------------+
+ *
+ * each entry:
+ *    history_log_header
+ *    uint32_t                  size of summary
+ *    history_block_summary     actions of the block sorted by global sequence, without traces
+ *    vector<bytes>             packed action_trace of each summarized action
+ *
+ * Only the summaries are read when the in-memory indexes are rebuilt on startup.
+ *
+ * history.accounts is a snapshot of the in-memory indexes, written on shutdown and after indexing on startup. It
+ * is loaded on startup while its last block is still in history.log, and only the blocks after it are indexed.
+ *
+ * history.trx is an open addressing hash table of (leading 64 bits of trx id, block num) slots, hashed on the
+ * leading 32 bits so that every id prefix of at least 8 hex digits probes a single cluster. It is regenerated
+ * from the summaries when its header does not match history.log, e.g. after a crash in the middle of a write.
+ */
+struct history_log_header {
+   uint32_t             block_num = 0;
+   chain::block_id_type block_id;
+   uint64_t             payload_size = 0;
+   uint8_t              version      = 0;
+};
+
+struct history_action_summary {
+   uint64_t                          global_sequence = 0;
+   chain::transaction_id_type        trx_id;
+   std::vector<chain::account_name>  accounts; ///< accounts which have this action in their history
+};
+
+struct history_block_summary {
+   chain::block_timestamp_type          block_time;
+   std::vector<history_action_summary>  actions;
+};
+
+struct history_action {
+   history_action_summary  summary;
+   chain::bytes            packed_trace;
+};
+
+/**
+ * Action history kept outside of chainbase: an append-only log of the recorded actions of each block, plus
+ * in-memory indexes of a few bytes per run of actions, loaded from history.accounts and brought up to date from
+ * the log summaries on startup. Transactions
+ * are indexed on disk in history.trx, as there is an entry per transaction rather than per run.
+ *
+ * The per-account index stores runs of consecutive global sequences, so an account touched by a burst of
+ * actions (e.g. all notifications of a transfer) costs one entry, and a lookup by account sequence is a
+ * binary search over the runs.
+ */
+class history_log {
+public:
+   struct action_entry {
+      uint64_t                     global_sequence = 0;
+      uint32_t                     block_num = 0;
+      chain::block_timestamp_type  block_time;
+      chain::transaction_id_type   trx_id;
+      chain::bytes                 packed_trace;
+   };
+
+   explicit history_log( const boost::filesystem::path& dir );
+
+   uint32_t begin_block()const { return _begin_block; }
+   uint32_t end_block()const { return _end_block; }
+
+   /// replaces the block and everything after it on a fork
+   void append_block( uint32_t block_num, const chain::block_id_type& block_id, const chain::block_id_type& prev_id,
+                      chain::block_timestamp_type block_time, std::vector<history_action>&& actions );
+
+   /// @return number of actions in the history of `account`, which is also its next account sequence
+   int32_t account_action_count( chain::account_name account )const;
+
+   /// @return global sequence of the `account_sequence`th action of `account`
+   fc::optional<uint64_t> global_sequence( chain::account_name account, int32_t account_sequence )const;
+
+   fc::optional<action_entry> get_action( uint64_t global_sequence );
+
+   /// saves the per-account and per-block indexes to history.accounts, so the next startup does not rebuild them
+   void write_account_index();
+
+   /**
+    * Finds a transaction whose id starts with the first `prefix_bits` bits of `id`, at least 32.
+    * @return the actions of the transaction in global sequence order, empty if not found
+    */
+   std::vector<action_entry> get_transaction( const chain::transaction_id_type& id, uint32_t prefix_bits,
+                                              const std::function<bool(const chain::transaction_id_type&)>& match );
+
+private:
+   struct action_run {
+      uint64_t first_global_sequence = 0;
+      int32_t  first_account_sequence = 0;
+      uint32_t count = 0;
+   };
+
+   struct block_entry {
+      history_block_summary      summary;
+      std::vector<chain::bytes>  traces;
+   };
+
+   struct trx_index_header {
+      uint32_t version = 0;
+      uint32_t log2_capacity = 0;
+      uint32_t begin_block = 0;
+      uint32_t end_block = 0;
+      uint64_t used = 0;   ///< live and removed slots, which both extend probe sequences
+      uint64_t count = 0;  ///< live slots
+      uint32_t clean = 0;  ///< cleared while history.log and history.trx are being modified
+      uint32_t reserved = 0;
+   };
+
+   struct trx_slot {
+      uint64_t key = 0;
+      uint32_t block_num = 0; ///< 0 for an empty slot, ~0 for a removed one
+      uint32_t reserved = 0;
+   };
+
+   struct account_index_header {
+      uint32_t             version = 0;
+      uint32_t             begin_block = 0;
+      uint32_t             end_block = 0;
+      uint32_t             reserved = 0;
+      chain::block_id_type last_block_id;    ///< of end_block - 1, history.log must still have it
+      uint64_t             num_blocks = 0;   ///< blocks with actions
+      uint64_t             num_accounts = 0;
+   };
+
+   struct account_index_block {
+      uint64_t first_global_sequence = 0;
+      uint32_t block_num = 0;
+      uint32_t reserved = 0;
+   };
+
+   struct account_index_entry {
+      uint64_t account = 0;
+      uint64_t num_runs = 0; ///< followed by the runs
+   };
+
+   static uint64_t trx_key( const chain::transaction_id_type& id );
+
+   bool get_last_block( uint64_t size );
+   void recover_blocks( uint64_t size );
+   void open_log();
+   void open_index();
+   bool open_trx_index();
+   uint32_t load_account_index();
+   void create_trx_index( uint32_t log2_capacity );
+   void rehash_trx_index( uint32_t log2_capacity );
+   void write_trx_header( bool clean );
+   uint64_t trx_slot_pos( uint64_t key )const;
+   trx_slot read_trx_slot( uint64_t slot_pos );
+   void write_trx_slot( uint64_t slot_pos, const trx_slot& slot );
+   void insert_trx( const trx_slot& slot );
+   void remove_trx( const trx_slot& slot );
+   void index_summary( uint32_t block_num, const history_block_summary& summary );
+   void unindex_summary( uint32_t block_num, const history_block_summary& summary );
+   void index_transactions( uint32_t block_num, const history_block_summary& summary );
+   void unindex_transactions( uint32_t block_num, const history_block_summary& summary );
+   uint64_t get_pos( uint32_t block_num );
+   history_log_header read_header( uint32_t block_num );
+   history_block_summary read_summary( uint64_t pos, history_log_header& header );
+   const block_entry& read_block( uint32_t block_num );
+   void truncate( uint32_t block_num );
+
+   std::string           log_filename;
+   std::string           index_filename;
+   std::string           trx_filename;
+   std::string           accounts_filename;
+   std::fstream          log;
+   std::fstream          index;
+   std::fstream          trx_index;
+   trx_index_header      trx_header;
+   uint32_t              _begin_block = 0;
+   uint32_t              _end_block   = 0;
+   chain::block_id_type  last_block_id;
+
+   std::map<chain::account_name, std::vector<action_run>>   account_runs;
+   std::vector<std::pair<uint64_t, uint32_t>>                block_first_sequence; ///< blocks with actions only
+
+   uint32_t                        cached_block_num = 0;
+   fc::optional<block_entry>       cached_block;
+};
+
+} // namespace eosio
+
+FC_REFLECT( eosio::history_action_summary, (global_sequence)(trx_id)(accounts) )
+FC_REFLECT( eosio::history_block_summary, (block_time)(actions) )
@@ -199,6 +199,10 @@ read_only::get_info_results read_only::get_info(const get_info_params&) const {
    return info;
 }
 
+read_only::get_cache_stats_results read_only::get_cache_stats(const get_cache_stats_params&) const {
+   return relay_->get_cache_stats();
+}
+
 read_write::open_channel_results read_write::open_channel(const open_channel_params& params) {
    auto& chain = app().get_plugin<chain_plugin>();
    auto& controller = chain.chain();
@@ -218,18 +222,11 @@ read_write::open_channel_results read_write::open_channel(const open_channel_par
 
    if( block_num.valid() ) {
       b = controller.fetch_block_state_by_number(static_cast<uint32_t>(*block_num));
-      if (not b) {
-         auto& idx = relay_->block_states_.get<by_num>();
-         auto it = idx.find(*block_num);
-         if (it != idx.end()) b = std::make_shared<block_header_state>(*it);
-      }
+      if (not b) b = relay_->cached_block_state(static_cast<uint32_t>(*block_num));
    } else {
       try {
          b = controller.fetch_block_state_by_id(fc::variant(seed_block_num_or_id).as<block_id_type>());
-         if (not b) {
-            auto it = relay_->block_states_.find(fc::variant(seed_block_num_or_id).as<block_id_type>());
-            if (it != relay_->block_states_.end()) b = std::make_shared<block_header_state>(*it);
-         }
+         if (not b) b = relay_->cached_block_state(fc::variant(seed_block_num_or_id).as<block_id_type>());
       } EOS_RETHROW_EXCEPTIONS(chain::block_id_type_exception, "Invalid block ID: ${block_num_or_id}", ("block_num_or_id", seed_block_num_or_id))
    }
 
@@ -237,7 +234,7 @@ read_write::open_channel_results read_write::open_channel(const open_channel_par
 
    auto n = block_header::num_from_id(b->id);
    auto head_num = controller.head_block_num();
-   EOS_ASSERT(n + 24 <= head_num and n + 500 >= head_num, invalid_http_request, "Improper block number: ${n}", ("n", n)); // Reduce possibility of block rollback and block state prune. TODO: 24, 500 configurable?
+   EOS_ASSERT(n + 24 <= head_num and n + relay_->cache_config_.max_block_states >= head_num, invalid_http_request, "Improper block number: ${n}", ("n", n)); // Reduce possibility of block rollback and block state prune. TODO: 24 configurable?
 
    relay_->open_channel(*b);
 
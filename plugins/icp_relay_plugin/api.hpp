@@ -57,6 +57,30 @@ struct sequence {
 
 using sequence_ptr = std::shared_ptr<sequence>;
 
+struct cache_stats {
+   uint32_t send_transactions = 0;
+   uint32_t block_action_digests = 0;
+   uint32_t recv_transactions = 0;
+   uint32_t block_states = 0;
+   uint32_t pending_headers = 0;
+
+   uint64_t cache_bytes = 0; // packed size of the packet caches
+   uint64_t max_cache_bytes = 0;
+   uint64_t evicted = 0; // irreversible entries dropped to stay within the budget
+   uint64_t refused = 0; // incoming packets not cached while over the budget, requested again later
+
+   uint64_t action_digests_hits = 0;
+   uint64_t action_digests_misses = 0;
+   uint64_t block_state_hits = 0;
+   uint64_t block_state_misses = 0;
+
+   fc::time_point last_saved;
+
+   uint64_t sent_messages = 0;
+   uint64_t sent_bytes = 0; // packed size of the sent messages
+   uint64_t sent_wire_bytes = 0; // after compression
+};
+
 class read_only {
 public:
    explicit read_only(relay_ptr relay) : relay_(std::move(relay)) {}
@@ -99,6 +123,10 @@ public:
    };
    get_info_results get_info(const get_info_params&) const;
 
+   using get_cache_stats_params = empty;
+   using get_cache_stats_results = cache_stats;
+   get_cache_stats_results get_cache_stats(const get_cache_stats_params&) const;
+
 private:
    relay_ptr relay_;
 };
@@ -123,6 +151,10 @@ private:
 FC_REFLECT(icp::empty, )
 FC_REFLECT(icp::head, (head_block_num)(head_block_id)(last_irreversible_block_num)(last_irreversible_block_id))
 FC_REFLECT(icp::sequence, (last_outgoing_packet_seq)(last_incoming_packet_seq)(last_outgoing_receipt_seq)(last_incoming_receipt_seq)(last_finalised_outgoing_receipt_seq)(last_incoming_packet_block_num)(last_incoming_receipt_block_num)(last_incoming_receiptend_block_num)(min_packet_seq)(min_receipt_seq)(min_block_num))
+FC_REFLECT(icp::cache_stats, (send_transactions)(block_action_digests)(recv_transactions)(block_states)(pending_headers)
+                             (cache_bytes)(max_cache_bytes)(evicted)(refused)
+                             (action_digests_hits)(action_digests_misses)(block_state_hits)(block_state_misses)(last_saved)
+                             (sent_messages)(sent_bytes)(sent_wire_bytes))
 FC_REFLECT(icp::read_only::get_block_params, (id))
 FC_REFLECT(icp::read_only::get_block_results, (block))
 FC_REFLECT(icp::read_only::get_info_results, (icp_version)(local_chain_id)(peer_chain_id)(local_contract)(peer_contract)
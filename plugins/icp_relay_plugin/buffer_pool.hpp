@@ -0,0 +1,52 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace icp {
+
+/**
+ * Send buffers shared by all sessions. A session holds a buffer only while its write is outstanding, and the
+ * buffer goes back to the pool with its capacity, so sending does not allocate once the pool is warm.
+ */
+class buffer_pool : public std::enable_shared_from_this<buffer_pool> {
+public:
+   using buffer_ptr = std::shared_ptr<std::vector<char>>;
+
+   explicit buffer_pool(size_t max_pooled = 16, size_t max_capacity = 4 * 1024 * 1024)
+      : max_pooled_(max_pooled), max_capacity_(max_capacity) {}
+
+   buffer_ptr acquire() {
+      std::unique_ptr<std::vector<char>> b;
+      {
+         std::lock_guard<std::mutex> g(mtx_);
+         if (not free_.empty()) {
+            b = std::move(free_.back());
+            free_.pop_back();
+         }
+      }
+      if (not b) b = std::make_unique<std::vector<char>>();
+
+      std::weak_ptr<buffer_pool> pool = shared_from_this();
+      return buffer_ptr(b.release(), [pool](std::vector<char>* p) {
+         std::unique_ptr<std::vector<char>> b(p);
+         if (auto self = pool.lock()) self->release(std::move(b));
+      });
+   }
+
+private:
+   void release(std::unique_ptr<std::vector<char>> b) {
+      if (b->capacity() > max_capacity_) return; // let an outsized buffer go
+      b->clear();
+      std::lock_guard<std::mutex> g(mtx_);
+      if (free_.size() < max_pooled_) free_.push_back(std::move(b));
+   }
+
+   std::mutex mtx_;
+   std::vector<std::unique_ptr<std::vector<char>>> free_;
+   size_t max_pooled_;
+   size_t max_capacity_;
+};
+
+}
@@ -7,12 +7,18 @@ namespace icp {
 using namespace eosio;
 using namespace eosio::chain;
 
-// TODO: configurable
-constexpr uint32_t MAX_CACHED_BLOCKS = 50; // 1000
-constexpr uint32_t MIN_CACHED_BLOCKS = 20; // 100
-constexpr uint32_t DUMMY_ICP_SECONDS = 20; // 3600
+struct cache_config {
+   uint32_t max_cached_blocks = 50; // send a header once the peer lags this many blocks
+   uint32_t min_cached_blocks = 20; // or this many when the block has icp packets
+   uint32_t dummy_icp_seconds = 20;
+   uint32_t max_block_states = 500; // recent block header states kept for channel seeds and header proofs
+   uint64_t max_cache_bytes = 64*1024*1024; // budget of the packet caches
+   uint32_t save_interval_blocks = 120; // persist changed caches every this many irreversible blocks, 0 only on shutdown
+};
+
 // constexpr uint32_t MAX_CLEANUP_SEQUENCES = 3;
 constexpr uint32_t MAX_CLEANUP_NUM = 10;
+constexpr uint32_t MAX_HEADERS_PER_MESSAGE = 32; // catch-up batch size
 
 struct by_id;
 struct by_num;
@@ -29,6 +35,7 @@ struct send_transaction_internal {
    action_name peer_action;
    action action_instance;
    action_receipt action_receipt_instance;
+   vector<digest_type> merkle_proof; // branch of the receipt digest in the block's action_mroot, set when sent
 };
 struct send_transaction {
    transaction_id_type id;
@@ -57,11 +64,14 @@ typedef boost::multi_index_container<send_transaction,
 struct block_with_action_digests {
    block_id_type id;
    vector<digest_type> action_digests;
+
+   uint32_t block_num() const { return block_header::num_from_id(id); }
 };
 
 typedef boost::multi_index_container<block_with_action_digests,
    indexed_by<
-      ordered_unique<tag<by_id>, member<block_with_action_digests, block_id_type, &block_with_action_digests::id>>
+      ordered_unique<tag<by_id>, member<block_with_action_digests, block_id_type, &block_with_action_digests::id>>,
+      ordered_non_unique<tag<by_block_num>, const_mem_fun<block_with_action_digests, uint32_t, &block_with_action_digests::block_num>>
    >
 > block_with_action_digests_index;
 
@@ -88,4 +98,20 @@ typedef boost::multi_index_container<recv_transaction,
    >
 > recv_transaction_index;
 
+/// what survives a relay restart, see relay::save_caches
+struct persisted_caches {
+   uint32_t version = 1;
+   vector<send_transaction> send_transactions;
+   vector<block_with_action_digests> block_action_digests;
+   vector<recv_transaction> recv_transactions;
+   vector<block_header_state> block_states;
+   vector<block_header_state> pending_headers;
+};
+
 }
+
+FC_REFLECT(icp::send_transaction_internal, (peer_action)(action_instance)(action_receipt_instance)(merkle_proof))
+FC_REFLECT(icp::send_transaction, (id)(block_num)(start_packet_seq)(start_receipt_seq)(packet_actions)(receipt_actions)(receiptend_actions))
+FC_REFLECT(icp::block_with_action_digests, (id)(action_digests))
+FC_REFLECT(icp::recv_transaction, (block_num)(block_id)(start_packet_seq)(start_receipt_seq)(action_add_block)(packet_actions)(receipt_actions)(receiptend_actions))
+FC_REFLECT(icp::persisted_caches, (version)(send_transactions)(block_action_digests)(recv_transactions)(block_states)(pending_headers))
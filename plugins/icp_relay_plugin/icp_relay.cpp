@@ -1,5 +1,9 @@
 #include "icp_relay.hpp"
 
+#include <eosio/chain/merkle.hpp>
+
+#include <fstream>
+
 #include "api.hpp"
 #include "message.hpp"
 
@@ -59,24 +63,40 @@ void listener::on_accept(boost::system::error_code ec) {
 }
 
 void relay::start() {
+   load_caches();
+   publish_cache_stats();
+
+   ioc_ = std::make_unique<boost::asio::io_context>(num_threads_);
+   strand_ = std::make_unique<boost::asio::strand<boost::asio::io_context::executor_type>>(ioc_->get_executor());
+
    on_applied_transaction_handle_ = app().get_channel<channels::applied_transaction>().subscribe([this](transaction_trace_ptr t) {
-      on_applied_transaction(t);
+      boost::asio::post(*strand_, [this, t] {
+         try_catch([&] { on_applied_transaction(t); }, "scanning transaction");
+         publish_cache_stats();
+      });
    });
 
    on_accepted_block_handle_ = app().get_channel<channels::accepted_block_with_action_digests>().subscribe([this](block_state_with_action_digests_ptr s) {
-      on_accepted_block(s);
+      boost::asio::post(*strand_, [this, s] {
+         try_catch([&] { on_accepted_block(s); }, "scanning accepted block");
+         publish_cache_stats();
+      });
+      try_catch([this]() mutable {
+         cleanup();
+      });
    });
 
    on_irreversible_block_handle_ = app().get_channel<channels::irreversible_block>().subscribe([this](block_state_ptr s) {
-      on_irreversible_block(s);
+      boost::asio::post(*strand_, [this, s] {
+         try_catch([&] { on_irreversible_block(s); }, "scanning irreversible block");
+         publish_cache_stats();
+      });
    });
 
    on_bad_block_handle_ = app().get_channel<channels::rejected_block>().subscribe([this](signed_block_ptr b) {
       on_bad_block(b);
    });
 
-   ioc_ = std::make_unique<boost::asio::io_context>(num_threads_);
-
    timer_ = std::make_shared<boost::asio::deadline_timer>(app().get_io_service());
    start_reconnect_timer();
 
@@ -125,6 +145,8 @@ void relay::stop() {
    for_each_session([](auto session) {
       EOS_ASSERT(false, plugin_exception, "session ${s} still active", ("s", session->session_id_));
    });
+
+   save_caches(false);
 }
 
 void relay::start_reconnect_timer() {
@@ -216,10 +238,26 @@ void relay::update_local_head(bool force) {
       local_head_ = *h;
       // wlog("head: ${h}", ("h", local_head_));
 
+      confirm_submissions(*s);
+
+      boost::asio::post(*strand_, [this, s, lib = local_head_.last_irreversible_block_num] {
+         try_catch([&] { process_recv_transactions(s, lib); }, "processing received transactions");
+      });
+
+      for_each_session([h=*h](session_ptr s) {
+         // wlog("has session");
+         s->update_local_head(h); // TODO: ?
+      });
+      send(head_notice{local_head_});
+   }
+}
+
+void relay::process_recv_transactions(const sequence_ptr& s, uint32_t last_irreversible_block_num) {
+   {
       std::unordered_set<packet_receipt_request> req_set; // deduplicate
 
       for (auto it = recv_transactions_.begin(); it != recv_transactions_.end();) {
-         if (it->block_num > local_head_.last_irreversible_block_num) break;
+         if (it->block_num > last_irreversible_block_num) break;
 
          // wlog("last_incoming_packet_seq: ${lp}, last_incoming_receipt_seq: ${lr}, start_packet_seq: ${sp}, start_receipt_seq: ${sr}", ("lp", s->last_incoming_packet_seq)("lr", s->last_incoming_receipt_seq)("sp", it->start_packet_seq)("sr", it->start_receipt_seq));
          auto req = s->make_genproof_request(it->start_packet_seq, it->start_receipt_seq);
@@ -234,15 +272,10 @@ void relay::update_local_head(bool force) {
 
          auto rt = *it;
          push_icp_actions(s, move(rt));
-         it = recv_transactions_.erase(it);
+         it = erase_recv_transaction(it);
       }
-
-      for_each_session([h=*h](session_ptr s) {
-         // wlog("has session");
-         s->update_local_head(h); // TODO: ?
-      });
-      send(head_notice{local_head_});
    }
+   publish_cache_stats();
 }
 
 void relay::on_applied_transaction(const transaction_trace_ptr& t) {
@@ -314,24 +347,249 @@ void relay::on_applied_transaction(const transaction_trace_ptr& t) {
 
    if (st.empty()) return;
 
+   insert_send_transaction(move(st));
+}
 
-   auto it = send_transactions_.find(t->id);
+void relay::insert_send_transaction(send_transaction&& st) {
+   cache_bytes_ += fc::raw::pack_size(st);
+   auto it = send_transactions_.find(st.id);
    if (it != send_transactions_.end()) {
+      cache_bytes_ -= fc::raw::pack_size(*it);
       send_transactions_.replace(it, st);
    } else {
-      send_transactions_.insert(st);
+      send_transactions_.insert(move(st));
+   }
+   caches_changed_ = true;
+   enforce_cache_budget();
+}
+
+void relay::insert_block_action_digests(block_with_action_digests&& b) {
+   auto size = fc::raw::pack_size(b);
+   if (block_with_action_digests_.insert(move(b)).second) {
+      cache_bytes_ += size;
+      caches_changed_ = true;
+      enforce_cache_budget();
+   }
+}
+
+/// Refused while the caches are over budget: the next packet from the peer makes the local contract request the
+/// missing seqs again with a genproof.
+void relay::insert_recv_transaction(recv_transaction&& rt) {
+   auto size = fc::raw::pack_size(rt);
+   cache_bytes_ += size;
+   bool fits = enforce_cache_budget();
+   cache_bytes_ -= size;
+   if (not fits) {
+      ++stats_.refused;
+      return;
+   }
+   cache_bytes_ += size;
+   recv_transactions_.insert(move(rt));
+   caches_changed_ = true;
+}
+
+recv_transaction_index::iterator relay::erase_recv_transaction(recv_transaction_index::iterator it) {
+   cache_bytes_ -= fc::raw::pack_size(*it);
+   caches_changed_ = true;
+   return recv_transactions_.erase(it);
+}
+
+/**
+ * Keeps the packet caches within max_cache_bytes by evicting entries at or below the local LIB, oldest first:
+ * outgoing packets and digests of irreversible blocks were relayed when the block became irreversible, incoming
+ * packets still waiting there can be provided again by the peer on a genproof request. Entries above LIB are never
+ * evicted, they could not be relayed again.
+ * @return false if the caches are still over budget
+ */
+bool relay::enforce_cache_budget() {
+   auto& sends = send_transactions_.get<by_block_num>();
+   auto& digests = block_with_action_digests_.get<by_block_num>();
+   while (cache_bytes_ > cache_config_.max_cache_bytes) {
+      bool send_evictable = not sends.empty() and sends.begin()->block_num <= irreversible_block_num_;
+      bool digest_evictable = not digests.empty() and digests.begin()->block_num() <= irreversible_block_num_;
+      if (send_evictable and (not digest_evictable or sends.begin()->block_num <= digests.begin()->block_num())) {
+         cache_bytes_ -= fc::raw::pack_size(*sends.begin());
+         sends.erase(sends.begin());
+      } else if (digest_evictable) {
+         cache_bytes_ -= fc::raw::pack_size(*digests.begin());
+         digests.erase(digests.begin());
+      } else if (not recv_transactions_.empty() and recv_transactions_.begin()->block_num <= irreversible_block_num_) {
+         erase_recv_transaction(recv_transactions_.begin());
+      } else {
+         break;
+      }
+      ++stats_.evicted;
+   }
+
+   bool within = cache_bytes_ <= cache_config_.max_cache_bytes;
+   if (within != caches_within_budget_) {
+      caches_within_budget_ = within;
+      if (within) {
+         ilog("icp relay caches are within their budget again");
+      } else {
+         wlog("icp relay caches use ${b} bytes, over their budget of ${m} with nothing at or below LIB ${lib} left to evict; "
+              "refusing incoming packets", ("b", cache_bytes_)("m", cache_config_.max_cache_bytes)("lib", irreversible_block_num_));
+      }
+   }
+   return within;
+}
+
+void relay::publish_cache_stats() {
+   cache_stats s = stats_;
+   s.send_transactions = send_transactions_.size();
+   s.block_action_digests = block_with_action_digests_.size();
+   s.recv_transactions = recv_transactions_.size();
+   {
+      std::lock_guard<std::mutex> g(block_states_mtx_);
+      s.block_states = block_states_.size();
+   }
+   s.pending_headers = pending_headers_.size();
+   s.cache_bytes = cache_bytes_;
+   s.max_cache_bytes = cache_config_.max_cache_bytes;
+
+   std::lock_guard<std::mutex> g(stats_mtx_);
+   published_stats_ = s;
+}
+
+// as of the last block processed by the relay
+cache_stats relay::get_cache_stats() const {
+   cache_stats s;
+   {
+      std::lock_guard<std::mutex> g(stats_mtx_);
+      s = published_stats_;
+   }
+   s.sent_messages = sent_messages_;
+   s.sent_bytes = sent_bytes_;
+   s.sent_wire_bytes = sent_wire_bytes_;
+   return s;
+}
+
+void relay::load_caches() {
+   auto file = cache_dir_ / "caches.bin";
+   if (not boost::filesystem::exists(file)) return;
+
+   try_catch([&] {
+      std::ifstream in(file.string(), std::ios::binary);
+      vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+      auto c = fc::raw::unpack<persisted_caches>(data);
+      if (c.version != persisted_caches{}.version) {
+         wlog("ignoring icp relay caches of version ${v}", ("v", c.version));
+         return;
+      }
+
+      for (auto& st: c.send_transactions) insert_send_transaction(move(st));
+      for (auto& b: c.block_action_digests) insert_block_action_digests(move(b));
+      for (auto& rt: c.recv_transactions) insert_recv_transaction(move(rt));
+      {
+         std::lock_guard<std::mutex> g(block_states_mtx_);
+         for (auto& b: c.block_states) block_states_.insert(b);
+         block_states_restored_ = not block_states_.empty();
+      }
+      for (auto& h: c.pending_headers) pending_headers_.emplace(h.block_num, h);
+
+      ilog("loaded icp relay caches: ${s} outgoing transactions, ${r} incoming transactions, ${b} block states",
+           ("s", send_transactions_.size())("r", recv_transactions_.size())("b", block_states_.size()));
+   }, "loading icp relay caches");
+
+   caches_changed_ = false;
+}
+
+/// The caches are copied on the calling thread; packing and writing happen on a background thread unless
+/// `background` is false, as on shutdown. A periodic save is skipped while the previous one is still being written.
+/// The file is written to a temporary file first, so a crash while saving leaves the previous snapshot intact.
+void relay::save_caches(bool background) {
+   if (pending_save_.valid()) {
+      if (background and pending_save_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+      pending_save_.get();
+   }
+
+   auto c = std::make_shared<persisted_caches>();
+   try_catch([&] {
+      c->send_transactions.assign(send_transactions_.begin(), send_transactions_.end());
+      c->block_action_digests.assign(block_with_action_digests_.begin(), block_with_action_digests_.end());
+      c->recv_transactions.assign(recv_transactions_.begin(), recv_transactions_.end());
+      {
+         std::lock_guard<std::mutex> g(block_states_mtx_);
+         c->block_states.assign(block_states_.begin(), block_states_.end());
+      }
+      for (auto& h: pending_headers_) c->pending_headers.push_back(h.second);
+   }, "copying icp relay caches");
+
+   caches_changed_ = false;
+   blocks_since_save_ = 0;
+   save_failed_ = false;
+   stats_.last_saved = fc::time_point::now();
+
+   auto write = [this, c, dir = cache_dir_] {
+      bool saved = false;
+      try_catch([&] {
+         boost::filesystem::create_directories(dir);
+         auto file = dir / "caches.bin";
+         auto tmp = dir / "caches.bin.tmp";
+         {
+            auto data = fc::raw::pack(*c);
+            std::ofstream out(tmp.string(), std::ios::binary | std::ios::trunc);
+            out.write(data.data(), data.size());
+            out.close();
+            EOS_ASSERT(out.good(), plugin_exception, "cannot write ${f}", ("f", tmp.string()));
+         }
+         boost::filesystem::rename(tmp, file);
+         saved = true;
+      }, "saving icp relay caches");
+      if (not saved) save_failed_ = true; // retried on the next interval
+   };
+   if (background) {
+      pending_save_ = std::async(std::launch::async, write);
+   } else {
+      write();
    }
 }
 
+void relay::set_peer_head(const head& h) {
+   boost::asio::post(*strand_, [this, h] {
+      // the first head after a restart keeps the block states restored from caches.bin instead of starting over
+      if (not peer_head_.valid() and not block_states_restored_) {
+         clear_cache_block_state();
+      }
+      block_states_restored_ = false;
+      peer_head_ = h; // TODO: check validity
+   });
+}
+
 void relay::clear_cache_block_state() {
+   std::lock_guard<std::mutex> g(block_states_mtx_);
    block_states_.clear();
    wlog("clear_cache_block_state");
 }
 
+std::shared_ptr<block_header_state> relay::cached_block_state(uint32_t block_num) const {
+   std::lock_guard<std::mutex> g(block_states_mtx_);
+   auto& idx = block_states_.get<by_num>();
+   auto it = idx.find(block_num);
+   if (it == idx.end()) return nullptr;
+   return std::make_shared<block_header_state>(*it);
+}
+
+std::shared_ptr<block_header_state> relay::cached_block_state(const block_id_type& id) const {
+   std::lock_guard<std::mutex> g(block_states_mtx_);
+   auto it = block_states_.find(id);
+   if (it == block_states_.end()) return nullptr;
+   return std::make_shared<block_header_state>(*it);
+}
+
+fc::optional<block_id_type> relay::cached_block_id(uint32_t block_num) const {
+   std::lock_guard<std::mutex> g(block_states_mtx_);
+   auto& idx = block_states_.get<by_num>();
+   auto it = idx.find(block_num);
+   if (it == idx.end()) return {};
+   return it->id;
+}
+
 void relay::cache_block_state(block_state_ptr b) {
+   std::lock_guard<std::mutex> g(block_states_mtx_);
    auto& idx = block_states_.get<by_num>();
    for (auto it = idx.begin(); it != idx.end();) {
-      if (it->block_num + 500 < b->block_num) {
+      if (it->block_num + cache_config_.max_block_states < b->block_num) {
          it = idx.erase(it);
       } else {
          break;
@@ -346,15 +604,143 @@ void relay::cache_block_state(block_state_ptr b) {
    // wlog("cache_block_state");
 }
 
+std::shared_ptr<const block_header_state> relay::find_block_header_state(const block_id_type& id) {
+   auto b = cached_block_state(id);
+   if (b) {
+      ++stats_.block_state_hits;
+   } else {
+      ++stats_.block_state_misses;
+   }
+   return b;
+}
+
+/**
+ * The branch proving that `anchor` is an ancestor of `target`: the merkle branch of the anchor's id in the target's
+ * blockroot_merkle. Its size is logarithmic in the distance between the two blocks.
+ *
+ * The siblings left of the anchor are the complete subtrees kept in the anchor's own blockroot_merkle, the ones
+ * right of it are hashed here from the ids of the blocks in between.
+ */
+fc::optional<vector<digest_type>> relay::make_block_merkle_proof(const block_header_state& anchor, const block_header_state& target) {
+   const auto& left_nodes = anchor.blockroot_merkle._active_nodes;
+   uint64_t index = anchor.blockroot_merkle._node_count; // leaf of the anchor id
+   uint64_t count = target.blockroot_merkle._node_count;
+   if (index >= count or target.block_num <= anchor.block_num or target.block_num - anchor.block_num != count - index) {
+      return {};
+   }
+
+   vector<digest_type> level{anchor.id};
+   level.reserve(count - index + 1);
+   for (auto n = anchor.block_num + 1; n < target.block_num; ++n) {
+      auto id = cached_block_id(n);
+      if (not id) return {}; // the gap is wider than the cached block states
+      level.push_back(*id);
+   }
+
+   vector<digest_type> proof;
+   auto left = left_nodes.begin();
+   while (count > 1) {
+      if (count % 2) { // implied right node, as in merkle()
+         level.push_back(level.back());
+         ++count;
+      }
+
+      vector<digest_type> next;
+      next.reserve(level.size() / 2 + 1);
+      size_t i = 0;
+      if (index % 2) {
+         if (left == left_nodes.end()) return {};
+         proof.push_back(make_canonical_left(*left));
+         next.push_back(digest_type::hash(make_canonical_pair(*left, level[0])));
+         ++left;
+         i = 1;
+      } else {
+         proof.push_back(make_canonical_right(level[1]));
+      }
+      for (; i + 1 < level.size(); i += 2) {
+         next.push_back(digest_type::hash(make_canonical_pair(level[i], level[i + 1])));
+      }
+
+      level = move(next);
+      index /= 2;
+      count /= 2;
+   }
+
+   if (merkle_root_from_proof(anchor.id, proof) != target.blockroot_merkle.get_root()) return {};
+   return proof;
+}
+
+void relay::send_block_header_with_merkle_path(const block_header_state& target) {
+   // reads the block log, so on the main thread
+   app().get_io_service().post([this, target, from = peer_head_.head_block_num] {
+      try_catch([&] {
+         auto& chain = app().get_plugin<chain_plugin>();
+         vector<block_id_type> merkle_path;
+         for (uint32_t i = from; i < target.block_num; ++i) {
+            merkle_path.push_back(chain.chain().get_block_id_for_num(i));
+         }
+
+         send(block_header_with_merkle_path{target, merkle_path});
+      }, "sending block header");
+   });
+}
+
+void relay::send_block_headers(const block_header_state& target) {
+   // schedule changes the peer has not followed yet go first, in order
+   vector<const block_header_state*> headers;
+   for (auto it = pending_headers_.begin(); it != pending_headers_.end();) {
+      if (it->first <= peer_head_.head_block_num) {
+         it = pending_headers_.erase(it);
+         continue;
+      }
+      if (it->first >= target.block_num) break;
+
+      auto id = cached_block_id(it->first);
+      if (id and *id != it->second.id) { // forked out
+         it = pending_headers_.erase(it);
+         continue;
+      }
+      headers.push_back(&it->second);
+      ++it;
+   }
+   headers.push_back(&target);
+
+   auto anchor = find_block_header_state(peer_head_.head_block_id);
+   if (not anchor) { // the peer head left our caches, fall back to the path of all ids since it
+      return send_block_header_with_merkle_path(target);
+   }
+
+   vector<block_headers_with_merkle_proof> msgs(1);
+   msgs.back().anchor = anchor->id;
+   const block_header_state* prev = anchor.get();
+   for (auto h: headers) {
+      if (msgs.back().headers.size() == MAX_HEADERS_PER_MESSAGE) {
+         msgs.emplace_back();
+         msgs.back().anchor = prev->id;
+      }
+
+      auto proof = make_block_merkle_proof(*prev, *h);
+      if (not proof) {
+         elog("cannot prove block ${n} descends from block ${p}", ("n", h->block_num)("p", prev->block_num));
+         return send_block_header_with_merkle_path(target);
+      }
+      msgs.back().headers.push_back(block_header_with_merkle_proof{*h, move(*proof)});
+      prev = h;
+   }
+
+   for (auto& m: msgs) {
+      send(m);
+   }
+}
+
 void relay::on_accepted_block(const block_state_with_action_digests_ptr& b) {
    bool must_send = false;
    bool may_send = false;
 
    auto& s = b->block_state;
 
-   if (not peer_head_.valid()) {
-      cache_block_state(s);
-   }
+   // also the anchors of header proofs once irreversible blocks leave the fork database
+   cache_block_state(s);
 
    // new pending schedule
    if (s->header.new_producers.valid()) {
@@ -368,6 +754,11 @@ void relay::on_accepted_block(const block_state_with_action_digests_ptr& b) {
       pending_schedule_version_ = 0; // reset
    }
 
+   if (must_send) {
+      pending_headers_.erase(pending_headers_.lower_bound(s->block_num), pending_headers_.end()); // replaced by a fork
+      pending_headers_.emplace(s->block_num, *s);
+   }
+
    for (auto& t: s->block->transactions) {
       auto id = t.trx.contains<transaction_id_type>() ? t.trx.get<transaction_id_type>() : t.trx.get<packed_transaction>().id();
       auto it = send_transactions_.find(id);
@@ -375,7 +766,7 @@ void relay::on_accepted_block(const block_state_with_action_digests_ptr& b) {
          may_send = true;
 
          if (block_with_action_digests_.find(s->id) == block_with_action_digests_.end()) {
-            block_with_action_digests_.insert(block_with_action_digests{s->id, b->action_digests});
+            insert_block_action_digests(block_with_action_digests{s->id, b->action_digests});
          }
 
          break;
@@ -384,31 +775,28 @@ void relay::on_accepted_block(const block_state_with_action_digests_ptr& b) {
 
    if (not must_send and peer_head_.valid() and s->block_num >= peer_head_.head_block_num) {
       auto lag = s->block_num - peer_head_.head_block_num;
-      if ((may_send and lag >= MIN_CACHED_BLOCKS) or lag >= MAX_CACHED_BLOCKS) {
+      if ((may_send and lag >= cache_config_.min_cached_blocks) or lag >= cache_config_.max_cached_blocks) {
          must_send = true;
       }
    }
 
-   if (must_send) {
-      auto& chain = app().get_plugin<chain_plugin>();
-      vector<block_id_type> merkle_path;
-      for (uint32_t i = peer_head_.head_block_num; i < s->block_num; ++i) {
-         merkle_path.push_back(chain.chain().get_block_id_for_num(i));
-      }
-
-      send(block_header_with_merkle_path{*s, merkle_path});
+   if (must_send and peer_head_.valid() and s->block_num > peer_head_.head_block_num) {
+      send_block_headers(*s);
    } else {
       for_each_session([](session_ptr s) mutable {
          s->maybe_send_next_message();
       });
    }
-
-   try_catch([this]() mutable {
-      cleanup();
-   });
 }
 
 void relay::on_irreversible_block(const block_state_ptr& s) {
+   irreversible_block_num_ = std::max(irreversible_block_num_, s->block_num);
+
+   if (cache_config_.save_interval_blocks and ++blocks_since_save_ >= cache_config_.save_interval_blocks
+       and (caches_changed_ or save_failed_)) {
+      save_caches(true);
+   }
+
    vector<send_transaction> txs;
    for (auto& t: s->block->transactions) {
       auto id = t.trx.contains<transaction_id_type>() ? t.trx.get<transaction_id_type>() : t.trx.get<packed_transaction>().id();
@@ -417,7 +805,7 @@ void relay::on_irreversible_block(const block_state_ptr& s) {
    }
 
    if (txs.empty()) {
-      if (fc::time_point::now() - last_transaction_time_ >= fc::seconds(DUMMY_ICP_SECONDS) and peer_head_.valid()) {
+      if (fc::time_point::now() - last_transaction_time_ >= fc::seconds(cache_config_.dummy_icp_seconds) and peer_head_.valid()) {
          app().get_io_service().post([=] {
             action a;
             a.name = ACTION_DUMMY;
@@ -433,23 +821,30 @@ void relay::on_irreversible_block(const block_state_ptr& s) {
 
    auto bit = block_with_action_digests_.find(s->id);
    if (bit == block_with_action_digests_.end()) {
+      ++stats_.action_digests_misses;
       elog("cannot find block action digests: block id ${id}", ("id", s->id));
       return;
    }
 
    if (s->block_num > peer_head_.head_block_num) {
-      auto& chain = app().get_plugin<chain_plugin>();
-      vector<block_id_type> merkle_path;
-      for (uint32_t i = peer_head_.head_block_num; i < s->block_num; ++i) {
-         merkle_path.push_back(chain.chain().get_block_id_for_num(i));
-      }
-
-      send(block_header_with_merkle_path{*s, merkle_path});
+      send_block_headers(*s);
    }
 
+   ++stats_.action_digests_hits;
+
    icp_actions ia;
    ia.block_header_instance = static_cast<block_header>(s->header);
-   ia.action_digests = bit->action_digests;
+
+   // each action carries its own branch of action_mroot instead of the block's whole digest list
+   std::map<digest_type, size_t> digest_index;
+   for (size_t i = 0; i < bit->action_digests.size(); ++i) {
+      digest_index[bit->action_digests[i]] = i;
+   }
+   auto prove = [&](send_transaction_internal& a) {
+      auto it = digest_index.find(a.action_receipt_instance.digest());
+      EOS_ASSERT(it != digest_index.end(), plugin_exception, "action receipt not found in block ${id}", ("id", s->id));
+      a.merkle_proof = merkle_proof(bit->action_digests, it->second);
+   };
 
    std::map<uint64_t, send_transaction_internal> packet_actions; // key is packet seq
    std::map<uint64_t, send_transaction_internal> receipt_actions; // key is receipt seq
@@ -458,14 +853,17 @@ void relay::on_irreversible_block(const block_state_ptr& s) {
       receipt_actions.insert(t.receipt_actions.cbegin(), t.receipt_actions.cend());
       for (auto& c: t.receiptend_actions) {
          ia.receiptend_actions.push_back(c);
+         prove(ia.receiptend_actions.back());
       }
       ia.set_seq(t.start_packet_seq, t.start_receipt_seq);
    }
    for (auto& p: packet_actions) {
       ia.packet_actions.emplace_back(p.first, p.second);
+      prove(ia.packet_actions.back().second);
    }
    for (auto& r: receipt_actions) {
       ia.receipt_actions.emplace_back(r.first, r.second);
+      prove(ia.receipt_actions.back().second);
    }
 
    send(ia);
@@ -476,7 +874,10 @@ void relay::on_bad_block(const signed_block_ptr& b) {
 
 void relay::handle_icp_actions(recv_transaction&& rt) {
    if (local_head_.last_irreversible_block_num < rt.block_num) {
-      recv_transactions_.insert(move(rt)); // cache it, push later
+      boost::asio::post(*strand_, [this, rt = move(rt)]() mutable {
+         insert_recv_transaction(move(rt)); // cache it, push later
+         publish_cache_stats();
+      });
       return;
    }
 
@@ -485,7 +886,10 @@ void relay::handle_icp_actions(recv_transaction&& rt) {
       auto req = s->make_genproof_request(rt.start_packet_seq, rt.start_receipt_seq);
       if (not req.empty()) {
          send(req);
-         recv_transactions_.insert(move(rt)); // cache it, push later
+         boost::asio::post(*strand_, [this, rt = move(rt)]() mutable {
+            insert_recv_transaction(move(rt)); // cache it, push later
+            publish_cache_stats();
+         });
          return;
       }
    } else {
@@ -498,26 +902,28 @@ void relay::handle_icp_actions(recv_transaction&& rt) {
 void relay::push_icp_actions(const sequence_ptr& s, recv_transaction&& rt) {
    app().get_io_service().post([=] {
       if (not rt.action_add_block.name.empty()) {
-         push_transaction(vector<action>{rt.action_add_block});
+         enqueue_action(rt.action_add_block);
       }
 
-      // TODO: rate limiting, cache, and retry
-      auto packet_seq = s->last_incoming_packet_seq + 1; // strictly increasing, otherwise fail
-      auto receipt_seq = s->last_incoming_receipt_seq + 1; // strictly increasing, otherwise fail
+      // continue after what is already queued, the contract only accepts strictly increasing seqs
+      auto packet_seq = std::max(s->last_incoming_packet_seq, queued_packet_seq_) + 1;
+      auto receipt_seq = std::max(s->last_incoming_receipt_seq, queued_receipt_seq_) + 1;
       for (auto& p: rt.packet_actions) {
          if (p.first != packet_seq) continue;
-         push_transaction(vector<action>{p.second});
+         enqueue_action(p.second, p.first);
          ++packet_seq;
       }
       for (auto& r: rt.receipt_actions) {
          wlog("last_incoming_receipt_seq: ${lr}, receipt seq: ${rs}", ("lr", receipt_seq)("rs", r.first));
          if (r.first != receipt_seq) continue;
-         push_transaction(vector<action>{r.second});
+         enqueue_action(r.second, 0, r.first);
          ++receipt_seq;
       }
       for (auto& a: rt.receiptend_actions) {
-         push_transaction(vector<action>{a});
+         enqueue_action(a);
       }
+
+      submit_queued_actions();
    });
 }
 
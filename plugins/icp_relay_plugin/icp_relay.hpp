@@ -1,12 +1,17 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <future>
 #include <memory>
+#include <mutex>
 
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/filesystem.hpp>
 
 #include <eosio/chain_plugin/chain_plugin.hpp>
 #include <eosio/chain/plugin_interface.hpp>
@@ -38,6 +43,21 @@ private:
    relay_ptr relay_;
 };
 
+/// A received icp action waiting to be submitted to the local contract
+struct queued_action {
+   uint64_t order = 0; // arrival order, kept across retries
+   action act;
+   uint64_t packet_seq = 0; // 0 if not an `onpacket`
+   uint64_t receipt_seq = 0; // 0 if not an `onreceipt`
+   uint32_t attempts = 0;
+   bool isolate = false; // submit in a transaction of its own, after its batch failed
+};
+
+struct submitted_batch {
+   fc::time_point_sec expiration;
+   vector<queued_action> actions;
+};
+
 class relay : public std::enable_shared_from_this<relay> {
 public:
    void start();
@@ -62,9 +82,22 @@ public:
    void push_transaction(vector<action> actions, function<void(bool)> callback = nullptr, packed_transaction::compression_type compression = packed_transaction::none);
    void handle_icp_actions(recv_transaction&& rt);
 
+   cache_stats get_cache_stats() const;
+
+   void set_peer_head(const head& h);
+   std::shared_ptr<block_header_state> cached_block_state(uint32_t block_num) const;
+   std::shared_ptr<block_header_state> cached_block_state(const block_id_type& id) const;
+
    std::string endpoint_address_;
    std::uint16_t endpoint_port_;
    std::uint32_t num_threads_ = 1;
+
+   message_compression compression_ = message_compression::zlib;
+   uint32_t compress_min_bytes_ = 512;
+   std::shared_ptr<buffer_pool> buffers_ = std::make_shared<buffer_pool>();
+   std::atomic<uint64_t> sent_messages_{0}; // by all sessions
+   std::atomic<uint64_t> sent_bytes_{0}; // before compression
+   std::atomic<uint64_t> sent_wire_bytes_{0};
    std::vector<std::string> connect_to_peers_;
 
    public_key_type id_ = fc::crypto::private_key::generate().get_public_key(); // random key to identify this process
@@ -74,24 +107,51 @@ public:
    vector<chain::permission_level> signer_;
    flat_set<public_key_type> signer_required_keys_;
 
-   head peer_head_;
+   cache_config cache_config_;
+   boost::filesystem::path cache_dir_;
 
-   block_state_index block_states_;
+   uint32_t batch_max_actions_ = 16;
+   uint32_t batch_max_bytes_ = 32 * 1024;
+   uint32_t max_submit_attempts_ = 3;
 
 private:
+   // Block and transaction scanning, proofs and the caches below run on strand_, off the main thread; the signal
+   // handlers only hand over the shared block states and traces. Chain state is still read on the main thread.
    void on_applied_transaction(const transaction_trace_ptr& t);
    void on_accepted_block(const block_state_with_action_digests_ptr& b);
    void on_irreversible_block(const block_state_ptr& s);
    void on_bad_block(const signed_block_ptr& b);
 
    void cache_block_state(block_state_ptr b);
+   std::shared_ptr<const block_header_state> find_block_header_state(const block_id_type& id);
+
+   void send_block_headers(const block_header_state& target);
+   void send_block_header_with_merkle_path(const block_header_state& target);
+   fc::optional<vector<digest_type>> make_block_merkle_proof(const block_header_state& anchor, const block_header_state& target);
 
    void push_icp_actions(const sequence_ptr& s, recv_transaction&& rt);
+   void enqueue_action(const action& a, uint64_t packet_seq = 0, uint64_t receipt_seq = 0);
+   void submit_queued_actions();
+   void submit_batch(vector<queued_action>&& batch);
+   void requeue_actions(vector<queued_action>&& actions);
+   void confirm_submissions(const sequence& s);
+   void process_recv_transactions(const sequence_ptr& s, uint32_t last_irreversible_block_num);
+   void publish_cache_stats();
+   fc::optional<block_id_type> cached_block_id(uint32_t block_num) const;
 
    void cleanup();
+
+   void load_caches();
+   void save_caches(bool background);
+   void insert_send_transaction(send_transaction&& st);
+   void insert_block_action_digests(block_with_action_digests&& b);
+   void insert_recv_transaction(recv_transaction&& rt);
+   recv_transaction_index::iterator erase_recv_transaction(recv_transaction_index::iterator it);
+   bool enforce_cache_budget();
    // void cleanup_sequences();
 
    std::unique_ptr<boost::asio::io_context> ioc_;
+   std::unique_ptr<boost::asio::strand<boost::asio::io_context::executor_type>> strand_;
    std::vector<std::thread> socket_threads_;
    std::shared_ptr<listener> listener_;
    std::shared_ptr<boost::asio::deadline_timer> timer_; // only access on app io_service
@@ -107,6 +167,9 @@ private:
    uint32_t tx_max_net_usage_ = 0;
    uint32_t delaysec_ = 0;
 
+   // only access on strand_
+   head peer_head_;
+   bool block_states_restored_ = false; // by load_caches, kept when the first peer head arrives
    fc::time_point last_transaction_time_ = fc::time_point::now();
 
    // uint32_t cumulative_cleanup_sequences_ = 0;
@@ -116,8 +179,33 @@ private:
    block_with_action_digests_index block_with_action_digests_;
    recv_transaction_index recv_transactions_;
    uint32_t pending_schedule_version_ = 0;
-
-   head local_head_;
+   std::map<uint32_t, block_header_state> pending_headers_; // schedule changes to deliver in order, by block num
+
+   block_state_index block_states_; // written on strand_, guarded by block_states_mtx_
+   mutable std::mutex block_states_mtx_;
+
+   uint64_t cache_bytes_ = 0;
+   cache_stats stats_;
+   cache_stats published_stats_; // guarded by stats_mtx_
+   mutable std::mutex stats_mtx_;
+   bool caches_changed_ = false;
+   uint32_t blocks_since_save_ = 0;
+   std::future<void> pending_save_; // background write of a snapshot taken on strand_
+   std::atomic<bool> save_failed_{false};
+   uint32_t irreversible_block_num_ = 0; // only access on strand_, entries at or below it may be evicted
+   bool caches_within_budget_ = true;
+
+   head local_head_; // only access on app io_service
+
+   // submission pipeline, only access on app io_service
+   std::map<uint64_t, queued_action> submit_queue_; // by order
+   std::deque<submitted_batch> accepted_batches_; // accepted locally, not yet known to be applied
+   uint64_t next_submit_order_ = 0;
+   bool batch_inflight_ = false; // one at a time, later batches depend on the earlier ones being applied
+   uint64_t queued_packet_seq_ = 0; // highest packet seq queued or submitted
+   uint64_t queued_receipt_seq_ = 0;
+   uint64_t confirmed_packet_seq_ = 0; // as last read from the local contract
+   uint64_t confirmed_receipt_seq_ = 0;
 };
 
 }
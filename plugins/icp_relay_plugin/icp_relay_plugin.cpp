@@ -41,6 +41,18 @@ void icp_relay_plugin::set_program_options(options_description&, options_descrip
        ("icp-relay-peer-contract", bpo::value<string>()->default_value("cochainioicp"), "The peer icp contract account name")
        ("icp-relay-local-contract", bpo::value<string>()->default_value("cochainioicp"), "The local icp contract account name")
        ("icp-relay-signer", bpo::value<string>()->default_value("cochainrelay@active"), "The account and permission level to authorize icp transactions on local icp contract, as in 'account@permission'")
+       ("icp-relay-max-cached-blocks", bpo::value<uint32_t>()->default_value(50), "Send a block header once the peer lags this many blocks behind")
+       ("icp-relay-min-cached-blocks", bpo::value<uint32_t>()->default_value(20), "Send a block header once the peer lags this many blocks behind a block with icp packets")
+       ("icp-relay-dummy-seconds", bpo::value<uint32_t>()->default_value(20), "Push a dummy icp transaction after this many seconds without icp transactions")
+       ("icp-relay-max-block-states", bpo::value<uint32_t>()->default_value(500), "The number of recent block header states cached for channel seeds and header proofs")
+       ("icp-relay-cache-size-mb", bpo::value<uint64_t>()->default_value(64), "Memory budget of the pending packet caches in MiB: packets of the oldest irreversible blocks are evicted first, incoming packets are refused while nothing more can be evicted")
+       ("icp-relay-cache-dir", bpo::value<bfs::path>()->default_value("icp-relay"), "The directory where the caches are kept across restarts (absolute path or relative to application data dir)")
+       ("icp-relay-cache-save-blocks", bpo::value<uint32_t>()->default_value(120), "Persist changed caches every this many irreversible blocks, 0 saves them on shutdown only")
+       ("icp-relay-compression", bpo::value<string>()->default_value("zlib"), "Compress large messages to peers that accept it, one of 'zlib' or 'none'")
+       ("icp-relay-compress-min-bytes", bpo::value<uint32_t>()->default_value(512), "Messages smaller than this are sent uncompressed")
+       ("icp-relay-batch-actions", bpo::value<uint32_t>()->default_value(16), "The maximum number of received icp actions submitted in one local transaction. Only one such transaction is in flight at a time, so that they apply in order; throughput is at most one batch per local push round trip")
+       ("icp-relay-batch-bytes", bpo::value<uint32_t>()->default_value(32 * 1024), "The maximum size in bytes of the received icp actions submitted in one local transaction")
+       ("icp-relay-submit-attempts", bpo::value<uint32_t>()->default_value(3), "Give up a received icp action after failing to submit it this many times")
     ;
 }
 
@@ -80,6 +92,29 @@ void icp_relay_plugin::plugin_initialize(const variables_map& options) {
     relay_->peer_contract_ = account_name(options.at("icp-relay-peer-contract").as<string>());
     relay_->peer_chain_id_ = chain_id_type(options.at("icp-relay-peer-chain-id").as<string>());
     relay_->signer_ = get_account_permissions(vector<string>{options.at("icp-relay-signer").as<string>()});
+
+    auto& cache = relay_->cache_config_;
+    cache.max_cached_blocks = options.at("icp-relay-max-cached-blocks").as<uint32_t>();
+    cache.min_cached_blocks = options.at("icp-relay-min-cached-blocks").as<uint32_t>();
+    cache.dummy_icp_seconds = options.at("icp-relay-dummy-seconds").as<uint32_t>();
+    cache.max_block_states = options.at("icp-relay-max-block-states").as<uint32_t>();
+    cache.max_cache_bytes = options.at("icp-relay-cache-size-mb").as<uint64_t>() * 1024 * 1024;
+    cache.save_interval_blocks = options.at("icp-relay-cache-save-blocks").as<uint32_t>();
+    FC_ASSERT(cache.min_cached_blocks <= cache.max_cached_blocks, "icp-relay-min-cached-blocks must not exceed icp-relay-max-cached-blocks");
+
+    auto compression = options.at("icp-relay-compression").as<string>();
+    FC_ASSERT(compression == "zlib" or compression == "none", "icp-relay-compression must be 'zlib' or 'none'");
+    relay_->compression_ = compression == "zlib" ? icp::message_compression::zlib : icp::message_compression::none;
+    relay_->compress_min_bytes_ = options.at("icp-relay-compress-min-bytes").as<uint32_t>();
+
+    relay_->batch_max_actions_ = options.at("icp-relay-batch-actions").as<uint32_t>();
+    relay_->batch_max_bytes_ = options.at("icp-relay-batch-bytes").as<uint32_t>();
+    relay_->max_submit_attempts_ = options.at("icp-relay-submit-attempts").as<uint32_t>();
+    FC_ASSERT(relay_->batch_max_actions_ > 0, "icp-relay-batch-actions must be positive");
+    FC_ASSERT(relay_->max_submit_attempts_ > 0, "icp-relay-submit-attempts must be positive");
+
+    auto cache_dir = options.at("icp-relay-cache-dir").as<bfs::path>();
+    relay_->cache_dir_ = cache_dir.is_relative() ? app().data_dir() / cache_dir : cache_dir;
 }
 
 void icp_relay_plugin::plugin_startup() {
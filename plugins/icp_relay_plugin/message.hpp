@@ -13,6 +13,7 @@ using namespace eosio::chain;
 static const action_name ACTION_OPENCHANNEL{"openchannel"};
 static const action_name ACTION_ADDBLOCKS{"addblocks"};
 static const action_name ACTION_ADDBLOCK{"addblock"};
+static const action_name ACTION_ADDHEADERS{"addheaders"};
 static const action_name ACTION_SENDACTION{"sendaction"};
 static const action_name ACTION_ONPACKET{"onpacket"};
 static const action_name ACTION_ONRECEIPT{"onreceipt"};
@@ -31,7 +32,7 @@ struct icp_action {
    bytes action;
    bytes action_receipt;
    block_id_type block_id;
-   bytes merkle_path;
+   bytes merkle_path; // packed merkle_proof of the action receipt digest, see eosio::chain::merkle_root_from_proof
 };
 
 struct bytes_data {
@@ -77,11 +78,17 @@ struct icp_receipt {
    }
 };
 
+enum class message_compression : uint8_t {
+   none = 0,
+   zlib = 1
+};
+
 struct hello {
    public_key_type id; // sender id
    chain_id_type chain_id; // sender chain id
    account_name contract; // sender contract name
    account_name peer_contract; // receiver contract name
+   vector<uint8_t> compressions; // message_compression the sender can inflate
 };
 struct ping {
    fc::time_point sent;
@@ -102,9 +109,24 @@ struct block_header_with_merkle_path {
    block_header_state block_header;
    vector<block_id_type> merkle_path;
 };
+/**
+ * Header of a block with the proof that it descends from the previous one: the merkle branch of the previous
+ * block id in this header's blockroot_merkle, see eosio::chain::merkle_root_from_proof.
+ */
+struct block_header_with_merkle_proof {
+   block_header_state block_header;
+   vector<digest_type> merkle_proof;
+};
+/**
+ * Consecutive headers the peer must follow in order, e.g. producer schedule changes while it lagged behind.
+ * The first header links to `anchor`, the peer's current head, and each following header to the one before it.
+ */
+struct block_headers_with_merkle_proof {
+   block_id_type anchor;
+   vector<block_header_with_merkle_proof> headers;
+};
 struct icp_actions {
    block_header block_header_instance;
-   vector<digest_type> action_digests;
 
    uint64_t start_packet_seq = 0;
    uint64_t start_receipt_seq = 0;
@@ -131,6 +153,12 @@ struct packet_receipt_request {
    }
 };
 
+/// A packed icp_message, compressed with one of the codecs the receiver listed in its hello
+struct compressed_message {
+   uint8_t compression = 0; // message_compression
+   bytes data;
+};
+
 using icp_message = fc::static_variant<
    hello,
    ping,
@@ -139,7 +167,9 @@ using icp_message = fc::static_variant<
    head_notice,
    block_header_with_merkle_path,
    icp_actions,
-   packet_receipt_request
+   packet_receipt_request,
+   block_headers_with_merkle_proof,
+   compressed_message
 >;
 
 }
@@ -155,15 +185,17 @@ namespace std {
    };
 }
 
-FC_REFLECT(icp::hello, (id)(chain_id)(contract)(peer_contract))
+FC_REFLECT(icp::hello, (id)(chain_id)(contract)(peer_contract)(compressions))
 FC_REFLECT(icp::ping, (sent)(code)(head_instance))
 FC_REFLECT(icp::pong, (sent)(code))
 FC_REFLECT(icp::channel_seed, (seed))
 FC_REFLECT(icp::head_notice, (head_instance))
 FC_REFLECT(icp::block_header_with_merkle_path, (block_header)(merkle_path))
-FC_REFLECT(icp::send_transaction_internal, (peer_action)(action_instance)(action_receipt_instance))
-FC_REFLECT(icp::icp_actions, (block_header_instance)(action_digests)(start_packet_seq)(start_receipt_seq)(packet_actions)(receipt_actions)(receiptend_actions))
+FC_REFLECT(icp::block_header_with_merkle_proof, (block_header)(merkle_proof))
+FC_REFLECT(icp::block_headers_with_merkle_proof, (anchor)(headers))
+FC_REFLECT(icp::icp_actions, (block_header_instance)(start_packet_seq)(start_receipt_seq)(packet_actions)(receipt_actions)(receiptend_actions))
 FC_REFLECT(icp::packet_receipt_request, (packet_seq)(receipt_seq)(finalised_receipt))
+FC_REFLECT(icp::compressed_message, (compression)(data))
 
 FC_REFLECT(icp::icp_action, (action)(action_receipt)(block_id)(merkle_path))
 FC_REFLECT(icp::bytes_data, (data))
@@ -1,11 +1,45 @@
 #include "session.hpp"
 
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+
 #include <appbase/application.hpp>
 
 #include "icp_relay.hpp"
 
 namespace icp {
 
+namespace bio = boost::iostreams;
+
+static const size_t MAX_INFLATED_MESSAGE_SIZE = 64 * 1024 * 1024;
+
+static bytes zlib_compress(const char* data, size_t size) {
+   bytes out;
+   bio::filtering_ostream comp;
+   comp.push(bio::zlib_compressor(bio::zlib::default_compression));
+   comp.push(bio::back_inserter(out));
+   bio::write(comp, data, size);
+   bio::close(comp);
+   return out;
+}
+
+static bytes zlib_decompress(const bytes& data) {
+   bytes out;
+   bio::filtering_istream decomp;
+   decomp.push(bio::zlib_decompressor());
+   decomp.push(bio::array_source(data.data(), data.size()));
+   char chunk[4096];
+   while (decomp) {
+      decomp.read(chunk, sizeof(chunk));
+      auto n = static_cast<size_t>(decomp.gcount());
+      FC_ASSERT(out.size() + n <= MAX_INFLATED_MESSAGE_SIZE, "compressed message inflates beyond ${n} bytes", ("n", MAX_INFLATED_MESSAGE_SIZE));
+      out.insert(out.end(), chunk, chunk + n);
+   }
+   return out;
+}
+
 // Creating session from server socket acceptance
 session::session(tcp::socket socket, relay_ptr relay)
    : ios_(socket.get_io_service()),
@@ -144,6 +178,9 @@ void session::do_hello() {
    hello_msg.chain_id = app().get_plugin<chain_plugin>().get_chain_id();
    hello_msg.contract = relay_->local_contract_;
    hello_msg.peer_contract = relay_->peer_contract_;
+   if (relay_->compression_ != message_compression::none) {
+      hello_msg.compressions.push_back(static_cast<uint8_t>(relay_->compression_));
+   }
    send(hello_msg);
    sent_remote_hello_ = true;
 }
@@ -232,7 +269,7 @@ void session::send() {
       verify_strand_in_this_thread(strand_, __func__, __LINE__);
 
       state_ = sending_state;
-      ws_->async_write(boost::asio::buffer(out_buffer_),
+      ws_->async_write(boost::asio::buffer(*out_buffer_),
                        boost::asio::bind_executor(strand_,
                           [this, self=shared_from_this()](boost::system::error_code ec, std::size_t bytes_transferred) {
                           verify_strand_in_this_thread(strand_, __func__, __LINE__);
@@ -241,19 +278,37 @@ void session::send() {
                             return on_error(ec, "write");
                           }
                           state_ = idle_state;
-                          out_buffer_.resize(0);
+                          out_buffer_.reset(); // back to the pool
                           maybe_send_next_message();
                        })
       );
    } FC_LOG_AND_RETHROW()
 }
 
+void session::pack_message(const icp_message& msg) {
+   auto ps = fc::raw::pack_size(msg);
+   out_buffer_->resize(ps);
+   fc::datastream<char*> ds(out_buffer_->data(), ps);
+   fc::raw::pack(ds, msg);
+}
+
 void session::send(const icp_message& msg) {
    try {
-      auto ps = fc::raw::pack_size(msg);
-      out_buffer_.resize(ps);
-      fc::datastream<char*> ds(out_buffer_.data(), ps);
-      fc::raw::pack(ds, msg);
+      out_buffer_ = relay_->buffers_->acquire();
+      pack_message(msg);
+      auto size = out_buffer_->size();
+
+      // large headers and action batches shrink well, small control messages are not worth it
+      if (peer_compression_ == message_compression::zlib and size >= relay_->compress_min_bytes_) {
+         auto data = zlib_compress(out_buffer_->data(), size);
+         if (data.size() < size) {
+            pack_message(compressed_message{static_cast<uint8_t>(message_compression::zlib), move(data)});
+         }
+      }
+
+      relay_->sent_messages_ += 1;
+      relay_->sent_bytes_ += size;
+      relay_->sent_wire_bytes_ += out_buffer_->size();
       send();
    } FC_LOG_AND_RETHROW()
 }
@@ -265,7 +320,7 @@ void session::buffer_send(icp_message&& msg) {
 void session::maybe_send_next_message() {
    verify_strand_in_this_thread(strand_, __func__, __LINE__);
    if (state_ == sending_state) return; // in process of sending
-   if (out_buffer_.size()) return; // in process of sending
+   if (out_buffer_) return; // in process of sending
    if (!recv_remote_hello_ || !sent_remote_hello_) return;
 
    if (send_pong()) return;
@@ -274,8 +329,7 @@ void session::maybe_send_next_message() {
    // ilog("msg buffer count: ${n}", ("n", msg_buffer_.size()));
 
    if (not msg_buffer_.empty()) {
-      auto msg = msg_buffer_.front();
-      send(msg);
+      send(msg_buffer_.front());
       msg_buffer_.pop_front();
    }
    // TODO
@@ -320,6 +374,12 @@ void session::on_message(const icp_message& msg) {
             // wlog("on packet_receipt_request");
             on(msg.get<packet_receipt_request>());
             break;
+         case icp_message::tag<block_headers_with_merkle_proof>::value:
+            on(msg.get<block_headers_with_merkle_proof>());
+            break;
+         case icp_message::tag<compressed_message>::value:
+            on(msg.get<compressed_message>());
+            return; // the inner message did the rest
          default:
             wlog("bad message received");
             ws_->close(boost::beast::websocket::close_code::bad_payload);
@@ -361,6 +421,13 @@ void session::on(const hello& hi) {
 
    peer_id_ = hi.id;
 
+   auto local = static_cast<uint8_t>(relay_->compression_);
+   if (relay_->compression_ != message_compression::none and
+       std::find(hi.compressions.begin(), hi.compressions.end(), local) != hi.compressions.end()) {
+      peer_compression_ = relay_->compression_;
+   }
+   ilog("session ${id} compression: ${c}", ("id", session_id_)("c", static_cast<uint32_t>(peer_compression_)));
+
    check_for_redundant_connection();
 }
 
@@ -372,12 +439,7 @@ void session::on(const ping& p) {
 
    if (not p.head_instance.valid()) return;
 
-   app().get_io_service().post([=, self=shared_from_this()] {
-      if (not relay_->peer_head_.valid()) {
-         relay_->clear_cache_block_state();
-      }
-      relay_->peer_head_ = p.head_instance; // TODO: check validity
-   });
+   relay_->set_peer_head(p.head_instance);
 }
 
 void session::on(const pong& p) {
@@ -404,12 +466,7 @@ void session::on(const head_notice& h) {
    // wlog("recv head: ${v}", ("v", h.head.valid()));
    if (not h.head_instance.valid()) return;
 
-   app().get_io_service().post([=, self=shared_from_this()] {
-      if (not relay_->peer_head_.valid()) {
-         relay_->clear_cache_block_state();
-      }
-      relay_->peer_head_ = h.head_instance; // TODO: check validity
-   });
+   relay_->set_peer_head(h.head_instance);
 }
 
 void session::on(const block_header_with_merkle_path& b) {
@@ -446,6 +503,34 @@ void session::on(const block_header_with_merkle_path& b) {
    });
 }
 
+void session::on(const block_headers_with_merkle_proof& b) {
+   if (b.headers.empty()) return;
+
+   auto ro = relay_->get_read_only_api();
+   auto head = ro.get_head();
+
+   if (not head) {
+      elog("local head not found, maybe icp channel not opened");
+      return;
+   }
+
+   if (b.anchor != head->head_block_id) {
+      // elog("unlinkable block headers: has ${has}, got anchor ${got}", ("has", head->head_block_id)("got", b.anchor));
+      return;
+   }
+
+   auto data = fc::raw::pack(bytes_data{fc::raw::pack(b)});
+
+   app().get_io_service().post([=, self=shared_from_this()] {
+      action a;
+      a.name = ACTION_ADDHEADERS;
+      a.data = data;
+      relay_->push_transaction(vector<action>{a}, [this, self](bool success) {
+         if (success) relay_->update_local_head();
+      });
+   });
+}
+
 void session::on(const icp_actions& ia) {
    auto block_id = ia.block_header_instance.id();
    auto block_num = ia.block_header_instance.block_num();
@@ -465,20 +550,20 @@ void session::on(const icp_actions& ia) {
       auto& s = p.second;
       action a;
       a.name = s.peer_action;
-      a.data = fc::raw::pack(icp_action{fc::raw::pack(s.action_instance), fc::raw::pack(s.action_receipt_instance), block_id, fc::raw::pack(ia.action_digests)});
+      a.data = fc::raw::pack(icp_action{fc::raw::pack(s.action_instance), fc::raw::pack(s.action_receipt_instance), block_id, fc::raw::pack(s.merkle_proof)});
       rt.packet_actions.emplace_back(p.first, a);
    }
    for (auto& r: ia.receipt_actions) {
       auto& s = r.second;
       action a;
       a.name = s.peer_action;
-      a.data = fc::raw::pack(icp_action{fc::raw::pack(s.action_instance), fc::raw::pack(s.action_receipt_instance), block_id, fc::raw::pack(ia.action_digests)});
+      a.data = fc::raw::pack(icp_action{fc::raw::pack(s.action_instance), fc::raw::pack(s.action_receipt_instance), block_id, fc::raw::pack(s.merkle_proof)});
       rt.receipt_actions.emplace_back(r.first, a);
    }
    for (auto& c: ia.receiptend_actions) {
       action a;
       a.name = c.peer_action;
-      a.data = fc::raw::pack(icp_action{fc::raw::pack(c.action_instance), fc::raw::pack(c.action_receipt_instance), block_id, fc::raw::pack(ia.action_digests)});
+      a.data = fc::raw::pack(icp_action{fc::raw::pack(c.action_instance), fc::raw::pack(c.action_receipt_instance), block_id, fc::raw::pack(c.merkle_proof)});
       rt.receiptend_actions.emplace_back(a);
    }
 
@@ -498,4 +583,14 @@ void session::on(const packet_receipt_request& req) {
    });
 }
 
+void session::on(const compressed_message& m) {
+   // only inflate what we offered in hello
+   FC_ASSERT(relay_->compression_ == message_compression::zlib and m.compression == static_cast<uint8_t>(message_compression::zlib),
+             "unexpected message compression ${c}", ("c", m.compression));
+
+   auto msg = fc::raw::unpack<icp_message>(zlib_decompress(m.data));
+   FC_ASSERT(not msg.contains<compressed_message>(), "nested compressed message");
+   on_message(msg);
+}
+
 }
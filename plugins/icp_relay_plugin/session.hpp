@@ -14,6 +14,7 @@
 
 #include "message.hpp"
 #include "api.hpp"
+#include "buffer_pool.hpp"
 
 namespace icp {
 
@@ -74,6 +75,7 @@ private:
    void send();
    void send(const icp_message& msg);
    void on_message(const icp_message& msg);
+   void pack_message(const icp_message& msg);
    void check_for_redundant_connection();
 
    void on(const hello& hi);
@@ -82,8 +84,10 @@ private:
    void on(const channel_seed& s);
    void on(const head_notice& h);
    void on(const block_header_with_merkle_path& b);
+   void on(const block_headers_with_merkle_proof& b);
    void on(const icp_actions& ia);
    void on(const packet_receipt_request& req);
+   void on(const compressed_message& m);
 
    enum session_state {
       hello_state,
@@ -104,12 +108,13 @@ private:
    string remote_port_;
 
    deque<icp_message> msg_buffer_;
-   vector<char> out_buffer_;
+   buffer_pool::buffer_ptr out_buffer_; // held while a write is outstanding
    boost::beast::flat_buffer in_buffer_;
 
    bool recv_remote_hello_ = false;
    bool sent_remote_hello_ = false;
    public_key_type peer_id_;
+   message_compression peer_compression_ = message_compression::none; // agreed in hello
 
    fc::time_point last_recv_ping_time_ = fc::time_point::now();
    ping last_recv_ping_;
@@ -127,4 +127,117 @@ void relay::push_transaction(vector<action> actions, function<void(bool)> callba
    });
 }
 
+void relay::enqueue_action(const action& a, uint64_t packet_seq, uint64_t receipt_seq) {
+   queued_action q;
+   q.order = next_submit_order_++;
+   q.act = a;
+   q.packet_seq = packet_seq;
+   q.receipt_seq = receipt_seq;
+   submit_queue_.emplace(q.order, move(q));
+
+   queued_packet_seq_ = std::max(queued_packet_seq_, packet_seq);
+   queued_receipt_seq_ = std::max(queued_receipt_seq_, receipt_seq);
+}
+
+/// Coalesces queued actions, in arrival order, into transactions of at most `batch_max_actions_` actions and
+/// `batch_max_bytes_` bytes. Only one is in flight at a time: push_transaction recovers signatures on the producer's
+/// thread pool, so transactions pushed together may be applied out of order, while blocks, packets and receipts
+/// must be applied in order. The next batch is submitted once the previous one is accepted or requeued.
+void relay::submit_queued_actions() {
+   if (not batch_inflight_ and not submit_queue_.empty()) {
+      vector<queued_action> batch;
+      size_t bytes = 0;
+      for (auto it = submit_queue_.begin(); it != submit_queue_.end() and batch.size() < batch_max_actions_;) {
+         if (not batch.empty() and it->second.isolate) break;
+         auto size = fc::raw::pack_size(it->second.act);
+         if (not batch.empty() and bytes + size > batch_max_bytes_) break;
+
+         bytes += size;
+         batch.push_back(move(it->second));
+         it = submit_queue_.erase(it);
+         if (batch.back().isolate) break;
+      }
+
+      submit_batch(move(batch)); // if not pushed, try again on next local head
+   }
+}
+
+void relay::submit_batch(vector<queued_action>&& batch) {
+   vector<action> actions;
+   for (auto& q: batch) {
+      actions.push_back(q.act);
+      ++q.attempts;
+   }
+
+   auto& chain = app().get_plugin<chain_plugin>().chain();
+   auto expiration = chain.head_block_time() + tx_expiration_;
+
+   batch_inflight_ = true;
+   auto shared_batch = std::make_shared<vector<queued_action>>(move(batch));
+   bool pushed = false;
+   try_catch([&] {
+      push_transaction(move(actions), [this, shared_batch, expiration](bool success) {
+         batch_inflight_ = false;
+         if (success) {
+            accepted_batches_.push_back(submitted_batch{expiration, move(*shared_batch)});
+         } else {
+            if (shared_batch->size() > 1) {
+               for (auto& q: *shared_batch) q.isolate = true; // find the failing action
+            }
+            requeue_actions(move(*shared_batch));
+         }
+         // the callback may run inside push_transaction
+         app().get_io_service().post([this] {
+            submit_queued_actions();
+         });
+      });
+      pushed = true;
+   }, "submitting icp actions");
+
+   if (not pushed) {
+      batch_inflight_ = false;
+      for (auto& q: *shared_batch) --q.attempts; // not the actions' fault
+      requeue_actions(move(*shared_batch));
+   }
+}
+
+void relay::requeue_actions(vector<queued_action>&& actions) {
+   for (auto& q: actions) {
+      if ((q.packet_seq and q.packet_seq <= confirmed_packet_seq_) or (q.receipt_seq and q.receipt_seq <= confirmed_receipt_seq_)) {
+         continue; // applied meanwhile
+      }
+      if (q.attempts >= max_submit_attempts_) {
+         elog("dropping icp action ${a} after ${n} attempts", ("a", q.act.name)("n", q.attempts));
+         // let a later delivery of the same seq be queued again
+         if (q.packet_seq) queued_packet_seq_ = std::min(queued_packet_seq_, q.packet_seq - 1);
+         if (q.receipt_seq) queued_receipt_seq_ = std::min(queued_receipt_seq_, q.receipt_seq - 1);
+         continue;
+      }
+      submit_queue_.emplace(q.order, move(q));
+   }
+}
+
+/// Called with the contract's sequence on every local head change: accepted transactions that expired before their
+/// packets or receipts were applied, e.g. dropped on a fork switch, are queued again.
+void relay::confirm_submissions(const sequence& s) {
+   confirmed_packet_seq_ = s.last_incoming_packet_seq;
+   confirmed_receipt_seq_ = s.last_incoming_receipt_seq;
+
+   auto now = app().get_plugin<chain_plugin>().chain().head_block_time();
+   while (not accepted_batches_.empty() and accepted_batches_.front().expiration < now) {
+      vector<queued_action> lost;
+      for (auto& q: accepted_batches_.front().actions) {
+         if (q.packet_seq > confirmed_packet_seq_ or q.receipt_seq > confirmed_receipt_seq_) lost.push_back(move(q));
+      }
+      accepted_batches_.pop_front();
+
+      if (not lost.empty()) {
+         wlog("${n} icp actions expired before being applied, retrying", ("n", lost.size()));
+         requeue_actions(move(lost));
+      }
+   }
+
+   submit_queued_actions();
+}
+
 }
@@ -0,0 +1,335 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE
+ */
+#include "bson.hpp"
+
+#include <eosio/chain/asset.hpp>
+#include <eosio/chain/exceptions.hpp>
+
+#include <fc/io/raw.hpp>
+#include <fc/utf8.hpp>
+
+#include <bsoncxx/types.hpp>
+
+#include <boost/algorithm/string/predicate.hpp>
+
+namespace eosio {
+
+using bsoncxx::builder::core;
+using boost::algorithm::ends_with;
+
+namespace {
+
+// fc::json::to_string quotes integers wider than 32 bits, bsoncxx::from_json picks the narrowest integer type
+void append_int64( core& c, int64_t i ) {
+   if( i > 0xffffffffll ) {
+      c.append( bsoncxx::types::b_utf8{std::to_string( i )} );
+   } else if( i >= std::numeric_limits<int32_t>::min() && i <= std::numeric_limits<int32_t>::max() ) {
+      c.append( bsoncxx::types::b_int32{static_cast<int32_t>(i)} );
+   } else {
+      c.append( bsoncxx::types::b_int64{i} );
+   }
+}
+
+void append_uint64( core& c, uint64_t u ) {
+   if( u > 0xffffffffull ) {
+      c.append( bsoncxx::types::b_utf8{std::to_string( u )} );
+   } else {
+      append_int64( c, static_cast<int64_t>(u) );
+   }
+}
+
+void append_string( core& c, const std::string& s, bool& purged ) {
+   if( fc::is_utf8( s ) ) {
+      c.append( bsoncxx::types::b_utf8{s} );
+   } else {
+      purged = true;
+      c.append( bsoncxx::types::b_utf8{fc::prune_invalid_utf8( s )} );
+   }
+}
+
+void append_key( core& c, const std::string& key, bool& purged ) {
+   if( fc::is_utf8( key ) ) {
+      c.key_owned( key );
+   } else {
+      purged = true;
+      c.key_owned( fc::prune_invalid_utf8( key ) );
+   }
+}
+
+template<typename T>
+fc::variant variant_from_stream( fc::datastream<const char*>& ds ) {
+   T temp;
+   fc::raw::unpack( ds, temp );
+   return fc::variant( temp );
+}
+
+template<typename T>
+T unpack( fc::datastream<const char*>& ds ) {
+   T temp;
+   fc::raw::unpack( ds, temp );
+   return temp;
+}
+
+} // anonymous namespace
+
+void append_bson( core& c, const fc::variant& v, bool& purged ) {
+   switch( v.get_type() ) {
+      case fc::variant::null_type:
+         c.append( bsoncxx::types::b_null{} );
+         break;
+      case fc::variant::int64_type:
+         append_int64( c, v.as_int64() );
+         break;
+      case fc::variant::uint64_type:
+         append_uint64( c, v.as_uint64() );
+         break;
+      case fc::variant::bool_type:
+         c.append( bsoncxx::types::b_bool{v.as_bool()} );
+         break;
+      case fc::variant::string_type:
+         append_string( c, v.get_string(), purged );
+         break;
+      case fc::variant::array_type:
+         c.open_array();
+         for( const auto& e : v.get_array() ) {
+            append_bson( c, e, purged );
+         }
+         c.close_array();
+         break;
+      case fc::variant::object_type:
+         c.open_document();
+         for( const auto& e : v.get_object() ) {
+            append_key( c, e.key(), purged );
+            append_bson( c, e.value(), purged );
+         }
+         c.close_document();
+         break;
+      default: // doubles and blobs are quoted by fc::json
+         append_string( c, v.as_string(), purged );
+         break;
+   }
+}
+
+bsoncxx::document::value to_bson( const fc::variant_object& o, bool& purged ) {
+   core c( false );
+   for( const auto& e : o ) {
+      append_key( c, e.key(), purged );
+      append_bson( c, e.value(), purged );
+   }
+   return c.extract_document();
+}
+
+abi_bson_encoder::abi_bson_encoder( const chain::abi_def& abi ) {
+   using namespace chain;
+
+   for( const auto& td : abi.types ) typedefs[td.new_type_name] = td.type;
+   for( const auto& st : abi.structs ) structs[st.name] = st;
+   for( const auto& v : abi.variants.value ) variants[v.name] = v;
+
+   // built-in types without a direct BSON mapping go through fc::variant, as abi_serializer does
+   others["varint32"] = &variant_from_stream<fc::signed_int>;
+   others["varuint32"] = &variant_from_stream<fc::unsigned_int>;
+   others["int128"] = &variant_from_stream<int128_t>;
+   others["uint128"] = &variant_from_stream<uint128_t>;
+   others["float32"] = &variant_from_stream<float>;
+   others["float64"] = &variant_from_stream<double>;
+   others["float128"] = &variant_from_stream<uint128_t>;
+   others["time_point"] = &variant_from_stream<fc::time_point>;
+   others["time_point_sec"] = &variant_from_stream<fc::time_point_sec>;
+   others["block_timestamp_type"] = &variant_from_stream<block_timestamp_type>;
+   others["bytes"] = &variant_from_stream<bytes>;
+   others["checksum160"] = &variant_from_stream<checksum160_type>;
+   others["checksum256"] = &variant_from_stream<checksum256_type>;
+   others["checksum512"] = &variant_from_stream<checksum512_type>;
+   others["public_key"] = &variant_from_stream<public_key_type>;
+   others["signature"] = &variant_from_stream<signature_type>;
+   others["symbol"] = &variant_from_stream<symbol>;
+   others["symbol_code"] = &variant_from_stream<symbol_code>;
+   others["asset"] = &variant_from_stream<asset>;
+   others["extended_asset"] = &variant_from_stream<extended_asset>;
+   // mongo_db_plugin stores eosio::setabi abi as abi_def instead of bytes
+   others[setabi_abi_type] = []( fc::datastream<const char*>& ds ) {
+      return fc::variant( fc::raw::unpack<abi_def>( unpack<bytes>( ds ) ) );
+   };
+
+   for( const auto& a : abi.actions ) {
+      auto nodes_before = nodes.size();
+      try {
+         auto idx = compile( a.type );
+         if( nodes[idx].kind == kind_t::structure ) actions[a.name] = idx;
+      } catch( const fc::exception& e ) {
+         // drop partially compiled nodes and leave the action to abi_serializer, which reports the problem when used
+         for( auto itr = compiled.begin(); itr != compiled.end(); ) {
+            itr = itr->second >= nodes_before ? compiled.erase( itr ) : std::next( itr );
+         }
+         nodes.resize( nodes_before );
+         wlog( "Unable to compile BSON encoder for action ${a}: ${e}", ("a", a.name)("e", e.to_string()) );
+      }
+   }
+}
+
+chain::type_name abi_bson_encoder::resolve( const chain::type_name& type ) const {
+   auto itr = typedefs.find( type );
+   if( itr != typedefs.end() ) {
+      for( auto i = typedefs.size(); i > 0; --i ) { // avoid infinite recursion
+         const auto& t = itr->second;
+         itr = typedefs.find( t );
+         if( itr == typedefs.end() ) return t;
+      }
+   }
+   return type;
+}
+
+uint32_t abi_bson_encoder::compile( const chain::type_name& type ) {
+   static const std::map<chain::type_name, builtin_t> direct = {
+         {"bool", builtin_t::boolean}, {"int8", builtin_t::int8}, {"uint8", builtin_t::uint8},
+         {"int16", builtin_t::int16}, {"uint16", builtin_t::uint16}, {"int32", builtin_t::int32},
+         {"uint32", builtin_t::uint32}, {"int64", builtin_t::int64}, {"uint64", builtin_t::uint64},
+         {"name", builtin_t::name}, {"string", builtin_t::string}};
+
+   auto rtype = resolve( type );
+   auto itr = compiled.find( rtype );
+   if( itr != compiled.end() ) return itr->second;
+
+   // register first so that recursive types refer back to this node
+   uint32_t idx = nodes.size();
+   nodes.emplace_back();
+   compiled[rtype] = idx;
+
+   node n;
+   if( ends_with( rtype, "[]" ) ) {
+      n.kind = kind_t::array;
+      n.element = compile( rtype.substr( 0, rtype.size() - 2 ) );
+   } else if( ends_with( rtype, "?" ) ) {
+      n.kind = kind_t::optional;
+      n.element = compile( rtype.substr( 0, rtype.size() - 1 ) );
+   } else if( direct.count( rtype ) ) {
+      n.builtin = direct.at( rtype );
+   } else if( others.count( rtype ) ) {
+      n.unpack = &others.at( rtype );
+   } else if( variants.count( rtype ) ) {
+      n.kind = kind_t::variant;
+      for( const auto& t : variants.at( rtype ).types ) {
+         auto alternative = compile( t );
+         n.alternatives.emplace_back( t, alternative );
+      }
+   } else if( structs.count( rtype ) ) {
+      n.kind = kind_t::structure;
+      std::vector<const chain::struct_def*> chain_of_bases;
+      for( auto s = &structs.at( rtype ); s; ) {
+         EOS_ASSERT( chain_of_bases.size() < chain::abi_serializer::max_recursion_depth, chain::abi_circular_def_exception,
+                     "Circular reference in struct ${s}", ("s", rtype) );
+         chain_of_bases.push_back( s );
+         if( s->base.empty() ) break;
+         auto base = structs.find( resolve( s->base ) );
+         EOS_ASSERT( base != structs.end(), chain::invalid_type_inside_abi, "Unknown base ${b} of struct ${s}", ("b", s->base)("s", rtype) );
+         s = &base->second;
+      }
+      for( auto s = chain_of_bases.rbegin(); s != chain_of_bases.rend(); ++s ) {
+         for( const auto& f : (*s)->fields ) {
+            bool extension = ends_with( f.type, "$" );
+            auto field_type = compile( extension ? f.type.substr( 0, f.type.size() - 1 ) : f.type );
+            n.fields.push_back( field{f.name, field_type, extension} );
+         }
+      }
+   } else {
+      EOS_THROW( chain::invalid_type_inside_abi, "Unknown type ${t}", ("t", rtype) );
+   }
+
+   nodes[idx] = std::move( n );
+   return idx;
+}
+
+void abi_bson_encoder::decode_fields( const node& n, fc::datastream<const char*>& ds, core& c, bool& purged, uint32_t depth ) const {
+   bool encountered_extension = false;
+   size_t written = 0;
+   for( const auto& f : n.fields ) {
+      encountered_extension |= f.extension;
+      if( !ds.remaining() ) {
+         if( f.extension ) continue;
+         EOS_ASSERT( !encountered_extension, chain::abi_exception,
+                     "Encountered field '${f}' without binary extension designation", ("f", f.name) );
+         EOS_THROW( chain::unpack_exception, "Stream unexpectedly ended; unable to unpack field '${f}'", ("f", f.name) );
+      }
+      append_key( c, f.name, purged );
+      decode( nodes[f.type], ds, c, purged, depth + 1 );
+      ++written;
+   }
+   EOS_ASSERT( written > 0, chain::unpack_exception, "Unable to unpack empty struct" );
+}
+
+void abi_bson_encoder::decode( const node& n, fc::datastream<const char*>& ds, core& c, bool& purged, uint32_t depth ) const {
+   EOS_ASSERT( depth < chain::abi_serializer::max_recursion_depth, chain::abi_recursion_depth_exception,
+               "recursive definition, max_recursion_depth ${r}", ("r", chain::abi_serializer::max_recursion_depth) );
+
+   switch( n.kind ) {
+      case kind_t::builtin:
+         switch( n.builtin ) {
+            case builtin_t::boolean: // packed and reported as uint8 by abi_serializer
+            case builtin_t::uint8:  append_uint64( c, unpack<uint8_t>( ds ) ); break;
+            case builtin_t::int8:   append_int64( c, unpack<int8_t>( ds ) ); break;
+            case builtin_t::int16:  append_int64( c, unpack<int16_t>( ds ) ); break;
+            case builtin_t::uint16: append_uint64( c, unpack<uint16_t>( ds ) ); break;
+            case builtin_t::int32:  append_int64( c, unpack<int32_t>( ds ) ); break;
+            case builtin_t::uint32: append_uint64( c, unpack<uint32_t>( ds ) ); break;
+            case builtin_t::int64:  append_int64( c, unpack<int64_t>( ds ) ); break;
+            case builtin_t::uint64: append_uint64( c, unpack<uint64_t>( ds ) ); break;
+            case builtin_t::name:   append_string( c, chain::name( unpack<uint64_t>( ds ) ).to_string(), purged ); break;
+            case builtin_t::string: append_string( c, unpack<std::string>( ds ), purged ); break;
+            case builtin_t::other:  append_bson( c, (*n.unpack)( ds ), purged ); break;
+         }
+         break;
+      case kind_t::array: {
+         auto size = unpack<fc::unsigned_int>( ds );
+         const auto& element = nodes[n.element];
+         c.open_array();
+         for( uint32_t i = 0; i < size.value; ++i ) {
+            if( element.kind == kind_t::optional ) {
+               // abi_serializer rejects null array elements
+               EOS_ASSERT( ds.remaining() && *(ds.pos()) != 0, chain::unpack_exception, "Invalid packed array" );
+            }
+            decode( element, ds, c, purged, depth + 1 );
+         }
+         c.close_array();
+         break;
+      }
+      case kind_t::optional:
+         if( unpack<char>( ds ) ) {
+            decode( nodes[n.element], ds, c, purged, depth + 1 );
+         } else {
+            c.append( bsoncxx::types::b_null{} );
+         }
+         break;
+      case kind_t::variant: {
+         auto select = unpack<fc::unsigned_int>( ds );
+         EOS_ASSERT( select.value < n.alternatives.size(), chain::unpack_exception,
+                     "Unpacked invalid tag (${select}) for variant", ("select", select.value) );
+         const auto& alternative = n.alternatives[select.value];
+         c.open_array();
+         append_string( c, alternative.first, purged );
+         decode( nodes[alternative.second], ds, c, purged, depth + 1 );
+         c.close_array();
+         break;
+      }
+      case kind_t::structure:
+         c.open_document();
+         decode_fields( n, ds, c, purged, depth );
+         c.close_document();
+         break;
+   }
+}
+
+bsoncxx::stdx::optional<bsoncxx::document::value>
+abi_bson_encoder::encode( chain::action_name action, const chain::bytes& data, bool& purged ) const {
+   auto itr = actions.find( action );
+   if( itr == actions.end() ) return {};
+
+   fc::datastream<const char*> ds( data.data(), data.size() );
+   core c( false );
+   decode_fields( nodes[itr->second], ds, c, purged, 0 );
+   return c.extract_document();
+}
+
+} // namespace eosio
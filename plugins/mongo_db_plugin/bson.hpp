@@ -0,0 +1,77 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE
+ */
+#pragma once
+
+#include <eosio/chain/abi_serializer.hpp>
+
+#include <bsoncxx/builder/core.hpp>
+#include <bsoncxx/document/value.hpp>
+#include <bsoncxx/stdx/optional.hpp>
+
+namespace eosio {
+
+/**
+ * Appends `v` to `c` with the representation bsoncxx::from_json( fc::json::to_string( v ) ) would produce,
+ * i.e. integers above 32 bits and doubles as strings, without the JSON text round trip.
+ * Invalid UTF-8 in strings and keys is pruned and reported through `purged`.
+ */
+void append_bson( bsoncxx::builder::core& c, const fc::variant& v, bool& purged );
+
+/// @return document with the fields of `o`, see append_bson
+bsoncxx::document::value to_bson( const fc::variant_object& o, bool& purged );
+
+/// type of the eosio::setabi `abi` field in the cached system ABI, so that only that field is stored as abi_def
+/// instead of bytes; it is not a C++ identifier, so no contract ABI can define a type of the same name
+constexpr const char setabi_abi_type[] = "setabi.abi";
+
+/**
+ * Decoder of one account's action data compiled from its ABI once, when the ABI is cached.
+ * Walks packed action data and writes BSON directly, producing the same document as
+ * abi_serializer::binary_to_variant followed by append_bson.
+ */
+class abi_bson_encoder {
+public:
+   explicit abi_bson_encoder( const chain::abi_def& abi );
+
+   /// @return nothing if `action` has no struct type in the ABI, throws if `data` does not match it
+   bsoncxx::stdx::optional<bsoncxx::document::value> encode( chain::action_name action, const chain::bytes& data, bool& purged ) const;
+
+private:
+   enum class kind_t : uint8_t { builtin, array, optional, structure, variant };
+   enum class builtin_t : uint8_t { boolean, int8, uint8, int16, uint16, int32, uint32, int64, uint64, name, string, other };
+
+   using unpack_function = std::function<fc::variant( fc::datastream<const char*>& )>;
+
+   struct field {
+      std::string name;
+      uint32_t    type = 0;
+      bool        extension = false;
+   };
+
+   struct node {
+      kind_t                  kind = kind_t::builtin;
+      builtin_t               builtin = builtin_t::other;
+      const unpack_function*  unpack = nullptr;  ///< for builtin_t::other
+      uint32_t                element = 0;       ///< array and optional element
+      std::vector<field>      fields;            ///< structure, base fields first
+      std::vector<std::pair<std::string, uint32_t>> alternatives; ///< variant
+   };
+
+   uint32_t compile( const chain::type_name& type );
+   chain::type_name resolve( const chain::type_name& type ) const;
+
+   void decode( const node& n, fc::datastream<const char*>& ds, bsoncxx::builder::core& c, bool& purged, uint32_t depth ) const;
+   void decode_fields( const node& n, fc::datastream<const char*>& ds, bsoncxx::builder::core& c, bool& purged, uint32_t depth ) const;
+
+   std::map<chain::type_name, chain::type_name>    typedefs;
+   std::map<chain::type_name, chain::struct_def>   structs;
+   std::map<chain::type_name, chain::variant_def>  variants;
+   std::map<chain::type_name, unpack_function>     others;
+   std::map<chain::type_name, uint32_t>            compiled;
+   std::vector<node>                               nodes;
+   std::map<chain::action_name, uint32_t>          actions;
+};
+
+} // namespace eosio
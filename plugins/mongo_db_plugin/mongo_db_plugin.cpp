@@ -9,7 +9,10 @@
 #include <eosio/chain/transaction.hpp>
 #include <eosio/chain/types.hpp>
 
+#include "bson.hpp"
+
 #include <fc/io/json.hpp>
+#include <fc/scoped_exit.hpp>
 #include <fc/utf8.hpp>
 #include <fc/variant.hpp>
 
@@ -20,6 +23,8 @@
 #include <queue>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <future>
 
 #include <bsoncxx/builder/basic/kvp.hpp>
 #include <bsoncxx/builder/basic/document.hpp>
@@ -65,6 +70,71 @@ struct filter_entry {
    }
 };
 
+/// consumer side of a queue, which the consumers depending on it wait on
+struct consumer_progress {
+   std::atomic<uint64_t> processed{0};
+   std::atomic_bool      stopped{false}; ///< the consumer thread exited, on shutdown once drained or on failure
+};
+
+/**
+ * Bounded queue between the chain thread and a consumer thread; producers block while it is full.
+ * Every entry records how far the streams it depends on had been pushed when it was queued, so that
+ * the consumer can wait for those streams to be processed first.
+ */
+template<typename Entry>
+class bounded_queue {
+public:
+   struct item {
+      Entry                 entry;
+      std::vector<uint64_t> after;
+   };
+
+   void set_max_size( size_t s ) { max_size = s; }
+
+   /// @return time spent waiting for room
+   fc::microseconds push( const Entry& e, std::vector<uint64_t> after, const std::atomic_bool& done ) {
+      fc::microseconds waited;
+      std::unique_lock<std::mutex> lock( mtx );
+      if( items.size() >= max_size && !done && !progress.stopped ) {
+         auto start = fc::time_point::now();
+         not_full.wait( lock, [&]() { return items.size() < max_size || done || progress.stopped; } );
+         waited = fc::time_point::now() - start;
+      }
+      items.push_back( item{e, std::move( after )} );
+      ++pushed;
+      lock.unlock();
+      not_empty.notify_one();
+      return waited;
+   }
+
+   /// blocks until something is queued or done is set, then takes everything queued
+   std::deque<item> pop_all( const std::atomic_bool& done ) {
+      std::unique_lock<std::mutex> lock( mtx );
+      not_empty.wait( lock, [&]() { return !items.empty() || done; } );
+      std::deque<item> result = std::move( items );
+      items.clear();
+      lock.unlock();
+      not_full.notify_all();
+      return result;
+   }
+
+   void awaken() {
+      std::lock_guard<std::mutex> lock( mtx );
+      not_empty.notify_all();
+      not_full.notify_all();
+   }
+
+   std::atomic<uint64_t> pushed{0};
+   consumer_progress     progress;
+
+private:
+   size_t                  max_size = 1024;
+   std::deque<item>        items;
+   std::mutex              mtx;
+   std::condition_variable not_empty;
+   std::condition_variable not_full;
+};
+
 class mongo_db_plugin_impl {
 public:
    mongo_db_plugin_impl();
@@ -75,7 +145,17 @@ public:
    fc::optional<boost::signals2::scoped_connection> accepted_transaction_connection;
    fc::optional<boost::signals2::scoped_connection> applied_transaction_connection;
 
-   void consume_blocks();
+   using metadata_queue_t = bounded_queue<chain::transaction_metadata_ptr>;
+   using trace_queue_t = bounded_queue<chain::transaction_trace_ptr>;
+   using block_state_queue_t = bounded_queue<chain::block_state_ptr>;
+
+   template<typename Queue, typename Process>
+   void consume( Queue& queue, const std::vector<const consumer_progress*>& depends_on, const char* desc, Process process );
+   bool wait_until_processed( const std::vector<const consumer_progress*>& depends_on, const std::vector<uint64_t>& after );
+   std::vector<uint64_t> pushed_snapshot( const std::vector<const std::atomic<uint64_t>*>& pushed ) const;
+   void init_collections( mongocxx::client& client );
+   void reset_collections();
+   void start_consumers();
 
    void accepted_block( const chain::block_state_ptr& );
    void applied_irreversible_block(const chain::block_state_ptr&);
@@ -83,22 +163,28 @@ public:
    void applied_transaction(const chain::transaction_trace_ptr&);
    void process_accepted_transaction(const chain::transaction_metadata_ptr&);
    void _process_accepted_transaction(const chain::transaction_metadata_ptr&);
-   void process_applied_transaction(const chain::transaction_trace_ptr&);
-   void _process_applied_transaction(const chain::transaction_trace_ptr&);
+   void process_applied_transactions(const std::deque<trace_queue_t::item>&);
+   void _process_applied_transaction(const chain::transaction_trace_ptr&,
+                                     std::vector<bsoncxx::document::value>& action_trace_docs,
+                                     std::vector<bsoncxx::document::value>& trans_trace_docs);
+   void write_traces(std::vector<bsoncxx::document::value>& action_trace_docs,
+                     std::vector<bsoncxx::document::value>& trans_trace_docs);
    void process_accepted_block( const chain::block_state_ptr& );
    void _process_accepted_block( const chain::block_state_ptr& );
    void process_irreversible_block(const chain::block_state_ptr&);
    void _process_irreversible_block(const chain::block_state_ptr&);
 
    optional<abi_serializer> get_abi_serializer( account_name n );
+   std::shared_ptr<const abi_bson_encoder> get_abi_encoder( account_name n );
    template<typename T> fc::variant to_variant_with_abi( const T& obj );
 
    void purge_abi_cache();
 
-   bool add_action_trace( mongocxx::bulk_write& bulk_action_traces, const chain::action_trace& atrace,
+   bool add_action_trace( std::vector<bsoncxx::document::value>& action_trace_docs, const chain::action_trace& atrace,
                           const chain::transaction_trace_ptr& t,
                           bool executed, const std::chrono::milliseconds& now,
                           bool& write_ttrace );
+   void append_action( bsoncxx::builder::core& c, const chain::action& act, bool& purged );
 
    void update_account(const chain::action& act);
 
@@ -118,7 +204,8 @@ public:
    void init();
    void wipe_database();
 
-   template<typename Queue, typename Entry> void queue(Queue& queue, const Entry& e);
+   template<typename Queue, typename Entry>
+   void queue(Queue& queue, const Entry& e, const std::vector<const std::atomic<uint64_t>*>& depends_on_pushed);
 
    bool configured{false};
    bool wipe_database_on_startup{false};
@@ -140,30 +227,28 @@ public:
    mongocxx::instance mongo_inst;
    fc::optional<mongocxx::pool> mongo_pool;
 
-   // consum thread
-   mongocxx::collection _accounts;
-   mongocxx::collection _trans;
-   mongocxx::collection _trans_traces;
-   mongocxx::collection _action_traces;
-   mongocxx::collection _block_states;
-   mongocxx::collection _blocks;
-   mongocxx::collection _pub_keys;
-   mongocxx::collection _account_controls;
+   // collections of the calling consumer thread, each consumer thread holds its own client
+   static thread_local mongocxx::collection _accounts;
+   static thread_local mongocxx::collection _trans;
+   static thread_local mongocxx::collection _trans_traces;
+   static thread_local mongocxx::collection _action_traces;
+   static thread_local mongocxx::collection _block_states;
+   static thread_local mongocxx::collection _blocks;
+   static thread_local mongocxx::collection _pub_keys;
+   static thread_local mongocxx::collection _account_controls;
 
    size_t max_queue_size = 0;
-   int queue_sleep_time = 0;
    size_t abi_cache_size = 0;
-   std::deque<chain::transaction_metadata_ptr> transaction_metadata_queue;
-   std::deque<chain::transaction_metadata_ptr> transaction_metadata_process_queue;
-   std::deque<chain::transaction_trace_ptr> transaction_trace_queue;
-   std::deque<chain::transaction_trace_ptr> transaction_trace_process_queue;
-   std::deque<chain::block_state_ptr> block_state_queue;
-   std::deque<chain::block_state_ptr> block_state_process_queue;
-   std::deque<chain::block_state_ptr> irreversible_block_state_queue;
-   std::deque<chain::block_state_ptr> irreversible_block_state_process_queue;
-   std::mutex mtx;
-   std::condition_variable condition;
-   std::thread consume_thread;
+   uint32_t transaction_consumers = 1;
+   // accepted transactions are sharded by id over the transaction consumers so updates of one trx stay ordered
+   std::vector<std::unique_ptr<metadata_queue_t>> transaction_metadata_queues;
+   trace_queue_t transaction_trace_queue;
+   block_state_queue_t block_state_queue;
+   block_state_queue_t irreversible_block_state_queue;
+   std::mutex progress_mtx;
+   std::condition_variable progress_condition;
+   std::vector<std::thread> consume_threads;
+   std::mutex abi_cache_mtx;
    std::atomic_bool done{false};
    std::atomic_bool startup{true};
    fc::optional<chain::chain_id_type> chain_id;
@@ -176,6 +261,7 @@ public:
       account_name                     account;
       fc::time_point                   last_accessed;
       fc::optional<abi_serializer>     serializer;
+      std::shared_ptr<const abi_bson_encoder> encoder;
    };
 
    typedef boost::multi_index_container<abi_cache,
@@ -187,6 +273,9 @@ public:
 
    abi_cache_index_t abi_cache_index;
 
+   /// loads the entry of `n` on a miss, abi_cache_mtx must be held
+   const abi_cache* find_abi_cache_entry( account_name n );
+
    static const action_name newaccount;
    static const action_name setabi;
    static const action_name updateauth;
@@ -204,6 +293,15 @@ public:
    static const std::string account_controls_col;
 };
 
+thread_local mongocxx::collection mongo_db_plugin_impl::_accounts;
+thread_local mongocxx::collection mongo_db_plugin_impl::_trans;
+thread_local mongocxx::collection mongo_db_plugin_impl::_trans_traces;
+thread_local mongocxx::collection mongo_db_plugin_impl::_action_traces;
+thread_local mongocxx::collection mongo_db_plugin_impl::_block_states;
+thread_local mongocxx::collection mongo_db_plugin_impl::_blocks;
+thread_local mongocxx::collection mongo_db_plugin_impl::_pub_keys;
+thread_local mongocxx::collection mongo_db_plugin_impl::_account_controls;
+
 const action_name mongo_db_plugin_impl::newaccount = chain::newaccount::get_name();
 const action_name mongo_db_plugin_impl::setabi = chain::setabi::get_name();
 const action_name mongo_db_plugin_impl::updateauth = chain::updateauth::get_name();
@@ -288,30 +386,24 @@ bool mongo_db_plugin_impl::filter_include( const transaction& trx ) const
 
 
 template<typename Queue, typename Entry>
-void mongo_db_plugin_impl::queue( Queue& queue, const Entry& e ) {
-   std::unique_lock<std::mutex> lock( mtx );
-   auto queue_size = queue.size();
-   if( queue_size > max_queue_size ) {
-      lock.unlock();
-      condition.notify_one();
-      queue_sleep_time += 10;
-      if( queue_sleep_time > 1000 )
-         wlog("queue size: ${q}", ("q", queue_size));
-      std::this_thread::sleep_for( std::chrono::milliseconds( queue_sleep_time ));
-      lock.lock();
-   } else {
-      queue_sleep_time -= 10;
-      if( queue_sleep_time < 0 ) queue_sleep_time = 0;
-   }
-   queue.emplace_back( e );
-   lock.unlock();
-   condition.notify_one();
+void mongo_db_plugin_impl::queue( Queue& queue, const Entry& e, const std::vector<const std::atomic<uint64_t>*>& depends_on_pushed ) {
+   auto waited = queue.push( e, pushed_snapshot( depends_on_pushed ), done );
+   if( waited > fc::microseconds( 500000 ) ) // reduce logging, .5 secs
+      wlog( "mongo_db_plugin queue full, waited ${t}", ("t", waited) );
+}
+
+std::vector<uint64_t> mongo_db_plugin_impl::pushed_snapshot( const std::vector<const std::atomic<uint64_t>*>& pushed ) const {
+   std::vector<uint64_t> result;
+   result.reserve( pushed.size() );
+   for( const auto* p : pushed ) result.push_back( *p );
+   return result;
 }
 
 void mongo_db_plugin_impl::accepted_transaction( const chain::transaction_metadata_ptr& t ) {
    try {
       if( store_transactions ) {
-         queue( transaction_metadata_queue, t );
+         auto& q = *transaction_metadata_queues[std::hash<transaction_id_type>()( t->id ) % transaction_metadata_queues.size()];
+         queue( q, t, {&transaction_trace_queue.pushed} );
       }
    } catch (fc::exception& e) {
       elog("FC Exception while accepted_transaction ${e}", ("e", e.to_string()));
@@ -347,7 +439,7 @@ void mongo_db_plugin_impl::applied_transaction( const chain::transaction_trace_p
       if( !is_producer && !t->producer_block_id.valid() )
          return;
       // always queue since account information always gathered
-      queue( transaction_trace_queue, t );
+      queue( transaction_trace_queue, t, {} );
    } catch (fc::exception& e) {
       elog("FC Exception while applied_transaction ${e}", ("e", e.to_string()));
    } catch (std::exception& e) {
@@ -360,7 +452,9 @@ void mongo_db_plugin_impl::applied_transaction( const chain::transaction_trace_p
 void mongo_db_plugin_impl::applied_irreversible_block( const chain::block_state_ptr& bs ) {
    try {
       if( store_blocks || store_block_states || store_transactions ) {
-         queue( irreversible_block_state_queue, bs );
+         std::vector<const std::atomic<uint64_t>*> depends_on{&transaction_trace_queue.pushed, &block_state_queue.pushed};
+         for( const auto& q : transaction_metadata_queues ) depends_on.push_back( &q->pushed );
+         queue( irreversible_block_state_queue, bs, depends_on );
       }
    } catch (fc::exception& e) {
       elog("FC Exception while applied_irreversible_block ${e}", ("e", e.to_string()));
@@ -379,7 +473,7 @@ void mongo_db_plugin_impl::accepted_block( const chain::block_state_ptr& bs ) {
          }
       }
       if( store_blocks || store_block_states ) {
-         queue( block_state_queue, bs );
+         queue( block_state_queue, bs, {&transaction_trace_queue.pushed} );
       }
    } catch (fc::exception& e) {
       elog("FC Exception while accepted_block ${e}", ("e", e.to_string()));
@@ -390,125 +484,137 @@ void mongo_db_plugin_impl::accepted_block( const chain::block_state_ptr& bs ) {
    }
 }
 
-void mongo_db_plugin_impl::consume_blocks() {
+void mongo_db_plugin_impl::init_collections( mongocxx::client& client ) {
+   _accounts = client[db_name][accounts_col];
+   _trans = client[db_name][trans_col];
+   _trans_traces = client[db_name][trans_traces_col];
+   _action_traces = client[db_name][action_traces_col];
+   _blocks = client[db_name][blocks_col];
+   _block_states = client[db_name][block_states_col];
+   _pub_keys = client[db_name][pub_keys_col];
+   _account_controls = client[db_name][account_controls_col];
+}
+
+void mongo_db_plugin_impl::reset_collections() {
+   // collections must not outlive the client they were created from
+   _accounts = mongocxx::collection{};
+   _trans = mongocxx::collection{};
+   _trans_traces = mongocxx::collection{};
+   _action_traces = mongocxx::collection{};
+   _blocks = mongocxx::collection{};
+   _block_states = mongocxx::collection{};
+   _pub_keys = mongocxx::collection{};
+   _account_controls = mongocxx::collection{};
+}
+
+/// @return false if a consumer depended on stopped before processing up to `after`, which would never happen
+bool mongo_db_plugin_impl::wait_until_processed( const std::vector<const consumer_progress*>& depends_on,
+                                                 const std::vector<uint64_t>& after ) {
+   bool gave_up = false;
+   std::unique_lock<std::mutex> lock( progress_mtx );
+   progress_condition.wait( lock, [&]() {
+      for( size_t i = 0; i < depends_on.size(); ++i ) {
+         if( depends_on[i]->processed >= after[i] ) continue;
+         // a consumer stops once done and drained, or when it fails; either way it makes no more progress
+         gave_up = depends_on[i]->stopped;
+         return gave_up;
+      }
+      return true;
+   } );
+   return !gave_up;
+}
+
+template<typename Queue, typename Process>
+void mongo_db_plugin_impl::consume( Queue& queue, const std::vector<const consumer_progress*>& depends_on,
+                                    const char* desc, Process process ) {
+   auto stop = fc::make_scoped_exit( [&]() {
+      {
+         std::lock_guard<std::mutex> lock( progress_mtx );
+         queue.progress.stopped = true;
+      }
+      progress_condition.notify_all();
+      queue.awaken(); // nothing pops the queue anymore
+      if( !done ) {
+         // a consumer failed, the database would be missing everything from here on
+         app().quit();
+      }
+   } );
    try {
       auto mongo_client = mongo_pool->acquire();
-      auto& mongo_conn = *mongo_client;
-
-      _accounts = mongo_conn[db_name][accounts_col];
-      _trans = mongo_conn[db_name][trans_col];
-      _trans_traces = mongo_conn[db_name][trans_traces_col];
-      _action_traces = mongo_conn[db_name][action_traces_col];
-      _blocks = mongo_conn[db_name][blocks_col];
-      _block_states = mongo_conn[db_name][block_states_col];
-      _pub_keys = mongo_conn[db_name][pub_keys_col];
-      _account_controls = mongo_conn[db_name][account_controls_col];
-
-      while (true) {
-         std::unique_lock<std::mutex> lock(mtx);
-         while ( transaction_metadata_queue.empty() &&
-                 transaction_trace_queue.empty() &&
-                 block_state_queue.empty() &&
-                 irreversible_block_state_queue.empty() &&
-                 !done ) {
-            condition.wait(lock);
-         }
+      init_collections( *mongo_client );
 
-         // capture for processing
-         size_t transaction_metadata_size = transaction_metadata_queue.size();
-         if (transaction_metadata_size > 0) {
-            transaction_metadata_process_queue = move(transaction_metadata_queue);
-            transaction_metadata_queue.clear();
-         }
-         size_t transaction_trace_size = transaction_trace_queue.size();
-         if (transaction_trace_size > 0) {
-            transaction_trace_process_queue = move(transaction_trace_queue);
-            transaction_trace_queue.clear();
-         }
-         size_t block_state_size = block_state_queue.size();
-         if (block_state_size > 0) {
-            block_state_process_queue = move(block_state_queue);
-            block_state_queue.clear();
-         }
-         size_t irreversible_block_size = irreversible_block_state_queue.size();
-         if (irreversible_block_size > 0) {
-            irreversible_block_state_process_queue = move(irreversible_block_state_queue);
-            irreversible_block_state_queue.clear();
+      while( true ) {
+         auto items = queue.pop_all( done );
+         if( items.empty() ) {
+            if( done ) break;
+            continue;
          }
 
-         lock.unlock();
+         if( done ) {
+            ilog( "draining ${d} queue, size: ${q}", ("d", desc)("q", items.size()) );
+         }
 
-         if (done) {
-            ilog("draining queue, size: ${q}", ("q", transaction_metadata_size + transaction_trace_size + block_state_size + irreversible_block_size));
+         // snapshots are monotonic, so the last entry carries the strictest requirement
+         if( !wait_until_processed( depends_on, items.back().after ) ) {
+            elog( "${d} dropping ${q} entries, a consumer they depend on stopped", ("d", desc)("q", items.size()) );
+            break;
          }
 
-         // process transactions
          auto start_time = fc::time_point::now();
-         auto size = transaction_trace_process_queue.size();
-         while (!transaction_trace_process_queue.empty()) {
-            const auto& t = transaction_trace_process_queue.front();
-            process_applied_transaction(t);
-            transaction_trace_process_queue.pop_front();
-         }
+         auto size = items.size();
+         process( items );
          auto time = fc::time_point::now() - start_time;
-         auto per = size > 0 ? time.count()/size : 0;
-         if( time > fc::microseconds(500000) ) // reduce logging, .5 secs
-            ilog( "process_applied_transaction,  time per: ${p}, size: ${s}, time: ${t}", ("s", size)("t", time)("p", per) );
-
-         start_time = fc::time_point::now();
-         size = transaction_metadata_process_queue.size();
-         while (!transaction_metadata_process_queue.empty()) {
-            const auto& t = transaction_metadata_process_queue.front();
-            process_accepted_transaction(t);
-            transaction_metadata_process_queue.pop_front();
-         }
-         time = fc::time_point::now() - start_time;
-         per = size > 0 ? time.count()/size : 0;
-         if( time > fc::microseconds(500000) ) // reduce logging, .5 secs
-            ilog( "process_accepted_transaction, time per: ${p}, size: ${s}, time: ${t}", ("s", size)( "t", time )( "p", per ));
-
-         // process blocks
-         start_time = fc::time_point::now();
-         size = block_state_process_queue.size();
-         while (!block_state_process_queue.empty()) {
-            const auto& bs = block_state_process_queue.front();
-            process_accepted_block( bs );
-            block_state_process_queue.pop_front();
-         }
-         time = fc::time_point::now() - start_time;
-         per = size > 0 ? time.count()/size : 0;
-         if( time > fc::microseconds(500000) ) // reduce logging, .5 secs
-            ilog( "process_accepted_block,       time per: ${p}, size: ${s}, time: ${t}", ("s", size)("t", time)("p", per) );
-
-         // process irreversible blocks
-         start_time = fc::time_point::now();
-         size = irreversible_block_state_process_queue.size();
-         while (!irreversible_block_state_process_queue.empty()) {
-            const auto& bs = irreversible_block_state_process_queue.front();
-            process_irreversible_block(bs);
-            irreversible_block_state_process_queue.pop_front();
-         }
-         time = fc::time_point::now() - start_time;
-         per = size > 0 ? time.count()/size : 0;
-         if( time > fc::microseconds(500000) ) // reduce logging, .5 secs
-            ilog( "process_irreversible_block,   time per: ${p}, size: ${s}, time: ${t}", ("s", size)("t", time)("p", per) );
-
-         if( transaction_metadata_size == 0 &&
-             transaction_trace_size == 0 &&
-             block_state_size == 0 &&
-             irreversible_block_size == 0 &&
-             done ) {
-            break;
+         auto per = time.count() / size;
+         if( time > fc::microseconds( 500000 ) ) // reduce logging, .5 secs
+            ilog( "${d}, time per: ${p}, size: ${s}, time: ${t}", ("d", desc)("s", size)("t", time)("p", per) );
+
+         {
+            std::lock_guard<std::mutex> lock( progress_mtx );
+            queue.progress.processed += size;
          }
+         progress_condition.notify_all();
       }
-      ilog("mongo_db_plugin consume thread shutdown gracefully");
+
+      reset_collections();
+      ilog( "mongo_db_plugin ${d} thread shutdown gracefully", ("d", desc) );
    } catch (fc::exception& e) {
-      elog("FC Exception while consuming block ${e}", ("e", e.to_string()));
+      elog("FC Exception while consuming ${d} ${e}", ("d", desc)("e", e.to_string()));
    } catch (std::exception& e) {
-      elog("STD Exception while consuming block ${e}", ("e", e.what()));
+      elog("STD Exception while consuming ${d} ${e}", ("d", desc)("e", e.what()));
    } catch (...) {
-      elog("Unknown exception while consuming block");
+      elog("Unknown exception while consuming ${d}", ("d", desc));
+   }
+}
+
+void mongo_db_plugin_impl::start_consumers() {
+   consume_threads.emplace_back( [this] {
+      consume( transaction_trace_queue, {}, "process_applied_transaction", [this]( const auto& items ) {
+         process_applied_transactions( items );
+      } );
+   } );
+
+   for( auto& q : transaction_metadata_queues ) {
+      auto* queue = q.get();
+      consume_threads.emplace_back( [this, queue] {
+         consume( *queue, {&transaction_trace_queue.progress}, "process_accepted_transaction", [this]( const auto& items ) {
+            for( const auto& i : items ) process_accepted_transaction( i.entry );
+         } );
+      } );
    }
+
+   consume_threads.emplace_back( [this] {
+      consume( block_state_queue, {&transaction_trace_queue.progress}, "process_accepted_block", [this]( const auto& items ) {
+         for( const auto& i : items ) process_accepted_block( i.entry );
+      } );
+   } );
+
+   std::vector<const consumer_progress*> irreversible_depends_on{&transaction_trace_queue.progress, &block_state_queue.progress};
+   for( const auto& q : transaction_metadata_queues ) irreversible_depends_on.push_back( &q->progress );
+   consume_threads.emplace_back( [this, irreversible_depends_on] {
+      consume( irreversible_block_state_queue, irreversible_depends_on, "process_irreversible_block", [this]( const auto& items ) {
+         for( const auto& i : items ) process_irreversible_block( i.entry );
+      } );
+   } );
 }
 
 namespace {
@@ -591,19 +697,18 @@ void mongo_db_plugin_impl::purge_abi_cache() {
    }
 }
 
-optional<abi_serializer> mongo_db_plugin_impl::get_abi_serializer( account_name n ) {
+const mongo_db_plugin_impl::abi_cache* mongo_db_plugin_impl::find_abi_cache_entry( account_name n ) {
    using bsoncxx::builder::basic::kvp;
    using bsoncxx::builder::basic::make_document;
    if( n.good()) {
       try {
-
          auto itr = abi_cache_index.find( n );
          if( itr != abi_cache_index.end() ) {
             abi_cache_index.modify( itr, []( auto& entry ) {
                entry.last_accessed = fc::time_point::now();
             });
 
-            return itr->serializer;
+            return &*itr;
          }
 
          auto account = _accounts.find_one( make_document( kvp("name", n.to_string())) );
@@ -615,7 +720,7 @@ optional<abi_serializer> mongo_db_plugin_impl::get_abi_serializer( account_name
                   abi = fc::json::from_string( bsoncxx::to_json( view["abi"].get_document())).as<abi_def>();
                } catch (...) {
                   ilog( "Unable to convert account abi to abi_def for ${n}", ( "n", n ));
-                  return optional<abi_serializer>();
+                  return nullptr;
                }
 
                purge_abi_cache(); // make room if necessary
@@ -633,9 +738,9 @@ optional<abi_serializer> mongo_db_plugin_impl::get_abi_serializer( account_name
                                                []( const auto& f ) { return f.name == "abi"; } );
                      if( itr2 != itr->fields.end() ) {
                         if( itr2->type == "bytes" ) {
-                           itr2->type = "abi_def";
+                           itr2->type = setabi_abi_type;
                            // unpack setabi.abi as abi_def instead of as bytes
-                           abis.add_specialized_unpack_pack( "abi_def",
+                           abis.add_specialized_unpack_pack( setabi_abi_type,
                                  std::make_pair<abi_serializer::unpack_function, abi_serializer::pack_function>(
                                        []( fc::datastream<const char*>& stream, bool is_array, bool is_optional ) -> fc::variant {
                                           EOS_ASSERT( !is_array && !is_optional, chain::mongo_db_exception, "unexpected abi_def");
@@ -665,13 +770,26 @@ optional<abi_serializer> mongo_db_plugin_impl::get_abi_serializer( account_name
                }
                abis.set_abi( abi, abi_serializer_max_time );
                entry.serializer.emplace( std::move( abis ) );
-               abi_cache_index.insert( entry );
-               return entry.serializer;
+               entry.encoder = std::make_shared<const abi_bson_encoder>( abi );
+               return &*abi_cache_index.insert( std::move( entry ) ).first;
             }
          }
       } FC_CAPTURE_AND_LOG((n))
    }
-   return optional<abi_serializer>();
+   return nullptr;
+}
+
+optional<abi_serializer> mongo_db_plugin_impl::get_abi_serializer( account_name n ) {
+   std::lock_guard<std::mutex> lock( abi_cache_mtx ); // shared by all consumer threads
+   const auto* entry = find_abi_cache_entry( n );
+   return entry ? entry->serializer : optional<abi_serializer>();
+}
+
+std::shared_ptr<const abi_bson_encoder> mongo_db_plugin_impl::get_abi_encoder( account_name n ) {
+   // only the shared_ptr is copied, unlike get_abi_serializer which copies the whole serializer
+   std::lock_guard<std::mutex> lock( abi_cache_mtx );
+   const auto* entry = find_abi_cache_entry( n );
+   return entry ? entry->encoder : std::shared_ptr<const abi_bson_encoder>();
 }
 
 template<typename T>
@@ -697,17 +815,29 @@ void mongo_db_plugin_impl::process_accepted_transaction( const chain::transactio
    }
 }
 
-void mongo_db_plugin_impl::process_applied_transaction( const chain::transaction_trace_ptr& t ) {
-   try {
-      // always call since we need to capture setabi on accounts even if not storing transaction traces
-      _process_applied_transaction( t );
-   } catch (fc::exception& e) {
-      elog("FC Exception while processing applied transaction trace: ${e}", ("e", e.to_detail_string()));
-   } catch (std::exception& e) {
-      elog("STD Exception while processing applied transaction trace: ${e}", ("e", e.what()));
-   } catch (...) {
-      elog("Unknown exception while processing applied transaction trace");
+void mongo_db_plugin_impl::process_applied_transactions( const std::deque<trace_queue_t::item>& items ) {
+   std::vector<bsoncxx::document::value> action_trace_docs;
+   std::vector<bsoncxx::document::value> trans_trace_docs;
+   const auto start = fc::time_point::now();
+   for( const auto& i : items ) {
+      try {
+         // always call since we need to capture setabi on accounts even if not storing transaction traces
+         _process_applied_transaction( i.entry, action_trace_docs, trans_trace_docs );
+      } catch (fc::exception& e) {
+         elog("FC Exception while processing applied transaction trace: ${e}", ("e", e.to_detail_string()));
+      } catch (std::exception& e) {
+         elog("STD Exception while processing applied transaction trace: ${e}", ("e", e.what()));
+      } catch (...) {
+         elog("Unknown exception while processing applied transaction trace");
+      }
+   }
+   const auto encoded = fc::time_point::now() - start;
+   if( encoded > fc::milliseconds( 500 ) ) {
+      const auto docs = action_trace_docs.size() + trans_trace_docs.size();
+      ilog( "encoded ${n} trace documents in ${t}ms, ${r} documents/sec",
+            ("n", docs)("t", encoded.count() / 1000)("r", docs * 1000000 / encoded.count()) );
    }
+   write_traces( action_trace_docs, trans_trace_docs );
 }
 
 void mongo_db_plugin_impl::process_irreversible_block(const chain::block_state_ptr& bs) {
@@ -760,21 +890,11 @@ void mongo_db_plugin_impl::_process_accepted_transaction( const chain::transacti
    trans_doc.append( kvp( "trx_id", trx_id_str ) );
 
    auto v = to_variant_with_abi( trx );
-   string trx_json = fc::json::to_string( v );
-
-   try {
-      const auto& trx_value = bsoncxx::from_json( trx_json );
-      trans_doc.append( bsoncxx::builder::concatenate_doc{trx_value.view()} );
-   } catch( bsoncxx::exception& ) {
-      try {
-         trx_json = fc::prune_invalid_utf8( trx_json );
-         const auto& trx_value = bsoncxx::from_json( trx_json );
-         trans_doc.append( bsoncxx::builder::concatenate_doc{trx_value.view()} );
-         trans_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
-      } catch( bsoncxx::exception& e ) {
-         elog( "Unable to convert transaction JSON to MongoDB JSON: ${e}", ("e", e.what()) );
-         elog( "  JSON: ${j}", ("j", trx_json) );
-      }
+   bool purged = false;
+   const auto& trx_value = to_bson( v.get_object(), purged );
+   trans_doc.append( bsoncxx::builder::concatenate_doc{trx_value.view()} );
+   if( purged ) {
+      trans_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
    }
 
    string signing_keys_json;
@@ -819,7 +939,7 @@ void mongo_db_plugin_impl::_process_accepted_transaction( const chain::transacti
 }
 
 bool
-mongo_db_plugin_impl::add_action_trace( mongocxx::bulk_write& bulk_action_traces, const chain::action_trace& atrace,
+mongo_db_plugin_impl::add_action_trace( std::vector<bsoncxx::document::value>& action_trace_docs, const chain::action_trace& atrace,
                                         const chain::transaction_trace_ptr& t,
                                         bool executed, const std::chrono::milliseconds& now,
                                         bool& write_ttrace )
@@ -842,41 +962,82 @@ mongo_db_plugin_impl::add_action_trace( mongocxx::bulk_write& bulk_action_traces
       // improve data distributivity when using mongodb sharding
       action_traces_doc.append( kvp( "_id", make_custom_oid() ) );
 
-      auto v = to_variant_with_abi( base );
-      string json = fc::json::to_string( v );
-      try {
-         const auto& value = bsoncxx::from_json( json );
-         action_traces_doc.append( bsoncxx::builder::concatenate_doc{value.view()} );
-      } catch( bsoncxx::exception& ) {
-         try {
-            json = fc::prune_invalid_utf8( json );
-            const auto& value = bsoncxx::from_json( json );
-            action_traces_doc.append( bsoncxx::builder::concatenate_doc{value.view()} );
-            action_traces_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
-         } catch( bsoncxx::exception& e ) {
-            elog( "Unable to convert action trace JSON to MongoDB JSON: ${e}", ("e", e.what()) );
-            elog( "  JSON: ${j}", ("j", json) );
+      // only the action data needs the abi, it is encoded straight from its packed form
+      const fc::variant v( base );
+      bool purged = false;
+      bsoncxx::builder::core c( false );
+      for( const auto& e : v.get_object() ) {
+         c.key_owned( e.key() );
+         if( e.key() == "act" ) {
+            append_action( c, base.act, purged );
+         } else {
+            append_bson( c, e.value(), purged );
          }
       }
+      action_traces_doc.append( bsoncxx::builder::concatenate_doc{c.view_document()} );
+      if( purged ) {
+         action_traces_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
+      }
       if( t->receipt.valid() ) {
          action_traces_doc.append( kvp( "trx_status", std::string( t->receipt->status ) ) );
       }
       action_traces_doc.append( kvp( "createdAt", b_date{now} ) );
 
-      mongocxx::model::insert_one insert_op{action_traces_doc.view()};
-      bulk_action_traces.append( insert_op );
+      action_trace_docs.emplace_back( action_traces_doc.extract() );
       added = true;
    }
 
    for( const auto& iline_atrace : atrace.inline_traces ) {
-      added |= add_action_trace( bulk_action_traces, iline_atrace, t, executed, now, write_ttrace );
+      added |= add_action_trace( action_trace_docs, iline_atrace, t, executed, now, write_ttrace );
    }
 
    return added;
 }
 
+void mongo_db_plugin_impl::append_action( bsoncxx::builder::core& c, const chain::action& act, bool& purged ) {
+   // same fields as abi_serializer::to_variant of an action
+   c.open_document();
+   c.key_view( "account" );
+   append_bson( c, fc::variant( act.account ), purged );
+   c.key_view( "name" );
+   append_bson( c, fc::variant( act.name ), purged );
+   c.key_view( "authorization" );
+   append_bson( c, fc::variant( act.authorization ), purged );
+
+   bool decoded = false;
+   try {
+      if( auto encoder = get_abi_encoder( act.account ) ) {
+         bool data_purged = false;
+         auto data = encoder->encode( act.name, act.data, data_purged );
+         if( data ) {
+            c.key_view( "data" );
+            c.append( bsoncxx::types::b_document{data->view()} );
+            purged |= data_purged;
+            decoded = true;
+         } else {
+            // action type is not a struct, rare enough to go through abi_serializer
+            auto abi = get_abi_serializer( act.account );
+            auto type = abi ? abi->get_action_type( act.name ) : chain::type_name();
+            if( !type.empty() ) {
+               auto value = abi->binary_to_variant( type, act.data, abi_serializer_max_time, true );
+               c.key_view( "data" );
+               append_bson( c, value, purged );
+               decoded = true;
+            }
+         }
+      }
+   } catch( ... ) {
+      // like abi_serializer, fall back to the raw data when it does not match the abi
+   }
+
+   c.key_view( decoded ? "hex_data" : "data" );
+   append_bson( c, fc::variant( act.data ), purged );
+   c.close_document();
+}
 
-void mongo_db_plugin_impl::_process_applied_transaction( const chain::transaction_trace_ptr& t ) {
+void mongo_db_plugin_impl::_process_applied_transaction( const chain::transaction_trace_ptr& t,
+                                                         std::vector<bsoncxx::document::value>& action_trace_docs,
+                                                         std::vector<bsoncxx::document::value>& trans_trace_docs ) {
    using namespace bsoncxx::types;
    using bsoncxx::builder::basic::kvp;
 
@@ -885,16 +1046,12 @@ void mongo_db_plugin_impl::_process_applied_transaction( const chain::transactio
    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
          std::chrono::microseconds{fc::time_point::now().time_since_epoch().count()});
 
-   mongocxx::options::bulk_write bulk_opts;
-   bulk_opts.ordered(false);
-   mongocxx::bulk_write bulk_action_traces = _action_traces.create_bulk_write(bulk_opts);
-   bool write_atraces = false;
    bool write_ttrace = false; // filters apply to transaction_traces as well
    bool executed = t->receipt.valid() && t->receipt->status == chain::transaction_receipt_header::executed;
 
    for( const auto& atrace : t->action_traces ) {
       try {
-         write_atraces |= add_action_trace( bulk_action_traces, atrace, t, executed, now, write_ttrace );
+         add_action_trace( action_trace_docs, atrace, t, executed, now, write_ttrace );
       } catch(...) {
          handle_mongo_exception("add action traces", __LINE__);
       }
@@ -907,47 +1064,61 @@ void mongo_db_plugin_impl::_process_applied_transaction( const chain::transactio
    if( store_transaction_traces && write_ttrace ) {
       try {
          auto v = to_variant_with_abi( *t );
-         string json = fc::json::to_string( v );
-         try {
-            const auto& value = bsoncxx::from_json( json );
-            trans_traces_doc.append( bsoncxx::builder::concatenate_doc{value.view()} );
-         } catch( bsoncxx::exception& ) {
-            try {
-               json = fc::prune_invalid_utf8( json );
-               const auto& value = bsoncxx::from_json( json );
-               trans_traces_doc.append( bsoncxx::builder::concatenate_doc{value.view()} );
-               trans_traces_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
-            } catch( bsoncxx::exception& e ) {
-               elog( "Unable to convert transaction JSON to MongoDB JSON: ${e}", ("e", e.what()) );
-               elog( "  JSON: ${j}", ("j", json) );
-            }
+         bool purged = false;
+         const auto& value = to_bson( v.get_object(), purged );
+         trans_traces_doc.append( bsoncxx::builder::concatenate_doc{value.view()} );
+         if( purged ) {
+            trans_traces_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
          }
          trans_traces_doc.append( kvp( "createdAt", b_date{now} ) );
+         trans_trace_docs.emplace_back( trans_traces_doc.extract() );
+      } catch( ... ) {
+         handle_mongo_exception( "trans_traces serialization: " + t->id.str(), __LINE__ );
+      }
+   }
+}
+
+namespace {
 
+void insert_unordered( mongocxx::collection& collection, const std::vector<bsoncxx::document::value>& docs, const char* desc ) {
+   mongocxx::options::bulk_write bulk_opts;
+   bulk_opts.ordered( false );
+   auto bulk = collection.create_bulk_write( bulk_opts );
+   for( const auto& doc : docs ) {
+      bulk.append( mongocxx::model::insert_one{doc.view()} );
+   }
+   if( !bulk.execute() ) {
+      EOS_ASSERT( false, chain::mongo_db_insert_fail, "Bulk ${d} insert failed", ("d", desc) );
+   }
+}
+
+} // anonymous namespace
+
+void mongo_db_plugin_impl::write_traces( std::vector<bsoncxx::document::value>& action_trace_docs,
+                                         std::vector<bsoncxx::document::value>& trans_trace_docs ) {
+   // the two collections are independent, write action traces on a second client concurrently
+   std::future<void> action_traces_written;
+   if( !action_trace_docs.empty() ) {
+      action_traces_written = std::async( std::launch::async, [this, &action_trace_docs]() {
          try {
-            if( !_trans_traces.insert_one( trans_traces_doc.view() ) ) {
-               EOS_ASSERT( false, chain::mongo_db_insert_fail, "Failed to insert trans ${id}", ("id", t->id) );
-            }
+            auto client = mongo_pool->acquire();
+            auto action_traces = (*client)[db_name][action_traces_col];
+            insert_unordered( action_traces, action_trace_docs, "action traces" );
          } catch( ... ) {
-            handle_mongo_exception( "trans_traces insert: " + json, __LINE__ );
+            handle_mongo_exception( "action traces insert", __LINE__ );
          }
-      } catch( ... ) {
-         handle_mongo_exception( "trans_traces serialization: " + t->id.str(), __LINE__ );
-      }
+      } );
    }
 
-   // insert action_traces
-   if( write_atraces ) {
+   if( !trans_trace_docs.empty() ) {
       try {
-         if( !bulk_action_traces.execute() ) {
-            EOS_ASSERT( false, chain::mongo_db_insert_fail,
-                        "Bulk action traces insert failed for transaction trace: ${id}", ("id", t->id) );
-         }
+         insert_unordered( _trans_traces, trans_trace_docs, "trans_traces" );
       } catch( ... ) {
-         handle_mongo_exception( "action traces insert", __LINE__ );
+         handle_mongo_exception( "trans_traces insert", __LINE__ );
       }
    }
 
+   if( action_traces_written.valid() ) action_traces_written.get();
 }
 
 void mongo_db_plugin_impl::_process_accepted_block( const chain::block_state_ptr& bs ) {
@@ -976,20 +1147,11 @@ void mongo_db_plugin_impl::_process_accepted_block( const chain::block_state_ptr
 
       const chain::block_header_state& bhs = *bs;
 
-      auto json = fc::json::to_string( bhs );
-      try {
-         const auto& value = bsoncxx::from_json( json );
-         block_state_doc.append( kvp( "block_header_state", value ) );
-      } catch( bsoncxx::exception& ) {
-         try {
-            json = fc::prune_invalid_utf8( json );
-            const auto& value = bsoncxx::from_json( json );
-            block_state_doc.append( kvp( "block_header_state", value ) );
-            block_state_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
-         } catch( bsoncxx::exception& e ) {
-            elog( "Unable to convert block_header_state JSON to MongoDB JSON: ${e}", ("e", e.what()) );
-            elog( "  JSON: ${j}", ("j", json) );
-         }
+      bool purged = false;
+      const auto& value = to_bson( fc::variant( bhs ).get_object(), purged );
+      block_state_doc.append( kvp( "block_header_state", value ) );
+      if( purged ) {
+         block_state_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
       }
       block_state_doc.append( kvp( "createdAt", b_date{now} ) );
 
@@ -1006,7 +1168,7 @@ void mongo_db_plugin_impl::_process_accepted_block( const chain::block_state_ptr
             }
          }
       } catch( ... ) {
-         handle_mongo_exception( "block_states insert: " + json, __LINE__ );
+         handle_mongo_exception( "block_states insert: " + block_id_str, __LINE__ );
       }
    }
 
@@ -1016,20 +1178,11 @@ void mongo_db_plugin_impl::_process_accepted_block( const chain::block_state_ptr
                         kvp( "block_id", block_id_str ) );
 
       auto v = to_variant_with_abi( *bs->block );
-      auto json = fc::json::to_string( v );
-      try {
-         const auto& value = bsoncxx::from_json( json );
-         block_doc.append( kvp( "block", value ) );
-      } catch( bsoncxx::exception& ) {
-         try {
-            json = fc::prune_invalid_utf8( json );
-            const auto& value = bsoncxx::from_json( json );
-            block_doc.append( kvp( "block", value ) );
-            block_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
-         } catch( bsoncxx::exception& e ) {
-            elog( "Unable to convert block JSON to MongoDB JSON: ${e}", ("e", e.what()) );
-            elog( "  JSON: ${j}", ("j", json) );
-         }
+      bool purged = false;
+      const auto& value = to_bson( v.get_object(), purged );
+      block_doc.append( kvp( "block", value ) );
+      if( purged ) {
+         block_doc.append( kvp( "non-utf8-purged", b_bool{true} ) );
       }
       block_doc.append( kvp( "createdAt", b_date{now} ) );
 
@@ -1046,7 +1199,7 @@ void mongo_db_plugin_impl::_process_accepted_block( const chain::block_state_ptr
             }
          }
       } catch( ... ) {
-         handle_mongo_exception( "blocks insert: " + json, __LINE__ );
+         handle_mongo_exception( "blocks insert: " + block_id_str, __LINE__ );
       }
    }
 }
@@ -1315,7 +1468,10 @@ void mongo_db_plugin_impl::update_account(const chain::action& act)
                std::chrono::microseconds{fc::time_point::now().time_since_epoch().count()} );
          auto setabi = act.data_as<chain::setabi>();
 
-         abi_cache_index.erase( setabi.account );
+         {
+            std::lock_guard<std::mutex> lock( abi_cache_mtx );
+            abi_cache_index.erase( setabi.account );
+         }
 
          auto account = find_account( _accounts, setabi.account );
          if( !account ) {
@@ -1359,9 +1515,15 @@ mongo_db_plugin_impl::~mongo_db_plugin_impl() {
       try {
          ilog( "mongo_db_plugin shutdown in process please be patient this can take a few minutes" );
          done = true;
-         condition.notify_one();
-
-         consume_thread.join();
+         for( auto& q : transaction_metadata_queues ) q->awaken();
+         transaction_trace_queue.awaken();
+         block_state_queue.awaken();
+         irreversible_block_state_queue.awaken();
+         progress_condition.notify_all();
+
+         for( auto& t : consume_threads ) {
+            if( t.joinable() ) t.join();
+         }
 
          mongo_pool.reset();
       } catch( std::exception& e ) {
@@ -1468,9 +1630,9 @@ void mongo_db_plugin_impl::init() {
       handle_mongo_exception( "mongo init", __LINE__ );
    }
 
-   ilog("starting db plugin thread");
+   ilog("starting db plugin threads");
 
-   consume_thread = std::thread([this] { consume_blocks(); });
+   start_consumers();
 
    startup = false;
 }
@@ -1492,7 +1654,10 @@ void mongo_db_plugin::set_program_options(options_description& cli, options_desc
 {
    cfg.add_options()
          ("mongodb-queue-size,q", bpo::value<uint32_t>()->default_value(1024),
-         "The target queue size between nodeos and MongoDB plugin thread.")
+         "The maximum size of each queue between nodeos and MongoDB plugin threads; nodeos blocks while a queue is full.")
+         ("mongodb-transaction-threads", bpo::value<uint32_t>()->default_value(1),
+         "The number of consumer threads, each with its own MongoDB client, storing accepted transactions."
+         " Blocks, irreversible blocks and traces each have one dedicated consumer thread.")
          ("mongodb-abi-cache-size", bpo::value<uint32_t>()->default_value(2048),
           "The maximum size of the abi cache for serializing data.")
          ("mongodb-wipe", bpo::bool_switch()->default_value(false),
@@ -1547,7 +1712,19 @@ void mongo_db_plugin::plugin_initialize(const variables_map& options)
 
          if( options.count( "mongodb-queue-size" )) {
             my->max_queue_size = options.at( "mongodb-queue-size" ).as<uint32_t>();
+            EOS_ASSERT( my->max_queue_size > 0, chain::plugin_config_exception, "mongodb-queue-size > 0 required" );
+         }
+         if( options.count( "mongodb-transaction-threads" )) {
+            my->transaction_consumers = options.at( "mongodb-transaction-threads" ).as<uint32_t>();
+            EOS_ASSERT( my->transaction_consumers > 0, chain::plugin_config_exception, "mongodb-transaction-threads > 0 required" );
+         }
+         for( uint32_t i = 0; i < my->transaction_consumers; ++i ) {
+            my->transaction_metadata_queues.emplace_back( std::make_unique<mongo_db_plugin_impl::metadata_queue_t>() );
+            my->transaction_metadata_queues.back()->set_max_size( my->max_queue_size );
          }
+         my->transaction_trace_queue.set_max_size( my->max_queue_size );
+         my->block_state_queue.set_max_size( my->max_queue_size );
+         my->irreversible_block_state_queue.set_max_size( my->max_queue_size );
          if( options.count( "mongodb-abi-cache-size" )) {
             my->abi_cache_size = options.at( "mongodb-abi-cache-size" ).as<uint32_t>();
             EOS_ASSERT( my->abi_cache_size > 0, chain::plugin_config_exception, "mongodb-abi-cache-size > 0 required" );
@@ -7,15 +7,42 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <chrono>
 #include <deque>
 #include <vector>
+#include <algorithm>
 #include <boost/noncopyable.hpp>
 
 namespace eosio {
 
-constexpr std::size_t FIFO_MAX_SIZE = 1000; // TODO: is cache useless?
+constexpr std::size_t FIFO_MAX_SIZE = 1024;
 constexpr std::size_t FIFO_POP_SIZE = 1000;
+constexpr std::size_t FIFO_MAX_SPILL = 1024 * 1024;
 
+enum class fifo_overflow {
+    block, spill
+};
+
+struct fifo_stats {
+    std::size_t size = 0;          // current queue depth, including spilled entries
+    std::size_t max_size = 0;      // highest observed depth since last reset
+    std::size_t spilled = 0;       // entries currently held in the overflow area
+    uint64_t spill_waits = 0;      // times a producer blocked on a full overflow area
+    uint64_t pushed = 0;           // total entries pushed
+    uint64_t push_wait_us = 0;     // total time producers spent blocked on a full queue
+    uint64_t pop_wait_us = 0;      // total time the consumer spent waiting on an empty queue
+};
+
+/**
+ * Single-producer/single-consumer queue.
+ *
+ * The fast path is a lock-free ring buffer; the producer is the chain thread and the consumer is the one
+ * database thread owning the queue. When the ring is full, the producer either waits for the consumer
+ * (`fifo_overflow::block`) or appends to an overflow area (`fifo_overflow::spill`) so that a lagging database
+ * does not stall block application; once the overflow area holds `max_spill` entries the producer waits too.
+ * Order is preserved across the ring and the overflow area. No element is ever dropped: after `awaken()` the
+ * consumer is going away, so a push that would wait is appended to the overflow area regardless of its cap.
+ */
 template <typename T>
 class fifo : public boost::noncopyable {
 public:
@@ -23,61 +50,236 @@ public:
         blocking, not_blocking
     };
 
-    fifo(std::size_t max_size = FIFO_MAX_SIZE);
+    fifo(std::size_t max_size = FIFO_MAX_SIZE, fifo_overflow policy = fifo_overflow::block,
+         std::size_t max_spill = FIFO_MAX_SPILL);
+
+    /// must be called before the first push
+    void configure(std::size_t max_size, fifo_overflow policy, std::size_t max_spill = FIFO_MAX_SPILL);
+
     void push(const T& element);
     std::vector<T> pop(std::size_t num = FIFO_POP_SIZE);
     void set_behavior(behavior value);
     void awaken();
 
+    std::size_t size() const;
+    fifo_stats stats(bool reset_max = false);
+
 private:
-    std::mutex mux_;
+    bool try_push(const T& element);
+    bool try_spill(const T& element, bool ignore_cap);
+    bool try_pop(T& element);
+    bool ring_empty() const;
+    void note_size();
+
+    static uint64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    std::vector<T> ring_;
+    std::size_t mask_ = 0;
+    fifo_overflow policy_ = fifo_overflow::block;
+    std::size_t max_spill_ = FIFO_MAX_SPILL;
+
+    // producer and consumer indexes live on separate cache lines
+    alignas(64) std::atomic<std::size_t> head_{0}; // next slot to pop, owned by the consumer
+    alignas(64) std::atomic<std::size_t> tail_{0}; // next slot to push, owned by the producer
+
+    alignas(64) std::atomic<behavior> behavior_{behavior::blocking};
+    std::atomic<bool> consumer_waiting_{false};
+    std::atomic<bool> producer_waiting_{false};
+    std::mutex wait_mux_;
     std::condition_variable not_empty_cv_;
     std::condition_variable not_full_cv_;
-    std::atomic<behavior> behavior_{behavior::blocking};
-    std::deque<T> deque_;
-    std::size_t max_size_;
+
+    std::mutex spill_mux_;
+    std::deque<T> spill_;
+    std::atomic<std::size_t> spill_size_{0};
+
+    std::atomic<std::size_t> max_size_seen_{0};
+    std::atomic<uint64_t> pushed_{0};
+    std::atomic<uint64_t> spill_waits_{0};
+    std::atomic<uint64_t> push_wait_us_{0};
+    std::atomic<uint64_t> pop_wait_us_{0};
 };
 
+/**
+ * Picks how many queued entries a consumer pops per database transaction, based on observed commit latency.
+ * Batches grow while the database keeps up with the target latency and shrink when it lags behind.
+ */
+class adaptive_batch_size {
+public:
+    adaptive_batch_size(std::size_t min_size = 100, std::size_t max_size = 10000, uint64_t target_us = 500000) {
+        configure(min_size, max_size, target_us);
+    }
+
+    /// must be called before the consumer starts
+    void configure(std::size_t min_size, std::size_t max_size, uint64_t target_us) {
+        min_ = std::max<std::size_t>(1, min_size);
+        max_ = std::max(min_, max_size);
+        target_us_ = target_us;
+        current_ = std::max(min_, std::min(FIFO_POP_SIZE, max_));
+    }
+
+    std::size_t get() const { return current_; }
+
+    void observe(std::size_t batch, uint64_t latency_us) {
+        last_latency_us_ = latency_us;
+        if (batch < current_ / 2) return; // queue was nearly drained, latency tells nothing about capacity
+        if (latency_us == 0) latency_us = 1;
+        auto scaled = static_cast<std::size_t>(static_cast<double>(current_) * target_us_ / latency_us);
+        // move half way to the estimate to damp oscillation
+        auto next = (current_ + scaled) / 2;
+        current_ = std::max(min_, std::min(max_, next));
+    }
+
+    uint64_t last_latency_us() const { return last_latency_us_; }
+
+private:
+    std::size_t min_ = 1;
+    std::size_t max_ = 1;
+    uint64_t target_us_ = 0;
+    std::atomic<std::size_t> current_{1};
+    std::atomic<uint64_t> last_latency_us_{0};
+};
+
+template <typename T>
+fifo<T>::fifo(std::size_t max_size, fifo_overflow policy, std::size_t max_spill) {
+    configure(max_size, policy, max_spill);
+}
+
+template <typename T>
+void fifo<T>::configure(std::size_t max_size, fifo_overflow policy, std::size_t max_spill) {
+    std::size_t capacity = 2;
+    while (capacity < max_size) capacity <<= 1;
+    ring_ = std::vector<T>(capacity);
+    mask_ = capacity - 1;
+    policy_ = policy;
+    max_spill_ = std::max<std::size_t>(1, max_spill);
+    head_ = 0;
+    tail_ = 0;
+}
+
+template <typename T>
+bool fifo<T>::try_push(const T& element) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) return false;
+    ring_[tail & mask_] = element;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
 template <typename T>
-fifo<T>::fifo(std::size_t max_size) {
-    max_size_ = max_size;
+bool fifo<T>::try_spill(const T& element, bool ignore_cap) {
+    // once anything is spilled, keep spilling until the consumer drains it, to preserve order
+    std::lock_guard<std::mutex> lock(spill_mux_);
+    if (spill_.empty() && try_push(element)) return true;
+    if (!ignore_cap && spill_.size() >= max_spill_) return false;
+    spill_.push_back(element);
+    spill_size_.store(spill_.size(), std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool fifo<T>::try_pop(T& element) {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return false;
+    element = std::move(ring_[head & mask_]);
+    ring_[head & mask_] = T();
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool fifo<T>::ring_empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+}
+
+template <typename T>
+void fifo<T>::note_size() {
+    auto current = size();
+    auto seen = max_size_seen_.load(std::memory_order_relaxed);
+    while (current > seen && !max_size_seen_.compare_exchange_weak(seen, current, std::memory_order_relaxed)) {}
 }
 
 template <typename T>
 void fifo<T>::push(const T& element) {
-    std::unique_lock<std::mutex> lock(mux_);
+    bool pushed = spill_size_.load(std::memory_order_acquire) == 0 && try_push(element);
+
+    if (!pushed && policy_ == fifo_overflow::spill) {
+        pushed = try_spill(element, false);
+        if (!pushed) ++spill_waits_;
+    }
 
-    if (deque_.size() >= max_size_) {
-        not_full_cv_.wait(lock, [&] {
-            return behavior_ == behavior::not_blocking || deque_.size() < max_size_;
-        });
+    if (!pushed) {
+        auto start = std::chrono::steady_clock::now();
+        while (true) {
+            // shutting down, nobody will drain the queue: keep the element instead of waiting forever
+            if (behavior_ == behavior::not_blocking) {
+                try_spill(element, true);
+                break;
+            }
+            if (policy_ == fifo_overflow::spill ? try_spill(element, false) : try_push(element)) break;
+            std::unique_lock<std::mutex> lock(wait_mux_);
+            producer_waiting_ = true;
+            not_full_cv_.wait_for(lock, std::chrono::milliseconds(10));
+            producer_waiting_ = false;
+        }
+        push_wait_us_ += elapsed_us(start);
     }
 
-    deque_.push_back(element);
-    not_empty_cv_.notify_one();
+    ++pushed_;
+    note_size();
+
+    if (consumer_waiting_.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(wait_mux_);
+        not_empty_cv_.notify_one();
+    }
 }
 
 template <typename T>
 std::vector<T> fifo<T>::pop(std::size_t num) {
-    std::unique_lock<std::mutex> lock(mux_);
-    if (deque_.empty()) {
-        not_empty_cv_.wait(lock, [&] {
-            return behavior_ == behavior::not_blocking || !deque_.empty();
-        });
+    if (size() == 0) {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(wait_mux_);
+        consumer_waiting_ = true;
+        // the timeout covers a push racing with setting `consumer_waiting_`
+        while (size() == 0 && behavior_ != behavior::not_blocking) {
+            not_empty_cv_.wait_for(lock, std::chrono::milliseconds(10));
+        }
+        consumer_waiting_ = false;
+        pop_wait_us_ += elapsed_us(start);
     }
 
     std::vector<T> result;
-    for (std::size_t i = 0; i < num && !deque_.empty(); ++i) {
-        result.push_back(std::move(deque_.front()));
-        deque_.pop_front();
+    result.reserve(std::min(num, size()));
+    T element;
+    while (result.size() < num) {
+        if (try_pop(element)) {
+            result.push_back(std::move(element));
+            continue;
+        }
+        if (spill_size_.load(std::memory_order_acquire) == 0) break;
+
+        std::lock_guard<std::mutex> lock(spill_mux_);
+        if (!ring_empty()) continue; // spilled entries are newer than anything left in the ring
+        while (result.size() < num && !spill_.empty()) {
+            result.push_back(std::move(spill_.front()));
+            spill_.pop_front();
+        }
+        spill_size_.store(spill_.size(), std::memory_order_release);
+    }
+
+    if (producer_waiting_.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(wait_mux_);
+        not_full_cv_.notify_all();
     }
-    not_full_cv_.notify_all();
     return result;
 }
 
 template <typename T>
 void fifo<T>::set_behavior(behavior value) {
     behavior_ = value;
+    std::lock_guard<std::mutex> lock(wait_mux_);
     not_empty_cv_.notify_all();
     not_full_cv_.notify_all();
 }
@@ -87,4 +289,24 @@ void fifo<T>::awaken() {
     set_behavior(behavior::not_blocking);
 }
 
+template <typename T>
+std::size_t fifo<T>::size() const {
+    // load head first so a concurrent pop can never make the difference negative
+    auto head = head_.load(std::memory_order_acquire);
+    return tail_.load(std::memory_order_acquire) - head + spill_size_.load(std::memory_order_acquire);
+}
+
+template <typename T>
+fifo_stats fifo<T>::stats(bool reset_max) {
+    fifo_stats s;
+    s.size = size();
+    s.max_size = reset_max ? max_size_seen_.exchange(s.size) : max_size_seen_.load();
+    s.spilled = spill_size_;
+    s.spill_waits = spill_waits_;
+    s.pushed = pushed_;
+    s.push_wait_us = push_wait_us_;
+    s.pop_wait_us = pop_wait_us_;
+    return s;
+}
+
 }
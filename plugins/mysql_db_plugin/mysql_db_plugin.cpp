@@ -47,12 +47,27 @@ using local_adj = boost::date_time::c_local_adjustor<boost::posix_time::ptime>;
 
 static appbase::abstract_plugin& _mysql_db_plugin = app().register_plugin<mysql_db_plugin>();
 
+// one of the parallel action writers; actions are sharded by receiver so that each account's actions stay ordered
+struct action_writer {
+    fifo<ActionPtr> queue_;
+    adaptive_batch_size batch_;
+    std::atomic<uint64_t> pushed_{0}; // only written by the chain thread
+    std::atomic<uint64_t> persisted_{0}; // only written by the writer thread, after commit
+    std::thread thread_;
+};
+
+using action_writer_ptr = std::unique_ptr<action_writer>;
+
 class mysql_db_plugin_impl {
 public:
     void consume_blocks();
     void consume_transactions();
     void consume_transaction_traces();
-    void consume_actions();
+    void consume_actions(action_writer& writer);
+    void seal_block(uint32_t block_num);
+    void advance_watermark();
+    void write_watermark(uint32_t block_num);
+    void report_metrics();
 
     void push_block(const chain::block_state_ptr& block_state);
     std::pair<uint32_t, uint32_t> push_transaction(const chain::transaction_receipt& transaction_receipt, const BlockPtr& block, const uint16_t block_seq);
@@ -77,16 +92,28 @@ public:
     fifo<BlockPtr> block_queue_;
     fifo<TransactionPtr> transaction_queue_;
     fifo<TransactionTracePtr> transaction_trace_queue_;
-    fifo<ActionPtr> action_queue_;
+    std::vector<action_writer_ptr> action_writers_;
+
+    // snapshots of every writer's pushed count at each accepted block, in application order
+    std::mutex watermark_mux_;
+    std::deque<std::pair<uint32_t, std::vector<uint64_t>>> pending_watermarks_;
+    std::atomic<uint32_t> watermark_{0}; // highest block whose actions are all persisted
+    fc::time_point watermark_written_at_;
+
+    adaptive_batch_size block_batch_;
+    adaptive_batch_size transaction_batch_;
+    adaptive_batch_size transaction_trace_batch_;
+    fc::microseconds metrics_interval_{fc::seconds(60)};
 
     boost::signals2::connection block_conn_;
     boost::signals2::connection irreversible_block_conn_;
+    boost::signals2::connection seal_block_conn_;
     boost::signals2::connection transaction_conn_;
 
     std::thread consume_block_thread_;
     std::thread consume_transaction_thread_;
     std::thread consume_transaction_trace_thread_;
-    std::thread consume_action_thread_;
+    std::thread metrics_thread_;
 
     std::vector<action_handler_ptr> action_handlers_;
 };
@@ -97,18 +124,23 @@ void mysql_db_plugin_impl::stop() {
 
         block_conn_.disconnect();
         irreversible_block_conn_.disconnect();
+        seal_block_conn_.disconnect();
         transaction_conn_.disconnect();
 
         block_queue_.awaken();
         transaction_queue_.awaken();
         transaction_trace_queue_.awaken();
-        action_queue_.awaken();
+        for (auto& writer: action_writers_) writer->queue_.awaken();
 
         if (consume_block_thread_.joinable()) consume_block_thread_.join();
         if (consume_transaction_thread_.joinable()) consume_transaction_thread_.join();
         if (consume_transaction_trace_thread_.joinable()) consume_transaction_trace_thread_.join();
-        if (consume_action_thread_.joinable()) consume_action_thread_.join();
+        for (auto& writer: action_writers_) {
+            if (writer->thread_.joinable()) writer->thread_.join();
+        }
+        if (metrics_thread_.joinable()) metrics_thread_.join();
 
+        if (db_ && watermark_) handle([=] { write_watermark(watermark_); }, "write action watermark");
         if (db_) db_.reset();
 
         for (auto& action_handler: action_handlers_) {
@@ -148,6 +180,15 @@ fc::time_point time_point(int64_t microseconds) {
     return fc::time_point(fc::microseconds(microseconds));
 }
 
+std::size_t action_writer_index(name_t receiver, std::size_t writers) {
+    // low bits of a name encode its trailing characters and are mostly zero, so mix before reducing
+    return static_cast<std::size_t>(((receiver * 0x9E3779B97F4A7C15ull) >> 32) % writers);
+}
+
+uint64_t elapsed_us(const fc::time_point& start) {
+    return static_cast<uint64_t>((fc::time_point::now() - start).count());
+}
+
 TransactionStatus transactionStatus(fc::enum_type<uint8_t, chain::transaction_receipt::status_enum> status) {
     if (status == chain::transaction_receipt::executed) return TransactionStatus::executed;
     else if (status == chain::transaction_receipt::soft_fail) return TransactionStatus::soft_fail;
@@ -254,7 +295,9 @@ void mysql_db_plugin_impl::push_action(const chain::action_trace& action_trace,
     if (not action_trace.console.empty()) a->console_ = action_trace.console;
     // a->total_cpu_usage_ = action_trace.total_cpu_usage;
 
-    action_queue_.push(a);
+    auto& writer = *action_writers_[action_writer_index(a->receiver_, action_writers_.size())];
+    writer.queue_.push(a);
+    ++writer.pushed_;
 
     for (auto& action_handler: action_handlers_) {
         action_handler->handle(action_trace.act, a->receiver_, a->global_seq_, tx);
@@ -268,8 +311,9 @@ void mysql_db_plugin_impl::push_action(const chain::action_trace& action_trace,
 void mysql_db_plugin_impl::consume_blocks() {
     using query = odb::query<Block>;
 
-    auto blocks = block_queue_.pop();
+    auto blocks = block_queue_.pop(block_batch_.get());
     if (blocks.empty()) return;
+    auto start = fc::time_point::now();
 
     unordered_map<bytes, BlockPtr> distinct_blocks_by_id;
     unordered_map<unsigned, BlockPtr> distinct_blocks_by_num;
@@ -323,13 +367,16 @@ void mysql_db_plugin_impl::consume_blocks() {
     db_->update(*stats_);
 
     t.commit();
+
+    block_batch_.observe(blocks.size(), elapsed_us(start));
 }
 
 void mysql_db_plugin_impl::consume_transactions() {
     using tx_query = odb::query<Transaction>;
 
-    auto txs = transaction_queue_.pop();
+    auto txs = transaction_queue_.pop(transaction_batch_.get());
     if (txs.empty()) return;
+    auto start = fc::time_point::now();
 
     unordered_map<bytes, TransactionPtr> distinct_txs;
     vector<bytes> ids;
@@ -360,13 +407,16 @@ void mysql_db_plugin_impl::consume_transactions() {
     }
 
     t.commit();
+
+    transaction_batch_.observe(txs.size(), elapsed_us(start));
 }
 
 void mysql_db_plugin_impl::consume_transaction_traces() {
     using tx_query = odb::query<TransactionTrace>;
 
-    auto txs = transaction_trace_queue_.pop();
+    auto txs = transaction_trace_queue_.pop(transaction_trace_batch_.get());
     if (txs.empty()) return;
+    auto start = fc::time_point::now();
 
     unordered_map<bytes, TransactionTracePtr> distinct_txs;
     vector<bytes> ids;
@@ -393,15 +443,18 @@ void mysql_db_plugin_impl::consume_transaction_traces() {
     }
 
     t.commit();
+
+    transaction_trace_batch_.observe(txs.size(), elapsed_us(start));
 }
 
-void mysql_db_plugin_impl::consume_actions() {
+void mysql_db_plugin_impl::consume_actions(action_writer& writer) {
     using action_query = odb::query<Action>;
     using action_prepared_query = odb::prepared_query<Action>;
     using action_result = odb::result<Action>;
 
-    auto actions = action_queue_.pop();
+    auto actions = writer.queue_.pop(writer.batch_.get());
     if (actions.empty()) return;
+    auto start = fc::time_point::now();
 
     unordered_map<uint64_t, ActionPtr> distinct_actions;
     vector<uint64_t> seqs;
@@ -428,6 +481,74 @@ void mysql_db_plugin_impl::consume_actions() {
     }
 
     t.commit();
+
+    writer.batch_.observe(actions.size(), elapsed_us(start));
+    writer.persisted_ += actions.size();
+    advance_watermark();
+}
+
+void mysql_db_plugin_impl::seal_block(uint32_t block_num) {
+    std::vector<uint64_t> pushed;
+    pushed.reserve(action_writers_.size());
+    for (auto& writer: action_writers_) pushed.push_back(writer->pushed_);
+
+    std::lock_guard<std::mutex> lock(watermark_mux_);
+    pending_watermarks_.emplace_back(block_num, std::move(pushed));
+}
+
+void mysql_db_plugin_impl::advance_watermark() {
+    uint32_t watermark = 0;
+    {
+        std::lock_guard<std::mutex> lock(watermark_mux_);
+        while (not pending_watermarks_.empty()) {
+            auto& front = pending_watermarks_.front();
+            bool persisted = true;
+            for (std::size_t i = 0; i < action_writers_.size() && persisted; ++i) {
+                persisted = action_writers_[i]->persisted_ >= front.second[i];
+            }
+            if (not persisted) break;
+            watermark = front.first;
+            pending_watermarks_.pop_front();
+        }
+        if (not watermark) return;
+        watermark_ = watermark;
+
+        // several writers race here; persisting the watermark once per second is plenty
+        auto now = fc::time_point::now();
+        if (now - watermark_written_at_ < fc::seconds(1)) return;
+        watermark_written_at_ = now;
+    }
+    write_watermark(watermark);
+}
+
+void mysql_db_plugin_impl::write_watermark(uint32_t block_num) {
+    odb::transaction t(db_->begin());
+    db_->execute("REPLACE INTO ActionWatermark (id, block_num) VALUES (0, " + std::to_string(block_num) + ")");
+    t.commit();
+}
+
+void mysql_db_plugin_impl::report_metrics() {
+    auto deadline = fc::time_point::now() + metrics_interval_;
+    while (not done_ && fc::time_point::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (done_) return;
+
+    auto report = [](const char* name, auto& queue, const adaptive_batch_size& batch) {
+        auto s = queue.stats(true);
+        ilog("mysql_db_plugin ${name} queue: size ${size}, max ${max}, spilled ${spilled}, spill full ${spill_waits}, "
+             "pushed ${pushed}, push wait ${push_wait}us, pop wait ${pop_wait}us, batch ${batch}, last commit ${latency}us",
+             ("name", name)("size", s.size)("max", s.max_size)("spilled", s.spilled)("spill_waits", s.spill_waits)("pushed", s.pushed)
+             ("push_wait", s.push_wait_us)("pop_wait", s.pop_wait_us)("batch", batch.get())("latency", batch.last_latency_us()));
+    };
+    report("block", block_queue_, block_batch_);
+    report("transaction", transaction_queue_, transaction_batch_);
+    report("transaction trace", transaction_trace_queue_, transaction_trace_batch_);
+    for (std::size_t i = 0; i < action_writers_.size(); ++i) {
+        auto name = "action writer " + std::to_string(i);
+        report(name.c_str(), action_writers_[i]->queue_, action_writers_[i]->batch_);
+    }
+    ilog("mysql_db_plugin actions persisted up to block ${num}", ("num", watermark_.load()));
 }
 
 void mysql_db_plugin_impl::init() {
@@ -436,6 +557,8 @@ void mysql_db_plugin_impl::init() {
         ilog("mysql db init, create tables");
         odb::schema_catalog::create_schema(*db_);
     }
+    // not part of the ODB model; tracks the highest block whose actions were all persisted by the parallel writers
+    db_->execute("CREATE TABLE IF NOT EXISTS ActionWatermark (id INT UNSIGNED NOT NULL PRIMARY KEY, block_num INT UNSIGNED NOT NULL)");
 
     stats_ = db_->query_one<Stats>(odb::query<Stats>::id == 0);
     if (not stats_) {
@@ -452,6 +575,7 @@ void mysql_db_plugin_impl::wipe_database() {
         ilog("mysql db wipe_database, drop tables");
         odb::schema_catalog::drop_schema(*db_);
     }
+    db_->execute("DROP TABLE IF EXISTS ActionWatermark");
     t.commit();
 }
 
@@ -469,6 +593,16 @@ void mysql_db_plugin::set_program_options(options_description&, options_descript
             ("mysql-db", bpo::value<string>()->default_value("eos"), "MySQL db name")
             ("mysql-only-irreversible", bpo::value<bool>()->default_value(false), "MySQL whether only stores irreversible blocks")
             ("mysql-start-block-num", bpo::value<unsigned>()->default_value(1), "MySQL starts syncing block number")
+            ("mysql-queue-size", bpo::value<unsigned>()->default_value(FIFO_MAX_SIZE), "MySQL per stream queue capacity, rounded up to a power of two")
+            ("mysql-queue-overflow", bpo::value<string>()->default_value("block"),
+             "MySQL behavior when a queue is full: 'block' waits for the database, 'spill' buffers the overflow without stalling the chain thread")
+            ("mysql-queue-spill-max", bpo::value<unsigned>()->default_value(FIFO_MAX_SPILL),
+             "MySQL maximum number of entries buffered per stream by 'spill' before the chain thread waits for the database")
+            ("mysql-batch-min", bpo::value<unsigned>()->default_value(100), "MySQL minimum number of rows written per database transaction")
+            ("mysql-batch-max", bpo::value<unsigned>()->default_value(10000), "MySQL maximum number of rows written per database transaction")
+            ("mysql-batch-target-ms", bpo::value<unsigned>()->default_value(500), "MySQL target database transaction latency used to adapt batch size")
+            ("mysql-action-writers", bpo::value<unsigned>()->default_value(1), "MySQL number of parallel action writer threads, sharded by receiver account")
+            ("mysql-metrics-interval-seconds", bpo::value<unsigned>()->default_value(60), "MySQL interval of queue metrics logging, 0 to disable")
             ("mysql-filter-token-contract", boost::program_options::value<vector<string>>()->composing()->multitoken(),
              "MySQL token contract account added to token filtering list (may specify multiple times)");
 }
@@ -501,7 +635,33 @@ void mysql_db_plugin::plugin_initialize(const variables_map& options) {
     unsigned start_block_num = options.at("mysql-start-block-num").as<unsigned>();
     ilog("my_db_plugin connecting to ${host}:${port}", ("host", host)("port", port));
 
-    std::unique_ptr<odb::mysql::connection_factory> conn_pool = make_unique<odb::mysql::connection_pool_factory>(5, 1, true);
+    auto queue_size = options.at("mysql-queue-size").as<unsigned>();
+    auto overflow_str = options.at("mysql-queue-overflow").as<string>();
+    EOS_ASSERT(overflow_str == "block" || overflow_str == "spill", chain::plugin_config_exception,
+               "mysql-queue-overflow must be 'block' or 'spill', got ${v}", ("v", overflow_str));
+    auto overflow = overflow_str == "spill" ? fifo_overflow::spill : fifo_overflow::block;
+    auto spill_max = options.at("mysql-queue-spill-max").as<unsigned>();
+    my->block_queue_.configure(queue_size, overflow, spill_max);
+    my->transaction_queue_.configure(queue_size, overflow, spill_max);
+    my->transaction_trace_queue_.configure(queue_size, overflow, spill_max);
+    auto action_writers = std::max(1u, options.at("mysql-action-writers").as<unsigned>());
+    for (unsigned i = 0; i < action_writers; ++i) {
+        my->action_writers_.emplace_back(std::make_unique<action_writer>());
+        my->action_writers_.back()->queue_.configure(queue_size, overflow, spill_max);
+    }
+
+    auto batch_min = options.at("mysql-batch-min").as<unsigned>();
+    auto batch_max = options.at("mysql-batch-max").as<unsigned>();
+    uint64_t batch_target_us = options.at("mysql-batch-target-ms").as<unsigned>() * 1000ull;
+    my->block_batch_.configure(batch_min, batch_max, batch_target_us);
+    my->transaction_batch_.configure(batch_min, batch_max, batch_target_us);
+    my->transaction_trace_batch_.configure(batch_min, batch_max, batch_target_us);
+    for (auto& writer: my->action_writers_) writer->batch_.configure(batch_min, batch_max, batch_target_us);
+    my->metrics_interval_ = fc::seconds(options.at("mysql-metrics-interval-seconds").as<unsigned>());
+
+    // one connection for each consumer thread, each action writer and the action handlers
+    std::size_t max_connections = 4 + action_writers;
+    std::unique_ptr<odb::mysql::connection_factory> conn_pool = make_unique<odb::mysql::connection_pool_factory>(max_connections, 1, true);
     my->db_ = make_shared<odb::mysql::database>(user, password, db, host, port, nullptr, "utf8", 0, std::move(conn_pool));
 
     if (my->wipe_database_on_startup_) {
@@ -532,6 +692,10 @@ void mysql_db_plugin::plugin_initialize(const variables_map& options) {
             handle([=] { my->push_block(b); }, "push block");
         });
     }
+    my->seal_block_conn_ = chain.accepted_block.connect([=](const chain::block_state_ptr& b) {
+        if (not my->start_sync_) return;
+        handle([=] { my->seal_block(b->block_num); }, "seal block");
+    });
     my->irreversible_block_conn_ = chain.irreversible_block.connect([=](const chain::block_state_ptr& b) {
         if (not my->start_sync_) {
             if (b->block_num >= start_block_num) my->start_sync_ = true;
@@ -562,9 +726,18 @@ void mysql_db_plugin::plugin_startup() {
             loop_handle(my->done_, "consume transaction traces", [=] { my->consume_transaction_traces(); });
         });
 
-        my->consume_action_thread_ = std::thread([=] {
-            loop_handle(my->done_, "consume actions", [=] { my->consume_actions(); });
-        });
+        for (auto& w: my->action_writers_) {
+            auto writer = w.get();
+            writer->thread_ = std::thread([=] {
+                loop_handle(my->done_, "consume actions", [=] { my->consume_actions(*writer); });
+            });
+        }
+
+        if (my->metrics_interval_.count() > 0) {
+            my->metrics_thread_ = std::thread([=] {
+                loop_handle(my->done_, "report metrics", [=] { my->report_metrics(); });
+            });
+        }
     }
 }
 
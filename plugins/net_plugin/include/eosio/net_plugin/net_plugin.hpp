@@ -15,6 +15,11 @@ namespace eosio {
       bool              connecting = false;
       bool              syncing    = false;
       handshake_message last_handshake;
+      bool              compression = false; ///< blocks and transactions above p2p-compress-min-bytes are compressed to this peer
+      uint64_t          bytes_sent = 0; ///< queued for sending, before compression
+      uint64_t          wire_bytes_sent = 0;
+      uint64_t          bytes_received = 0; ///< after decompression
+      uint64_t          wire_bytes_received = 0;
    };
 
    class net_plugin : public appbase::plugin<net_plugin>
@@ -45,4 +50,5 @@ namespace eosio {
 
 }
 
-FC_REFLECT( eosio::connection_status, (peer)(connecting)(syncing)(last_handshake) )
+FC_REFLECT( eosio::connection_status, (peer)(connecting)(syncing)(last_handshake)(compression)
+            (bytes_sent)(wire_bytes_sent)(bytes_received)(wire_bytes_received) )
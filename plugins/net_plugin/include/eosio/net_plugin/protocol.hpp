@@ -132,6 +132,21 @@ namespace eosio {
       uint32_t end_block;
    };
 
+   enum class message_compression : uint8_t {
+      none = 0,
+      zlib = 1
+   };
+
+   /**
+    * A block or transaction message compressed for a peer that advertised proto_compression
+    * or later in its handshake network_version.
+    */
+   struct compressed_message {
+      uint8_t  compression = 0; ///< a message_compression
+      uint32_t size = 0; ///< size of the uncompressed message, not counting the length header
+      bytes    data;
+   };
+
    using net_message = static_variant<handshake_message,
                                       chain_size_message,
                                       go_away_message,
@@ -140,7 +155,8 @@ namespace eosio {
                                       request_message,
                                       sync_request_message,
                                       signed_block,         // which = 7
-                                      packed_transaction>;  // which = 8
+                                      packed_transaction,   // which = 8
+                                      compressed_message>;  // which = 9
 
 } // namespace eosio
 
@@ -159,6 +175,7 @@ FC_REFLECT( eosio::time_message, (org)(rec)(xmt)(dst) )
 FC_REFLECT( eosio::notice_message, (known_trx)(known_blocks) )
 FC_REFLECT( eosio::request_message, (req_trx)(req_blocks) )
 FC_REFLECT( eosio::sync_request_message, (start_block)(end_block) )
+FC_REFLECT( eosio::compressed_message, (compression)(size)(data) )
 
 /**
  *
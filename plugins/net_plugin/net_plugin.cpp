@@ -25,6 +25,10 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ip/host_name.hpp>
 #include <boost/asio/steady_timer.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
 
 using namespace eosio::chain::plugin_interface::compat;
 
@@ -75,29 +79,227 @@ namespace eosio {
       }
    };
 
-   typedef multi_index_container<
-      node_transaction_state,
-      indexed_by<
-         ordered_unique<
-            tag< by_id >,
-            member < node_transaction_state,
-                     transaction_id_type,
-                     &node_transaction_state::id >,
-            sha256_less >,
-         ordered_non_unique<
-            tag< by_expiry >,
-            member< node_transaction_state,
-                    fc::time_point_sec,
-                    &node_transaction_state::expires >
-            >,
-         ordered_non_unique<
-            tag<by_block_num>,
-            member< node_transaction_state,
-                    uint32_t,
-                    &node_transaction_state::block_num > >
-         >
-      >
-   node_transaction_index;
+   /**
+    * Transactions known to this node, shared by the main thread and the net threads.
+    *
+    * Entries are spread over shards by id, each with its own mutex, so a lookup from a net thread only
+    * waits on work in one shard. Expiry is time bucketed: every shard keeps a wheel of one second
+    * buckets holding the ids expiring in that second (modulo the wheel size) and a map of ids by the
+    * block that included them, so expire() only visits the buckets that came due since the last call
+    * and the blocks that became irreversible, never the whole set.
+    */
+   class local_txn_cache {
+   public:
+      struct stats {
+         uint64_t inserts = 0;
+         uint64_t insert_us = 0;
+         uint64_t lookups = 0;
+         uint64_t lookup_us = 0;
+         uint64_t expired = 0;
+         uint64_t expire_us = 0;
+         uint64_t max_expire_us = 0; ///< longest single expire()
+      };
+
+      local_txn_cache();
+
+      /// @return false if the id is already present
+      bool insert( node_transaction_state&& nts );
+      bool contains( const transaction_id_type& id ) const;
+      /// @return the serialized transaction, null when unknown or not kept
+      std::shared_ptr<vector<char>> serialized( const transaction_id_type& id ) const;
+      void set_block_num( const transaction_id_type& id, uint32_t block_num );
+      /// removes transactions expired by now or included in a block at or below lib
+      void expire( const time_point& now, uint32_t lib );
+      size_t size() const;
+      stats get_stats() const;
+
+   private:
+      static constexpr size_t   num_shards = 16;
+      static constexpr uint32_t wheel_size = 1024; ///< seconds
+
+      struct id_hash {
+         size_t operator()( const transaction_id_type& id ) const { return id._hash[1]; }
+      };
+
+      struct shard {
+         mutable std::mutex                                                         mtx;
+         std::unordered_map<transaction_id_type, node_transaction_state, id_hash>    txns;
+         vector<vector<transaction_id_type>>                                        wheel = vector<vector<transaction_id_type>>( wheel_size );
+         uint32_t                                                                   wheel_sec = 0; ///< next second to sweep
+         std::map<uint32_t, vector<transaction_id_type>>                            by_block;
+      };
+
+      shard& shard_for( const transaction_id_type& id ) { return shards[id._hash[0] % num_shards]; }
+      const shard& shard_for( const transaction_id_type& id ) const { return shards[id._hash[0] % num_shards]; }
+      void record_lookup( const time_point& start ) const;
+
+      std::array<shard, num_shards> shards;
+
+      std::atomic<uint64_t>         inserts{0};
+      std::atomic<uint64_t>         insert_us{0};
+      mutable std::atomic<uint64_t> lookups{0};
+      mutable std::atomic<uint64_t> lookup_us{0};
+      std::atomic<uint64_t>         expired{0};
+      std::atomic<uint64_t>         expire_us{0};
+      std::atomic<uint64_t>         max_expire_us{0};
+   };
+
+   constexpr size_t   local_txn_cache::num_shards;
+   constexpr uint32_t local_txn_cache::wheel_size;
+
+   local_txn_cache::local_txn_cache() {
+      auto now = time_point_sec( time_point::now() ).sec_since_epoch();
+      for( auto& s : shards ) {
+         s.wheel_sec = now;
+      }
+   }
+
+   bool local_txn_cache::insert( node_transaction_state&& nts ) {
+      auto start = time_point::now();
+      auto& s = shard_for( nts.id );
+      bool inserted = false;
+      {
+         std::lock_guard<std::mutex> g( s.mtx );
+         auto id = nts.id;
+         auto sec = std::max( nts.expires.sec_since_epoch(), s.wheel_sec );
+         uint32_t block_num = nts.block_num;
+         inserted = s.txns.emplace( id, std::move( nts ) ).second;
+         if( inserted ) {
+            s.wheel[sec % wheel_size].push_back( id );
+            if( block_num ) {
+               s.by_block[block_num].push_back( id );
+            }
+         }
+      }
+      ++inserts;
+      insert_us += (time_point::now() - start).count();
+      return inserted;
+   }
+
+   void local_txn_cache::record_lookup( const time_point& start ) const {
+      ++lookups;
+      lookup_us += (time_point::now() - start).count();
+   }
+
+   bool local_txn_cache::contains( const transaction_id_type& id ) const {
+      auto start = time_point::now();
+      const auto& s = shard_for( id );
+      bool found;
+      {
+         std::lock_guard<std::mutex> g( s.mtx );
+         found = s.txns.count( id ) > 0;
+      }
+      record_lookup( start );
+      return found;
+   }
+
+   std::shared_ptr<vector<char>> local_txn_cache::serialized( const transaction_id_type& id ) const {
+      auto start = time_point::now();
+      const auto& s = shard_for( id );
+      std::shared_ptr<vector<char>> buff;
+      {
+         std::lock_guard<std::mutex> g( s.mtx );
+         auto tx = s.txns.find( id );
+         if( tx != s.txns.end() ) {
+            buff = tx->second.serialized_txn;
+         }
+      }
+      record_lookup( start );
+      return buff;
+   }
+
+   void local_txn_cache::set_block_num( const transaction_id_type& id, uint32_t block_num ) {
+      auto& s = shard_for( id );
+      std::lock_guard<std::mutex> g( s.mtx );
+      auto tx = s.txns.find( id );
+      if( tx != s.txns.end() && tx->second.block_num != block_num ) {
+         tx->second.block_num = block_num;
+         if( block_num ) {
+            s.by_block[block_num].push_back( id ); // entry under the old block, if any, is skipped by expire
+         }
+      }
+   }
+
+   void local_txn_cache::expire( const time_point& now, uint32_t lib ) {
+      auto start = time_point::now();
+      const uint32_t now_sec = time_point_sec( now ).sec_since_epoch();
+      uint64_t removed = 0;
+      for( auto& s : shards ) {
+         std::lock_guard<std::mutex> g( s.mtx );
+
+         // the buckets due since the last sweep, each at most once; ids due in a later turn of the wheel stay
+         uint32_t due = std::min( now_sec + 1 - std::min( s.wheel_sec, now_sec + 1 ), wheel_size );
+         for( uint32_t i = 0; i < due; ++i ) {
+            auto& bucket = s.wheel[(s.wheel_sec + i) % wheel_size];
+            auto keep = bucket.begin();
+            for( auto& id : bucket ) {
+               auto tx = s.txns.find( id );
+               if( tx == s.txns.end() ) {
+                  continue;
+               }
+               if( tx->second.expires <= now ) {
+                  s.txns.erase( tx );
+                  ++removed;
+               } else {
+                  *keep++ = id;
+               }
+            }
+            bucket.erase( keep, bucket.end() );
+         }
+         s.wheel_sec = std::max( s.wheel_sec, now_sec + 1 );
+
+         auto last = s.by_block.upper_bound( lib );
+         for( auto b = s.by_block.begin(); b != last; ++b ) {
+            for( auto& id : b->second ) {
+               auto tx = s.txns.find( id );
+               if( tx != s.txns.end() && tx->second.block_num != 0 && tx->second.block_num <= lib ) {
+                  s.txns.erase( tx );
+                  ++removed;
+               }
+            }
+         }
+         s.by_block.erase( s.by_block.begin(), last );
+      }
+
+      uint64_t us = (time_point::now() - start).count();
+      expired += removed;
+      expire_us += us;
+      if( us > max_expire_us ) {
+         max_expire_us = us;
+      }
+   }
+
+   size_t local_txn_cache::size() const {
+      size_t n = 0;
+      for( auto& s : shards ) {
+         std::lock_guard<std::mutex> g( s.mtx );
+         n += s.txns.size();
+      }
+      return n;
+   }
+
+   local_txn_cache::stats local_txn_cache::get_stats() const {
+      stats st;
+      st.inserts = inserts;
+      st.insert_us = insert_us;
+      st.lookups = lookups;
+      st.lookup_us = lookup_us;
+      st.expired = expired;
+      st.expire_us = expire_us;
+      st.max_expire_us = max_expire_us;
+      return st;
+   }
+
+   /**
+    * A message framed and unpacked on a net thread. Blocks and transactions are
+    * moved out of msg, which is then left default constructed.
+    */
+   struct parsed_message {
+      net_message                   msg;
+      signed_block_ptr              block;
+      transaction_metadata_ptr      trx;
+      std::shared_ptr<vector<char>> raw; ///< framed bytes of a block or transaction, forwarded to other peers as is
+   };
 
    class net_plugin_impl {
    public:
@@ -131,6 +333,7 @@ namespace eosio {
 
       unique_ptr<boost::asio::steady_timer> connector_check;
       unique_ptr<boost::asio::steady_timer> transaction_check;
+      unique_ptr<boost::asio::steady_timer> announce_check;
       unique_ptr<boost::asio::steady_timer> keepalive_timer;
       boost::asio::steady_timer::duration   connector_period;
       boost::asio::steady_timer::duration   txn_exp_period;
@@ -149,12 +352,16 @@ namespace eosio {
       producer_plugin*              producer_plug = nullptr;
       int                           started_sessions = 0;
 
-      node_transaction_index        local_txns;
+      local_txn_cache               local_txns; ///< safe to query from the net threads
 
       shared_ptr<tcp::resolver>     resolver;
 
       bool                          use_socket_read_watermark = false;
 
+      message_compression           compression = message_compression::none; ///< used towards peers that accept it
+      uint32_t                      compress_min_bytes = 0;
+      bool                          trx_announce = false; ///< announce transaction ids to peers that fetch them, instead of pushing
+
       channels::transaction_ack::channel_type::handle  incoming_transaction_ack_subscription;
 
       uint16_t                                  thread_pool_size = 1; // currently used by server_ioc
@@ -169,15 +376,28 @@ namespace eosio {
       void start_listen_loop();
       void start_read_message(const connection_ptr& c);
 
-      /** \brief Process the next message from the pending message buffer
+      /** \brief Frame and unpack the messages of a completed read, on a net thread
        *
-       * Process the next message from the pending_message_buffer.
-       * message_length is the already determined length of the data
-       * part of the message that will handle the message.
-       * Returns true is successful. Returns false if an error was
-       * encountered unpacking or processing the message.
+       * Appends every complete message in the pending_message_buffer to parsed
+       * and records how many bytes the next read needs. Returns false if the
+       * stream is malformed and the connection should be closed. Called with
+       * conn->read_mtx held, so that the main thread cannot close the socket or
+       * reset the buffer underneath it.
        */
-      bool process_next_message(const connection_ptr& conn, uint32_t message_length);
+      bool parse_messages(const connection_ptr& conn, std::size_t bytes_transferred, vector<parsed_message>& parsed);
+
+      /** \brief Unpack the next message from the pending message buffer, on a net thread
+       *
+       * message_length is the already determined length of the data part of
+       * the message. Transactions already in local_txns are dropped here.
+       * Returns false if an error was encountered unpacking the message.
+       */
+      bool parse_next_message(const connection_ptr& conn, uint32_t message_length, vector<parsed_message>& parsed);
+
+      /// Handle a message parsed by parse_messages, on the main thread
+      void handle_parsed_message(const connection_ptr& conn, parsed_message& m);
+
+      bool have_txn(const transaction_id_type& id) const;
 
       void close(const connection_ptr& c);
       size_t count_open_sockets() const;
@@ -213,11 +433,13 @@ namespace eosio {
       void handle_message(const connection_ptr& c, const sync_request_message& msg);
       void handle_message(const connection_ptr& c, const signed_block& msg) = delete; // signed_block_ptr overload used instead
       void handle_message(const connection_ptr& c, const signed_block_ptr& msg);
-      void handle_message(const connection_ptr& c, const packed_transaction& msg) = delete; // packed_transaction_ptr overload used instead
-      void handle_message(const connection_ptr& c, const packed_transaction_ptr& msg);
+      void handle_message(const connection_ptr& c, const packed_transaction& msg) = delete; // transaction_metadata_ptr overload used instead
+      void handle_message(const connection_ptr& c, const transaction_metadata_ptr& msg,
+                          const std::shared_ptr<std::vector<char>>& raw = std::shared_ptr<std::vector<char>>());
 
       void start_conn_timer(boost::asio::steady_timer::duration du, std::weak_ptr<connection> from_connection);
       void start_txn_timer();
+      void start_announce_timer();
       void start_monitors();
 
       void expire_txns();
@@ -311,10 +533,19 @@ namespace eosio {
    constexpr auto     def_txn_expire_wait = std::chrono::seconds(3);
    constexpr auto     def_resp_expected_wait = std::chrono::seconds(5);
    constexpr auto     def_sync_fetch_span = 100;
+   constexpr auto     def_sync_peers = 1;
+   constexpr auto     def_block_buffer_cache_size = 32*1024*1024; // serialized blocks kept for other peers
+   constexpr auto     def_compress_min_bytes = 1024;
+   constexpr auto     def_compressed_buffer_count = 64; // compressed blocks and transactions kept for other peers
+   constexpr auto     def_trx_announce_interval = std::chrono::milliseconds(10);
+   constexpr auto     def_trx_announce_batch = 256; // ids queued for a peer before announcing without waiting
+   constexpr auto     def_max_trx_announce = 1024; // ids accepted in one announcement or request
+   constexpr auto     def_trx_announce_expire = 60; // seconds a peer is remembered as knowing an announced transaction
 
    constexpr auto     message_header_size = 4;
    constexpr uint32_t signed_block_which = 7;        // see protocol net_message
    constexpr uint32_t packed_transaction_which = 8;  // see protocol net_message
+   constexpr uint32_t compressed_message_which = 9;  // see protocol net_message
 
    /**
     *  For a while, network version was a 16 bit value equal to the second set of 16 bits
@@ -336,8 +567,10 @@ namespace eosio {
     */
    constexpr uint16_t proto_base = 0;
    constexpr uint16_t proto_explicit_sync = 1;
+   constexpr uint16_t proto_compression = 2;       // accepts compressed_message
+   constexpr uint16_t proto_trx_announce = 3;      // fetches transactions announced in notice_message known_trx
 
-   constexpr uint16_t net_version = proto_explicit_sync;
+   constexpr uint16_t net_version = proto_trx_announce;
 
    struct transaction_state {
       transaction_id_type id;
@@ -379,9 +612,6 @@ namespace eosio {
    struct update_block_num {
       uint32_t new_bnum;
       update_block_num(uint32_t bnum) : new_bnum(bnum) {}
-      void operator() (node_transaction_state& nts) {
-         nts.block_num = new_bnum;
-      }
       void operator() (transaction_state& ts) {
          ts.block_num = new_bnum;
       }
@@ -502,6 +732,10 @@ namespace eosio {
 
       fc::message_buffer<1024*1024>    pending_message_buffer;
       fc::optional<std::size_t>        outstanding_read_bytes;
+      /// guards pending_message_buffer, outstanding_read_bytes and closing the socket between the net thread
+      /// parsing a completed read and the main thread closing or reconnecting
+      std::mutex                       read_mtx;
+      uint32_t                         read_generation = 0; ///< bumped on close under read_mtx, stale reads are dropped
 
 
       queued_buffer           buffer_queue;
@@ -515,6 +749,8 @@ namespace eosio {
       bool                    connecting = false;
       bool                    syncing = false;
       uint16_t                protocol_version  = 0;
+      bool                    compress = false; ///< compress blocks and transactions sent to this peer
+      vector<transaction_id_type> pending_announce; ///< transaction ids not yet announced to this peer
       string                  peer_addr;
       unique_ptr<boost::asio::steady_timer> response_expected;
       unique_ptr<boost::asio::steady_timer> read_delay_timer;
@@ -523,12 +759,22 @@ namespace eosio {
       uint32_t               fork_head_num = 0;
       optional<request_message> last_req;
 
+      std::atomic<uint64_t>  bytes_sent{0}; ///< queued, before compression
+      std::atomic<uint64_t>  wire_bytes_sent{0};
+      std::atomic<uint64_t>  bytes_received{0}; ///< counted on the net threads, after decompression
+      std::atomic<uint64_t>  wire_bytes_received{0};
+
       connection_status get_status()const {
          connection_status stat;
          stat.peer = peer_addr;
          stat.connecting = connecting;
          stat.syncing = syncing;
          stat.last_handshake = last_handshake_recv;
+         stat.compression = compress;
+         stat.bytes_sent = bytes_sent;
+         stat.wire_bytes_sent = wire_bytes_sent;
+         stat.bytes_received = bytes_received;
+         stat.wire_bytes_received = wire_bytes_received;
          return stat;
       }
 
@@ -652,12 +898,15 @@ namespace eosio {
       void operator()( packed_transaction& msg ) const {
          EOS_ASSERT( false, plugin_config_exception, "operator()(packed_transaction&&) should be called" );
       }
+      void operator()( const compressed_message& msg ) const {
+         EOS_ASSERT( false, plugin_config_exception, "compressed_message is unpacked by parse_next_message" );
+      }
 
       void operator()( signed_block&& msg ) const {
          impl.handle_message( c, std::make_shared<signed_block>( std::move( msg ) ) );
       }
       void operator()( packed_transaction&& msg ) const {
-         impl.handle_message( c, std::make_shared<packed_transaction>( std::move( msg ) ) );
+         impl.handle_message( c, std::make_shared<transaction_metadata>( std::make_shared<packed_transaction>( std::move( msg ) ) ) );
       }
 
       template <typename T>
@@ -675,19 +924,37 @@ namespace eosio {
          in_sync
       };
 
+      /// a range of blocks requested from one peer during parallel lib catchup
+      struct sync_range {
+         uint32_t       start;
+         uint32_t       end;
+         connection_ptr source;
+      };
+
       uint32_t       sync_known_lib_num;
       uint32_t       sync_last_requested_num;
       uint32_t       sync_next_expected_num;
       uint32_t       sync_req_span;
+      uint32_t       sync_peers; ///< peers fetching ranges concurrently in lib catchup, 1 for a single source
       connection_ptr source;
       stages         state;
 
+      std::map<uint32_t, sync_range> sync_ranges; ///< outstanding, by start block
+      std::map<uint32_t, std::pair<connection_ptr, signed_block_ptr>> sync_buffer; ///< received ahead of sync_next_expected_num
+
       chain_plugin* chain_plug = nullptr;
 
       constexpr auto stage_str(stages s );
 
+      bool parallel() const { return sync_peers > 1 && state == lib_catchup; }
+      void request_ranges();
+      bool request_range(uint32_t start, uint32_t end);
+      bool is_requested(uint32_t num) const;
+      void drop_ranges(const connection_ptr& c);
+      void reset_ranges();
+
    public:
-      explicit sync_manager(uint32_t span);
+      sync_manager(uint32_t span, uint32_t peers);
       void set_state(stages s);
       bool sync_required();
       void send_handshakes();
@@ -699,6 +966,7 @@ namespace eosio {
       void verify_catchup(const connection_ptr& c, uint32_t num, const block_id_type& id);
       void rejected_block(const connection_ptr& c, uint32_t blk_num);
       void recv_block(const connection_ptr& c, const block_id_type& blk_id, uint32_t blk_num);
+      bool buffer_block(const connection_ptr& c, const signed_block_ptr& b, uint32_t blk_num);
       void recv_handshake(const connection_ptr& c, const handshake_message& msg);
       void recv_notice(const connection_ptr& c, const notice_message& msg);
    };
@@ -709,7 +977,7 @@ namespace eosio {
       std::multimap<transaction_id_type, connection_ptr, sha256_less> received_transactions;
 
       void bcast_transaction(const transaction_metadata_ptr& trx);
-      void rejected_transaction(const transaction_id_type& msg);
+      void rejected_transaction(const transaction_metadata_ptr& ptrx);
       void bcast_block(const block_state_ptr& bs);
       void rejected_block(const block_id_type& id);
 
@@ -719,6 +987,78 @@ namespace eosio {
       void recv_notice(const connection_ptr& conn, const notice_message& msg, bool generated);
 
       void retry_fetch(const connection_ptr& conn);
+
+      /** \name Transaction announcements
+       * With p2p-transaction-announce, peers at proto_trx_announce get the ids of new transactions in batched
+       * notice_messages and ask for the bodies they lack with a request_message. trx_state doubles as the
+       * per-peer filter of ids it is known to have.
+       * @{
+       */
+      void announce_transaction(const connection_ptr& c, const transaction_id_type& id);
+      void send_announcements();
+      void send_announcement(const connection_ptr& c);
+      void recv_announcement(const connection_ptr& c, const vector<transaction_id_type>& ids);
+      void send_requested_transactions(const connection_ptr& c, const vector<transaction_id_type>& ids);
+      void expire_requested_transactions(const time_point& now);
+
+      /// transactions asked for, until they arrive or the request times out
+      std::map<transaction_id_type, time_point, sha256_less> requested_transactions;
+      bool announce_scheduled = false;
+      uint64_t trx_announced = 0;
+      uint64_t trx_requested = 0;
+      /** @} */
+
+      /** \brief Serialized block to send, shared by all connections
+       *
+       * Returns the buffer received or packed earlier for the block, packing
+       * and caching it only when there is none.
+       */
+      std::shared_ptr<std::vector<char>> block_buffer(const block_id_type& id, const signed_block_ptr& sb);
+      void cache_block_buffer(const block_id_type& id, const std::shared_ptr<std::vector<char>>& buff);
+
+      /** \brief Bytes a block or transaction was received as
+       *
+       * Kept with the exact object unpacked from them and only used once that object is
+       * accepted: the ids do not cover signatures or extensions, so another copy with the
+       * same id may carry different bytes.
+       */
+      void recv_block_buffer(const signed_block_ptr& sb, const std::shared_ptr<std::vector<char>>& buff);
+      void forget_block_buffer(const signed_block_ptr& sb);
+      void recv_transaction_buffer(const transaction_metadata_ptr& ptrx, const std::shared_ptr<std::vector<char>>& buff);
+      void expire_transaction_buffers(const time_point_sec& now);
+
+      /** \brief Compressed form of a serialized block or transaction, shared by all connections
+       *
+       * Returns buff itself for other messages, ones below p2p-compress-min-bytes and ones
+       * that do not get smaller.
+       */
+      std::shared_ptr<std::vector<char>> compressed_buffer(const std::shared_ptr<std::vector<char>>& buff);
+
+      struct transaction_buffer {
+         time_point_sec                     expires;
+         std::shared_ptr<std::vector<char>> buffer;
+      };
+
+      /// buffers of accepted or locally packed blocks
+      std::map<block_id_type, std::shared_ptr<std::vector<char>>, sha256_less> block_buffers;
+      std::deque<block_id_type> block_buffer_order; ///< oldest first
+      size_t block_buffer_bytes = 0;
+      /// received blocks being applied
+      std::map<signed_block_ptr, std::shared_ptr<std::vector<char>>> received_block_buffers;
+      /// received transactions waiting to be relayed once accepted
+      std::map<transaction_metadata_ptr, transaction_buffer> transaction_buffers;
+
+      struct compressed_entry {
+         std::weak_ptr<std::vector<char>>   buffer; ///< the uncompressed buffer, detects reuse of its address
+         std::shared_ptr<std::vector<char>> compressed;
+      };
+      std::map<const std::vector<char>*, compressed_entry> compressed_buffers;
+      std::deque<const std::vector<char>*> compressed_buffer_order; ///< oldest first
+
+      uint64_t bytes_compressed = 0; ///< blocks and transactions compressed, before compression
+      uint64_t bytes_packed = 0; ///< blocks and transactions serialized for sending
+      uint64_t bytes_reused = 0; ///< blocks and transactions queued from a buffer packed or received earlier
+      uint64_t bytes_sent = 0;
    };
 
    //---------------------------------------------------------------------------
@@ -796,6 +1136,7 @@ namespace eosio {
       peer_requested.reset();
       blk_state.clear();
       trx_state.clear();
+      pending_announce.clear();
    }
 
    void connection::flush_queues() {
@@ -803,11 +1144,15 @@ namespace eosio {
    }
 
    void connection::close() {
-      if(socket) {
-         socket->close();
-      }
-      else {
-         fc_wlog( logger, "no socket to close!" );
+      {
+         std::lock_guard<std::mutex> g( read_mtx );
+         ++read_generation;
+         if(socket) {
+            socket->close();
+         }
+         else {
+            fc_wlog( logger, "no socket to close!" );
+         }
       }
       flush_queues();
       connecting = false;
@@ -976,6 +1321,7 @@ namespace eosio {
                   my_impl->close(conn);
                   return;
                }
+               my_impl->dispatcher->bytes_sent += w;
                conn->buffer_queue.clear_out_queue();
                conn->enqueue_sync_block();
                conn->do_queue_write( priority );
@@ -1091,16 +1437,55 @@ namespace eosio {
       return create_send_buffer( packed_transaction_which, trx );
    }
 
+   namespace bio = boost::iostreams;
+
+   /// compressed_message holding the payload of a framed block or transaction buffer
+   static std::shared_ptr<std::vector<char>> create_compressed_buffer( const std::vector<char>& buff ) {
+      compressed_message cm;
+      cm.compression = static_cast<uint8_t>( message_compression::zlib );
+      cm.size = buff.size() - message_header_size;
+      {
+         bio::filtering_ostream comp;
+         comp.push( bio::zlib_compressor( bio::zlib::best_speed ) );
+         comp.push( bio::back_inserter( cm.data ) );
+         bio::write( comp, buff.data() + message_header_size, cm.size );
+         bio::close( comp );
+      }
+      return create_send_buffer( compressed_message_which, cm );
+   }
+
+   /// framed buffer holding the message a compressed_message was created from
+   static std::shared_ptr<std::vector<char>> decompress_message( const compressed_message& cm ) {
+      EOS_ASSERT( cm.compression == static_cast<uint8_t>( message_compression::zlib ), plugin_exception,
+                  "unknown message compression ${c}", ("c", cm.compression) );
+      EOS_ASSERT( cm.size > 0 && cm.size <= def_send_buffer_size*2, plugin_exception,
+                  "compressed message size unexpected (${s})", ("s", cm.size) );
+
+      auto buff = std::make_shared<std::vector<char>>( message_header_size + cm.size );
+      memcpy( buff->data(), &cm.size, message_header_size );
+      bio::filtering_istream decomp;
+      decomp.push( bio::zlib_decompressor() );
+      decomp.push( bio::array_source( cm.data.data(), cm.data.size() ) );
+      decomp.read( buff->data() + message_header_size, cm.size );
+      EOS_ASSERT( static_cast<uint32_t>( decomp.gcount() ) == cm.size && decomp.get() == EOF, plugin_exception,
+                  "compressed message does not inflate to ${s} bytes", ("s", cm.size) );
+      return buff;
+   }
+
    void connection::enqueue_block( const signed_block_ptr& sb, bool trigger_send, bool to_sync_queue) {
-      enqueue_buffer( create_send_buffer( sb ), trigger_send, priority::low, no_reason, to_sync_queue);
+      enqueue_buffer( my_impl->dispatcher->block_buffer( sb->id(), sb ), trigger_send, priority::low, no_reason, to_sync_queue);
    }
 
    void connection::enqueue_buffer( const std::shared_ptr<std::vector<char>>& send_buffer,
                                     bool trigger_send, int priority, go_away_reason close_after_send,
                                     bool to_sync_queue)
    {
+      bytes_sent += send_buffer->size();
+      auto buff = compress ? my_impl->dispatcher->compressed_buffer( send_buffer ) : send_buffer;
+      wire_bytes_sent += buff->size();
+
       connection_wptr weak_this = shared_from_this();
-      queue_write(send_buffer,trigger_send, priority,
+      queue_write(buff,trigger_send, priority,
                   [weak_this, close_after_send](boost::system::error_code ec, std::size_t ) {
                      connection_ptr conn = weak_this.lock();
                      if (conn) {
@@ -1210,11 +1595,12 @@ namespace eosio {
 
    //-----------------------------------------------------------
 
-    sync_manager::sync_manager( uint32_t req_span )
+    sync_manager::sync_manager( uint32_t req_span, uint32_t peers )
       :sync_known_lib_num( 0 )
       ,sync_last_requested_num( 0 )
       ,sync_next_expected_num( 1 )
       ,sync_req_span( req_span )
+      ,sync_peers( peers )
       ,source()
       ,state(in_sync)
    {
@@ -1257,6 +1643,11 @@ namespace eosio {
          if( c->last_handshake_recv.last_irreversible_block_num > sync_known_lib_num) {
             sync_known_lib_num =c->last_handshake_recv.last_irreversible_block_num;
          }
+      } else if( parallel() ) {
+         if( std::any_of( sync_ranges.begin(), sync_ranges.end(), [&c]( const auto& r ) { return r.second.source == c; } ) ) {
+            drop_ranges( c );
+            request_ranges();
+         }
       } else if( c == source ) {
          sync_last_requested_num = 0;
          request_next_chunk();
@@ -1272,6 +1663,11 @@ namespace eosio {
    }
 
    void sync_manager::request_next_chunk( const connection_ptr& conn ) {
+      if( parallel() ) {
+         request_ranges();
+         return;
+      }
+
       uint32_t head_block = chain_plug->chain().fork_db_head_block_num();
 
       if (head_block < sync_last_requested_num && source && source->current()) {
@@ -1354,6 +1750,120 @@ namespace eosio {
       }
    }
 
+   /**
+    * Parallel lib catchup: keep up to sync_peers disjoint ranges of sync_req_span blocks outstanding, each from a
+    * different peer, within a look-ahead of sync_peers * sync_req_span blocks past the next block to apply. Blocks
+    * arriving ahead of sync_next_expected_num wait in sync_buffer and are applied in order. Blocks neither buffered
+    * nor covered by an outstanding range, e.g. after a peer timed out or closed, are requested again first.
+    */
+   void sync_manager::request_ranges() {
+      // holes below what was already requested
+      uint32_t n = sync_next_expected_num;
+      while( n <= sync_last_requested_num ) {
+         if( is_requested( n ) ) {
+            ++n;
+            continue;
+         }
+         uint32_t end = n;
+         while( end < sync_last_requested_num && end - n + 1 < sync_req_span && !is_requested( end + 1 ) ) {
+            ++end;
+         }
+         if( !request_range( n, end ) ) {
+            break;
+         }
+         n = end + 1;
+      }
+
+      const uint32_t look_ahead = sync_peers * sync_req_span;
+      while( sync_ranges.size() < sync_peers && sync_last_requested_num < sync_known_lib_num &&
+             sync_last_requested_num < sync_next_expected_num + look_ahead ) {
+         uint32_t start = std::max( sync_last_requested_num + 1, sync_next_expected_num );
+         uint32_t end = std::min( start + sync_req_span - 1, sync_known_lib_num );
+         if( !request_range( start, end ) ) {
+            break;
+         }
+         sync_last_requested_num = end;
+      }
+
+      if( sync_ranges.empty() && sync_buffer.empty() && sync_next_expected_num <= sync_known_lib_num ) {
+         fc_elog( logger, "Unable to continue syncing at this time");
+         sync_known_lib_num = chain_plug->chain().last_irreversible_block_num();
+         sync_last_requested_num = 0;
+         reset_ranges();
+         set_state(in_sync); // probably not, but we can't do anything else
+      }
+   }
+
+   /// request [start, end] from the next idle peer able to serve it, round-robin after the last source
+   bool sync_manager::request_range( uint32_t start, uint32_t end ) {
+      auto& conns = my_impl->connections;
+      if( conns.empty() ) {
+         return false;
+      }
+      auto cptr = source ? conns.upper_bound( source ) : conns.begin();
+      for( size_t i = 0; i < conns.size(); ++i, ++cptr ) {
+         if( cptr == conns.end() ) {
+            cptr = conns.begin();
+         }
+         const auto& c = *cptr;
+         if( !c->current() || c->last_handshake_recv.last_irreversible_block_num < end ) {
+            continue;
+         }
+         bool busy = std::any_of( sync_ranges.begin(), sync_ranges.end(), [&c]( const auto& r ) { return r.second.source == c; } );
+         if( busy ) {
+            continue;
+         }
+         fc_ilog(logger, "requesting range ${s} to ${e}, from ${n}", ("n",c->peer_name())("s",start)("e",end));
+         c->request_sync_blocks( start, end );
+         sync_ranges.emplace( start, sync_range{start, end, c} );
+         source = c;
+         return true;
+      }
+      return false;
+   }
+
+   bool sync_manager::is_requested( uint32_t num ) const {
+      if( sync_buffer.count( num ) ) {
+         return true;
+      }
+      auto r = sync_ranges.upper_bound( num );
+      return r != sync_ranges.begin() && (--r)->second.end >= num;
+   }
+
+   void sync_manager::drop_ranges( const connection_ptr& c ) {
+      for( auto r = sync_ranges.begin(); r != sync_ranges.end(); ) {
+         if( r->second.source == c ) {
+            r = sync_ranges.erase( r );
+         } else {
+            ++r;
+         }
+      }
+   }
+
+   void sync_manager::reset_ranges() {
+      sync_ranges.clear();
+      sync_buffer.clear();
+   }
+
+   /// returns true if the block was taken into sync_buffer, to be applied once the blocks before it are
+   bool sync_manager::buffer_block( const connection_ptr& c, const signed_block_ptr& b, uint32_t blk_num ) {
+      if( !parallel() || blk_num <= sync_next_expected_num ) {
+         return false;
+      }
+      sync_buffer.emplace( blk_num, std::make_pair( c, b ) );
+
+      auto r = std::find_if( sync_ranges.begin(), sync_ranges.end(), [&c]( const auto& r ) { return r.second.source == c; } );
+      if( r != sync_ranges.end() ) {
+         if( blk_num >= r->second.end ) {
+            sync_ranges.erase( r );
+            request_ranges();
+         } else {
+            c->sync_wait();
+         }
+      }
+      return true;
+   }
+
    void sync_manager::send_handshakes()
    {
       for( auto &ci : my_impl->connections) {
@@ -1391,7 +1901,11 @@ namespace eosio {
       fc_ilog(logger, "reassign_fetch, our last req is ${cc}, next expected is ${ne} peer ${p}",
               ( "cc",sync_last_requested_num)("ne",sync_next_expected_num)("p",c->peer_name()));
 
-      if (c == source) {
+      if( parallel() ) {
+         c->cancel_sync(reason);
+         drop_ranges( c );
+         request_ranges();
+      } else if (c == source) {
          c->cancel_sync(reason);
          sync_last_requested_num = 0;
          request_next_chunk();
@@ -1525,6 +2039,7 @@ namespace eosio {
          fc_ilog(logger, "block ${bn} not accepted from ${p}",("bn",blk_num)("p",c->peer_name()));
          sync_last_requested_num = 0;
          source.reset();
+         reset_ranges();
          my_impl->close(c);
          set_state(in_sync);
          send_handshakes();
@@ -1539,6 +2054,7 @@ namespace eosio {
             return;
          }
          sync_next_expected_num = blk_num + 1;
+         sync_buffer.erase( blk_num );
       }
       if (state == head_catchup) {
          fc_dlog(logger, "sync_manager in head_catchup state");
@@ -1566,9 +2082,27 @@ namespace eosio {
       else if (state == lib_catchup) {
          if( blk_num == sync_known_lib_num ) {
             fc_dlog( logger, "All caught up with last known last irreversible block resending handshake");
+            reset_ranges();
             set_state(in_sync);
             send_handshakes();
          }
+         else if( sync_peers > 1 ) {
+            auto r = std::find_if( sync_ranges.begin(), sync_ranges.end(), [&c]( const auto& r ) { return r.second.source == c; } );
+            if( r != sync_ranges.end() && blk_num >= r->second.end ) {
+               sync_ranges.erase( r );
+               request_ranges();
+            } else if( r != sync_ranges.end() ) {
+               c->sync_wait();
+            }
+
+            // apply the next buffered block, one per post so other work can interleave
+            auto next = sync_buffer.find( sync_next_expected_num );
+            if( next != sync_buffer.end() ) {
+               app().post( priority::medium, [from = next->second.first, b = next->second.second]() {
+                  my_impl->handle_message( from, b );
+               } );
+            }
+         }
          else if (blk_num == sync_last_requested_num) {
             request_next_chunk();
          }
@@ -1603,7 +2137,7 @@ namespace eosio {
                continue;
             }
             if( !send_buffer ) {
-               send_buffer = create_send_buffer( bs->block );
+               send_buffer = block_buffer( bs->id, bs->block );
             }
             fc_dlog(logger, "bcast block ${b} to ${p}", ("b", bnum)("p", cp->peer_name()));
             cp->enqueue_buffer( send_buffer, true, priority::high, no_reason );
@@ -1612,6 +2146,99 @@ namespace eosio {
 
    }
 
+   std::shared_ptr<std::vector<char>> dispatch_manager::block_buffer(const block_id_type& id, const signed_block_ptr& sb) {
+      auto it = block_buffers.find( id );
+      if( it != block_buffers.end() ) {
+         bytes_reused += it->second->size();
+         return it->second;
+      }
+      std::shared_ptr<std::vector<char>> buff;
+      auto received = received_block_buffers.find( sb );
+      if( received != received_block_buffers.end() ) {
+         buff = std::move( received->second );
+         received_block_buffers.erase( received );
+         bytes_reused += buff->size();
+      } else {
+         buff = create_send_buffer( sb );
+         bytes_packed += buff->size();
+      }
+      cache_block_buffer( id, buff );
+      return buff;
+   }
+
+   void dispatch_manager::cache_block_buffer(const block_id_type& id, const std::shared_ptr<std::vector<char>>& buff) {
+      if( !block_buffers.emplace( id, buff ).second ) {
+         return;
+      }
+      block_buffer_order.push_back( id );
+      block_buffer_bytes += buff->size();
+      while( block_buffer_bytes > def_block_buffer_cache_size && block_buffer_order.size() > 1 ) {
+         auto old = block_buffers.find( block_buffer_order.front() );
+         block_buffer_bytes -= old->second->size();
+         block_buffers.erase( old );
+         block_buffer_order.pop_front();
+      }
+   }
+
+   void dispatch_manager::recv_block_buffer(const signed_block_ptr& sb, const std::shared_ptr<std::vector<char>>& buff) {
+      if( buff ) {
+         received_block_buffers[sb] = buff;
+      }
+   }
+
+   void dispatch_manager::forget_block_buffer(const signed_block_ptr& sb) {
+      received_block_buffers.erase( sb );
+   }
+
+   void dispatch_manager::recv_transaction_buffer(const transaction_metadata_ptr& ptrx, const std::shared_ptr<std::vector<char>>& buff) {
+      if( buff ) {
+         transaction_buffers[ptrx] = transaction_buffer{ptrx->packed_trx->expiration(), buff};
+      }
+   }
+
+   std::shared_ptr<std::vector<char>> dispatch_manager::compressed_buffer(const std::shared_ptr<std::vector<char>>& buff) {
+      if( buff->size() < message_header_size + my_impl->compress_min_bytes ) {
+         return buff;
+      }
+      // which of both fits in the first payload byte
+      auto which = static_cast<uint8_t>( (*buff)[message_header_size] );
+      if( which != signed_block_which && which != packed_transaction_which ) {
+         return buff;
+      }
+
+      auto it = compressed_buffers.find( buff.get() );
+      if( it != compressed_buffers.end() && it->second.buffer.lock() == buff ) {
+         return it->second.compressed;
+      }
+
+      auto compressed = create_compressed_buffer( *buff );
+      bytes_compressed += buff->size();
+      if( compressed->size() >= buff->size() ) {
+         compressed = buff;
+      }
+      if( it != compressed_buffers.end() ) {
+         it->second = compressed_entry{buff, compressed};
+      } else {
+         compressed_buffers.emplace( buff.get(), compressed_entry{buff, compressed} );
+         compressed_buffer_order.push_back( buff.get() );
+         if( compressed_buffer_order.size() > def_compressed_buffer_count ) {
+            compressed_buffers.erase( compressed_buffer_order.front() );
+            compressed_buffer_order.pop_front();
+         }
+      }
+      return compressed;
+   }
+
+   void dispatch_manager::expire_transaction_buffers(const time_point_sec& now) {
+      for( auto i = transaction_buffers.begin(); i != transaction_buffers.end(); ) {
+         if( i->second.expires <= now ) {
+            i = transaction_buffers.erase( i );
+         } else {
+            ++i;
+         }
+      }
+   }
+
    void dispatch_manager::recv_block(const connection_ptr& c, const block_id_type& id, uint32_t bnum) {
       received_blocks.insert(std::make_pair(id, c));
       if (c &&
@@ -1654,7 +2281,14 @@ namespace eosio {
       }
       received_transactions.erase(range.first, range.second);
 
-      if( my_impl->local_txns.get<by_id>().find( id ) != my_impl->local_txns.end() ) { //found
+      std::shared_ptr<std::vector<char>> buff;
+      auto received = transaction_buffers.find( ptrx );
+      if( received != transaction_buffers.end() ) {
+         buff = received->second.buffer;
+         transaction_buffers.erase( received );
+      }
+
+      if( my_impl->have_txn( id ) ) { //found
          fc_dlog(logger, "found trxid in local_trxs" );
          return;
       }
@@ -1662,12 +2296,17 @@ namespace eosio {
       time_point_sec trx_expiration = ptrx->packed_trx->expiration();
       const packed_transaction& trx = *ptrx->packed_trx;
 
-      auto buff = create_send_buffer( trx );
+      if( buff ) {
+         bytes_reused += buff->size();
+      } else {
+         buff = create_send_buffer( trx );
+         bytes_packed += buff->size();
+      }
 
       node_transaction_state nts = {id, trx_expiration, 0, buff};
       my_impl->local_txns.insert(std::move(nts));
 
-      my_impl->send_transaction_to_all( buff, [&id, &skips, trx_expiration](const connection_ptr& c) -> bool {
+      my_impl->send_transaction_to_all( buff, [this, &id, &skips, trx_expiration](const connection_ptr& c) -> bool {
          if( skips.find(c) != skips.end() || c->syncing ) {
             return false;
           }
@@ -1675,6 +2314,10 @@ namespace eosio {
           bool unknown = bs == c->trx_state.end();
           if( unknown ) {
              c->trx_state.insert(transaction_state({id,0,trx_expiration}));
+             if( my_impl->trx_announce && c->protocol_version >= proto_trx_announce ) {
+                announce_transaction( c, id ); // the peer asks for the body if it needs it
+                return false;
+             }
              fc_dlog(logger, "sending trx to ${n}", ("n",c->peer_name() ) );
           }
           return unknown;
@@ -1684,6 +2327,7 @@ namespace eosio {
 
    void dispatch_manager::recv_transaction(const connection_ptr& c, const transaction_id_type& id) {
       received_transactions.insert(std::make_pair(id, c));
+      requested_transactions.erase(id);
       if (c &&
           c->last_req &&
           c->last_req->req_trx.mode != none &&
@@ -1696,10 +2340,12 @@ namespace eosio {
       c->cancel_wait();
    }
 
-   void dispatch_manager::rejected_transaction(const transaction_id_type& id) {
+   void dispatch_manager::rejected_transaction(const transaction_metadata_ptr& ptrx) {
+      const auto& id = ptrx->id;
       fc_dlog(logger,"not sending rejected transaction ${tid}",("tid",id));
       auto range = received_transactions.equal_range(id);
       received_transactions.erase(range.first, range.second);
+      transaction_buffers.erase(ptrx);
    }
 
    void dispatch_manager::recv_notice(const connection_ptr& c, const notice_message& msg, bool generated) {
@@ -1752,6 +2398,93 @@ namespace eosio {
       }
    }
 
+   void dispatch_manager::announce_transaction(const connection_ptr& c, const transaction_id_type& id) {
+      c->pending_announce.push_back( id );
+      if( c->pending_announce.size() >= def_trx_announce_batch ) {
+         send_announcement( c );
+      } else if( !announce_scheduled ) {
+         announce_scheduled = true;
+         my_impl->start_announce_timer();
+      }
+   }
+
+   void dispatch_manager::send_announcements() {
+      announce_scheduled = false;
+      for( const auto& c : my_impl->connections ) {
+         if( !c->pending_announce.empty() ) {
+            send_announcement( c );
+         }
+      }
+   }
+
+   void dispatch_manager::send_announcement(const connection_ptr& c) {
+      if( !c->current() ) {
+         c->pending_announce.clear();
+         return;
+      }
+      notice_message note;
+      note.known_trx.mode = normal;
+      note.known_trx.pending = c->pending_announce.size();
+      note.known_trx.ids = std::move( c->pending_announce );
+      note.known_blocks.mode = none;
+      c->pending_announce.clear();
+      trx_announced += note.known_trx.ids.size();
+      fc_dlog(logger, "announcing ${n} trxs to ${p}", ("n", note.known_trx.ids.size())("p", c->peer_name()));
+      c->enqueue( note );
+   }
+
+   void dispatch_manager::recv_announcement(const connection_ptr& c, const vector<transaction_id_type>& ids) {
+      if( ids.size() > def_max_trx_announce ) {
+         peer_elog( c, "announcement of ${n} trxs exceeds ${m}, ignoring", ("n", ids.size())("m", def_max_trx_announce) );
+         return;
+      }
+      request_message req;
+      req.req_trx.mode = normal;
+      req.req_blocks.mode = none;
+      auto now = time_point::now();
+      time_point_sec known_until = time_point_sec( now ) + def_trx_announce_expire;
+      for( const auto& id : ids ) {
+         if( c->trx_state.find( id ) == c->trx_state.end() ) {
+            c->trx_state.insert( transaction_state({id, 0, known_until}) );
+         }
+         if( my_impl->have_txn( id ) ) {
+            continue;
+         }
+         auto r = requested_transactions.find( id );
+         if( r != requested_transactions.end() && r->second > now ) {
+            continue; // asked another peer, which has not timed out yet
+         }
+         requested_transactions[id] = now + fc::microseconds(
+               std::chrono::duration_cast<std::chrono::microseconds>( my_impl->resp_expected_period ).count() );
+         req.req_trx.ids.push_back( id );
+      }
+      if( !req.req_trx.ids.empty() ) {
+         req.req_trx.pending = req.req_trx.ids.size();
+         trx_requested += req.req_trx.ids.size();
+         c->enqueue( req );
+      }
+   }
+
+   void dispatch_manager::send_requested_transactions(const connection_ptr& c, const vector<transaction_id_type>& ids) {
+      for( const auto& id : ids ) {
+         auto buff = my_impl->local_txns.serialized( id );
+         if( buff ) {
+            bytes_reused += buff->size();
+            c->enqueue_buffer( buff, true, priority::low, no_reason );
+         }
+      }
+   }
+
+   void dispatch_manager::expire_requested_transactions(const time_point& now) {
+      for( auto i = requested_transactions.begin(); i != requested_transactions.end(); ) {
+         if( i->second <= now ) {
+            i = requested_transactions.erase( i );
+         } else {
+            ++i;
+         }
+      }
+   }
+
    void dispatch_manager::retry_fetch(const connection_ptr& c) {
       if (!c->last_req) {
          return;
@@ -1852,7 +2585,11 @@ namespace eosio {
       auto current_endpoint = *endpoint_itr;
       ++endpoint_itr;
       c->connecting = true;
-      c->pending_message_buffer.reset();
+      {
+         std::lock_guard<std::mutex> g( c->read_mtx );
+         c->pending_message_buffer.reset();
+         c->outstanding_read_bytes.reset();
+      }
       connection_wptr weak_conn = c;
       c->socket->async_connect( current_endpoint, boost::asio::bind_executor( c->strand,
             [weak_conn, endpoint_itr, this]( const boost::system::error_code& err ) {
@@ -1973,7 +2710,11 @@ namespace eosio {
          }
          connection_wptr weak_conn = conn;
 
+         std::unique_lock<std::mutex> read_lock( conn->read_mtx );
+         const uint32_t read_generation = conn->read_generation;
          std::size_t minimum_read = conn->outstanding_read_bytes ? *conn->outstanding_read_bytes : message_header_size;
+         auto read_buffers = conn->pending_message_buffer.get_buffer_sequence_for_boost_async_read();
+         read_lock.unlock();
 
          if (use_socket_read_watermark) {
             const size_t max_socket_read_watermark = 4096;
@@ -2023,64 +2764,60 @@ namespace eosio {
          }
 
          ++conn->reads_in_flight;
-         boost::asio::async_read(*conn->socket,
-            conn->pending_message_buffer.get_buffer_sequence_for_boost_async_read(), completion_handler,
-            boost::asio::bind_executor( conn->strand,
-            [this,weak_conn]( boost::system::error_code ec, std::size_t bytes_transferred ) {
-            app().post( priority::medium, [this,weak_conn, ec, bytes_transferred]() {
+         boost::asio::async_read(*conn->socket, read_buffers, completion_handler,
+            [this,weak_conn,read_generation]( boost::system::error_code ec, std::size_t bytes_transferred ) {
+            // runs on a net thread: frame and unpack here, hand only the parsed messages to the main thread
+            auto conn = weak_conn.lock();
+            if (!conn) {
+               return;
+            }
+
+            auto parsed = std::make_shared<vector<parsed_message>>();
+            bool close_after = false;
+            std::unique_lock<std::mutex> read_lock( conn->read_mtx );
+            if( read_generation != conn->read_generation ) {
+               return; // closed since the read started, the buffer may already belong to a new session
+            }
+            conn->outstanding_read_bytes.reset();
+            if( !ec ) {
+               try {
+                  close_after = !parse_messages( conn, bytes_transferred, *parsed );
+               }
+               catch(const fc::exception &ex) {
+                  fc_elog( logger, "Exception in handling read data ${s}", ("s",ex.to_string()) );
+                  close_after = true;
+               }
+               catch(const std::exception &ex) {
+                  fc_elog( logger, "Exception in handling read data ${s}", ("s",ex.what()) );
+                  close_after = true;
+               }
+               catch (...) {
+                  fc_elog( logger, "Undefined exception handling the read data" );
+                  close_after = true;
+               }
+            }
+            read_lock.unlock();
+
+            app().post( priority::medium, [this,weak_conn, ec, parsed, close_after, read_generation]() {
                auto conn = weak_conn.lock();
-               if (!conn || !conn->socket || !conn->socket->is_open()) {
+               if (!conn || !conn->socket || !conn->socket->is_open() || read_generation != conn->read_generation) {
                   return;
                }
 
                --conn->reads_in_flight;
-               conn->outstanding_read_bytes.reset();
 
                try {
                   if( !ec ) {
-                     if (bytes_transferred > conn->pending_message_buffer.bytes_to_write()) {
-                        fc_elog( logger,"async_read_some callback: bytes_transfered = ${bt}, buffer.bytes_to_write = ${btw}",
-                                 ("bt",bytes_transferred)("btw",conn->pending_message_buffer.bytes_to_write()) );
-                     }
-                     EOS_ASSERT(bytes_transferred <= conn->pending_message_buffer.bytes_to_write(), plugin_exception, "");
-                     conn->pending_message_buffer.advance_write_ptr(bytes_transferred);
-                     while (conn->pending_message_buffer.bytes_to_read() > 0) {
-                        uint32_t bytes_in_buffer = conn->pending_message_buffer.bytes_to_read();
-
-                        if (bytes_in_buffer < message_header_size) {
-                           conn->outstanding_read_bytes.emplace(message_header_size - bytes_in_buffer);
-                           break;
-                        } else {
-                           uint32_t message_length;
-                           auto index = conn->pending_message_buffer.read_index();
-                           conn->pending_message_buffer.peek(&message_length, sizeof(message_length), index);
-                           if(message_length > def_send_buffer_size*2 || message_length == 0) {
-                              boost::system::error_code ec;
-                              fc_elog( logger,"incoming message length unexpected (${i}), from ${p}",
-                                       ("i", message_length)("p",boost::lexical_cast<std::string>(conn->socket->remote_endpoint(ec))) );
-                              close(conn);
-                              return;
-                           }
-
-                           auto total_message_bytes = message_length + message_header_size;
-
-                           if (bytes_in_buffer >= total_message_bytes) {
-                              conn->pending_message_buffer.advance_read_ptr(message_header_size);
-                              if (!process_next_message(conn, message_length)) {
-                                 return;
-                              }
-                           } else {
-                              auto outstanding_message_bytes = total_message_bytes - bytes_in_buffer;
-                              auto available_buffer_bytes = conn->pending_message_buffer.bytes_to_write();
-                              if (outstanding_message_bytes > available_buffer_bytes) {
-                                 conn->pending_message_buffer.add_space( outstanding_message_bytes - available_buffer_bytes );
-                              }
-
-                              conn->outstanding_read_bytes.emplace(outstanding_message_bytes);
-                              break;
-                           }
+                     for( auto& m : *parsed ) {
+                        handle_parsed_message( conn, m );
+                        if( !conn->socket->is_open() ) {
+                           return;
                         }
                      }
+                     if( close_after ) {
+                        close( conn );
+                        return;
+                     }
                      start_read_message(conn);
                   } else {
                      auto pname = conn->peer_name();
@@ -2108,7 +2845,7 @@ namespace eosio {
                   close( conn );
                }
             });
-         }));
+         });
       } catch (...) {
          string pname = conn ? conn->peer_name() : "no connection name";
          fc_elog( logger, "Undefined exception handling reading ${p}",("p",pname) );
@@ -2116,45 +2853,121 @@ namespace eosio {
       }
    }
 
-   bool net_plugin_impl::process_next_message(const connection_ptr& conn, uint32_t message_length) {
+   bool net_plugin_impl::parse_messages(const connection_ptr& conn, std::size_t bytes_transferred, vector<parsed_message>& parsed) {
+      if (bytes_transferred > conn->pending_message_buffer.bytes_to_write()) {
+         fc_elog( logger,"async_read_some callback: bytes_transfered = ${bt}, buffer.bytes_to_write = ${btw}",
+                  ("bt",bytes_transferred)("btw",conn->pending_message_buffer.bytes_to_write()) );
+      }
+      EOS_ASSERT(bytes_transferred <= conn->pending_message_buffer.bytes_to_write(), plugin_exception, "");
+      conn->pending_message_buffer.advance_write_ptr(bytes_transferred);
+      while (conn->pending_message_buffer.bytes_to_read() > 0) {
+         uint32_t bytes_in_buffer = conn->pending_message_buffer.bytes_to_read();
+
+         if (bytes_in_buffer < message_header_size) {
+            conn->outstanding_read_bytes.emplace(message_header_size - bytes_in_buffer);
+            break;
+         } else {
+            uint32_t message_length;
+            auto index = conn->pending_message_buffer.read_index();
+            conn->pending_message_buffer.peek(&message_length, sizeof(message_length), index);
+            if(message_length > def_send_buffer_size*2 || message_length == 0) {
+               boost::system::error_code ec;
+               fc_elog( logger,"incoming message length unexpected (${i}), from ${p}",
+                        ("i", message_length)("p",boost::lexical_cast<std::string>(conn->socket->remote_endpoint(ec))) );
+               return false;
+            }
+
+            auto total_message_bytes = message_length + message_header_size;
+
+            if (bytes_in_buffer >= total_message_bytes) {
+               conn->pending_message_buffer.advance_read_ptr(message_header_size);
+               if (!parse_next_message(conn, message_length, parsed)) {
+                  return false;
+               }
+            } else {
+               auto outstanding_message_bytes = total_message_bytes - bytes_in_buffer;
+               auto available_buffer_bytes = conn->pending_message_buffer.bytes_to_write();
+               if (outstanding_message_bytes > available_buffer_bytes) {
+                  conn->pending_message_buffer.add_space( outstanding_message_bytes - available_buffer_bytes );
+               }
+
+               conn->outstanding_read_bytes.emplace(outstanding_message_bytes);
+               break;
+            }
+         }
+      }
+      return true;
+   }
+
+   bool net_plugin_impl::parse_next_message(const connection_ptr& conn, uint32_t message_length, vector<parsed_message>& parsed) {
       try {
-         // if next message is a block we already have, exit early
+         parsed_message m;
          auto peek_ds = conn->pending_message_buffer.create_peek_datastream();
          unsigned_int which{};
          fc::raw::unpack( peek_ds, which );
-         if( which == signed_block_which ) {
-            block_header bh;
-            fc::raw::unpack( peek_ds, bh );
-
-            controller& cc = chain_plug->chain();
-            block_id_type blk_id = bh.id();
-            uint32_t blk_num = bh.block_num();
-            if( cc.fetch_block_by_id( blk_id ) ) {
-               sync_master->recv_block( conn, blk_id, blk_num );
-               conn->pending_message_buffer.advance_read_ptr( message_length );
-               return true;
-            }
+         if( which == signed_block_which || which == packed_transaction_which ) {
+            m.raw = std::make_shared<vector<char>>( message_header_size + message_length );
+            memcpy( m.raw->data(), &message_length, message_header_size );
+            auto index = conn->pending_message_buffer.read_index();
+            conn->pending_message_buffer.peek( m.raw->data() + message_header_size, message_length, index );
          }
 
          auto ds = conn->pending_message_buffer.create_datastream();
-         net_message msg;
-         fc::raw::unpack( ds, msg );
-         msg_handler m( *this, conn );
-         if( msg.contains<signed_block>() ) {
-            m( std::move( msg.get<signed_block>() ) );
-         } else if( msg.contains<packed_transaction>() ) {
-            m( std::move( msg.get<packed_transaction>() ) );
-         } else {
-            msg.visit( m );
+         fc::raw::unpack( ds, m.msg );
+         conn->wire_bytes_received += message_header_size + message_length;
+         if( m.msg.contains<compressed_message>() ) {
+            m.raw = decompress_message( m.msg.get<compressed_message>() );
+            fc::datastream<const char*> raw_ds( m.raw->data() + message_header_size, m.raw->size() - message_header_size );
+            fc::raw::unpack( raw_ds, m.msg );
+            EOS_ASSERT( m.msg.contains<signed_block>() || m.msg.contains<packed_transaction>(), plugin_exception,
+                        "only blocks and transactions are sent compressed" );
+         }
+         conn->bytes_received += m.raw ? m.raw->size() : message_header_size + message_length;
+         if( m.msg.contains<signed_block>() ) {
+            m.block = std::make_shared<signed_block>( std::move( m.msg.get<signed_block>() ) );
+            m.msg = net_message();
+         } else if( m.msg.contains<packed_transaction>() ) {
+            auto ptrx = std::make_shared<packed_transaction>( std::move( m.msg.get<packed_transaction>() ) );
+            m.msg = net_message();
+            m.trx = std::make_shared<transaction_metadata>( ptrx ); // computes the id here rather than on the main thread
+            if( have_txn( m.trx->id ) ) {
+               fc_dlog(logger, "got a duplicate transaction - dropping");
+               return true;
+            }
          }
+         parsed.emplace_back( std::move( m ) );
       } catch( const fc::exception& e ) {
          edump( (e.to_detail_string()) );
-         close( conn );
          return false;
       }
       return true;
    }
 
+   void net_plugin_impl::handle_parsed_message(const connection_ptr& conn, parsed_message& m) {
+      if( m.block ) {
+         // a block we already have, exit early
+         controller& cc = chain_plug->chain();
+         block_id_type blk_id = m.block->id();
+         if( cc.fetch_block_by_id( blk_id ) ) {
+            sync_master->recv_block( conn, blk_id, m.block->block_num() );
+            return;
+         }
+         // accept_block is synchronous, the buffer is taken over by bcast_block when the block is accepted
+         dispatcher->recv_block_buffer( m.block, m.raw );
+         handle_message( conn, m.block );
+         dispatcher->forget_block_buffer( m.block );
+      } else if( m.trx ) {
+         handle_message( conn, m.trx, m.raw );
+      } else {
+         msg_handler h( *this, conn );
+         m.msg.visit( h );
+      }
+   }
+
+   bool net_plugin_impl::have_txn(const transaction_id_type& id) const {
+      return local_txns.contains( id );
+   }
+
    size_t net_plugin_impl::count_open_sockets() const
    {
       size_t count = 0;
@@ -2256,6 +3069,7 @@ namespace eosio {
             return;
          }
          c->protocol_version = to_protocol_version(msg.network_version);
+         c->compress = compression != message_compression::none && c->protocol_version >= proto_compression;
          if(c->protocol_version != net_version) {
             if (network_version_match) {
                fc_elog( logger, "Peer network version does not match expected ${nv} but got ${mnv}",
@@ -2380,7 +3194,9 @@ namespace eosio {
          break;
       }
       case normal: {
-         dispatcher->recv_notice(c, msg, false);
+         if( !msg.known_trx.ids.empty() ) {
+            dispatcher->recv_announcement(c, msg.known_trx.ids);
+         }
       }
       }
 
@@ -2441,9 +3257,13 @@ namespace eosio {
          // no break
       case normal :
          if( !msg.req_trx.ids.empty() ) {
-            elog( "Invalid request_message, req_trx.ids.size ${s}", ("s", msg.req_trx.ids.size()) );
-            close(c);
-            return;
+            if( msg.req_trx.mode != normal || c->protocol_version < proto_trx_announce ||
+                msg.req_trx.ids.size() > def_max_trx_announce ) {
+               elog( "Invalid request_message, req_trx.ids.size ${s}", ("s", msg.req_trx.ids.size()) );
+               close(c);
+               return;
+            }
+            dispatcher->send_requested_transactions(c, msg.req_trx.ids);
          }
          break;
       default:;
@@ -2468,7 +3288,8 @@ namespace eosio {
              trx->get_signatures().size() * sizeof(signature_type);
    }
 
-   void net_plugin_impl::handle_message(const connection_ptr& c, const packed_transaction_ptr& trx) {
+   void net_plugin_impl::handle_message(const connection_ptr& c, const transaction_metadata_ptr& ptrx,
+                                        const std::shared_ptr<std::vector<char>>& raw) {
       fc_dlog(logger, "got a packed transaction, cancel wait");
       peer_ilog(c, "received packed_transaction");
       controller& cc = my_impl->chain_plug->chain();
@@ -2481,14 +3302,14 @@ namespace eosio {
          return;
       }
 
-      auto ptrx = std::make_shared<transaction_metadata>( trx );
       const auto& tid = ptrx->id;
 
-      if(local_txns.get<by_id>().find(tid) != local_txns.end()) {
+      if( have_txn( tid ) ) {
          fc_dlog(logger, "got a duplicate transaction - dropping");
          return;
       }
       dispatcher->recv_transaction(c, tid);
+      dispatcher->recv_transaction_buffer(ptrx, raw);
       c->trx_in_progress_size += calc_trx_size( ptrx->packed_trx );
       chain_plug->accept_transaction(ptrx, [c, this, ptrx](const static_variant<fc::exception_ptr, transaction_trace_ptr>& result) {
          c->trx_in_progress_size -= calc_trx_size( ptrx->packed_trx );
@@ -2505,7 +3326,7 @@ namespace eosio {
             peer_elog(c, "bad packed_transaction : ${m}", ("m",trace->except->what()));
          }
 
-         dispatcher->rejected_transaction(ptrx->id);
+         dispatcher->rejected_transaction(ptrx);
       });
    }
 
@@ -2526,6 +3347,10 @@ namespace eosio {
          fc_elog( logger,"Caught an unknown exception trying to recall blockID" );
       }
 
+      if( sync_master->buffer_block(c, msg, blk_num) ) {
+         return;
+      }
+
       dispatcher->recv_block(c, blk_id, blk_num);
       fc::microseconds age( fc::time_point::now() - msg->timestamp);
       peer_ilog(c, "received signed_block : #${n} block age in secs = ${age}",
@@ -2558,10 +3383,7 @@ namespace eosio {
       if( reason == no_reason ) {
          for (const auto &recpt : msg->transactions) {
             auto id = (recpt.trx.which() == 0) ? recpt.trx.get<transaction_id_type>() : recpt.trx.get<packed_transaction>().id();
-            auto ltx = local_txns.get<by_id>().find(id);
-            if( ltx != local_txns.end()) {
-               local_txns.modify( ltx, ubn );
-            }
+            local_txns.set_block_num( id, blk_num );
             auto ctx = c->trx_state.get<by_id>().find(id);
             if( ctx != c->trx_state.end()) {
                c->trx_state.modify( ctx, ubn );
@@ -2605,6 +3427,19 @@ namespace eosio {
       });
    }
 
+   void net_plugin_impl::start_announce_timer() {
+      announce_check->expires_from_now( def_trx_announce_interval );
+      announce_check->async_wait( [this]( boost::system::error_code ec ) {
+         app().post( priority::low, [this, ec]() {
+            if( ec ) {
+               dispatcher->announce_scheduled = false;
+               return;
+            }
+            dispatcher->send_announcements();
+         } );
+      });
+   }
+
    void net_plugin_impl::ticker() {
       keepalive_timer->expires_from_now(keepalive_interval);
       keepalive_timer->async_wait( [this]( boost::system::error_code ec ) {
@@ -2625,6 +3460,7 @@ namespace eosio {
    void net_plugin_impl::start_monitors() {
       connector_check.reset(new boost::asio::steady_timer( *server_ioc ));
       transaction_check.reset(new boost::asio::steady_timer( *server_ioc ));
+      announce_check.reset(new boost::asio::steady_timer( *server_ioc ));
       start_conn_timer(connector_period, std::weak_ptr<connection>());
       start_txn_timer();
    }
@@ -2640,6 +3476,8 @@ namespace eosio {
       controller& cc = chain_plug->chain();
       uint32_t lib = cc.last_irreversible_block_num();
       dispatcher->expire_blocks( lib );
+      dispatcher->expire_transaction_buffers( time_point::now() );
+      dispatcher->expire_requested_transactions( time_point::now() );
       for ( auto &c : connections ) {
          auto &stale_txn = c->trx_state.get<by_block_num>();
          stale_txn.erase( stale_txn.lower_bound(1), stale_txn.upper_bound(lib) );
@@ -2650,18 +3488,22 @@ namespace eosio {
       }
       fc_dlog(logger, "expire_txns ${n}us size ${s} removed ${r}",
             ("n", time_point::now() - now)("s", start_size)("r", start_size - local_txns.size()) );
+      fc_dlog(logger, "send buffers: packed ${p} bytes, reused ${r} bytes, compressed ${c} bytes, sent ${s} bytes",
+            ("p", dispatcher->bytes_packed)("r", dispatcher->bytes_reused)("c", dispatcher->bytes_compressed)
+            ("s", dispatcher->bytes_sent) );
+      fc_dlog(logger, "trx announcements: announced ${a} ids, requested ${r} ids, ${o} requests outstanding",
+            ("a", dispatcher->trx_announced)("r", dispatcher->trx_requested)("o", dispatcher->requested_transactions.size()) );
+      auto st = local_txns.get_stats();
+      fc_dlog(logger, "local_txns: ${i} inserts ${iu}us, ${l} lookups ${lu}us, ${e} expired ${eu}us, longest expire ${m}us",
+            ("i", st.inserts)("iu", st.insert_us)("l", st.lookups)("lu", st.lookup_us)
+            ("e", st.expired)("eu", st.expire_us)("m", st.max_expire_us) );
    }
 
    void net_plugin_impl::expire_local_txns() {
-      auto& old = local_txns.get<by_expiry>();
-      auto ex_lo = old.lower_bound( fc::time_point_sec(0) );
-      auto ex_up = old.upper_bound( time_point::now() );
-      old.erase( ex_lo, ex_up );
-
-      auto& stale = local_txns.get<by_block_num>();
       controller& cc = chain_plug->chain();
       uint32_t lib = cc.last_irreversible_block_num();
-      stale.erase( stale.lower_bound(1), stale.upper_bound(lib) );
+
+      local_txns.expire( time_point::now(), lib );
    }
 
    void net_plugin_impl::connection_monitor(std::weak_ptr<connection> from_connection) {
@@ -2710,7 +3552,7 @@ namespace eosio {
       const auto& id = results.second->id;
       if (results.first) {
          fc_ilog(logger,"signaled NACK, trx-id = ${id} : ${why}",("id", id)("why", results.first->to_detail_string()));
-         dispatcher->rejected_transaction(id);
+         dispatcher->rejected_transaction(results.second);
       } else {
          fc_ilog(logger,"signaled ACK, trx-id = ${id}",("id", id));
          dispatcher->bcast_transaction(results.second);
@@ -2868,6 +3710,15 @@ namespace eosio {
          ( "net-threads", bpo::value<uint16_t>()->default_value(my->thread_pool_size),
            "Number of worker threads in net_plugin thread pool" )
          ( "sync-fetch-span", bpo::value<uint32_t>()->default_value(def_sync_fetch_span), "number of blocks to retrieve in a chunk from any individual peer during synchronization")
+         ( "sync-peers", bpo::value<uint32_t>()->default_value(def_sync_peers), "number of peers to fetch disjoint chunks from concurrently while catching up to the last irreversible block, 1 to sync from a single peer at a time")
+         ( "p2p-compression", bpo::value<string>()->default_value("none"),
+           "Compress blocks and transactions sent to peers that accept compressed messages, one of 'zlib' or 'none'. "
+           "Compressed messages are accepted either way.")
+         ( "p2p-compress-min-bytes", bpo::value<uint32_t>()->default_value(def_compress_min_bytes),
+           "Smallest serialized block or transaction compressed when p2p-compression is enabled")
+         ( "p2p-transaction-announce", bpo::value<bool>()->default_value(false),
+           "Announce the ids of new transactions to peers that support it and send the bodies only when requested, "
+           "instead of pushing every transaction to every peer")
          ( "use-socket-read-watermark", bpo::value<bool>()->default_value(false), "Enable expirimental socket read watermark optimization")
          ( "peer-log-format", bpo::value<string>()->default_value( "[\"${_name}\" ${_ip}:${_port}]" ),
            "The string used to format peers when logging messages about them.  Variables are escaped with ${<variable name>}.\n"
@@ -2894,7 +3745,7 @@ namespace eosio {
 
          my->network_version_match = options.at( "network-version-match" ).as<bool>();
 
-         my->sync_master.reset( new sync_manager( options.at( "sync-fetch-span" ).as<uint32_t>()));
+         my->sync_master.reset( new sync_manager( options.at( "sync-fetch-span" ).as<uint32_t>(), options.at( "sync-peers" ).as<uint32_t>()));
          my->dispatcher.reset( new dispatch_manager );
 
          my->connector_period = std::chrono::seconds( options.at( "connection-cleanup-period" ).as<int>());
@@ -2908,6 +3759,13 @@ namespace eosio {
 
          my->use_socket_read_watermark = options.at( "use-socket-read-watermark" ).as<bool>();
 
+         const auto& compression = options.at( "p2p-compression" ).as<string>();
+         EOS_ASSERT( compression == "zlib" || compression == "none", chain::plugin_config_exception,
+                     "p2p-compression must be 'zlib' or 'none'" );
+         my->compression = compression == "zlib" ? message_compression::zlib : message_compression::none;
+         my->compress_min_bytes = options.at( "p2p-compress-min-bytes" ).as<uint32_t>();
+         my->trx_announce = options.at( "p2p-transaction-announce" ).as<bool>();
+
          if( options.count( "p2p-listen-endpoint" ) && options.at("p2p-listen-endpoint").as<string>().length()) {
             my->p2p_address = options.at( "p2p-listen-endpoint" ).as<string>();
          }
@@ -3062,6 +3920,8 @@ namespace eosio {
             my->connector_check->cancel();
          if( my->transaction_check )
             my->transaction_check->cancel();
+         if( my->announce_check )
+            my->announce_check->cancel();
          if( my->keepalive_timer )
             my->keepalive_timer->cancel();
 
@@ -90,6 +90,8 @@ void producer_api_plugin::plugin_startup() {
             INVOKE_R_V(producer, get_integrity_hash), 201),
        CALL(producer, producer, create_snapshot,
             INVOKE_R_V(producer, create_snapshot), 201),
+       CALL(producer, producer, get_subjective_cpu,
+            INVOKE_R_R(producer, get_subjective_cpu, producer_plugin::subjective_cpu_params), 201),
    });
 }
 
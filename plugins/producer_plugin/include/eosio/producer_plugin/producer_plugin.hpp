@@ -51,6 +51,23 @@ public:
       std::string          snapshot_name;
    };
 
+   struct subjective_cpu_params {
+      fc::optional<account_name> lower_bound;
+      fc::optional<uint32_t>     limit = 100;
+   };
+
+   struct subjective_cpu_account {
+      account_name account;
+      int64_t      failed_cpu_us = 0; ///< decayed CPU time used by the account's failed transactions
+      bool         over_budget = false;
+   };
+
+   struct subjective_cpu_results {
+      int64_t                              budget_us = -1;
+      std::vector<subjective_cpu_account>  accounts;
+      fc::optional<account_name>           more;
+   };
+
    producer_plugin();
    virtual ~producer_plugin();
 
@@ -84,6 +101,8 @@ public:
    integrity_hash_information get_integrity_hash() const;
    snapshot_information create_snapshot() const;
 
+   subjective_cpu_results get_subjective_cpu(const subjective_cpu_params& params) const;
+
    signal<void(const chain::producer_confirmation&)> confirmed_block;
 private:
    std::shared_ptr<class producer_plugin_impl> my;
@@ -96,4 +115,7 @@ FC_REFLECT(eosio::producer_plugin::greylist_params, (accounts));
 FC_REFLECT(eosio::producer_plugin::whitelist_blacklist, (actor_whitelist)(actor_blacklist)(contract_whitelist)(contract_blacklist)(action_blacklist)(key_blacklist) )
 FC_REFLECT(eosio::producer_plugin::integrity_hash_information, (head_block_id)(integrity_hash))
 FC_REFLECT(eosio::producer_plugin::snapshot_information, (head_block_id)(snapshot_name))
+FC_REFLECT(eosio::producer_plugin::subjective_cpu_params, (lower_bound)(limit))
+FC_REFLECT(eosio::producer_plugin::subjective_cpu_account, (account)(failed_cpu_us)(over_budget))
+FC_REFLECT(eosio::producer_plugin::subjective_cpu_results, (budget_us)(accounts)(more))
 
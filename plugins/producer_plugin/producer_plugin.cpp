@@ -19,6 +19,7 @@
 
 #include <iostream>
 #include <algorithm>
+#include <cmath>
 #include <boost/algorithm/string.hpp>
 #include <boost/range/adaptor/map.hpp>
 #include <boost/function_output_iterator.hpp>
@@ -86,6 +87,193 @@ using transaction_id_with_expiry_index = multi_index_container<
    >
 >;
 
+/**
+ * Decides the order in which start_block retries unapplied and queued incoming transactions.
+ *
+ * Transactions are ranked by the tier of their first authorizer (priority-account, higher first); within a tier
+ * the ones that already failed subjectively go last, the rest are ordered by transaction-priority: arrival keeps
+ * the order they were received in, cost prefers the ones that were cheapest when last executed (never executed
+ * counts as free) and expiration prefers the ones closest to expiring. Time spent retrying known failing
+ * transactions is capped per block so they cannot starve the others.
+ */
+class transaction_scheduler {
+   public:
+      enum class order_by {
+         arrival,
+         cost,
+         expiration
+      };
+
+      order_by                               order = order_by::arrival;
+      std::map<account_name, uint32_t>       tiers;
+      fc::microseconds                       max_failing_time_per_block = fc::microseconds(-1);
+
+      /// Stable sorts @p trxs by priority, @p get returns the transaction_metadata of an element
+      template<typename Container, typename Get>
+      void sort( Container& trxs, Get get ) const {
+         if( trxs.size() < 2 || (order == order_by::arrival && tiers.empty() && _history.empty()) )
+            return;
+
+         std::vector<std::pair<priority, size_t>> keys;
+         keys.reserve( trxs.size() );
+         for( size_t i = 0; i < trxs.size(); ++i )
+            keys.emplace_back( priority_of( get( trxs[i] ) ), i );
+         std::stable_sort( keys.begin(), keys.end(), []( const auto& a, const auto& b ) { return a.first < b.first; } );
+
+         Container sorted;
+         for( const auto& k : keys )
+            sorted.push_back( std::move( trxs[k.second] ) );
+         trxs.swap( sorted );
+      }
+
+      /// Resets the per block budget for known failing transactions and forgets expired ones
+      void start_block( const fc::time_point& block_time ) {
+         _failing_time = fc::microseconds();
+         auto& by_exp = _history.get<by_expiry>();
+         while( !by_exp.empty() && by_exp.begin()->expiry < block_time )
+            by_exp.erase( by_exp.begin() );
+      }
+
+      /// true if @p id failed subjectively before and the budget for retrying such transactions is used up
+      bool should_skip( const transaction_id_type& id ) const {
+         if( max_failing_time_per_block.count() < 0 || _failing_time < max_failing_time_per_block )
+            return false;
+         auto itr = _history.find( id );
+         return itr != _history.end() && itr->failures > 0;
+      }
+
+      /// Remembers the outcome of executing @p trx, which took @p elapsed wall-clock time
+      void record( const transaction_metadata& trx, const fc::microseconds& elapsed, bool subjective_failure ) {
+         auto itr = _history.find( trx.id );
+         if( itr == _history.end() ) {
+            if( subjective_failure || order == order_by::cost ) {
+               _history.insert( transaction_history{trx.id, trx.packed_trx->expiration(), elapsed, subjective_failure ? 1u : 0u} );
+            }
+            return;
+         }
+         if( itr->failures > 0 )
+            _failing_time += elapsed;
+         _history.modify( itr, [&]( auto& h ) {
+            h.cost = elapsed;
+            h.failures = subjective_failure ? h.failures + 1 : 0;
+         } );
+      }
+
+      size_t size() const { return _history.size(); }
+
+   private:
+      struct priority {
+         uint32_t tier = 0;
+         bool     failing = false;
+         int64_t  rank = 0; ///< lower first, depends on order
+
+         bool operator<( const priority& o ) const {
+            return std::make_tuple( o.tier, failing, rank ) < std::make_tuple( tier, o.failing, o.rank );
+         }
+      };
+
+      struct transaction_history {
+         transaction_id_type     trx_id;
+         fc::time_point          expiry;
+         fc::microseconds        cost;
+         uint32_t                failures = 0;
+      };
+
+      using transaction_history_index = multi_index_container<
+         transaction_history,
+         indexed_by<
+            hashed_unique<tag<by_id>, BOOST_MULTI_INDEX_MEMBER(transaction_history, transaction_id_type, trx_id)>,
+            ordered_non_unique<tag<by_expiry>, BOOST_MULTI_INDEX_MEMBER(transaction_history, fc::time_point, expiry)>
+         >
+      >;
+
+      priority priority_of( const transaction_metadata& trx ) const {
+         priority p;
+         if( !tiers.empty() ) {
+            auto itr = tiers.find( trx.packed_trx->get_transaction().first_authorizor() );
+            if( itr != tiers.end() )
+               p.tier = itr->second;
+         }
+         auto h = _history.find( trx.id );
+         if( h != _history.end() )
+            p.failing = h->failures > 0;
+         switch( order ) {
+            case order_by::cost:
+               p.rank = h != _history.end() ? h->cost.count() : 0;
+               break;
+            case order_by::expiration:
+               p.rank = fc::time_point( trx.packed_trx->expiration() ).time_since_epoch().count();
+               break;
+            case order_by::arrival:
+               break;
+         }
+         return p;
+      }
+
+      transaction_history_index  _history;
+      fc::microseconds           _failing_time;
+};
+
+/**
+ * Per account record of the CPU time spent executing transactions that failed, charged to their first authorizer.
+ * Subjective failures (e.g. the block deadline ran out) are not the account's fault and are retried, so they are
+ * not charged.
+ * Charges decay exponentially with a configurable half-life. New incoming transactions of an account whose decayed
+ * total is over the budget are rejected before they are executed.
+ */
+class subjective_cpu_ledger {
+   public:
+      struct account_usage {
+         double            failed_cpu_us = 0;
+         fc::time_point    updated;
+      };
+
+      int64_t              budget_us = -1; ///< negative disables early rejection
+      fc::microseconds     half_life = fc::seconds(60);
+
+      void charge( const account_name& a, const fc::microseconds& elapsed, const fc::time_point& now ) {
+         auto& u = _accounts[a];
+         u.failed_cpu_us = failed_cpu_us( u, now ) + elapsed.count();
+         u.updated = now;
+      }
+
+      double failed_cpu_us( const account_usage& u, const fc::time_point& now ) const {
+         if( now <= u.updated )
+            return u.failed_cpu_us;
+         return u.failed_cpu_us * std::exp2( -double( (now - u.updated).count() ) / half_life.count() );
+      }
+
+      bool over_budget( const account_usage& u, const fc::time_point& now ) const {
+         return budget_us >= 0 && failed_cpu_us( u, now ) > budget_us;
+      }
+
+      bool over_budget( const account_name& a, const fc::time_point& now ) const {
+         if( budget_us < 0 )
+            return false;
+         auto itr = _accounts.find( a );
+         return itr != _accounts.end() && over_budget( itr->second, now );
+      }
+
+      /// Forgets accounts whose charges decayed below a microsecond, at most once per half-life
+      void prune( const fc::time_point& now ) {
+         if( now < _last_prune + half_life )
+            return;
+         _last_prune = now;
+         for( auto itr = _accounts.begin(); itr != _accounts.end(); ) {
+            if( failed_cpu_us( itr->second, now ) < 1.0 )
+               itr = _accounts.erase( itr );
+            else
+               ++itr;
+         }
+      }
+
+      const std::map<account_name, account_usage>& accounts() const { return _accounts; }
+
+   private:
+      std::map<account_name, account_usage>  _accounts;
+      fc::time_point                         _last_prune;
+};
+
 enum class pending_block_mode {
    producing,
    speculating
@@ -158,6 +346,8 @@ class producer_plugin_impl : public std::enable_shared_from_this<producer_plugin
       incoming::methods::transaction_async::method_type::handle _incoming_transaction_async_provider;
 
       transaction_id_with_expiry_index                         _blacklisted_transactions;
+      transaction_scheduler                                    _scheduler;
+      subjective_cpu_ledger                                    _subjective_cpu;
 
       fc::optional<scoped_connection>                          _accepted_block_connection;
       fc::optional<scoped_connection>                          _irreversible_block_connection;
@@ -346,26 +536,81 @@ class producer_plugin_impl : public std::enable_shared_from_this<producer_plugin
          }
       }
 
-      std::deque<std::tuple<transaction_metadata_ptr, bool, next_function<transaction_trace_ptr>>> _pending_incoming_transactions;
+      struct incoming_transaction {
+         transaction_metadata_ptr              trx;
+         bool                                  persist_until_expired = false;
+         next_function<transaction_trace_ptr>  next;
+      };
 
+      std::deque<incoming_transaction> _pending_incoming_transactions;
+
+      /**
+       * Recovers the signing keys and runs the checks that need no chain state on the thread pool, so that
+       * only transactions ready to execute reach the main thread. Failures are reported from there.
+       */
       void on_incoming_transaction_async(const transaction_metadata_ptr& trx, bool persist_until_expired, next_function<transaction_trace_ptr> next) {
          chain::controller& chain = chain_plug->chain();
          const auto& cfg = chain.get_global_properties().configuration;
          signing_keys_future_type future = transaction_metadata::start_recover_keys( trx, *_thread_pool,
                chain.get_chain_id(), fc::microseconds( cfg.max_transaction_cpu_usage ) );
-         boost::asio::post( *_thread_pool, [self = this, future, trx, persist_until_expired, next]() {
-            if( future.valid() )
-               future.wait();
-            app().post(priority::low, [self, trx, persist_until_expired, next]() {
+         const auto max_lifetime = fc::seconds( cfg.max_transaction_lifetime );
+         const bool skip_checks = chain.skip_trx_checks();
+         boost::asio::post( *_thread_pool, [self = this, future, trx, persist_until_expired, next, max_lifetime, skip_checks]() {
+            fc::exception_ptr except;
+            try {
+               if( future.valid() )
+                  future.get(); // rethrows a failed recovery
+               if( !skip_checks )
+                  prevalidate_transaction( *trx, max_lifetime );
+            } catch( const fc::exception& e ) {
+               except = e.dynamic_copy_exception();
+            } catch( const std::exception& e ) {
+               except = fc::std_exception_wrapper::from_current_exception( e ).dynamic_copy_exception();
+            }
+            app().post(priority::low, [self, trx, persist_until_expired, next, except]() {
+               if( except ) {
+                  self->reject_incoming_transaction( trx, next, except );
+                  return;
+               }
                self->process_incoming_transaction_async( trx, persist_until_expired, next );
             });
          });
       }
 
+      /**
+       * The transaction checks of transaction_context that read no chain state. The pending block time is not
+       * known here, so the expiration window is widened by a block interval on both sides; the exact check is
+       * repeated when the transaction executes.
+       */
+      static void prevalidate_transaction( const transaction_metadata& trx, const fc::microseconds& max_lifetime ) {
+         const signed_transaction& t = trx.packed_trx->get_signed_transaction();
+         const auto now = fc::time_point::now();
+         const auto slack = fc::milliseconds( config::block_interval_ms );
+         const fc::time_point expiration = t.expiration;
+         EOS_ASSERT( expiration + slack >= now, expired_tx_exception, "expired transaction ${id}", ("id", trx.id) );
+         EOS_ASSERT( expiration <= now + max_lifetime + slack, tx_exp_too_far_exception,
+                     "Transaction expiration is too far in the future, expiration is ${exp} and the maximum transaction lifetime is ${max}",
+                     ("exp", t.expiration)("max", max_lifetime) );
+
+         for( const auto& a : t.context_free_actions ) {
+            EOS_ASSERT( a.authorization.size() == 0, transaction_exception,
+                        "context-free actions cannot have authorizations" );
+         }
+         bool one_auth = std::any_of( t.actions.begin(), t.actions.end(), []( const action& a ) { return !a.authorization.empty(); } );
+         EOS_ASSERT( one_auth, tx_no_auths, "transaction must have at least one authorization" );
+      }
+
+      void reject_incoming_transaction(const transaction_metadata_ptr& trx, const next_function<transaction_trace_ptr>& next, const fc::exception_ptr& except) {
+         next(except);
+         _transaction_ack_channel.publish(priority::low, std::pair<fc::exception_ptr, transaction_metadata_ptr>(except, trx));
+         fc_dlog(_trx_trace_log, "[TRX_TRACE] Pre-validation is REJECTING tx: ${txid} : ${why} ",
+                 ("txid", trx->id)("why", except->what()));
+      }
+
       void process_incoming_transaction_async(const transaction_metadata_ptr& trx, bool persist_until_expired, next_function<transaction_trace_ptr> next) {
          chain::controller& chain = chain_plug->chain();
          if (!chain.pending_block_state()) {
-            _pending_incoming_transactions.emplace_back(trx, persist_until_expired, next);
+            _pending_incoming_transactions.emplace_back(incoming_transaction{trx, persist_until_expired, next});
             return;
          }
 
@@ -411,6 +656,13 @@ class producer_plugin_impl : public std::enable_shared_from_this<producer_plugin
             return;
          }
 
+         const auto first_auth = trx->packed_trx->get_transaction().first_authorizor();
+         if( _subjective_cpu.over_budget(first_auth, fc::time_point::now()) ) {
+            send_response(std::static_pointer_cast<fc::exception>(std::make_shared<subjective_cpu_budget_exceeded>(
+                  FC_LOG_MESSAGE(error, "account ${a} exceeded the CPU budget for failed transactions, rejecting ${id}", ("a", first_auth)("id", id)) )));
+            return;
+         }
+
          auto deadline = fc::time_point::now() + fc::milliseconds(_max_transaction_time_ms);
          bool deadline_is_subjective = false;
          const auto block_deadline = calculate_block_deadline(block_time);
@@ -420,10 +672,14 @@ class producer_plugin_impl : public std::enable_shared_from_this<producer_plugin
          }
 
          try {
+            const auto start = fc::time_point::now();
             auto trace = chain.push_transaction(trx, deadline);
+            const auto end = fc::time_point::now();
+            const bool subjective_failure = trace->except && failure_is_subjective(*trace->except, deadline_is_subjective);
+            _scheduler.record(*trx, end - start, subjective_failure);
             if (trace->except) {
-               if (failure_is_subjective(*trace->except, deadline_is_subjective)) {
-                  _pending_incoming_transactions.emplace_back(trx, persist_until_expired, next);
+               if (subjective_failure) {
+                  _pending_incoming_transactions.emplace_back(incoming_transaction{trx, persist_until_expired, next});
                   if (_pending_block_mode == pending_block_mode::producing) {
                      fc_dlog(_trx_trace_log, "[TRX_TRACE] Block ${block_num} for producer ${prod} COULD NOT FIT, tx: ${txid} RETRYING ",
                              ("block_num", chain.head_block_num() + 1)
@@ -434,6 +690,7 @@ class producer_plugin_impl : public std::enable_shared_from_this<producer_plugin
                              ("txid", trx->id));
                   }
                } else {
+                  _subjective_cpu.charge(first_auth, end - start, end);
                   auto e_ptr = trace->except->dynamic_copy_exception();
                   send_response(e_ptr);
                }
@@ -550,6 +807,20 @@ void producer_plugin::set_program_options(
           "Maximum wall-clock time, in milliseconds, spent retiring scheduled transactions in any block before returning to normal transaction processing.")
          ("incoming-defer-ratio", bpo::value<double>()->default_value(1.0),
           "ratio between incoming transations and deferred transactions when both are exhausted")
+         ("transaction-priority", bpo::value<string>()->default_value("arrival"),
+          "Order in which unapplied and queued incoming transactions are retried within a priority tier. Options are:\n"
+          "  arrival   \tthe order they were received in\n"
+          "  cost      \tcheapest first, by the time their last execution took\n"
+          "  expiration\tclosest to expiring first")
+         ("priority-account", bpo::value<vector<string>>()->composing()->multitoken(),
+          "Account whose transactions are retried before others, as <account> or <account>=<tier>; higher tiers go first, the default tier is 1 (may specify multiple times)")
+         ("max-failing-transaction-time-per-block-ms", bpo::value<int32_t>()->default_value(50),
+          "Maximum wall-clock time, in milliseconds, spent in any block retrying transactions that already failed to fit in a block (-1 for unlimited)")
+         ("subjective-account-failure-budget-us", bpo::value<int64_t>()->default_value(-1),
+          "Maximum wall-clock time, in microseconds, that transactions of an account may have spent executing before failing; "
+          "new transactions of an account over it are rejected without being executed (-1 to disable)")
+         ("subjective-account-decay-half-life-sec", bpo::value<uint32_t>()->default_value(60),
+          "Half-life, in seconds, of the time charged to an account for its failed transactions")
          ("producer-threads", bpo::value<uint16_t>()->default_value(config::default_controller_thread_pool_size),
           "Number of worker threads in producer thread pool")
          ("snapshots-dir", bpo::value<bfs::path>()->default_value("snapshots"),
@@ -694,6 +965,51 @@ void producer_plugin::plugin_initialize(const boost::program_options::variables_
 
    my->_incoming_defer_ratio = options.at("incoming-defer-ratio").as<double>();
 
+   const auto& trx_priority = options.at("transaction-priority").as<string>();
+   if( trx_priority == "arrival" ) {
+      my->_scheduler.order = transaction_scheduler::order_by::arrival;
+   } else if( trx_priority == "cost" ) {
+      my->_scheduler.order = transaction_scheduler::order_by::cost;
+   } else if( trx_priority == "expiration" ) {
+      my->_scheduler.order = transaction_scheduler::order_by::expiration;
+   } else {
+      EOS_THROW( plugin_config_exception, "unknown transaction-priority ${p}", ("p", trx_priority) );
+   }
+
+   if( options.count("priority-account") ) {
+      for( const auto& s : options["priority-account"].as<vector<string>>() ) {
+         auto delim = s.find('=');
+         const auto account_str = s.substr( 0, delim );
+         EOS_ASSERT( !account_str.empty(), plugin_config_exception, "missing account in priority-account ${s}", ("s", s) );
+         account_name account;
+         try {
+            account = account_name( account_str );
+         } EOS_RETHROW_EXCEPTIONS( plugin_config_exception, "invalid account in priority-account ${s}", ("s", s) )
+         uint32_t tier = 1;
+         if( delim != string::npos ) {
+            const auto tier_str = s.substr( delim + 1 );
+            uint64_t t = 0;
+            bool valid = !tier_str.empty() && tier_str.size() <= 10;
+            for( char c : tier_str ) {
+               valid = valid && c >= '0' && c <= '9';
+               if( valid ) t = t * 10 + (c - '0');
+            }
+            EOS_ASSERT( valid && t <= std::numeric_limits<uint32_t>::max(), plugin_config_exception,
+                        "invalid tier in priority-account ${s}, expected <account>=<unsigned 32-bit integer>", ("s", s) );
+            tier = t;
+         }
+         my->_scheduler.tiers[account] = tier;
+      }
+   }
+
+   my->_scheduler.max_failing_time_per_block = fc::milliseconds( options.at("max-failing-transaction-time-per-block-ms").as<int32_t>() );
+
+   my->_subjective_cpu.budget_us = options.at("subjective-account-failure-budget-us").as<int64_t>();
+   auto half_life_sec = options.at("subjective-account-decay-half-life-sec").as<uint32_t>();
+   EOS_ASSERT( half_life_sec > 0, plugin_config_exception,
+               "subjective-account-decay-half-life-sec ${n} must be greater than 0", ("n", half_life_sec) );
+   my->_subjective_cpu.half_life = fc::seconds( half_life_sec );
+
    auto thread_pool_size = options.at( "producer-threads" ).as<uint16_t>();
    EOS_ASSERT( thread_pool_size > 0, plugin_config_exception,
                "producer-threads ${num} must be greater than 0", ("num", thread_pool_size));
@@ -976,6 +1292,25 @@ producer_plugin::snapshot_information producer_plugin::create_snapshot() const {
    return {head_id, snapshot_path};
 }
 
+producer_plugin::subjective_cpu_results producer_plugin::get_subjective_cpu(const subjective_cpu_params& params) const {
+   subjective_cpu_results results;
+   const auto& ledger = my->_subjective_cpu;
+   const auto& accounts = ledger.accounts();
+   const auto now = fc::time_point::now();
+   const uint32_t limit = params.limit ? *params.limit : 100;
+
+   results.budget_us = ledger.budget_us;
+   auto itr = params.lower_bound ? accounts.lower_bound(*params.lower_bound) : accounts.begin();
+   for( ; itr != accounts.end(); ++itr ) {
+      if( results.accounts.size() >= limit ) {
+         results.more = itr->first;
+         break;
+      }
+      results.accounts.push_back({itr->first, int64_t(ledger.failed_cpu_us(itr->second, now)), ledger.over_budget(itr->second, now)});
+   }
+   return results;
+}
+
 optional<fc::time_point> producer_plugin_impl::calculate_next_block_time(const account_name& producer_name, const block_timestamp_type& current_block_time) const {
    chain::controller& chain = chain_plug->chain();
    const auto& hbs = chain.head_block_state();
@@ -1194,6 +1529,9 @@ producer_plugin_impl::start_block_result producer_plugin_impl::start_block() {
       }
 
       try {
+         _scheduler.start_block(pbs->header.timestamp.to_time_point());
+         _subjective_cpu.prune(fc::time_point::now());
+         _scheduler.sort(_pending_incoming_transactions, [](const incoming_transaction& e) -> const transaction_metadata& { return *e.trx; });
          size_t orig_pending_txn_size = _pending_incoming_transactions.size();
 
          // Processing unapplied transactions...
@@ -1210,6 +1548,7 @@ producer_plugin_impl::start_block_result producer_plugin_impl::start_block() {
                int num_applied = 0;
                int num_failed = 0;
                int num_processed = 0;
+               int num_skipped = 0;
                auto calculate_transaction_category = [&](const transaction_metadata_ptr& trx) {
                   if (trx->packed_trx->expiration() < pbs->header.timestamp.to_time_point()) {
                      return tx_category::EXPIRED;
@@ -1220,13 +1559,10 @@ producer_plugin_impl::start_block_result producer_plugin_impl::start_block() {
                   }
                };
 
+               // drop what can no longer be applied and collect what should be retried, in scheduler order
+               vector<transaction_metadata_ptr> retry;
                auto itr = unapplied_trxs.begin();
                while( itr != unapplied_trxs.end() ) {
-                  auto itr_next = itr; // save off next since itr may be invalidated by loop
-                  ++itr_next;
-
-                  if( preprocess_deadline <= fc::time_point::now() ) exhausted = true;
-                  if( exhausted ) break;
                   const auto& trx = itr->second;
                   auto category = calculate_transaction_category(trx);
                   if (category == tx_category::EXPIRED ||
@@ -1236,49 +1572,67 @@ producer_plugin_impl::start_block_result producer_plugin_impl::start_block() {
                         fc_dlog(_trx_trace_log, "[TRX_TRACE] Node with producers configured is dropping an EXPIRED transaction that was PREVIOUSLY ACCEPTED : ${txid}",
                                ("txid", trx->id));
                      }
-                     itr = unapplied_trxs.erase( itr ); // unapplied_trxs map has not been modified, so simply erase and continue
+                     itr = unapplied_trxs.erase( itr );
                      continue;
                   } else if (category == tx_category::PERSISTED ||
                             (category == tx_category::UNEXPIRED_UNPERSISTED && _pending_block_mode == pending_block_mode::producing))
                   {
-                     ++num_processed;
-
-                     try {
-                        auto deadline = fc::time_point::now() + fc::milliseconds(_max_transaction_time_ms);
-                        bool deadline_is_subjective = false;
-                        if (_max_transaction_time_ms < 0 || (_pending_block_mode == pending_block_mode::producing && preprocess_deadline < deadline)) {
-                           deadline_is_subjective = true;
-                           deadline = preprocess_deadline;
-                        }
+                     retry.push_back( trx );
+                  }
+                  ++itr;
+               }
+               _scheduler.sort( retry, [](const transaction_metadata_ptr& trx) -> const transaction_metadata& { return *trx; } );
 
-                        auto trace = chain.push_transaction(trx, deadline);
-                        if (trace->except) {
-                           if (failure_is_subjective(*trace->except, deadline_is_subjective)) {
-                              exhausted = true;
-                              break;
-                           } else {
-                              // this failed our configured maximum transaction time, we don't want to replay it
-                              // chain.plus_transactions can modify unapplied_trxs, so erase by id
-                              unapplied_trxs.erase( trx->signed_id );
-                              ++num_failed;
-                           }
-                        } else {
-                           ++num_applied;
-                        }
-                     } catch ( const guard_exception& e ) {
-                        chain_plug->handle_guard_exception(e);
-                        return start_block_result::failed;
-                     } FC_LOG_AND_DROP();
+               for( const auto& trx : retry ) {
+                  if( preprocess_deadline <= fc::time_point::now() ) exhausted = true;
+                  if( exhausted ) break;
+                  // chain.push_transaction can modify unapplied_trxs, so look it up again
+                  if( unapplied_trxs.find( trx->signed_id ) == unapplied_trxs.end() ) continue;
+                  if( _scheduler.should_skip( trx->id ) ) {
+                     ++num_skipped;
+                     continue;
                   }
 
-                  itr = itr_next;
+                  ++num_processed;
+
+                  try {
+                     auto deadline = fc::time_point::now() + fc::milliseconds(_max_transaction_time_ms);
+                     bool deadline_is_subjective = false;
+                     if (_max_transaction_time_ms < 0 || (_pending_block_mode == pending_block_mode::producing && preprocess_deadline < deadline)) {
+                        deadline_is_subjective = true;
+                        deadline = preprocess_deadline;
+                     }
+
+                     const auto start = fc::time_point::now();
+                     auto trace = chain.push_transaction(trx, deadline);
+                     const auto end = fc::time_point::now();
+                     const bool subjective_failure = trace->except && failure_is_subjective(*trace->except, deadline_is_subjective);
+                     _scheduler.record(*trx, end - start, subjective_failure);
+                     if (trace->except) {
+                        if (subjective_failure) {
+                           exhausted = true;
+                           break;
+                        } else {
+                           _subjective_cpu.charge(trx->packed_trx->get_transaction().first_authorizor(), end - start, end);
+                           // this failed our configured maximum transaction time, we don't want to replay it
+                           unapplied_trxs.erase( trx->signed_id );
+                           ++num_failed;
+                        }
+                     } else {
+                        ++num_applied;
+                     }
+                  } catch ( const guard_exception& e ) {
+                     chain_plug->handle_guard_exception(e);
+                     return start_block_result::failed;
+                  } FC_LOG_AND_DROP();
                }
 
-               fc_dlog(_log, "Processed ${m} of ${n} previously applied transactions, Applied ${applied}, Failed/Dropped ${failed}",
+               fc_dlog(_log, "Processed ${m} of ${n} previously applied transactions, Applied ${applied}, Failed/Dropped ${failed}, Skipped failing ${skipped}",
                              ("m", num_processed)
                              ("n", unapplied_trxs_size)
                              ("applied", num_applied)
-                             ("failed", num_failed));
+                             ("failed", num_failed)
+                             ("skipped", num_skipped));
             }
          }
 
@@ -1348,8 +1702,12 @@ producer_plugin_impl::start_block_result producer_plugin_impl::start_block() {
                   auto e = _pending_incoming_transactions.front();
                   _pending_incoming_transactions.pop_front();
                   --orig_pending_txn_size;
+                  if (_scheduler.should_skip(e.trx->id)) {
+                     _pending_incoming_transactions.push_back(e);
+                     continue;
+                  }
                   _incoming_trx_weight -= 1.0;
-                  process_incoming_transaction_async(std::get<0>(e), std::get<1>(e), std::get<2>(e));
+                  process_incoming_transaction_async(e.trx, e.persist_until_expired, e.next);
                }
 
                if (scheduled_trx_deadline <= fc::time_point::now()) {
@@ -1415,7 +1773,11 @@ producer_plugin_impl::start_block_result producer_plugin_impl::start_block() {
                   auto e = _pending_incoming_transactions.front();
                   _pending_incoming_transactions.pop_front();
                   --orig_pending_txn_size;
-                  process_incoming_transaction_async(std::get<0>(e), std::get<1>(e), std::get<2>(e));
+                  if (_scheduler.should_skip(e.trx->id)) {
+                     _pending_incoming_transactions.push_back(e);
+                     continue;
+                  }
+                  process_incoming_transaction_async(e.trx, e.persist_until_expired, e.next);
                }
             }
             return start_block_result::succeeded;
@@ -0,0 +1,44 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE
+ */
+#pragma once
+
+#include <eosio/state_history_plugin/state_history_plugin.hpp>
+
+namespace eosio {
+
+/**
+ * Selects the parts of a block's log entries a get_blocks_request_v1 asked for. Works directly on the packed
+ * transaction_trace[] and table_delta[] stored in the logs: matching items are copied as they are, the rest are
+ * skipped without being unpacked.
+ *
+ * An empty filter list leaves that kind of entry unfiltered.
+ */
+class state_history_filter {
+ public:
+   state_history_filter(std::vector<action_filter> actions, std::vector<delta_filter> deltas);
+
+   bool filters_traces() const { return !actions.empty(); }
+   bool filters_deltas() const { return !deltas.empty(); }
+
+   /**
+    * Keeps the transaction traces with at least one matching action trace, inline traces included.
+    * @return number of transaction traces kept
+    */
+   uint32_t filter_traces(const char* data, size_t size, bytes& out) const;
+
+   /**
+    * Keeps the table deltas with a matching name; rows of contract_* tables are also matched by code, scope and table.
+    * @return number of rows kept
+    */
+   uint32_t filter_deltas(const char* data, size_t size, bytes& out) const;
+
+ private:
+   bool match_action(uint64_t receiver, uint64_t account, uint64_t action) const;
+
+   std::vector<action_filter> actions;
+   std::vector<delta_filter>  deltas;
+};
+
+} // namespace eosio
@@ -5,8 +5,13 @@
 #pragma once
 
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <stdint.h>
+#include <sys/mman.h>
 
 #include <eosio/chain/exceptions.hpp>
 #include <eosio/chain/types.hpp>
@@ -29,7 +34,7 @@ namespace eosio {
  *    uint32_t       block_num
  *    block_id_type  block_id
  *    uint64_t       size of payload
- *    uint8_t        version
+ *    uint8_t        version, which is the state_history_compression of the payload
  *                   payload
  *
  * each summary:
@@ -37,9 +42,15 @@ namespace eosio {
  *
  * state payload:
  *    uint32_t    size of deltas
- *    char[]      deltas
+ *    char[]      deltas, compressed
  */
 
+enum class state_history_compression : uint8_t {
+   zlib = 0, ///< all entries written before the codec became selectable
+   none = 1,
+   zstd = 2,
+};
+
 // todo: look into switching this to serialization instead of memcpy
 // todo: consider reworking versioning
 // todo: consider dropping block_num since it's included in block_id
@@ -66,6 +77,11 @@ class state_history_log {
    uint32_t             _end_block   = 0;
    chain::block_id_type last_block_id;
 
+   // read-only view of the log for sessions; maps ahead of the file so appends rarely need a remap
+   static constexpr uint64_t                         map_headroom = 64 * 1024 * 1024;
+   fc::optional<boost::interprocess::file_mapping>   mapping;
+   fc::optional<boost::interprocess::mapped_region>  region;
+
  public:
    state_history_log(const char* const name, std::string log_filename, std::string index_filename)
        : name(name)
@@ -105,6 +121,7 @@ class state_history_log {
       EOS_ASSERT(end == pos + sizeof(header) + header.payload_size, chain::plugin_exception,
                  "wrote payload with incorrect size to ${name}.log", ("name", name));
       log.write((char*)&pos, sizeof(pos));
+      log.flush(); // visible through the mapping; not synced
 
       index.seekg(0, std::ios_base::end);
       state_history_summary summary{.pos = pos};
@@ -130,6 +147,31 @@ class state_history_log {
       return header.block_id;
    }
 
+   // returns the payload through the mapping, valid until the log is written again
+   const char* map_entry(uint32_t block_num, state_history_log_header& header) {
+      EOS_ASSERT(block_num >= _begin_block && block_num < _end_block, chain::plugin_exception,
+                 "read non-existing block in ${name}.log", ("name", name));
+      uint64_t pos = get_pos(block_num);
+      ensure_mapped(pos + sizeof(header));
+      memcpy(&header, (const char*)region->get_address() + pos, sizeof(header));
+      ensure_mapped(pos + sizeof(header) + header.payload_size);
+      return (const char*)region->get_address() + pos + sizeof(header);
+   }
+
+   // asks the kernel to page in the entries of [begin, end) ahead of a session streaming them
+   void read_ahead(uint32_t begin, uint32_t end) {
+      begin = std::max(begin, _begin_block);
+      end   = std::min(end, _end_block);
+      if (begin >= end)
+         return;
+      uint64_t from = get_pos(begin);
+      uint64_t to   = end < _end_block ? get_pos(end) : get_pos(end - 1) + sizeof(state_history_log_header);
+      ensure_mapped(to);
+      uint64_t page = boost::interprocess::mapped_region::get_page_size();
+      uint64_t aligned = from / page * page;
+      posix_madvise((char*)region->get_address() + aligned, to - aligned, POSIX_MADV_WILLNEED);
+   }
+
  private:
    bool get_last_block(uint64_t size) {
       state_history_log_header header;
@@ -192,7 +234,8 @@ class state_history_log {
          state_history_log_header header;
          log.seekg(0);
          log.read((char*)&header, sizeof(header));
-         EOS_ASSERT(header.version == 0 && sizeof(header) + header.payload_size + sizeof(uint64_t) <= size,
+         EOS_ASSERT(header.version <= (uint8_t)state_history_compression::zstd &&
+                        sizeof(header) + header.payload_size + sizeof(uint64_t) <= size,
                     chain::plugin_exception, "corrupt ${name}.log (1)", ("name", name));
          _begin_block  = header.block_num;
          last_block_id = header.block_id;
@@ -243,6 +286,16 @@ class state_history_log {
       }
    }
 
+   void ensure_mapped(uint64_t size) {
+      if (region && region->get_size() >= size)
+         return;
+      uint64_t file_size = boost::filesystem::file_size(log_filename);
+      EOS_ASSERT(size <= file_size, chain::plugin_exception, "read past the end of ${name}.log", ("name", name));
+      region.reset();
+      mapping.emplace(log_filename.c_str(), boost::interprocess::read_only);
+      region.emplace(*mapping, boost::interprocess::read_only, 0, file_size + map_headroom);
+   }
+
    uint64_t get_pos(uint32_t block_num) {
       state_history_summary summary;
       index.seekg((block_num - _begin_block) * sizeof(summary));
@@ -251,6 +304,8 @@ class state_history_log {
    }
 
    void truncate(uint32_t block_num) {
+      region.reset();
+      mapping.reset();
       log.flush();
       index.flush();
       uint64_t num_removed = 0;
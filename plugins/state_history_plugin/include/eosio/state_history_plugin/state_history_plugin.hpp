@@ -55,6 +55,27 @@ struct get_blocks_request_v0 {
    bool                        fetch_deltas           = false;
 };
 
+/// zero fields match any value
+struct action_filter {
+   chain::name receiver = {};
+   chain::name account  = {};
+   chain::name action   = {};
+};
+
+/// empty or zero fields match any value; code, scope and table only apply to the contract_* tables
+struct delta_filter {
+   std::string name  = {};
+   chain::name code  = {};
+   chain::name scope = {};
+   chain::name table = {};
+};
+
+/// get_blocks_request_v0 with traces and deltas filtered by the server; an empty filter list disables that filter
+struct get_blocks_request_v1 : get_blocks_request_v0 {
+   std::vector<action_filter> action_filters = {};
+   std::vector<delta_filter>  delta_filters  = {};
+};
+
 struct get_blocks_ack_request_v0 {
    uint32_t num_messages = 0;
 };
@@ -69,7 +90,8 @@ struct get_blocks_result_v0 {
    fc::optional<bytes>          deltas;
 };
 
-using state_request = fc::static_variant<get_status_request_v0, get_blocks_request_v0, get_blocks_ack_request_v0>;
+using state_request = fc::static_variant<get_status_request_v0, get_blocks_request_v0, get_blocks_ack_request_v0,
+                                         get_blocks_request_v1>;
 using state_result  = fc::static_variant<get_status_result_v0, get_blocks_result_v0>;
 
 class state_history_plugin : public plugin<state_history_plugin> {
@@ -97,5 +119,8 @@ FC_REFLECT(eosio::block_position, (block_num)(block_id));
 FC_REFLECT_EMPTY(eosio::get_status_request_v0);
 FC_REFLECT(eosio::get_status_result_v0, (head)(last_irreversible)(trace_begin_block)(trace_end_block)(chain_state_begin_block)(chain_state_end_block));
 FC_REFLECT(eosio::get_blocks_request_v0, (start_block_num)(end_block_num)(max_messages_in_flight)(have_positions)(irreversible_only)(fetch_block)(fetch_traces)(fetch_deltas));
+FC_REFLECT(eosio::action_filter, (receiver)(account)(action));
+FC_REFLECT(eosio::delta_filter, (name)(code)(scope)(table));
+FC_REFLECT_DERIVED(eosio::get_blocks_request_v1, (eosio::get_blocks_request_v0), (action_filters)(delta_filters));
 FC_REFLECT(eosio::get_blocks_ack_request_v0, (num_messages));
 // clang-format on
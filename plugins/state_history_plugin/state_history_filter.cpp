@@ -0,0 +1,193 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE
+ */
+
+#include <eosio/chain/exceptions.hpp>
+#include <eosio/state_history_plugin/state_history_filter.hpp>
+
+namespace eosio {
+using namespace chain;
+
+// The layouts walked here are the ones written by state_history_serialization.hpp and described by
+// state_history_plugin_abi.cpp; the three must change together.
+namespace {
+
+using stream = fc::datastream<const char*>;
+
+template <typename T>
+T read(stream& ds) {
+   T v;
+   fc::raw::unpack(ds, v);
+   return v;
+}
+
+uint32_t read_varuint(stream& ds) { return read<fc::unsigned_int>(ds).value; }
+
+void skip(stream& ds, size_t size) {
+   EOS_ASSERT(size <= ds.remaining(), plugin_exception, "truncated state history entry");
+   ds.skip(size);
+}
+
+void skip_bytes(stream& ds) { skip(ds, read_varuint(ds)); }
+
+void skip_array(stream& ds, size_t element_size) { skip(ds, size_t(read_varuint(ds)) * element_size); }
+
+void skip_optional_string(stream& ds) {
+   if (read<bool>(ds))
+      skip_bytes(ds);
+}
+
+void read_variant_v0(stream& ds) {
+   EOS_ASSERT(read_varuint(ds) == 0, plugin_exception, "unsupported state history entry version");
+}
+
+template <typename F>
+bool scan_action_trace(stream& ds, const F& match) {
+   read_variant_v0(ds); // action_trace
+   read_variant_v0(ds); // action_receipt
+   auto receiver = read<uint64_t>(ds);
+   skip(ds, sizeof(digest_type) + 2 * sizeof(uint64_t)); // act_digest, global_sequence, recv_sequence
+   skip_array(ds, 2 * sizeof(uint64_t));                 // auth_sequence
+   read_varuint(ds);                                     // code_sequence
+   read_varuint(ds);                                     // abi_sequence
+   auto account = read<uint64_t>(ds);
+   auto action  = read<uint64_t>(ds);
+   skip_array(ds, 2 * sizeof(uint64_t));                 // authorization
+   skip_bytes(ds);                                       // data
+   skip(ds, sizeof(bool) + sizeof(int64_t));             // context_free, elapsed
+   skip_bytes(ds);                                       // console
+   skip_array(ds, sizeof(uint64_t) + sizeof(int64_t));   // account_ram_deltas
+   skip_optional_string(ds);                             // except
+
+   bool matched = match(receiver, account, action);
+   for (auto n = read_varuint(ds); n; --n)
+      matched |= scan_action_trace(ds, match);
+   return matched;
+}
+
+template <typename F>
+bool scan_transaction_trace(stream& ds, const F& match) {
+   read_variant_v0(ds);
+   skip(ds, sizeof(transaction_id_type) + sizeof(uint8_t) + sizeof(uint32_t)); // id, status, cpu_usage_us
+   read_varuint(ds);                                                          // net_usage_words
+   skip(ds, sizeof(int64_t) + sizeof(uint64_t) + sizeof(bool));               // elapsed, net_usage, scheduled
+
+   bool matched = false;
+   for (auto n = read_varuint(ds); n; --n)
+      matched |= scan_action_trace(ds, match);
+   skip_optional_string(ds); // except
+   if (read<bool>(ds))       // failed_dtrx_trace
+      matched |= scan_transaction_trace(ds, match);
+   return matched;
+}
+
+bool is_contract_table(const std::string& name) { return name.compare(0, 9, "contract_") == 0; }
+
+template <typename T>
+void append(bytes& out, const T& v) {
+   auto b = fc::raw::pack(v);
+   out.insert(out.end(), b.begin(), b.end());
+}
+
+} // namespace
+
+state_history_filter::state_history_filter(std::vector<action_filter> actions, std::vector<delta_filter> deltas)
+    : actions(std::move(actions))
+    , deltas(std::move(deltas)) {}
+
+bool state_history_filter::match_action(uint64_t receiver, uint64_t account, uint64_t action) const {
+   for (auto& f : actions) {
+      if ((!f.receiver.value || f.receiver.value == receiver) && (!f.account.value || f.account.value == account) &&
+          (!f.action.value || f.action.value == action))
+         return true;
+   }
+   return false;
+}
+
+uint32_t state_history_filter::filter_traces(const char* data, size_t size, bytes& out) const {
+   stream   ds(data, size);
+   bytes    body;
+   uint32_t kept  = 0;
+   auto     match = [this](uint64_t receiver, uint64_t account, uint64_t action) {
+      return match_action(receiver, account, action);
+   };
+   for (auto n = read_varuint(ds); n; --n) {
+      auto begin = ds.pos();
+      if (scan_transaction_trace(ds, match)) {
+         body.insert(body.end(), begin, ds.pos());
+         ++kept;
+      }
+   }
+   out = fc::raw::pack(fc::unsigned_int(kept));
+   out.insert(out.end(), body.begin(), body.end());
+   return kept;
+}
+
+uint32_t state_history_filter::filter_deltas(const char* data, size_t size, bytes& out) const {
+   stream                           ds(data, size);
+   bytes                            body;
+   uint32_t                         kept_deltas = 0;
+   uint32_t                         kept_rows   = 0;
+   std::vector<const delta_filter*> matching;
+   for (auto n = read_varuint(ds); n; --n) {
+      read_variant_v0(ds);
+      auto name = read<std::string>(ds);
+      auto contract = is_contract_table(name);
+
+      matching.clear();
+      bool whole = false;
+      for (auto& f : deltas) {
+         if (!f.name.empty() && f.name != name)
+            continue;
+         matching.push_back(&f);
+         whole |= !contract || (!f.code.value && !f.scope.value && !f.table.value);
+      }
+
+      bytes    rows;
+      uint32_t num_rows = 0;
+      for (auto r = read_varuint(ds); r; --r) {
+         auto begin = ds.pos();
+         read<bool>(ds); // present
+         auto row_size = read_varuint(ds);
+         auto row      = ds.pos();
+         skip(ds, row_size);
+         if (matching.empty())
+            continue;
+
+         bool keep = whole;
+         if (!keep) {
+            stream row_ds(row, row_size);
+            read_variant_v0(row_ds);
+            auto code  = read<uint64_t>(row_ds);
+            auto scope = read<uint64_t>(row_ds);
+            auto table = read<uint64_t>(row_ds);
+            for (auto* f : matching) {
+               if ((!f->code.value || f->code.value == code) && (!f->scope.value || f->scope.value == scope) &&
+                   (!f->table.value || f->table.value == table)) {
+                  keep = true;
+                  break;
+               }
+            }
+         }
+         if (keep) {
+            rows.insert(rows.end(), begin, ds.pos());
+            ++num_rows;
+         }
+      }
+      if (!num_rows)
+         continue;
+
+      append(body, fc::unsigned_int(0));
+      append(body, name);
+      append(body, fc::unsigned_int(num_rows));
+      body.insert(body.end(), rows.begin(), rows.end());
+      ++kept_deltas;
+      kept_rows += num_rows;
+   }
+   out = fc::raw::pack(fc::unsigned_int(kept_deltas));
+   out.insert(out.end(), body.begin(), body.end());
+   return kept_rows;
+}
+
+} // namespace eosio
@@ -4,6 +4,7 @@
  */
 
 #include <eosio/chain/config.hpp>
+#include <eosio/state_history_plugin/state_history_filter.hpp>
 #include <eosio/state_history_plugin/state_history_log.hpp>
 #include <eosio/state_history_plugin/state_history_serialization.hpp>
 
@@ -11,6 +12,7 @@
 #include <boost/asio/ip/host_name.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/iostreams/device/back_inserter.hpp>
@@ -18,6 +20,18 @@
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/signals2/connection.hpp>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#ifdef EOSIO_STATE_HISTORY_ZSTD
+#include <zstd.h>
+#endif
+
 using tcp    = boost::asio::ip::tcp;
 namespace ws = boost::beast::websocket;
 
@@ -43,7 +57,7 @@ auto catch_and_log(F f) {
 }
 
 namespace bio = boost::iostreams;
-static bytes zlib_compress_bytes(bytes in) {
+static bytes zlib_compress_bytes(const bytes& in) {
    bytes                  out;
    bio::filtering_ostream comp;
    comp.push(bio::zlib_compressor(bio::zlib::default_compression));
@@ -53,11 +67,59 @@ static bytes zlib_compress_bytes(bytes in) {
    return out;
 }
 
+static bytes compress_bytes(state_history_compression compression, bytes in) {
+   switch (compression) {
+   case state_history_compression::zlib: return zlib_compress_bytes(in);
+   case state_history_compression::none: return in;
+#ifdef EOSIO_STATE_HISTORY_ZSTD
+   case state_history_compression::zstd: {
+      bytes  out(ZSTD_compressBound(in.size()));
+      size_t size = ZSTD_compress(out.data(), out.size(), in.data(), in.size(), 3); // zstd's default level
+      EOS_ASSERT(!ZSTD_isError(size), plugin_exception, "zstd compression failed: ${e}", ("e", ZSTD_getErrorName(size)));
+      out.resize(size);
+      return out;
+   }
+#endif
+   default: break;
+   }
+   EOS_ASSERT(false, plugin_exception, "unsupported state history compression ${c}", ("c", (uint32_t)compression));
+   return {};
+}
+
+static bytes decompress_bytes(state_history_compression compression, bytes in) {
+   switch (compression) {
+   case state_history_compression::zlib: {
+      bytes                  out;
+      bio::filtering_ostream decomp;
+      decomp.push(bio::zlib_decompressor());
+      decomp.push(bio::back_inserter(out));
+      bio::write(decomp, in.data(), in.size());
+      bio::close(decomp);
+      return out;
+   }
+   case state_history_compression::none: return in;
+#ifdef EOSIO_STATE_HISTORY_ZSTD
+   case state_history_compression::zstd: {
+      auto size = ZSTD_getFrameContentSize(in.data(), in.size());
+      EOS_ASSERT(size != ZSTD_CONTENTSIZE_ERROR && size != ZSTD_CONTENTSIZE_UNKNOWN, plugin_exception,
+                 "corrupt zstd state history entry");
+      bytes out(size);
+      auto  r = ZSTD_decompress(out.data(), out.size(), in.data(), in.size());
+      EOS_ASSERT(!ZSTD_isError(r) && r == size, plugin_exception, "zstd decompression failed");
+      return out;
+   }
+#endif
+   default: break;
+   }
+   EOS_ASSERT(false, plugin_exception, "unsupported state history compression ${c}", ("c", (uint32_t)compression));
+   return {};
+}
+
 struct state_history_plugin_impl : std::enable_shared_from_this<state_history_plugin_impl> {
    chain_plugin*                                        chain_plug = nullptr;
    fc::optional<state_history_log>                      trace_log;
    fc::optional<state_history_log>                      chain_state_log;
-   bool                                                 stopping = false;
+   std::atomic<bool>                                    stopping{false};
    fc::optional<scoped_connection>                      applied_transaction_connection;
    fc::optional<scoped_connection>                      accepted_block_connection;
    string                                               endpoint_address = "0.0.0.0";
@@ -65,35 +127,155 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
    std::unique_ptr<tcp::acceptor>                       acceptor;
    std::map<transaction_id_type, transaction_trace_ptr> cached_traces;
    transaction_trace_ptr                                onblock_trace;
+   state_history_compression                            compression = state_history_compression::zlib;
+   uint32_t                                             chain_state_queued_begin = 0; // chain_state_log's range once
+   uint32_t                                             chain_state_queued_end   = 0; // the queued writes are appended
+   uint16_t                                             delta_threads       = 4;
+   fc::optional<boost::asio::thread_pool>               delta_pool;
+   static constexpr int64_t                             slow_delta_extraction_us = 50 * 1000;
 
-   void get_log_entry(state_history_log& log, uint32_t block_num, fc::optional<bytes>& result) {
-      if (block_num < log.begin_block() || block_num >= log.end_block())
-         return;
+   // Entries are packed on the main thread, which owns the chain state, then compressed and appended in order
+   // by the writer thread. log_mtx guards trace_log and chain_state_log against session reads meanwhile.
+   struct pending_write {
+      state_history_log*       log = nullptr;
       state_history_log_header header;
-      auto&                    stream = log.get_entry(block_num, header);
-      uint32_t                 s;
-      stream.read((char*)&s, sizeof(s));
-      result.emplace();
-      result->resize(s);
-      if (s)
-         stream.read(result->data(), s);
+      chain::block_id_type     prev_id;
+      bytes                    payload;
+      bool                     last_of_block = false;
+   };
+   static constexpr size_t   max_pending_writes = 64;
+   std::mutex                log_mtx;
+   std::mutex                write_mtx;
+   std::condition_variable   write_cv;
+   std::deque<pending_write> write_queue;
+   bool                      writer_stopping = false;
+   bool                      writer_failed   = false; // the writer exited on an error, the node is quitting
+   std::thread               writer_thread;
+
+   void queue_write(pending_write&& w) {
+      std::unique_lock<std::mutex> lock(write_mtx);
+      // blocks the main thread only when the writer falls far behind, e.g. during replay
+      write_cv.wait(lock,
+                    [&] { return write_queue.size() < max_pending_writes || writer_stopping || writer_failed; });
+      EOS_ASSERT(!writer_failed, plugin_exception, "state history writer failed, not storing block ${b}",
+                 ("b", w.header.block_num));
+      write_queue.push_back(std::move(w));
+      write_cv.notify_all();
    }
 
-   void get_block(uint32_t block_num, fc::optional<bytes>& result) {
-      chain::signed_block_ptr p;
-      try {
-         p = chain_plug->chain().fetch_block_by_number(block_num);
-      } catch (...) {
-         return;
+   // called by the writer thread before it exits on an error
+   void fail_writer() {
+      {
+         std::lock_guard<std::mutex> lock(write_mtx);
+         writer_failed = true;
+         write_cv.notify_all();
       }
-      result = fc::raw::pack(*p);
+      app().post(priority::high, [] { app().quit(); });
    }
 
-   fc::optional<chain::block_id_type> get_block_id(uint32_t block_num) {
+   void start_writer() {
+      writer_thread = std::thread([this] {
+         while (true) {
+            pending_write w;
+            {
+               std::unique_lock<std::mutex> lock(write_mtx);
+               write_cv.wait(lock, [&] { return !write_queue.empty() || writer_stopping || writer_failed; });
+               if (write_queue.empty() || writer_failed)
+                  return;
+               w = std::move(write_queue.front());
+               write_queue.pop_front();
+               write_cv.notify_all();
+            }
+            try {
+               write(w);
+            } catch (const fc::exception& e) {
+               elog("state history write failed: ${e}", ("e", e.to_detail_string()));
+               fail_writer();
+               return;
+            } catch (const std::exception& e) {
+               elog("state history write failed: ${e}", ("e", e.what()));
+               fail_writer();
+               return;
+            }
+            if (w.last_of_block)
+               send_updates();
+         }
+      });
+   }
+
+   void stop_writer() {
+      {
+         std::lock_guard<std::mutex> lock(write_mtx);
+         writer_stopping = true;
+         write_cv.notify_all();
+      }
+      // the writer drains the queue before exiting
+      if (writer_thread.joinable())
+         writer_thread.join();
+   }
+
+   void write(pending_write& w) {
+      auto bin = compress_bytes(compression, std::move(w.payload));
+      EOS_ASSERT(bin.size() == (uint32_t)bin.size(), plugin_exception, "state history entry is too big");
+      w.header.payload_size = sizeof(uint32_t) + bin.size();
+      w.header.version      = (uint8_t)compression;
+
+      std::lock_guard<std::mutex> lock(log_mtx);
+      w.log->write_entry(w.header, w.prev_id, [&](auto& stream) {
+         uint32_t s = (uint32_t)bin.size();
+         stream.write((char*)&s, sizeof(s));
+         if (!bin.empty())
+            stream.write(bin.data(), bin.size());
+      });
+   }
+
+   // last block whose requested entries are in the logs
+   uint32_t last_written_block(const get_blocks_request_v0& req) {
+      std::lock_guard<std::mutex> lock(log_mtx);
+      uint32_t result = std::numeric_limits<uint32_t>::max();
+      if (req.fetch_traces && trace_log)
+         result = std::min(result, trace_log->end_block() ? trace_log->end_block() - 1 : 0);
+      if (req.fetch_deltas && chain_state_log)
+         result = std::min(result, chain_state_log->end_block() ? chain_state_log->end_block() - 1 : 0);
+      return result;
+   }
+
+   // Sessions run on a dedicated thread pool, each on its own strand. They read the logs under log_mtx and take
+   // head and irreversible positions from a snapshot updated on the main thread; blocks and block ids missing
+   // from the logs are fetched on the main thread, which owns the controller.
+
+   // caller holds log_mtx
+   void get_log_entry(state_history_log& log, uint32_t block_num, fc::optional<bytes>& result,
+                      state_history_compression& codec) {
+      if (block_num < log.begin_block() || block_num >= log.end_block())
+         return;
+      state_history_log_header header;
+      const char*              payload = log.map_entry(block_num, header);
+      codec                            = (state_history_compression)header.version;
+      uint32_t                 s;
+      memcpy(&s, payload, sizeof(s));
+      EOS_ASSERT(sizeof(s) + s <= header.payload_size, plugin_exception, "corrupt state history entry ${b}",
+                 ("b", block_num));
+      result.emplace(payload + sizeof(s), payload + sizeof(s) + s);
+   }
+
+   // caller holds log_mtx
+   fc::optional<chain::block_id_type> get_log_block_id(uint32_t block_num) {
       if (trace_log && block_num >= trace_log->begin_block() && block_num < trace_log->end_block())
          return trace_log->get_block_id(block_num);
       if (chain_state_log && block_num >= chain_state_log->begin_block() && block_num < chain_state_log->end_block())
          return chain_state_log->get_block_id(block_num);
+      return {};
+   }
+
+   // main thread only
+   fc::optional<chain::block_id_type> get_block_id(uint32_t block_num) {
+      {
+         std::lock_guard<std::mutex> lock(log_mtx);
+         auto                        id = get_log_block_id(block_num);
+         if (id)
+            return id;
+      }
       try {
          auto block = chain_plug->chain().fetch_block_by_number(block_num);
          if (block)
@@ -103,17 +285,114 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
       return {};
    }
 
+   void read_log_entries(uint32_t block_num, const get_blocks_request_v0& req, uint32_t read_ahead_end,
+                         get_blocks_result_v0& result, state_history_compression& trace_codec,
+                         state_history_compression& delta_codec) {
+      std::lock_guard<std::mutex> lock(log_mtx);
+      auto                        block_id = get_log_block_id(block_num);
+      if (block_id) {
+         result.this_block  = block_position{block_num, *block_id};
+         auto prev_block_id = get_log_block_id(block_num - 1);
+         if (prev_block_id)
+            result.prev_block = block_position{block_num - 1, *prev_block_id};
+      }
+      if (req.fetch_traces && trace_log) {
+         get_log_entry(*trace_log, block_num, result.traces, trace_codec);
+         if (read_ahead_end)
+            trace_log->read_ahead(block_num + 1, read_ahead_end);
+      }
+      if (req.fetch_deltas && chain_state_log) {
+         get_log_entry(*chain_state_log, block_num, result.deltas, delta_codec);
+         if (read_ahead_end)
+            chain_state_log->read_ahead(block_num + 1, read_ahead_end);
+      }
+   }
+
+   // get_blocks_result_v0 carries zlib entries, the only codec clients know about; entries stored with another
+   // codec are transcoded when served
+   static void to_client_codec(fc::optional<bytes>& entry, state_history_compression codec) {
+      if (entry && codec != state_history_compression::zlib)
+         entry = zlib_compress_bytes(decompress_bytes(codec, std::move(*entry)));
+   }
+
+   // Re-encodes the entries read for a filtered request as zlib.
+   // @return whether anything matched
+   static bool apply_filter(const state_history_filter& filter, get_blocks_result_v0& result,
+                            state_history_compression trace_codec, state_history_compression delta_codec) {
+      bool matched = false;
+      if (result.traces && filter.filters_traces()) {
+         bytes filtered;
+         auto  bin = decompress_bytes(trace_codec, std::move(*result.traces));
+         matched |= filter.filter_traces(bin.data(), bin.size(), filtered) > 0;
+         result.traces = zlib_compress_bytes(filtered);
+      } else if (result.traces) {
+         to_client_codec(result.traces, trace_codec);
+         matched = true;
+      }
+      if (result.deltas && filter.filters_deltas()) {
+         bytes filtered;
+         auto  bin = decompress_bytes(delta_codec, std::move(*result.deltas));
+         matched |= filter.filter_deltas(bin.data(), bin.size(), filtered) > 0;
+         result.deltas = zlib_compress_bytes(filtered);
+      } else if (result.deltas) {
+         to_client_codec(result.deltas, delta_codec);
+         matched = true;
+      }
+      return matched;
+   }
+
+   // main thread only
+   void read_chain(uint32_t block_num, bool fetch_block, get_blocks_result_v0& result) {
+      chain::signed_block_ptr p;
+      try {
+         p = chain_plug->chain().fetch_block_by_number(block_num);
+      } catch (...) {
+      }
+      if (!p)
+         return;
+      if (!result.this_block)
+         result.this_block = block_position{block_num, p->id()};
+      if (!result.prev_block && block_num > 1)
+         result.prev_block = block_position{block_num - 1, p->previous};
+      if (fetch_block)
+         result.block = fc::raw::pack(*p);
+   }
+
+   std::mutex     positions_mtx;
+   block_position head;
+   block_position last_irreversible;
+
+   void update_positions() {
+      auto&                       chain = chain_plug->chain();
+      std::lock_guard<std::mutex> lock(positions_mtx);
+      head              = {chain.head_block_num(), chain.head_block_id()};
+      last_irreversible = {chain.last_irreversible_block_num(), chain.last_irreversible_block_id()};
+   }
+
+   std::pair<block_position, block_position> get_positions() {
+      std::lock_guard<std::mutex> lock(positions_mtx);
+      return {head, last_irreversible};
+   }
+
    struct session : std::enable_shared_from_this<session> {
+      static constexpr uint32_t max_skipped_blocks = 1000;
+      using strand_t = boost::asio::strand<boost::asio::io_context::executor_type>;
+
       std::shared_ptr<state_history_plugin_impl> plugin;
+      strand_t                                   strand;
       std::unique_ptr<ws::stream<tcp::socket>>   socket_stream;
       bool                                       sending  = false;
+      bool                                       updating = false; // waiting on the main thread
       bool                                       sent_abi = false;
       std::vector<std::vector<char>>             send_queue;
       fc::optional<get_blocks_request_v0>        current_request;
+      std::shared_ptr<const state_history_filter> filter; // set by get_blocks_request_v1
       bool                                       need_to_send_update = false;
+      uint32_t                                   read_ahead_until    = 0;
 
-      session(std::shared_ptr<state_history_plugin_impl> plugin)
-          : plugin(std::move(plugin)) {}
+      session(std::shared_ptr<state_history_plugin_impl> plugin, boost::asio::io_context& ioc)
+          : plugin(std::move(plugin))
+          , strand(ioc.get_executor()) {}
 
       void start(tcp::socket socket) {
          ilog("incoming connection");
@@ -122,18 +401,20 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
          socket_stream->next_layer().set_option(boost::asio::ip::tcp::no_delay(true));
          socket_stream->next_layer().set_option(boost::asio::socket_base::send_buffer_size(1024 * 1024));
          socket_stream->next_layer().set_option(boost::asio::socket_base::receive_buffer_size(1024 * 1024));
-         socket_stream->async_accept([self = shared_from_this(), this](boost::system::error_code ec) {
-            callback(ec, "async_accept", [&] {
-               start_read();
-               send(state_history_plugin_abi);
-            });
-         });
+         socket_stream->async_accept(
+             boost::asio::bind_executor(strand, [self = shared_from_this(), this](boost::system::error_code ec) {
+                callback(ec, "async_accept", [&] {
+                   start_read();
+                   send(state_history_plugin_abi);
+                });
+             }));
       }
 
       void start_read() {
          auto in_buffer = std::make_shared<boost::beast::flat_buffer>();
          socket_stream->async_read(
-             *in_buffer, [self = shared_from_this(), this, in_buffer](boost::system::error_code ec, size_t) {
+             *in_buffer, boost::asio::bind_executor(strand, [self = shared_from_this(), this,
+                                                             in_buffer](boost::system::error_code ec, size_t) {
                 callback(ec, "async_read", [&] {
                    auto d = boost::asio::buffer_cast<char const*>(boost::beast::buffers_front(in_buffer->data()));
                    auto s = boost::asio::buffer_size(in_buffer->data());
@@ -143,7 +424,7 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
                    req.visit(*this);
                    start_read();
                 });
-             });
+             }));
       }
 
       void send(const char* s) {
@@ -167,21 +448,34 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
          sent_abi = true;
          socket_stream->async_write( //
              boost::asio::buffer(send_queue[0]),
-             [self = shared_from_this(), this](boost::system::error_code ec, size_t) {
+             boost::asio::bind_executor(strand, [self = shared_from_this(), this](boost::system::error_code ec, size_t) {
                 callback(ec, "async_write", [&] {
                    send_queue.erase(send_queue.begin());
                    sending = false;
                    send();
                 });
-             });
+             }));
+      }
+
+      // runs `f` on the main thread, then `then` with its result back on the session strand
+      template <typename F, typename Then>
+      void on_main_thread(F f, Then then) {
+         app().post(priority::medium, [self = shared_from_this(), this, f = std::move(f), then = std::move(then)]() mutable {
+            if (plugin->stopping)
+               return;
+            auto r = f();
+            boost::asio::post(strand, [self, this, r = std::move(r), then = std::move(then)]() mutable {
+               if (!plugin->stopping)
+                  catch_and_close([&] { then(std::move(r)); });
+            });
+         });
       }
 
       using result_type = void;
       void operator()(get_status_request_v0&) {
-         auto&                chain = plugin->chain_plug->chain();
          get_status_result_v0 result;
-         result.head              = {chain.head_block_num(), chain.head_block_id()};
-         result.last_irreversible = {chain.last_irreversible_block_num(), chain.last_irreversible_block_id()};
+         std::tie(result.head, result.last_irreversible) = plugin->get_positions();
+         std::lock_guard<std::mutex> lock(plugin->log_mtx);
          if (plugin->trace_log) {
             result.trace_begin_block = plugin->trace_log->begin_block();
             result.trace_end_block   = plugin->trace_log->end_block();
@@ -193,17 +487,34 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
          send(std::move(result));
       }
 
-      void operator()(get_blocks_request_v0& req) {
-         for (auto& cp : req.have_positions) {
-            if (req.start_block_num <= cp.block_num)
-               continue;
-            auto id = plugin->get_block_id(cp.block_num);
-            if (!id || *id != cp.block_id)
-               req.start_block_num = std::min(req.start_block_num, cp.block_num);
-         }
-         req.have_positions.clear();
-         current_request = req;
-         send_update(true);
+      void operator()(get_blocks_request_v0& req) { start_request(std::move(req), nullptr); }
+
+      void operator()(get_blocks_request_v1& req) {
+         std::shared_ptr<const state_history_filter> f;
+         if (!req.action_filters.empty() || !req.delta_filters.empty())
+            f = std::make_shared<state_history_filter>(std::move(req.action_filters), std::move(req.delta_filters));
+         start_request(std::move(static_cast<get_blocks_request_v0&>(req)), std::move(f));
+      }
+
+      void start_request(get_blocks_request_v0 req, std::shared_ptr<const state_history_filter> f) {
+         on_main_thread(
+             [plugin = plugin, req]() mutable {
+                for (auto& cp : req.have_positions) {
+                   if (req.start_block_num <= cp.block_num)
+                      continue;
+                   auto id = plugin->get_block_id(cp.block_num);
+                   if (!id || *id != cp.block_id)
+                      req.start_block_num = std::min(req.start_block_num, cp.block_num);
+                }
+                req.have_positions.clear();
+                return req;
+             },
+             [this, f = std::move(f)](get_blocks_request_v0 req) {
+                current_request  = std::move(req);
+                filter           = f;
+                read_ahead_until = 0;
+                send_update(true);
+             });
       }
 
       void operator()(get_blocks_ack_request_v0& req) {
@@ -213,37 +524,77 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
          send_update();
       }
 
+      void rewind(uint32_t block_num) {
+         if (current_request && block_num < current_request->start_block_num)
+            current_request->start_block_num = block_num;
+      }
+
       void send_update(bool changed = false) {
          if (changed)
             need_to_send_update = true;
-         if (!send_queue.empty() || !need_to_send_update || !current_request ||
+         if (updating || !send_queue.empty() || !need_to_send_update || !current_request ||
              !current_request->max_messages_in_flight)
             return;
-         auto&                chain = plugin->chain_plug->chain();
          get_blocks_result_v0 result;
-         result.head              = {chain.head_block_num(), chain.head_block_id()};
-         result.last_irreversible = {chain.last_irreversible_block_num(), chain.last_irreversible_block_id()};
+         std::tie(result.head, result.last_irreversible) = plugin->get_positions();
          uint32_t current =
              current_request->irreversible_only ? result.last_irreversible.block_num : result.head.block_num;
-         if (current_request->start_block_num <= current &&
-             current_request->start_block_num < current_request->end_block_num) {
-            auto block_id = plugin->get_block_id(current_request->start_block_num);
-            if (block_id) {
-               result.this_block  = block_position{current_request->start_block_num, *block_id};
-               auto prev_block_id = plugin->get_block_id(current_request->start_block_num - 1);
-               if (prev_block_id)
-                  result.prev_block = block_position{current_request->start_block_num - 1, *prev_block_id};
-               if (current_request->fetch_block)
-                  plugin->get_block(current_request->start_block_num, result.block);
-               if (current_request->fetch_traces && plugin->trace_log)
-                  plugin->get_log_entry(*plugin->trace_log, current_request->start_block_num, result.traces);
-               if (current_request->fetch_deltas && plugin->chain_state_log)
-                  plugin->get_log_entry(*plugin->chain_state_log, current_request->start_block_num, result.deltas);
+         current = std::min(current, plugin->last_written_block(*current_request));
+         uint32_t skipped = 0;
+         while (current_request->start_block_num <= current &&
+                current_request->start_block_num < current_request->end_block_num) {
+            uint32_t block_num = current_request->start_block_num++;
+
+            // page in the next range while streaming history well behind head
+            uint32_t read_ahead_end = 0;
+            uint32_t read_ahead     = plugin->read_ahead_blocks;
+            if (read_ahead && block_num + read_ahead < current && block_num + read_ahead / 2 >= read_ahead_until) {
+               read_ahead_end   = std::min(block_num + 1 + read_ahead, current_request->end_block_num);
+               read_ahead_until = read_ahead_end;
+            }
+            auto trace_codec = state_history_compression::none;
+            auto delta_codec = state_history_compression::none;
+            plugin->read_log_entries(block_num, *current_request, read_ahead_end, result, trace_codec, delta_codec);
+            if (!filter) {
+               to_client_codec(result.traces, trace_codec);
+               to_client_codec(result.deltas, delta_codec);
+            }
+
+            // a filtered stream leaves out blocks without matches, except the last one available and one block in
+            // max_skipped_blocks so clients still see progress
+            if (filter && !apply_filter(*filter, result, trace_codec, delta_codec) && !current_request->fetch_block &&
+                block_num < current && current_request->start_block_num < current_request->end_block_num &&
+                ++skipped < max_skipped_blocks) {
+               result.this_block.reset();
+               result.prev_block.reset();
+               result.traces.reset();
+               result.deltas.reset();
+               continue;
             }
-            ++current_request->start_block_num;
+
+            if (current_request->fetch_block || !result.this_block || !result.prev_block) {
+               updating = true;
+               on_main_thread(
+                   [plugin = plugin, block_num, fetch_block = current_request->fetch_block,
+                    result = std::move(result)]() mutable {
+                      plugin->read_chain(block_num, fetch_block, result);
+                      return std::move(result);
+                   },
+                   [this, current](get_blocks_result_v0 result) {
+                      updating = false;
+                      finish_update(std::move(result), current);
+                   });
+               return;
+            }
+            break;
          }
+         finish_update(std::move(result), current);
+      }
+
+      void finish_update(get_blocks_result_v0&& result, uint32_t current) {
          send(std::move(result));
-         --current_request->max_messages_in_flight;
+         if (current_request->max_messages_in_flight)
+            --current_request->max_messages_in_flight;
          need_to_send_update = current_request->start_block_num <= current &&
                                current_request->start_block_num < current_request->end_block_num;
       }
@@ -283,18 +634,47 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
       }
 
       void close() {
-         socket_stream->next_layer().close();
+         boost::system::error_code ec;
+         socket_stream->next_layer().close(ec);
+         std::lock_guard<std::mutex> lock(plugin->sessions_mtx);
          plugin->sessions.erase(this);
       }
    };
+   std::mutex                                   sessions_mtx;
    std::map<session*, std::shared_ptr<session>> sessions;
 
+   // may be called from any thread
+   template <typename F>
+   void for_each_session(F f) {
+      std::lock_guard<std::mutex> lock(sessions_mtx);
+      for (auto& s : sessions) {
+         if (s.second)
+            boost::asio::post(s.second->strand, [s = s.second, f] {
+               if (!s->plugin->stopping)
+                  s->catch_and_close([&] { f(*s); });
+            });
+      }
+   }
+
+   using io_work_t = boost::asio::executor_work_guard<boost::asio::io_context::executor_type>;
+   uint16_t                                 thread_pool_size  = 2;
+   uint32_t                                 read_ahead_blocks = 256;
+   fc::optional<boost::asio::thread_pool>   thread_pool;
+   std::shared_ptr<boost::asio::io_context> ioc;
+   fc::optional<io_work_t>                  ioc_work;
+
    void listen() {
       boost::system::error_code ec;
 
+      thread_pool.emplace(thread_pool_size);
+      ioc = std::make_shared<boost::asio::io_context>();
+      ioc_work.emplace(boost::asio::make_work_guard(*ioc));
+      for (uint16_t i = 0; i < thread_pool_size; ++i)
+         boost::asio::post(*thread_pool, [ioc = ioc]() { ioc->run(); });
+
       auto address  = boost::asio::ip::make_address(endpoint_address);
       auto endpoint = tcp::endpoint{address, endpoint_port};
-      acceptor      = std::make_unique<tcp::acceptor>(app().get_io_service());
+      acceptor      = std::make_unique<tcp::acceptor>(*ioc);
 
       auto check_ec = [&](const char* what) {
          if (!ec)
@@ -314,7 +694,7 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
    }
 
    void do_accept() {
-      auto socket = std::make_shared<tcp::socket>(app().get_io_service());
+      auto socket = std::make_shared<tcp::socket>(*ioc);
       acceptor->async_accept(*socket, [self = shared_from_this(), socket, this](auto ec) {
          if (stopping)
             return;
@@ -324,14 +704,39 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
             return;
          }
          catch_and_log([&] {
-            auto s            = std::make_shared<session>(self);
-            sessions[s.get()] = s;
-            s->start(std::move(*socket));
+            auto s = std::make_shared<session>(self, *ioc);
+            {
+               std::lock_guard<std::mutex> lock(sessions_mtx);
+               sessions[s.get()] = s;
+            }
+            boost::asio::post(s->strand, [s, socket] { s->catch_and_close([&] { s->start(std::move(*socket)); }); });
          });
          catch_and_log([&] { do_accept(); });
       });
    }
 
+   void stop_sessions() {
+      stopping = true;
+      if (ioc_work)
+         ioc_work->reset();
+      if (ioc)
+         ioc->stop();
+      if (thread_pool) {
+         thread_pool->join();
+         thread_pool->stop();
+      }
+      // no session handler runs past this point
+      boost::system::error_code ec;
+      if (acceptor)
+         acceptor->close(ec);
+      std::lock_guard<std::mutex> lock(sessions_mtx);
+      for (auto& s : sessions) {
+         if (s.second && s.second->socket_stream)
+            s.second->socket_stream->next_layer().close(ec);
+      }
+      sessions.clear();
+   }
+
    static bool is_onblock(const transaction_trace_ptr& p) {
       if (p->action_traces.size() != 1)
          return false;
@@ -356,16 +761,18 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
    }
 
    void on_accepted_block(const block_state_ptr& block_state) {
+      // posted ahead of the writes, so each session's strand runs the rewind before the writer's send_updates
+      for_each_session([block_num = block_state->block_num](session& s) { s.rewind(block_num); });
       store_traces(block_state);
       store_chain_state(block_state);
-      for (auto& s : sessions) {
-         auto& p = s.second;
-         if (p) {
-            if (p->current_request && block_state->block_num < p->current_request->start_block_num)
-               p->current_request->start_block_num = block_state->block_num;
-            p->send_update(true);
-         }
-      }
+      update_positions();
+      // otherwise sessions are updated once the writer has appended the block
+      if (!trace_log && !chain_state_log)
+         send_updates();
+   }
+
+   void send_updates() {
+      for_each_session([](session& s) { s.send_update(true); });
    }
 
    void store_traces(const block_state_ptr& block_state) {
@@ -388,27 +795,28 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
       cached_traces.clear();
       onblock_trace.reset();
 
-      auto& db         = chain_plug->chain().db();
-      auto  traces_bin = zlib_compress_bytes(fc::raw::pack(make_history_serial_wrapper(db, traces)));
-      EOS_ASSERT(traces_bin.size() == (uint32_t)traces_bin.size(), plugin_exception, "traces is too big");
-
-      state_history_log_header header{.block_num    = block_state->block->block_num(),
-                                      .block_id     = block_state->block->id(),
-                                      .payload_size = sizeof(uint32_t) + traces_bin.size()};
-      trace_log->write_entry(header, block_state->block->previous, [&](auto& stream) {
-         uint32_t s = (uint32_t)traces_bin.size();
-         stream.write((char*)&s, sizeof(s));
-         if (!traces_bin.empty())
-            stream.write(traces_bin.data(), traces_bin.size());
-      });
+      auto& db = chain_plug->chain().db();
+      pending_write w;
+      w.log     = &*trace_log;
+      w.header  = {.block_num = block_state->block->block_num(), .block_id = block_state->block->id()};
+      w.prev_id = block_state->block->previous;
+      w.payload = fc::raw::pack(make_history_serial_wrapper(db, traces));
+      w.last_of_block = !chain_state_log;
+      queue_write(std::move(w));
    }
 
    void store_chain_state(const block_state_ptr& block_state) {
       if (!chain_state_log)
          return;
-      bool fresh = chain_state_log->begin_block() == chain_state_log->end_block();
+      // the writer may still hold entries for chain_state_log, so track the range it will have after appending this
+      // one, as write_entry does: the log starts over when it is empty or a fork truncates it back to empty
+      auto block_num = block_state->block->block_num();
+      bool fresh     = chain_state_queued_begin == chain_state_queued_end || block_num <= chain_state_queued_begin;
+      if (fresh)
+         chain_state_queued_begin = block_num;
+      chain_state_queued_end = block_num + 1;
       if (fresh)
-         ilog("Placing initial state in block ${n}", ("n", block_state->block->block_num()));
+         ilog("Placing initial state in block ${n}", ("n", block_num));
 
       std::vector<table_delta> deltas;
       auto&                    db = chain_plug->chain().db();
@@ -433,35 +841,43 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
          return fc::raw::pack(make_history_context_wrapper(db, get_table_id(row.t_id._id), row));
       };
 
-      auto process_table = [&](auto* name, auto& index, auto& pack_row) {
-         if (fresh) {
-            if (index.indices().empty())
-               return;
-            deltas.push_back({});
-            auto& delta = deltas.back();
-            delta.name  = name;
-            for (auto& row : index.indices())
-               delta.rows.obj.emplace_back(true, pack_row(row));
-         } else {
-            if (index.stack().empty())
-               return;
-            auto& undo = index.stack().back();
-            if (undo.old_values.empty() && undo.new_ids.empty() && undo.removed_values.empty())
-               return;
-            deltas.push_back({});
-            auto& delta = deltas.back();
-            delta.name  = name;
-            for (auto& old : undo.old_values) {
-               auto& row = index.get(old.first);
-               delta.rows.obj.emplace_back(true, pack_row(row));
-            }
-            for (auto& old : undo.removed_values)
-               delta.rows.obj.emplace_back(false, pack_row(old.second));
-            for (auto id : undo.new_ids) {
-               auto& row = index.get(id);
-               delta.rows.obj.emplace_back(true, pack_row(row));
+      // Each table is extracted by its own job; the main thread waits for all of them, so the chain state is
+      // only read meanwhile. Results are merged in the order the tables are listed below.
+      struct table_job {
+         const char*               name = nullptr;
+         std::function<void()>     run;
+         fc::optional<table_delta> delta;
+         fc::microseconds          elapsed;
+      };
+      std::deque<table_job> jobs;
+
+      auto process_table = [&](const char* name, auto& index, auto& pack_row) {
+         jobs.emplace_back();
+         auto& job = jobs.back();
+         job.name  = name;
+         job.run   = [&job, &index, &pack_row, fresh] {
+            auto start = fc::time_point::now();
+            auto add   = [&](bool present, auto& row) {
+               if (!job.delta) {
+                  job.delta.emplace();
+                  job.delta->name = job.name;
+               }
+               job.delta->rows.obj.emplace_back(present, pack_row(row));
+            };
+            if (fresh) {
+               for (auto& row : index.indices())
+                  add(true, row);
+            } else if (!index.stack().empty()) {
+               auto& undo = index.stack().back();
+               for (auto& old : undo.old_values)
+                  add(true, index.get(old.first));
+               for (auto& old : undo.removed_values)
+                  add(false, old.second);
+               for (auto id : undo.new_ids)
+                  add(true, index.get(id));
             }
-         }
+            job.elapsed = fc::time_point::now() - start;
+         };
       };
 
       process_table("account", db.get_index<account_index>(), pack_row);
@@ -485,17 +901,51 @@ struct state_history_plugin_impl : std::enable_shared_from_this<state_history_pl
       process_table("resource_limits_state", db.get_index<resource_limits::resource_limits_state_index>(), pack_row);
       process_table("resource_limits_config", db.get_index<resource_limits::resource_limits_config_index>(), pack_row);
 
-      auto deltas_bin = zlib_compress_bytes(fc::raw::pack(deltas));
-      EOS_ASSERT(deltas_bin.size() == (uint32_t)deltas_bin.size(), plugin_exception, "deltas is too big");
-      state_history_log_header header{.block_num    = block_state->block->block_num(),
-                                      .block_id     = block_state->block->id(),
-                                      .payload_size = sizeof(uint32_t) + deltas_bin.size()};
-      chain_state_log->write_entry(header, block_state->block->previous, [&](auto& stream) {
-         uint32_t s = (uint32_t)deltas_bin.size();
-         stream.write((char*)&s, sizeof(s));
-         if (!deltas_bin.empty())
-            stream.write(deltas_bin.data(), deltas_bin.size());
-      });
+      auto start = fc::time_point::now();
+      if (delta_pool) {
+         std::vector<std::future<void>> done;
+         for (auto& job : jobs) {
+            auto task = std::make_shared<std::packaged_task<void()>>(job.run);
+            done.push_back(task->get_future());
+            boost::asio::post(*delta_pool, [task] { (*task)(); });
+         }
+         // wait for every job before rethrowing, they reference this frame
+         for (auto& d : done)
+            d.wait();
+         for (auto& d : done)
+            d.get();
+      } else {
+         for (auto& job : jobs)
+            job.run();
+      }
+      auto elapsed = fc::time_point::now() - start;
+
+      size_t num_rows = 0;
+      for (auto& job : jobs) {
+         if (!job.delta)
+            continue;
+         num_rows += job.delta->rows.obj.size();
+         deltas.push_back(std::move(*job.delta));
+      }
+
+      if (elapsed.count() >= slow_delta_extraction_us) {
+         std::string tables;
+         for (auto& job : jobs) {
+            if (job.elapsed.count() >= 1000)
+               tables += std::string(" ") + job.name + "=" + std::to_string(job.elapsed.count() / 1000) + "ms/" +
+                         std::to_string(job.delta ? job.delta->rows.obj.size() : 0);
+         }
+         ilog("chain state deltas of block ${n}: ${r} rows in ${t}ms,${tables}",
+              ("n", block_state->block->block_num())("r", num_rows)("t", elapsed.count() / 1000)("tables", tables));
+      }
+
+      pending_write w;
+      w.log           = &*chain_state_log;
+      w.header        = {.block_num = block_state->block->block_num(), .block_id = block_state->block->id()};
+      w.prev_id       = block_state->block->previous;
+      w.payload       = fc::raw::pack(deltas);
+      w.last_of_block = true;
+      queue_write(std::move(w));
    } // store_chain_state
 };   // state_history_plugin_impl
 
@@ -510,10 +960,19 @@ void state_history_plugin::set_program_options(options_description& cli, options
            "the location of the state-history directory (absolute path or relative to application data dir)");
    cli.add_options()("delete-state-history", bpo::bool_switch()->default_value(false), "clear state history files");
    options("trace-history", bpo::bool_switch()->default_value(false), "enable trace history");
+   options("state-history-compression", bpo::value<string>()->default_value("zlib"),
+           "compression of new trace and chain state entries: zlib, zstd or none. Each entry records its own "
+           "codec; entries are always sent to clients as zlib, others are transcoded when served.");
    options("chain-state-history", bpo::bool_switch()->default_value(false), "enable chain state history");
    options("state-history-endpoint", bpo::value<string>()->default_value("127.0.0.1:8080"),
            "the endpoint upon which to listen for incoming connections. Caution: only expose this port to "
            "your internal network.");
+   options("state-history-threads", bpo::value<uint16_t>()->default_value(my->thread_pool_size),
+           "number of threads serving state history sessions");
+   options("state-history-delta-threads", bpo::value<uint16_t>()->default_value(my->delta_threads),
+           "number of threads extracting the chain state deltas of each block, 0 extracts them on the main thread");
+   options("state-history-read-ahead-blocks", bpo::value<uint32_t>()->default_value(my->read_ahead_blocks),
+           "number of upcoming blocks paged in for sessions streaming history behind head, 0 disables read-ahead");
 }
 
 void state_history_plugin::plugin_initialize(const variables_map& options) {
@@ -543,30 +1002,65 @@ void state_history_plugin::plugin_initialize(const variables_map& options) {
       my->endpoint_port    = std::stoi(port);
       idump((ip_port)(host)(port));
 
+      my->thread_pool_size = options.at("state-history-threads").as<uint16_t>();
+      EOS_ASSERT(my->thread_pool_size > 0, plugin_config_exception, "state-history-threads ${num} must be greater than 0",
+                 ("num", my->thread_pool_size));
+      my->read_ahead_blocks = options.at("state-history-read-ahead-blocks").as<uint32_t>();
+      my->delta_threads     = options.at("state-history-delta-threads").as<uint16_t>();
+
       if (options.at("delete-state-history").as<bool>()) {
          ilog("Deleting state history");
          boost::filesystem::remove_all(state_history_dir);
       }
       boost::filesystem::create_directories(state_history_dir);
 
+      auto compression = options.at("state-history-compression").as<string>();
+      if (compression == "zlib") {
+         my->compression = state_history_compression::zlib;
+      } else if (compression == "none") {
+         my->compression = state_history_compression::none;
+      } else if (compression == "zstd") {
+#ifdef EOSIO_STATE_HISTORY_ZSTD
+         my->compression = state_history_compression::zstd;
+#else
+         EOS_ASSERT(false, plugin_config_exception, "nodeos was built without zstd support");
+#endif
+      } else {
+         EOS_ASSERT(false, plugin_config_exception, "unknown state-history-compression: ${c}", ("c", compression));
+      }
+
       if (options.at("trace-history").as<bool>())
          my->trace_log.emplace("trace_history", (state_history_dir / "trace_history.log").string(),
                                (state_history_dir / "trace_history.index").string());
       if (options.at("chain-state-history").as<bool>())
          my->chain_state_log.emplace("chain_state_history", (state_history_dir / "chain_state_history.log").string(),
                                      (state_history_dir / "chain_state_history.index").string());
+      if (my->chain_state_log) {
+         my->chain_state_queued_begin = my->chain_state_log->begin_block();
+         my->chain_state_queued_end   = my->chain_state_log->end_block();
+         if (my->delta_threads)
+            my->delta_pool.emplace(my->delta_threads);
+      }
+      if (my->trace_log || my->chain_state_log)
+         my->start_writer();
    }
    FC_LOG_AND_RETHROW()
 } // state_history_plugin::plugin_initialize
 
-void state_history_plugin::plugin_startup() { my->listen(); }
+void state_history_plugin::plugin_startup() {
+   my->update_positions();
+   my->listen();
+}
 
 void state_history_plugin::plugin_shutdown() {
    my->applied_transaction_connection.reset();
    my->accepted_block_connection.reset();
-   while (!my->sessions.empty())
-      my->sessions.begin()->second->close();
-   my->stopping = true;
+   my->stop_writer();
+   my->stop_sessions();
+   if (my->delta_pool) {
+      my->delta_pool->join();
+      my->delta_pool->stop();
+   }
 }
 
 } // namespace eosio
@@ -6,6 +6,7 @@
 #include <eosio/chain/authority.hpp>
 #include <eosio/chain/authority_checker.hpp>
 #include <eosio/chain/chain_config.hpp>
+#include <eosio/chain/merkle.hpp>
 #include <eosio/chain/types.hpp>
 #include <eosio/testing/tester.hpp>
 
@@ -1067,6 +1068,24 @@ BOOST_AUTO_TEST_CASE(reflector_init_test) {
    } FC_LOG_AND_RETHROW()
 }
 
+BOOST_AUTO_TEST_CASE(merkle_proof_test) { try {
+   for( size_t n = 1; n <= 9; ++n ) {
+      vector<digest_type> ids;
+      for( size_t i = 0; i < n; ++i )
+         ids.push_back( digest_type::hash( i ) );
+      auto root = merkle( ids );
+
+      for( size_t i = 0; i < n; ++i ) {
+         auto proof = merkle_proof( ids, i );
+         BOOST_CHECK( merkle_root_from_proof( ids[i], proof ) == root );
+
+         auto other = digest_type::hash( n + i );
+         BOOST_CHECK( merkle_root_from_proof( other, proof ) != root );
+      }
+   }
+
+   BOOST_CHECK_THROW( merkle_proof( vector<digest_type>{digest_type::hash(0)}, 1 ), fc::exception );
+} FC_LOG_AND_RETHROW() }
 
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -0,0 +1,181 @@
+/**
+ *  @file
+ *  @copyright defined in eos/LICENSE
+ */
+#include <eosio/state_history_plugin/state_history_filter.hpp>
+#include <eosio/state_history_plugin/state_history_serialization.hpp>
+#include <eosio/testing/tester.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace eosio;
+using namespace eosio::chain;
+using tester = eosio::testing::tester;
+
+namespace {
+
+action_trace make_action_trace( name receiver, name account, name action, vector<action_trace> inline_traces = {} ) {
+   action_trace a;
+   a.receipt.receiver = receiver;
+   a.act.account = account;
+   a.act.name = action;
+   a.act.data = bytes{ 1, 2, 3 };
+   a.console = "console";
+   a.inline_traces = std::move( inline_traces );
+   return a;
+}
+
+transaction_trace_ptr make_trace( uint8_t id, vector<action_trace> actions ) {
+   auto t = std::make_shared<transaction_trace>();
+   t->id = fc::sha256::hash( std::string( 1, char(id) ) );
+   t->receipt = transaction_receipt_header( transaction_receipt_header::executed );
+   t->action_traces = std::move( actions );
+   return t;
+}
+
+// packed as state_history_plugin writes the trace log
+bytes pack_traces( const chainbase::database& db, const vector<transaction_trace_ptr>& traces ) {
+   return fc::raw::pack( make_history_serial_wrapper( db, traces ) );
+}
+
+template <typename T>
+void append( bytes& out, const T& v ) {
+   auto b = fc::raw::pack( v );
+   out.insert( out.end(), b.begin(), b.end() );
+}
+
+// contract_row v0: code, scope, table, primary_key, payer, value
+bytes contract_row( name code, name scope, name table, uint64_t primary_key ) {
+   bytes row;
+   append( row, fc::unsigned_int(0) );
+   append( row, code.value );
+   append( row, scope.value );
+   append( row, table.value );
+   append( row, primary_key );
+   append( row, code.value );
+   append( row, bytes{ 4, 5 } );
+   return row;
+}
+
+table_delta make_delta( std::string table_name, vector<std::pair<bool, bytes>> rows ) {
+   table_delta d;
+   d.name = std::move( table_name );
+   d.rows.obj = std::move( rows );
+   return d;
+}
+
+// packed as state_history_plugin writes the delta log
+bytes pack_deltas( const vector<table_delta>& deltas ) {
+   return fc::raw::pack( deltas );
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(state_history_filter_tests)
+
+BOOST_AUTO_TEST_CASE(no_filters)
+{ try {
+   state_history_filter none( {}, {} );
+   BOOST_CHECK( !none.filters_traces() );
+   BOOST_CHECK( !none.filters_deltas() );
+
+   state_history_filter actions_only( { action_filter{ N(alice) } }, {} );
+   BOOST_CHECK( actions_only.filters_traces() );
+   BOOST_CHECK( !actions_only.filters_deltas() );
+
+   state_history_filter deltas_only( {}, { delta_filter{ "account" } } );
+   BOOST_CHECK( !deltas_only.filters_traces() );
+   BOOST_CHECK( deltas_only.filters_deltas() );
+} FC_LOG_AND_RETHROW() }
+
+BOOST_FIXTURE_TEST_CASE(filter_traces, tester)
+{ try {
+   const auto& db = control->db();
+   auto transfer = make_trace( 1, { make_action_trace( N(eosio.token), N(eosio.token), N(transfer), {
+                                       make_action_trace( N(alice), N(eosio.token), N(transfer) ),
+                                       make_action_trace( N(bob), N(eosio.token), N(transfer) ) } ) } );
+   auto vote     = make_trace( 2, { make_action_trace( N(eosio), N(eosio), N(voteproducer) ) } );
+   auto deferred = make_trace( 3, { make_action_trace( N(carol), N(carol), N(onerror) ) } );
+   deferred->failed_dtrx_trace = make_trace( 4, { make_action_trace( N(dave), N(dave), N(run) ) } );
+   const auto packed = pack_traces( db, { transfer, vote, deferred } );
+
+   auto check = [&]( vector<action_filter> filters, const vector<transaction_trace_ptr>& expected ) {
+      state_history_filter f( std::move( filters ), {} );
+      bytes out;
+      BOOST_CHECK_EQUAL( f.filter_traces( packed.data(), packed.size(), out ), uint32_t(expected.size()) );
+      BOOST_CHECK( out == pack_traces( db, expected ) );
+   };
+
+   // receiver of an inline notification selects the whole transaction trace
+   check( { action_filter{ N(bob) } }, { transfer } );
+   // account and action, any receiver
+   check( { action_filter{ {}, N(eosio.token), N(transfer) } }, { transfer } );
+   check( { action_filter{ {}, {}, N(voteproducer) } }, { vote } );
+   // all fields must match
+   check( { action_filter{ N(alice), N(eosio), N(transfer) } }, {} );
+   // any filter may match, the order of the log is kept
+   check( { action_filter{ N(eosio) }, action_filter{ N(alice) } }, { transfer, vote } );
+   // actions of a failed deferred transaction count for the trace reporting it
+   check( { action_filter{ N(dave), {}, N(run) } }, { deferred } );
+   // zero fields match anything
+   check( { action_filter{} }, { transfer, vote, deferred } );
+   check( { action_filter{ N(nobody) } }, {} );
+
+   // an empty log stays empty
+   const auto empty = pack_traces( db, {} );
+   state_history_filter f( { action_filter{} }, {} );
+   bytes out;
+   BOOST_CHECK_EQUAL( f.filter_traces( empty.data(), empty.size(), out ), 0u );
+   BOOST_CHECK( out == empty );
+} FC_LOG_AND_RETHROW() }
+
+BOOST_AUTO_TEST_CASE(filter_deltas)
+{ try {
+   const auto alice_balance = contract_row( N(eosio.token), N(alice), N(accounts), 1 );
+   const auto bob_balance   = contract_row( N(eosio.token), N(bob), N(accounts), 2 );
+   const auto token_stat    = contract_row( N(eosio.token), N(eos), N(stat), 3 );
+   const auto vote_row      = contract_row( N(eosio), N(eosio), N(voters), 4 );
+   const bytes account_row{ 0, 6, 7 };
+
+   const auto account = make_delta( "account", { {true, account_row} } );
+   const auto rows    = make_delta( "contract_row", { {true, alice_balance}, {false, bob_balance}, {true, token_stat}, {true, vote_row} } );
+   const auto packed  = pack_deltas( { account, rows } );
+
+   auto check = [&]( vector<delta_filter> filters, const vector<table_delta>& expected ) {
+      state_history_filter f( {}, std::move( filters ) );
+      bytes out;
+      uint32_t expected_rows = 0;
+      for( const auto& d : expected ) expected_rows += d.rows.obj.size();
+      BOOST_CHECK_EQUAL( f.filter_deltas( packed.data(), packed.size(), out ), expected_rows );
+      BOOST_CHECK( out == pack_deltas( expected ) );
+   };
+
+   // by table name, all rows
+   check( { delta_filter{ "account" } }, { account } );
+   check( { delta_filter{ "contract_row" } }, { rows } );
+   // contract rows by code, scope and table; removed rows are kept too
+   check( { delta_filter{ "contract_row", N(eosio.token), {}, N(accounts) } },
+          { make_delta( "contract_row", { {true, alice_balance}, {false, bob_balance} } ) } );
+   check( { delta_filter{ "contract_row", {}, N(alice) } },
+          { make_delta( "contract_row", { {true, alice_balance} } ) } );
+   check( { delta_filter{ {}, N(eosio) } },
+          { account, make_delta( "contract_row", { {true, vote_row} } ) } );
+   // any filter may match a row, each row is kept once
+   check( { delta_filter{ "contract_row", {}, {}, N(stat) }, delta_filter{ "contract_row", N(eosio.token) } },
+          { make_delta( "contract_row", { {true, alice_balance}, {false, bob_balance}, {true, token_stat} } ) } );
+   // deltas left without rows are dropped
+   check( { delta_filter{ "contract_row", N(nobody) } }, {} );
+   check( { delta_filter{ "permission" } }, {} );
+   // empty fields match anything
+   check( { delta_filter{} }, { account, rows } );
+} FC_LOG_AND_RETHROW() }
+
+BOOST_AUTO_TEST_CASE(truncated_entries)
+{ try {
+   const auto packed = pack_deltas( { make_delta( "contract_row", { {true, contract_row( N(eosio), N(eosio), N(voters), 1 )} } ) } );
+   state_history_filter f( {}, { delta_filter{ "contract_row" } } );
+   bytes out;
+   BOOST_CHECK_THROW( f.filter_deltas( packed.data(), packed.size() - 3, out ), fc::exception );
+} FC_LOG_AND_RETHROW() }
+
+BOOST_AUTO_TEST_SUITE_END()